@@ -0,0 +1,34 @@
+dnl  Copyright (C) 2010 Trond Norbye
+dnl This file is free software; Trond Norbye
+dnl gives unlimited permission to copy and/or distribute it,
+dnl with or without modifications, as long as this notice is preserved.
+
+AC_DEFUN([_PANDORA_SEARCH_LIBLZ4],[
+  AC_REQUIRE([AC_LIB_PREFIX])
+
+  dnl --------------------------------------------------------------------
+  dnl  Check for liblz4
+  dnl --------------------------------------------------------------------
+
+  AC_ARG_ENABLE([liblz4],
+    [AS_HELP_STRING([--disable-liblz4],
+      [Build with liblz4 support @<:@default=on@:>@])],
+    [ac_enable_liblz4="$enableval"],
+    [ac_enable_liblz4="yes"])
+
+  AS_IF([test "x$ac_enable_liblz4" = "xyes"],[
+    AC_LIB_HAVE_LINKFLAGS(lz4,,[
+      #include <lz4.h>
+    ],[
+      (void)LZ4_compressBound(10);
+    ])
+  ],[
+    ac_cv_liblz4="no"
+  ])
+
+  AM_CONDITIONAL(HAVE_LIBLZ4, [test "x${ac_cv_liblz4}" = "xyes"])
+])
+
+AC_DEFUN([PANDORA_HAVE_LIBLZ4],[
+  AC_REQUIRE([_PANDORA_SEARCH_LIBLZ4])
+])
@@ -0,0 +1,34 @@
+dnl  Copyright (C) 2010 Trond Norbye
+dnl This file is free software; Trond Norbye
+dnl gives unlimited permission to copy and/or distribute it,
+dnl with or without modifications, as long as this notice is preserved.
+
+AC_DEFUN([_PANDORA_SEARCH_LIBZSTD],[
+  AC_REQUIRE([AC_LIB_PREFIX])
+
+  dnl --------------------------------------------------------------------
+  dnl  Check for libzstd
+  dnl --------------------------------------------------------------------
+
+  AC_ARG_ENABLE([libzstd],
+    [AS_HELP_STRING([--disable-libzstd],
+      [Build with libzstd support @<:@default=on@:>@])],
+    [ac_enable_libzstd="$enableval"],
+    [ac_enable_libzstd="yes"])
+
+  AS_IF([test "x$ac_enable_libzstd" = "xyes"],[
+    AC_LIB_HAVE_LINKFLAGS(zstd,,[
+      #include <zstd.h>
+    ],[
+      (void)ZSTD_compressBound(10);
+    ])
+  ],[
+    ac_cv_libzstd="no"
+  ])
+
+  AM_CONDITIONAL(HAVE_LIBZSTD, [test "x${ac_cv_libzstd}" = "xyes"])
+])
+
+AC_DEFUN([PANDORA_HAVE_LIBZSTD],[
+  AC_REQUIRE([_PANDORA_SEARCH_LIBZSTD])
+])
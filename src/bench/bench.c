@@ -0,0 +1,792 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * A small benchmark driving an engine directly (without memcached and the
+ * network in between). It loads the engine through create_instance,
+ * provides a minimal server API and reports the throughput and the
+ * latency percentiles of the gets and sets.
+ *
+ *   bench [options] engine.so [engine config]
+ */
+#include "config.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <memcached/engine.h>
+
+/* The histograms have 8 buckets per power of two nanoseconds */
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_BITS 36
+#define BUCKETS ((MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS)
+
+/* The number of iovecs we accept from get_item_info */
+#define MAX_IOVECS 64
+
+enum op { OP_GET, OP_SET, OPS };
+
+static const char *op_names[OPS] = { "get", "set" };
+
+struct histogram {
+    uint64_t counts[BUCKETS];
+    uint64_t total_ns;
+    uint64_t count;
+};
+
+struct cookie {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    ENGINE_ERROR_CODE status;
+};
+
+struct worker {
+    pthread_t tid;
+    int id;
+    uint64_t rng;
+    struct cookie cookie;
+    char *value;
+    struct histogram ops[OPS];
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t blocked;
+    uint64_t get_errors;
+    uint64_t set_errors;
+};
+
+static struct {
+    int threads;
+    double duration;
+    uint64_t ops;
+    uint64_t keys;
+    double zipf;
+    int get_pct;
+    size_t min_size;
+    size_t max_size;
+    bool log_sizes;
+    bool random_payload;
+    bool preload;
+    const char *stats;
+} settings = {
+    .threads = 4,
+    .duration = 10,
+    .ops = 0,
+    .keys = 100000,
+    .zipf = 0.99,
+    .get_pct = 90,
+    .min_size = 100,
+    .max_size = 100,
+    .log_sizes = false,
+    .random_payload = false,
+    .preload = true,
+    .stats = NULL
+};
+
+static ENGINE_HANDLE *handle;
+static ENGINE_HANDLE_V1 *engine;
+static time_t process_started;
+static volatile bool stop;
+
+/* The constants of the zipfian distribution (see next_key) */
+static struct {
+    double zetan;
+    double theta;
+    double alpha;
+    double eta;
+} zipf;
+
+/*
+ * The server API
+ */
+
+static const char *server_version(void) {
+    return "bench";
+}
+
+/* FNV-1a with a final mix, so that the low bits are good too */
+static uint32_t hash(const void *key, size_t nkey, uint32_t previous) {
+    const unsigned char *p = key;
+    uint32_t h = 2166136261u ^ previous;
+    size_t ii;
+
+    for (ii = 0; ii < nkey; ++ii) {
+        h ^= p[ii];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static rel_time_t get_current_time(void) {
+    return (rel_time_t)(time(NULL) - process_started);
+}
+
+static rel_time_t realtime(const time_t exptime) {
+    if (exptime == 0) {
+        return 0;
+    }
+    /* An absolute unix time (like memcached, anything above 30 days) */
+    if (exptime > 60 * 60 * 24 * 30) {
+        if (exptime <= process_started) {
+            return 1;
+        }
+        return (rel_time_t)(exptime - process_started);
+    }
+    return (rel_time_t)(exptime + get_current_time());
+}
+
+static void notify_io_complete(const void *cookie, ENGINE_ERROR_CODE status) {
+    struct cookie *c = (struct cookie *)cookie;
+    pthread_mutex_lock(&c->lock);
+    c->done = true;
+    c->status = status;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void count_eviction(const void *cookie, const void *key,
+                           const int nkey) {
+    (void)cookie;
+    (void)key;
+    (void)nkey;
+}
+
+/* Parse "key=value;key=value" like memcached does */
+static int bench_parse_config(const char *str, struct config_item items[],
+                              FILE *error) {
+    char *copy = strdup(str);
+    char *save = NULL;
+    char *token;
+    int ret = 0;
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    for (token = strtok_r(copy, ";", &save); token != NULL;
+         token = strtok_r(NULL, ";", &save)) {
+        char *value = strchr(token, '=');
+        int ii;
+
+        while (*token == ' ') {
+            ++token;
+        }
+        if (value == NULL) {
+            fprintf(error, "Missing value for %s\n", token);
+            ret = -1;
+            continue;
+        }
+        *value++ = '\0';
+
+        for (ii = 0; items[ii].key != NULL; ++ii) {
+            if (strcmp(items[ii].key, token) == 0) {
+                break;
+            }
+        }
+        if (items[ii].key == NULL) {
+            fprintf(error, "Unsupported key: <%s>\n", token);
+            ret = -1;
+            continue;
+        }
+
+        items[ii].found = true;
+        switch (items[ii].datatype) {
+        case DT_SIZE:
+            *items[ii].value.dt_size = (size_t)strtoull(value, NULL, 10);
+            break;
+        case DT_FLOAT:
+            *items[ii].value.dt_float = strtof(value, NULL);
+            break;
+        case DT_BOOL:
+            *items[ii].value.dt_bool = strcasecmp(value, "true") == 0 ||
+                strcasecmp(value, "on") == 0 || strcmp(value, "1") == 0;
+            break;
+        case DT_STRING:
+            *items[ii].value.dt_string = strdup(value);
+            break;
+        default:
+            fprintf(error, "Config files aren't supported: <%s>\n", token);
+            ret = -1;
+            break;
+        }
+    }
+
+    free(copy);
+    return ret;
+}
+
+static SERVER_HANDLE_V1 server_api = {
+    .interface = 1,
+    .server_version = server_version,
+    .hash = hash,
+    .realtime = realtime,
+    .notify_io_complete = notify_io_complete,
+    .get_current_time = get_current_time,
+    .parse_config = bench_parse_config,
+    .count_eviction = count_eviction
+};
+
+static void *get_server_api(int interface) {
+    if (interface != 1) {
+        return NULL;
+    }
+    return &server_api;
+}
+
+/*
+ * The workload
+ */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t next_random(struct worker *w) {
+    w->rng ^= w->rng >> 12;
+    w->rng ^= w->rng << 25;
+    w->rng ^= w->rng >> 27;
+    return w->rng * 2685821657736338717ULL;
+}
+
+static double next_double(struct worker *w) {
+    return (next_random(w) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(void) {
+    uint64_t ii;
+    double zeta2;
+
+    if (settings.zipf <= 0) {
+        return;
+    }
+
+    zipf.theta = settings.zipf;
+    zipf.zetan = 0;
+    for (ii = 1; ii <= settings.keys; ++ii) {
+        zipf.zetan += 1 / pow((double)ii, zipf.theta);
+    }
+    zeta2 = 1 + 1 / pow(2, zipf.theta);
+    zipf.alpha = 1 / (1 - zipf.theta);
+    zipf.eta = (1 - pow(2.0 / settings.keys, 1 - zipf.theta)) /
+        (1 - zeta2 / zipf.zetan);
+}
+
+/*
+ * Pick the next key. The zipfian keys are generated as described in
+ * "Quickly generating billion-record synthetic databases" (Gray et al),
+ * like YCSB does it: key 0 is the most popular one.
+ */
+static uint64_t next_key(struct worker *w) {
+    double u, uz;
+    uint64_t ret;
+
+    if (settings.zipf <= 0) {
+        return next_random(w) % settings.keys;
+    }
+
+    u = next_double(w);
+    uz = u * zipf.zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, zipf.theta)) {
+        return 1;
+    }
+    ret = (uint64_t)(settings.keys * pow(zipf.eta * u - zipf.eta + 1,
+                                         zipf.alpha));
+    return ret < settings.keys ? ret : settings.keys - 1;
+}
+
+static size_t next_size(struct worker *w) {
+    double lo, hi;
+
+    if (settings.min_size == settings.max_size) {
+        return settings.min_size;
+    }
+    if (!settings.log_sizes) {
+        return settings.min_size +
+            next_random(w) % (settings.max_size - settings.min_size + 1);
+    }
+
+    /* Log-uniform: as many values between 10 and 100 as 100 and 1000 */
+    lo = log((double)settings.min_size);
+    hi = log((double)settings.max_size + 1);
+    return (size_t)exp(lo + next_double(w) * (hi - lo));
+}
+
+/* Fill the value buffer of a worker (the sets use a prefix of it) */
+static void make_payload(struct worker *w) {
+    static const char *words[] = {
+        "\"id\":", "\"name\":", "\"email\":", "\"created\":", "\"active\":",
+        "true,", "false,", "null,", "\"user\",", "\"admin\",", "{", "}",
+        "[", "],", "\"tags\":", "\"2010-01-01T00:00:00Z\",", "1234,"
+    };
+    const size_t nwords = sizeof(words) / sizeof(words[0]);
+    size_t off = 0;
+
+    while (off < settings.max_size) {
+        if (settings.random_payload) {
+            w->value[off++] = (char)next_random(w);
+        } else {
+            const char *word = words[next_random(w) % nwords];
+            size_t len = strlen(word);
+            if (len > settings.max_size - off) {
+                len = settings.max_size - off;
+            }
+            memcpy(w->value + off, word, len);
+            off += len;
+        }
+    }
+}
+
+static void record(struct histogram *h, uint64_t start) {
+    uint64_t ns = now_ns() - start;
+    int idx;
+
+    if (ns < SUB_BUCKETS) {
+        idx = (int)ns;
+    } else {
+        int msb = 63 - __builtin_clzll(ns);
+        if (msb >= MAX_BITS) {
+            idx = BUCKETS - 1;
+        } else {
+            int shift = msb - SUB_BITS;
+            idx = (shift + 1) * SUB_BUCKETS +
+                (int)((ns >> shift) - SUB_BUCKETS);
+        }
+    }
+    h->counts[idx]++;
+    h->total_ns += ns;
+    h->count++;
+}
+
+/* The highest value recorded in a bucket */
+static uint64_t bucket_max(int idx) {
+    int shift;
+    if (idx < SUB_BUCKETS) {
+        return idx;
+    }
+    shift = idx / SUB_BUCKETS - 1;
+    return (((uint64_t)SUB_BUCKETS + idx % SUB_BUCKETS) << shift) +
+        ((uint64_t)1 << shift) - 1;
+}
+
+/* Wait for the engine to call notify_io_complete */
+static ENGINE_ERROR_CODE wait_for_io(struct cookie *c) {
+    ENGINE_ERROR_CODE ret;
+    pthread_mutex_lock(&c->lock);
+    while (!c->done) {
+        pthread_cond_wait(&c->cond, &c->lock);
+    }
+    c->done = false;
+    ret = c->status;
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+static void do_get(struct worker *w, const char *key, size_t nkey) {
+    ENGINE_ERROR_CODE ret;
+    item *it = NULL;
+
+    ret = engine->get(handle, &w->cookie, &it, key, nkey);
+    while (ret == ENGINE_EWOULDBLOCK) {
+        /* The engine is fetching the item (from disk), ask again */
+        ++w->blocked;
+        if ((ret = wait_for_io(&w->cookie)) != ENGINE_SUCCESS) {
+            break;
+        }
+        ret = engine->get(handle, &w->cookie, &it, key, nkey);
+    }
+
+    if (ret == ENGINE_SUCCESS) {
+        ++w->hits;
+        engine->release(handle, &w->cookie, it);
+    } else if (ret == ENGINE_KEY_ENOENT) {
+        ++w->misses;
+    } else {
+        ++w->get_errors;
+    }
+}
+
+static void do_set(struct worker *w, uint64_t k, const char *key,
+                   size_t nkey) {
+    union {
+        item_info info;
+        char buffer[sizeof(item_info) + MAX_IOVECS * sizeof(struct iovec)];
+    } info;
+    size_t size = next_size(w);
+    size_t off = 0;
+    uint64_t cas = 0;
+    item *it;
+    int ii;
+
+    /* The data ends with \r\n like in the memcached protocol */
+    if (engine->allocate(handle, &w->cookie, &it, key, nkey, size + 2, 0,
+                         0) != ENGINE_SUCCESS) {
+        ++w->set_errors;
+        return;
+    }
+
+    info.info.nvalue = MAX_IOVECS;
+    if (!engine->get_item_info(handle, it, &info.info)) {
+        ++w->set_errors;
+        engine->release(handle, &w->cookie, it);
+        return;
+    }
+
+    /* Make the values of the keys differ a bit */
+    snprintf(w->value, settings.max_size, "%llu", (unsigned long long)k);
+    for (ii = 0; ii < info.info.nvalue; ++ii) {
+        size_t len = info.info.value[ii].iov_len;
+        char *dest = info.info.value[ii].iov_base;
+        size_t data = off < size ? size - off : 0;
+        size_t jj;
+
+        if (data > len) {
+            data = len;
+        }
+        memcpy(dest, w->value + off, data);
+        for (jj = data; jj < len; ++jj) {
+            dest[jj] = "\r\n"[off + jj - size];
+        }
+        off += len;
+    }
+
+    engine->item_set_cas(handle, it, 0);
+    if (engine->store(handle, &w->cookie, it, &cas,
+                      OPERATION_SET) != ENGINE_SUCCESS) {
+        ++w->set_errors;
+    }
+    engine->release(handle, &w->cookie, it);
+}
+
+static void *preload_main(void *arg) {
+    struct worker *w = arg;
+    char key[32];
+    uint64_t k;
+
+    for (k = w->id; k < settings.keys; k += settings.threads) {
+        int nkey = snprintf(key, sizeof(key), "key:%llu",
+                            (unsigned long long)k);
+        do_set(w, k, key, nkey);
+    }
+    return NULL;
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    char key[32];
+    uint64_t ii;
+
+    for (ii = 0; settings.ops == 0 || ii < settings.ops; ++ii) {
+        if (stop) {
+            break;
+        }
+
+        uint64_t k = next_key(w);
+        int nkey = snprintf(key, sizeof(key), "key:%llu",
+                            (unsigned long long)k);
+        uint64_t start = now_ns();
+        if ((int)(next_random(w) % 100) < settings.get_pct) {
+            do_get(w, key, nkey);
+            record(&w->ops[OP_GET], start);
+        } else {
+            do_set(w, k, key, nkey);
+            record(&w->ops[OP_SET], start);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The report
+ */
+
+static void report(struct worker *workers, double elapsed) {
+    struct histogram total;
+    uint64_t all = 0, hits = 0, misses = 0, blocked = 0;
+    uint64_t get_errors = 0, set_errors = 0;
+    int op, ii, t;
+
+    printf("%-4s %12s %12s %9s %9s %9s %9s %9s %9s\n", "op", "count",
+           "ops/s", "mean_us", "p50_us", "p90_us", "p99_us", "p999_us",
+           "max_us");
+    for (op = 0; op < OPS; ++op) {
+        static const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        double values[4] = { 0, 0, 0, 0 };
+        uint64_t seen = 0;
+        size_t next = 0;
+        int max = 0;
+
+        memset(&total, 0, sizeof(total));
+        for (t = 0; t < settings.threads; ++t) {
+            for (ii = 0; ii < BUCKETS; ++ii) {
+                total.counts[ii] += workers[t].ops[op].counts[ii];
+            }
+            total.total_ns += workers[t].ops[op].total_ns;
+            total.count += workers[t].ops[op].count;
+        }
+        if (total.count == 0) {
+            continue;
+        }
+        all += total.count;
+
+        for (ii = 0; ii < BUCKETS; ++ii) {
+            if (total.counts[ii] == 0) {
+                continue;
+            }
+            max = ii;
+            seen += total.counts[ii];
+            while (next < 4 && seen >= percentiles[next] * total.count) {
+                values[next++] = bucket_max(ii) / 1000.0;
+            }
+        }
+
+        printf("%-4s %12llu %12.0f %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+               op_names[op], (unsigned long long)total.count,
+               total.count / elapsed,
+               total.total_ns / 1000.0 / total.count,
+               values[0], values[1], values[2], values[3],
+               bucket_max(max) / 1000.0);
+    }
+
+    for (t = 0; t < settings.threads; ++t) {
+        hits += workers[t].hits;
+        misses += workers[t].misses;
+        blocked += workers[t].blocked;
+        get_errors += workers[t].get_errors;
+        set_errors += workers[t].set_errors;
+    }
+    printf("total %llu ops in %.2f s: %.0f ops/s\n",
+           (unsigned long long)all, elapsed, all / elapsed);
+    if (hits + misses > 0) {
+        printf("get hit ratio %.4f (%llu hits, %llu misses, "
+               "%llu blocked on io)\n", (double)hits / (hits + misses),
+               (unsigned long long)hits, (unsigned long long)misses,
+               (unsigned long long)blocked);
+    }
+    if (get_errors + set_errors > 0) {
+        printf("%llu gets and %llu sets failed\n",
+               (unsigned long long)get_errors, (unsigned long long)set_errors);
+    }
+}
+
+static void add_stat(const char *key, const uint16_t klen,
+                     const char *val, const uint32_t vlen,
+                     const void *cookie) {
+    (void)cookie;
+    if (klen > 0) {
+        printf("  %.*s %.*s\n", (int)klen, key, (int)vlen, val);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options] engine.so [engine config]\n"
+            "  -t threads    number of client threads (%d)\n"
+            "  -d seconds    how long to run (%.0f)\n"
+            "  -n ops        operations per thread (instead of -d)\n"
+            "  -k keys       number of keys (%llu)\n"
+            "  -z theta      zipfian skew of the keys, 0 for uniform (%.2f)\n"
+            "  -g percent    the share of gets (%d)\n"
+            "  -s min[-max]  the value size (uniform between min and max)\n"
+            "  -l            log-uniform value sizes instead of uniform\n"
+            "  -r            incompressible (random) values instead of text\n"
+            "  -N            don't store the keys before the run\n"
+            "  -S key        print these engine stats after the run\n"
+            "                (\"\" for the default stats, like \"latency\")\n",
+            name, settings.threads, settings.duration,
+            (unsigned long long)settings.keys, settings.zipf,
+            settings.get_pct);
+}
+
+static bool parse_size(const char *arg) {
+    char *end;
+    settings.min_size = settings.max_size = strtoull(arg, &end, 10);
+    if (*end == '-') {
+        settings.max_size = strtoull(end + 1, &end, 10);
+    }
+    return *end == '\0' && settings.min_size > 0 &&
+        settings.min_size <= settings.max_size;
+}
+
+static bool run_threads(struct worker *workers, void *(*fn)(void *)) {
+    int t;
+    for (t = 0; t < settings.threads; ++t) {
+        if (pthread_create(&workers[t].tid, NULL, fn, &workers[t]) != 0) {
+            fprintf(stderr, "Failed to create thread: %s\n", strerror(errno));
+            return false;
+        }
+    }
+    for (t = 0; t < settings.threads; ++t) {
+        pthread_join(workers[t].tid, NULL);
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    ENGINE_ERROR_CODE (*create)(uint64_t, GET_SERVER_API, ENGINE_HANDLE **);
+    struct worker *workers;
+    const char *config;
+    uint64_t start;
+    void *dl;
+    int c, t;
+
+    while ((c = getopt(argc, argv, "t:d:n:k:z:g:s:lrNS:")) != -1) {
+        switch (c) {
+        case 't':
+            settings.threads = atoi(optarg);
+            break;
+        case 'd':
+            settings.duration = atof(optarg);
+            break;
+        case 'n':
+            settings.ops = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            settings.keys = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            settings.zipf = atof(optarg);
+            break;
+        case 'g':
+            settings.get_pct = atoi(optarg);
+            break;
+        case 's':
+            if (!parse_size(optarg)) {
+                fprintf(stderr, "Invalid value size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            settings.log_sizes = true;
+            break;
+        case 'r':
+            settings.random_payload = true;
+            break;
+        case 'N':
+            settings.preload = false;
+            break;
+        case 'S':
+            settings.stats = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc || settings.threads < 1 || settings.keys < 2 ||
+        settings.zipf >= 1 || settings.get_pct < 0 || settings.get_pct > 100) {
+        usage(argv[0]);
+        return 1;
+    }
+    config = optind + 1 < argc ? argv[optind + 1] : "";
+
+    if ((dl = dlopen(argv[optind], RTLD_NOW | RTLD_LOCAL)) == NULL) {
+        fprintf(stderr, "Failed to load %s: %s\n", argv[optind], dlerror());
+        return 1;
+    }
+    *(void **)(&create) = dlsym(dl, "create_instance");
+    if (create == NULL) {
+        fprintf(stderr, "%s has no create_instance\n", argv[optind]);
+        return 1;
+    }
+
+    process_started = time(NULL) - 2;
+    if (create(1, get_server_api, &handle) != ENGINE_SUCCESS ||
+        handle->interface != 1) {
+        fprintf(stderr, "Failed to create the engine\n");
+        return 1;
+    }
+    engine = (ENGINE_HANDLE_V1 *)handle;
+    if (engine->initialize(handle, config) != ENGINE_SUCCESS) {
+        fprintf(stderr, "Failed to initialize the engine\n");
+        return 1;
+    }
+
+    zipf_init();
+    if ((workers = calloc(settings.threads, sizeof(*workers))) == NULL) {
+        fprintf(stderr, "Failed to allocate the workers\n");
+        return 1;
+    }
+    for (t = 0; t < settings.threads; ++t) {
+        workers[t].id = t;
+        workers[t].rng = 0x9e3779b97f4a7c15ULL * (t + 1);
+        pthread_mutex_init(&workers[t].cookie.lock, NULL);
+        pthread_cond_init(&workers[t].cookie.cond, NULL);
+        if ((workers[t].value = malloc(settings.max_size + 1)) == NULL) {
+            fprintf(stderr, "Failed to allocate the values\n");
+            return 1;
+        }
+        make_payload(&workers[t]);
+    }
+
+    if (settings.preload) {
+        start = now_ns();
+        if (!run_threads(workers, preload_main)) {
+            return 1;
+        }
+        printf("stored %llu keys in %.2f s\n",
+               (unsigned long long)settings.keys,
+               (now_ns() - start) / 1e9);
+        for (t = 0; t < settings.threads; ++t) {
+            workers[t].set_errors = 0;
+        }
+    }
+
+    start = now_ns();
+    if (settings.ops == 0) {
+        /* The main thread just keeps the time */
+        struct timespec ts;
+        for (t = 0; t < settings.threads; ++t) {
+            if (pthread_create(&workers[t].tid, NULL, worker_main,
+                               &workers[t]) != 0) {
+                fprintf(stderr, "Failed to create thread: %s\n",
+                        strerror(errno));
+                return 1;
+            }
+        }
+        ts.tv_sec = (time_t)settings.duration;
+        ts.tv_nsec = (long)((settings.duration - ts.tv_sec) * 1e9);
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+            /* sleep for the rest of the time */
+        }
+        stop = true;
+        for (t = 0; t < settings.threads; ++t) {
+            pthread_join(workers[t].tid, NULL);
+        }
+    } else if (!run_threads(workers, worker_main)) {
+        return 1;
+    }
+    report(workers, (now_ns() - start) / 1e9);
+
+    if (settings.stats != NULL) {
+        const char *key = *settings.stats != '\0' ? settings.stats : NULL;
+        printf("stats %s\n", settings.stats);
+        engine->get_stats(handle, &workers[0].cookie, key,
+                          key ? strlen(key) : 0, add_stat);
+    }
+
+    engine->destroy(handle);
+    for (t = 0; t < settings.threads; ++t) {
+        free(workers[t].value);
+    }
+    free(workers);
+    return 0;
+}
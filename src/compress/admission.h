@@ -0,0 +1,89 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The admission filter (TinyLFU). A count-min sketch estimates how often
+ * each key has been asked for lately, and an item asked for more often
+ * than the one we store is moved back to the head of the LRU instead of
+ * being evicted. That keeps a scan through a keyspace from flushing the
+ * items everybody uses.
+ *
+ * The sketch has ADMISSION_DEPTH rows of 4 bit counters (kept in a byte
+ * each). The first access to a key only sets its bits in a small bloom
+ * filter (the doorkeeper), so the keys used once don't fill up the
+ * counters. Every admission_filter_keys * 10 accesses all of the counters
+ * are halved and the doorkeeper is cleared, so the estimates follow the
+ * recent traffic.
+ */
+#define ADMISSION_DEPTH 4
+
+/* A counter saturates at this value */
+#define ADMISSION_MAX_COUNT 15
+
+/*
+ * The number of hotter items a store may move back to the head of the
+ * LRU before it evicts one of them anyway (a store can't be refused)
+ */
+#define ADMISSION_MAX_KEPT 4
+
+struct admission {
+   /* ADMISSION_DEPTH rows of mask + 1 counters (NULL if it's disabled) */
+   uint8_t *counters;
+   size_t mask;
+   /* The keys we've seen once since the counters were halved */
+   uint64_t *doorkeeper;
+   /* The accesses counted since the counters were halved (atomic) */
+   uint64_t additions;
+   /* Halve the counters when additions reaches this */
+   uint64_t sample;
+   /* Held while the counters are halved */
+   pthread_mutex_t lock;
+   /* Updated with atomic operations */
+   uint64_t kept;
+   uint64_t resets;
+};
+
+/**
+ * Allocate the sketch (if admission_filter is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE admission_init(struct compress_engine *engine);
+
+void admission_destroy(struct compress_engine *engine);
+
+/**
+ * Check if the admission filter is used
+ * @param engine handle to the storage engine
+ */
+bool admission_enabled(struct compress_engine *engine);
+
+/**
+ * Count an access to a key
+ * @param engine handle to the storage engine
+ * @param hv the hash of the key
+ */
+void admission_record(struct compress_engine *engine, uint32_t hv);
+
+/**
+ * Estimate how often a key was asked for lately
+ * @param engine handle to the storage engine
+ * @param hv the hash of the key
+ * @return the estimate (0 if the filter is disabled)
+ */
+uint32_t admission_estimate(struct compress_engine *engine, uint32_t hv);
+
+void admission_stats(struct compress_engine *engine, ADD_STAT add_stat,
+                     const void *cookie);
+
+void admission_reset_stats(struct compress_engine *engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
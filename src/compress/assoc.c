@@ -18,179 +18,382 @@
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "compress_engine.h"
 
 #define hashsize(n) ((uint32_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
+/*
+ * The number of item locks is a power of two, and must not be larger than
+ * the initial size of the hash table (so that all of the items in a bucket
+ * map to the same lock, both in the old and the new table).
+ */
+#define ITEM_LOCK_POWER 12
+
+/*
+ * During expansion the overflow chain of a bucket in the old table is set
+ * to this once its items have been moved over to the primary table.
+ */
+#define BUCKET_MOVED ((hash_item*)1)
+
+/* Grow the table when the buckets are 3/4 full on average */
+#define ASSOC_MAX_LOAD(n) ((hashsize(n) * ASSOC_BUCKET_SLOTS * 3) / 4)
+
+static struct assoc_bucket *assoc_table_alloc(unsigned int power) {
+    size_t size = hashsize(power) * sizeof(struct assoc_bucket);
+    void *ret;
+#ifdef __WIN32__
+    ret = malloc(size);
+#else
+    if (posix_memalign(&ret, sizeof(struct assoc_bucket), size) != 0) {
+        ret = NULL;
+    }
+#endif
+    if (ret != NULL) {
+        memset(ret, 0, size);
+    }
+    return ret;
+}
+
+static void *assoc_maintenance_thread(void *arg);
+
 ENGINE_ERROR_CODE assoc_init(struct compress_engine *engine) {
-    engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower), sizeof(void *));
-    return (engine->assoc.primary_hashtable != NULL) ? ENGINE_SUCCESS : ENGINE_ENOMEM;
+    unsigned int power = ITEM_LOCK_POWER;
+    unsigned int ii;
+
+    /* The expansion would never make any progress with hash_bulk_move=0 */
+    if (engine->config.hash_bulk_move == 0) {
+        engine->config.hash_bulk_move = 1;
+    }
+
+    if (power > engine->assoc.hashpower - 1) {
+        power = engine->assoc.hashpower - 1;
+    }
+    engine->assoc.item_lock_mask = hashmask(power);
+    engine->assoc.item_locks = calloc(hashsize(power), sizeof(pthread_mutex_t));
+    if (engine->assoc.item_locks == NULL) {
+        return ENGINE_ENOMEM;
+    }
+    for (ii = 0; ii < hashsize(power); ++ii) {
+        pthread_mutex_init(&engine->assoc.item_locks[ii], NULL);
+    }
+
+    engine->assoc.primary_hashtable = assoc_table_alloc(engine->assoc.hashpower);
+    if (engine->assoc.primary_hashtable == NULL) {
+        return ENGINE_ENOMEM;
+    }
+
+    pthread_mutex_init(&engine->assoc.maintenance_lock, NULL);
+    pthread_cond_init(&engine->assoc.maintenance_cond, NULL);
+    int ret;
+    if ((ret = pthread_create(&engine->assoc.maintenance_tid, NULL,
+                              assoc_maintenance_thread, engine)) != 0) {
+        fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
+        return ENGINE_FAILED;
+    }
+
+    return ENGINE_SUCCESS;
 }
 
-hash_item *assoc_find(struct compress_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
-    hash_item *it;
-    unsigned int oldbucket;
-
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        it = engine->assoc.old_hashtable[oldbucket];
-    } else {
-        it = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
-    }
-
-    hash_item *ret = NULL;
-    int depth = 0;
-    while (it) {
-        if ((nkey == it->nkey) && (memcmp(key, item_get_key(it), nkey) == 0)) {
-            ret = it;
-            break;
+void assoc_destroy(struct compress_engine *engine) {
+    unsigned int ii;
+
+    pthread_mutex_lock(&engine->assoc.maintenance_lock);
+    engine->assoc.maintenance_shutdown = true;
+    pthread_cond_signal(&engine->assoc.maintenance_cond);
+    pthread_mutex_unlock(&engine->assoc.maintenance_lock);
+    pthread_join(engine->assoc.maintenance_tid, NULL);
+
+    pthread_cond_destroy(&engine->assoc.maintenance_cond);
+    pthread_mutex_destroy(&engine->assoc.maintenance_lock);
+    for (ii = 0; ii <= engine->assoc.item_lock_mask; ++ii) {
+        pthread_mutex_destroy(&engine->assoc.item_locks[ii]);
+    }
+    free(engine->assoc.item_locks);
+    free(engine->assoc.old_hashtable);
+    free(engine->assoc.primary_hashtable);
+}
+
+void item_lock(struct compress_engine *engine, uint32_t hv) {
+    pthread_mutex_t *lock = &engine->assoc.item_locks[hv & engine->assoc.item_lock_mask];
+    /* Only look at the clock if we have to wait */
+    if (pthread_mutex_trylock(lock) != 0) {
+        uint64_t start = latency_start(engine);
+        pthread_mutex_lock(lock);
+        latency_lock_wait(engine, start);
+    }
+}
+
+bool item_trylock(struct compress_engine *engine, uint32_t hv) {
+    return pthread_mutex_trylock(&engine->assoc.item_locks[hv & engine->assoc.item_lock_mask]) == 0;
+}
+
+void item_unlock(struct compress_engine *engine, uint32_t hv) {
+    pthread_mutex_unlock(&engine->assoc.item_locks[hv & engine->assoc.item_lock_mask]);
+}
+
+/* Lock all of the hash chains (used when we swap the tables) */
+static void item_lock_all(struct compress_engine *engine) {
+    unsigned int ii;
+    for (ii = 0; ii <= engine->assoc.item_lock_mask; ++ii) {
+        pthread_mutex_lock(&engine->assoc.item_locks[ii]);
+    }
+}
+
+static void item_unlock_all(struct compress_engine *engine) {
+    unsigned int ii;
+    for (ii = 0; ii <= engine->assoc.item_lock_mask; ++ii) {
+        pthread_mutex_unlock(&engine->assoc.item_locks[ii]);
+    }
+}
+
+/*
+ * Get a bit mask of the slots in the bucket holding an item with the
+ * given hash value.
+ */
+static inline unsigned int bucket_match(const struct assoc_bucket *b,
+                                        uint32_t hash) {
+#ifdef __SSE2__
+    __m128i needle = _mm_set1_epi32((int)hash);
+    __m128i hashes = _mm_loadu_si128((const __m128i*)b->hashes);
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(needle, hashes)));
+#else
+    unsigned int mask = 0;
+    unsigned int ii;
+    for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+        if (b->hashes[ii] == hash) {
+            mask |= 1U << ii;
         }
-        it = it->h_next;
-        ++depth;
     }
-    return ret;
+    return mask;
+#endif
+}
+
+/* Add an item to a bucket (in a free slot, or the overflow chain) */
+static void bucket_add(struct assoc_bucket *b, uint32_t hash, hash_item *it) {
+    unsigned int ii;
+    for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+        if (b->items[ii] == NULL) {
+            b->hashes[ii] = hash;
+            b->items[ii] = it;
+            it->h_next = NULL;
+            return;
+        }
+    }
+    it->h_next = b->overflow;
+    b->overflow = it;
 }
 
-/* returns the address of the item pointer before the key.  if *item == 0,
-   the item wasn't found */
+/*
+ * Move the items in a bucket of the old table over to the primary table.
+ * The items in the slots carry their hash value, so we only need to hash
+ * the keys in the overflow chain. The caller must hold the item lock for
+ * the bucket.
+ */
+static void assoc_move_bucket(struct compress_engine *engine,
+                              unsigned int oldbucket) {
+    struct assoc_bucket *b = &engine->assoc.old_hashtable[oldbucket];
+    uint32_t mask = hashmask(engine->assoc.hashpower);
+    hash_item *it, *next;
+    unsigned int ii;
 
-static hash_item** _hashitem_before(struct compress_engine *engine,
-                                    uint32_t hash,
-                                    const char *key,
-                                    const size_t nkey) {
-    hash_item **pos;
-    unsigned int oldbucket;
+    if (b->overflow == BUCKET_MOVED) {
+        return;
+    }
+
+    for (ii = 0; ii < ASSOC_BUCKET_SLOTS; ++ii) {
+        if (b->items[ii] != NULL) {
+            bucket_add(&engine->assoc.primary_hashtable[b->hashes[ii] & mask],
+                       b->hashes[ii], b->items[ii]);
+        }
+    }
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        pos = &engine->assoc.old_hashtable[oldbucket];
-    } else {
-        pos = &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
+    for (it = b->overflow; NULL != it; it = next) {
+        uint32_t hash = engine->server.hash(item_get_key(it), it->nkey, 0);
+        next = it->h_next;
+        bucket_add(&engine->assoc.primary_hashtable[hash & mask], hash, it);
     }
 
-    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, item_get_key(*pos), nkey))) {
-        pos = &(*pos)->h_next;
+    memset(b, 0, sizeof(*b));
+    b->overflow = BUCKET_MOVED;
+}
+
+/*
+ * Get the bucket the key lives in. During expansion we move the bucket over
+ * from the old table the first time it's used, so the front end threads
+ * share the work with the maintenance thread, and never have to look in
+ * two tables. The caller holds the item lock, which covers both the old
+ * and the new bucket.
+ */
+static struct assoc_bucket *assoc_bucket(struct compress_engine *engine,
+                                         uint32_t hash) {
+    if (engine->assoc.expanding) {
+        assoc_move_bucket(engine, hash & hashmask(engine->assoc.hashpower - 1));
     }
-    return pos;
+    return &engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
 }
 
-static void *assoc_maintenance_thread(void *arg);
+static inline bool key_match(const hash_item *it, const char *key,
+                             const size_t nkey) {
+    return nkey == it->nkey && memcmp(key, item_get_key(it), nkey) == 0;
+}
+
+hash_item *assoc_find(struct compress_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
+    struct assoc_bucket *b = assoc_bucket(engine, hash);
+    unsigned int mask;
+    hash_item *it;
+
+    /* Only look at the items with the same hash value */
+    for (mask = bucket_match(b, hash); mask != 0; mask &= mask - 1) {
+        it = b->items[__builtin_ctz(mask)];
+        if (it != NULL && key_match(it, key, nkey)) {
+            return it;
+        }
+    }
+
+    for (it = b->overflow; it != NULL; it = it->h_next) {
+        if (key_match(it, key, nkey)) {
+            return it;
+        }
+    }
+    return NULL;
+}
 
 /* grows the hashtable to the next power of 2. */
 static void assoc_expand(struct compress_engine *engine) {
-    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+    struct assoc_bucket *new_hashtable;
 
-    engine->assoc.primary_hashtable = calloc(hashsize(engine->assoc.hashpower + 1), sizeof(void *));
-    if (engine->assoc.primary_hashtable) {
-        engine->assoc.hashpower++;
-        engine->assoc.expanding = true;
-        engine->assoc.expand_bucket = 0;
-
-        /* start a thread to do the expansion */
-        int ret;
-        pthread_t tid;
-        if ((ret = pthread_create(&tid, NULL,
-                                  assoc_maintenance_thread, engine)) != 0) {
-            fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
-            engine->assoc.hashpower--;
-            engine->assoc.expanding = false;
-            free(engine->assoc.primary_hashtable);
-            engine->assoc.primary_hashtable =engine->assoc.old_hashtable;
-        }
-    } else {
-        engine->assoc.primary_hashtable = engine->assoc.old_hashtable;
+    /* Only the maintenance thread modifies hashpower */
+    new_hashtable = assoc_table_alloc(engine->assoc.hashpower + 1);
+    if (new_hashtable == NULL) {
         /* Bad news, but we can keep running. */
+        return;
     }
+
+    item_lock_all(engine);
+    engine->assoc.old_hashtable = engine->assoc.primary_hashtable;
+    engine->assoc.primary_hashtable = new_hashtable;
+    engine->assoc.hashpower++;
+    engine->assoc.expanding = true;
+    engine->assoc.expand_bucket = 0;
+    item_unlock_all(engine);
 }
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(struct compress_engine *engine, uint32_t hash, hash_item *it) {
-    unsigned int oldbucket;
-
     assert(assoc_find(engine, hash, item_get_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (engine->assoc.expanding &&
-        (oldbucket = (hash & hashmask(engine->assoc.hashpower - 1))) >= engine->assoc.expand_bucket)
-    {
-        it->h_next = engine->assoc.old_hashtable[oldbucket];
-        engine->assoc.old_hashtable[oldbucket] = it;
-    } else {
-        it->h_next = engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)];
-        engine->assoc.primary_hashtable[hash & hashmask(engine->assoc.hashpower)] = it;
-    }
+    bucket_add(assoc_bucket(engine, hash), hash, it);
 
-    engine->assoc.hash_items++;
-    if (! engine->assoc.expanding && engine->assoc.hash_items > (hashsize(engine->assoc.hashpower) * 3) / 2) {
-        assoc_expand(engine);
+    unsigned int items = __sync_add_and_fetch(&engine->assoc.hash_items, 1);
+    if (! engine->assoc.expanding && items > ASSOC_MAX_LOAD(engine->assoc.hashpower)) {
+        /* Let the maintenance thread grow the table */
+        pthread_mutex_lock(&engine->assoc.maintenance_lock);
+        if (!engine->assoc.maintenance_running) {
+            engine->assoc.maintenance_running = true;
+            pthread_cond_signal(&engine->assoc.maintenance_cond);
+        }
+        pthread_mutex_unlock(&engine->assoc.maintenance_lock);
     }
 
     return 1;
 }
 
 void assoc_delete(struct compress_engine *engine, uint32_t hash, const char *key, const size_t nkey) {
-    hash_item **before = _hashitem_before(engine, hash, key, nkey);
-
-    if (*before) {
-        hash_item *nxt;
-        engine->assoc.hash_items--;
-        /* The DTrace probe cannot be triggered as the last instruction
-         * due to possible tail-optimization by the compiler
-         */
-        nxt = (*before)->h_next;
-        (*before)->h_next = 0;   /* probably pointless, but whatever. */
-        *before = nxt;
-        return;
+    struct assoc_bucket *b = assoc_bucket(engine, hash);
+    hash_item **before;
+    unsigned int mask;
+
+    for (mask = bucket_match(b, hash); mask != 0; mask &= mask - 1) {
+        unsigned int slot = __builtin_ctz(mask);
+        hash_item *it = b->items[slot];
+        if (it != NULL && key_match(it, key, nkey)) {
+            __sync_sub_and_fetch(&engine->assoc.hash_items, 1);
+            b->items[slot] = NULL;
+            b->hashes[slot] = 0;
+            /* Pull an item from the overflow chain into the free slot */
+            if ((it = b->overflow) != NULL) {
+                b->overflow = it->h_next;
+                it->h_next = 0;
+                b->hashes[slot] = engine->server.hash(item_get_key(it), it->nkey, 0);
+                b->items[slot] = it;
+            }
+            return;
+        }
+    }
+
+    for (before = &b->overflow; *before != NULL; before = &(*before)->h_next) {
+        if (key_match(*before, key, nkey)) {
+            hash_item *nxt;
+            __sync_sub_and_fetch(&engine->assoc.hash_items, 1);
+            nxt = (*before)->h_next;
+            (*before)->h_next = 0;   /* probably pointless, but whatever. */
+            *before = nxt;
+            return;
+        }
     }
     /* Note:  we never actually get here.  the callers don't delete things
        they can't find. */
     assert(*before != 0);
 }
 
+/*
+ * The maintenance thread moves the buckets the front end threads haven't
+ * touched. It moves hash_bulk_move buckets at a time (taking the item lock
+ * for one bucket at a time), and sleeps hash_move_sleep microseconds between
+ * the batches so it doesn't compete with the front end threads.
+ */
+static void *assoc_maintenance_thread(void *arg) {
+    struct compress_engine *engine = arg;
 
+    pthread_mutex_lock(&engine->assoc.maintenance_lock);
+    while (!engine->assoc.maintenance_shutdown) {
+        if (!engine->assoc.maintenance_running) {
+            pthread_cond_wait(&engine->assoc.maintenance_cond,
+                              &engine->assoc.maintenance_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&engine->assoc.maintenance_lock);
 
-#define DEFAULT_HASH_BULK_MOVE 1
-int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
+        assoc_expand(engine);
 
-static void *assoc_maintenance_thread(void *arg) {
-    struct compress_engine *engine = arg;
-    bool done = false;
-    do {
-        int ii;
-        pthread_mutex_lock(&engine->cache_lock);
-
-        for (ii = 0; ii < hash_bulk_move && engine->assoc.expanding; ++ii) {
-            hash_item *it, *next;
-            int bucket;
-
-            for (it = engine->assoc.old_hashtable[engine->assoc.expand_bucket];
-                 NULL != it; it = next) {
-                next = it->h_next;
-
-                bucket = engine->server.hash(item_get_key(it), it->nkey, 0) & hashmask(engine->assoc.hashpower);
-                it->h_next = engine->assoc.primary_hashtable[bucket];
-                engine->assoc.primary_hashtable[bucket] = it;
+        while (engine->assoc.expanding && !engine->assoc.maintenance_shutdown) {
+            unsigned int nbuckets = hashsize(engine->assoc.hashpower - 1);
+            size_t ii;
+
+            for (ii = 0; ii < engine->config.hash_bulk_move &&
+                     engine->assoc.expand_bucket < nbuckets; ++ii) {
+                unsigned int oldbucket = engine->assoc.expand_bucket++;
+
+                /* Everything in this bucket maps to the same item lock */
+                item_lock(engine, oldbucket);
+                assoc_move_bucket(engine, oldbucket);
+                item_unlock(engine, oldbucket);
             }
 
-            engine->assoc.old_hashtable[engine->assoc.expand_bucket] = NULL;
-            engine->assoc.expand_bucket++;
-            if (engine->assoc.expand_bucket == hashsize(engine->assoc.hashpower - 1)) {
+            if (engine->assoc.expand_bucket == nbuckets) {
+                item_lock_all(engine);
                 engine->assoc.expanding = false;
                 free(engine->assoc.old_hashtable);
+                engine->assoc.old_hashtable = NULL;
+                item_unlock_all(engine);
                 if (engine->config.verbose > 1) {
                     fprintf(stderr, "Hash table expansion done\n");
                 }
+            } else if (engine->config.hash_move_sleep != 0) {
+                usleep(engine->config.hash_move_sleep);
             }
         }
-        if (!engine->assoc.expanding) {
-            done = true;
-        }
-        pthread_mutex_unlock(&engine->cache_lock);
-    } while (!done);
 
-    pthread_detach(pthread_self());
+        pthread_mutex_lock(&engine->assoc.maintenance_lock);
+        engine->assoc.maintenance_running = false;
+    }
+    pthread_mutex_unlock(&engine->assoc.maintenance_lock);
+
     return NULL;
 }
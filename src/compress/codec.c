@@ -0,0 +1,386 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compression codecs used by the compress engine
+ *
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#include "codec.h"
+
+struct codec_context {
+    int level;
+    /* The streams are initialized the first time they are used */
+    bool deflate_ok;
+    bool inflate_ok;
+    z_stream deflate;
+    z_stream inflate;
+#ifdef HAVE_LIBLZ4
+    LZ4_stream_t *lz4_stream;
+#endif
+#ifdef HAVE_LIBZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+
+struct codec_dict {
+    char *data;
+    size_t size;
+#ifdef HAVE_LIBZSTD
+    ZSTD_CDict *zstd_cdict;
+    ZSTD_DDict *zstd_ddict;
+#endif
+};
+
+/******************************** ZLIB ***************************************/
+
+static size_t zlib_bound(size_t nbytes) {
+    return compressBound(nbytes);
+}
+
+static size_t zlib_compress(struct codec_context *ctx,
+                            const struct codec_dict *dict,
+                            const void *src, size_t nsrc,
+                            void *dest, size_t ndest) {
+    z_stream *z = &ctx->deflate;
+    if (ctx->deflate_ok) {
+        deflateReset(z);
+    } else {
+        int level = ctx->level == 0 ? Z_DEFAULT_COMPRESSION : ctx->level;
+        if (level > Z_BEST_COMPRESSION) {
+            level = Z_BEST_COMPRESSION;
+        }
+        if (deflateInit(z, level) != Z_OK) {
+            return 0;
+        }
+        ctx->deflate_ok = true;
+    }
+
+    if (dict != NULL &&
+        deflateSetDictionary(z, (Bytef*)dict->data, dict->size) != Z_OK) {
+        return 0;
+    }
+
+    z->next_in = (Bytef*)src;
+    z->avail_in = nsrc;
+    z->next_out = dest;
+    z->avail_out = ndest;
+
+    if (deflate(z, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+    return z->total_out;
+}
+
+static bool zlib_decompress(struct codec_context *ctx,
+                            const struct codec_dict *dict,
+                            const void *src, size_t nsrc,
+                            void *dest, size_t ndest) {
+    z_stream *z = &ctx->inflate;
+    if (ctx->inflate_ok) {
+        inflateReset(z);
+    } else {
+        if (inflateInit(z) != Z_OK) {
+            return false;
+        }
+        ctx->inflate_ok = true;
+    }
+
+    z->next_in = (Bytef*)src;
+    z->avail_in = nsrc;
+    z->next_out = dest;
+    z->avail_out = ndest;
+
+    int r = inflate(z, Z_FINISH);
+    if (r == Z_NEED_DICT && dict != NULL &&
+        inflateSetDictionary(z, (Bytef*)dict->data, dict->size) == Z_OK) {
+        r = inflate(z, Z_FINISH);
+    }
+
+    return r == Z_STREAM_END && z->total_out == ndest;
+}
+
+/******************************** LZ4 ****************************************/
+
+#ifdef HAVE_LIBLZ4
+static size_t lz4_bound(size_t nbytes) {
+    return LZ4_compressBound(nbytes);
+}
+
+static size_t lz4_compress(struct codec_context *ctx,
+                           const struct codec_dict *dict,
+                           const void *src, size_t nsrc,
+                           void *dest, size_t ndest) {
+    /* The level is used as the acceleration factor (higher is faster) */
+    int acceleration = ctx->level == 0 ? 1 : ctx->level;
+    int r;
+
+    if (dict == NULL) {
+        r = LZ4_compress_fast(src, dest, nsrc, ndest, acceleration);
+    } else {
+        if (ctx->lz4_stream == NULL &&
+            (ctx->lz4_stream = LZ4_createStream()) == NULL) {
+            return 0;
+        }
+        LZ4_loadDict(ctx->lz4_stream, dict->data, dict->size);
+        r = LZ4_compress_fast_continue(ctx->lz4_stream, src, dest, nsrc,
+                                       ndest, acceleration);
+    }
+    return r > 0 ? (size_t)r : 0;
+}
+
+static bool lz4_decompress(struct codec_context *ctx,
+                           const struct codec_dict *dict,
+                           const void *src, size_t nsrc,
+                           void *dest, size_t ndest) {
+    (void)ctx;
+    if (dict == NULL) {
+        return LZ4_decompress_safe(src, dest, nsrc, ndest) == (int)ndest;
+    }
+    return LZ4_decompress_safe_usingDict(src, dest, nsrc, ndest,
+                                         dict->data, dict->size) == (int)ndest;
+}
+#endif
+
+/******************************** ZSTD ***************************************/
+
+#ifdef HAVE_LIBZSTD
+static size_t zstd_bound(size_t nbytes) {
+    return ZSTD_compressBound(nbytes);
+}
+
+static size_t zstd_compress(struct codec_context *ctx,
+                            const struct codec_dict *dict,
+                            const void *src, size_t nsrc,
+                            void *dest, size_t ndest) {
+    size_t r;
+    if (ctx->zstd_cctx == NULL && (ctx->zstd_cctx = ZSTD_createCCtx()) == NULL) {
+        return 0;
+    }
+
+    if (dict == NULL) {
+        r = ZSTD_compressCCtx(ctx->zstd_cctx, dest, ndest, src, nsrc,
+                              ctx->level);
+    } else {
+        r = ZSTD_compress_usingCDict(ctx->zstd_cctx, dest, ndest, src, nsrc,
+                                     dict->zstd_cdict);
+    }
+    return ZSTD_isError(r) ? 0 : r;
+}
+
+static bool zstd_decompress(struct codec_context *ctx,
+                            const struct codec_dict *dict,
+                            const void *src, size_t nsrc,
+                            void *dest, size_t ndest) {
+    size_t r;
+    if (ctx->zstd_dctx == NULL && (ctx->zstd_dctx = ZSTD_createDCtx()) == NULL) {
+        return false;
+    }
+
+    if (dict == NULL) {
+        r = ZSTD_decompressDCtx(ctx->zstd_dctx, dest, ndest, src, nsrc);
+    } else {
+        r = ZSTD_decompress_usingDDict(ctx->zstd_dctx, dest, ndest, src, nsrc,
+                                       dict->zstd_ddict);
+    }
+    return !ZSTD_isError(r) && r == ndest;
+}
+#endif
+
+static const struct codec codecs[] = {
+    { .name = "zlib",
+      .id = CODEC_ZLIB,
+      .bound = zlib_bound,
+      .compress = zlib_compress,
+      .decompress = zlib_decompress },
+#ifdef HAVE_LIBLZ4
+    { .name = "lz4",
+      .id = CODEC_LZ4,
+      .bound = lz4_bound,
+      .compress = lz4_compress,
+      .decompress = lz4_decompress },
+#endif
+#ifdef HAVE_LIBZSTD
+    { .name = "zstd",
+      .id = CODEC_ZSTD,
+      .bound = zstd_bound,
+      .compress = zstd_compress,
+      .decompress = zstd_decompress },
+#endif
+    { .name = NULL }
+};
+
+const struct codec *codec_find(const char *name) {
+    const struct codec *codec;
+    for (codec = codecs; codec->name != NULL; ++codec) {
+        if (strcmp(codec->name, name) == 0) {
+            return codec;
+        }
+    }
+    return NULL;
+}
+
+const struct codec *codec_get(uint8_t id) {
+    const struct codec *codec;
+    for (codec = codecs; codec->name != NULL; ++codec) {
+        if (codec->id == id) {
+            return codec;
+        }
+    }
+    return NULL;
+}
+
+struct codec_context *codec_context_create(int level) {
+    struct codec_context *ctx = calloc(1, sizeof(*ctx));
+    if (ctx != NULL) {
+        ctx->level = level;
+    }
+    return ctx;
+}
+
+void codec_context_destroy(struct codec_context *ctx) {
+    if (ctx->deflate_ok) {
+        deflateEnd(&ctx->deflate);
+    }
+    if (ctx->inflate_ok) {
+        inflateEnd(&ctx->inflate);
+    }
+#ifdef HAVE_LIBLZ4
+    if (ctx->lz4_stream != NULL) {
+        LZ4_freeStream(ctx->lz4_stream);
+    }
+#endif
+#ifdef HAVE_LIBZSTD
+    ZSTD_freeCCtx(ctx->zstd_cctx);
+    ZSTD_freeDCtx(ctx->zstd_dctx);
+#endif
+    free(ctx);
+}
+
+/*
+ * Use the samples as the dictionary content. The codecs find matches
+ * closer to the end of the dictionary cheaper, so the first (most
+ * recently used) samples are put last.
+ */
+static size_t dict_from_samples(char *dest, size_t maxsize,
+                                const char *samples, const size_t *sizes,
+                                unsigned int nsamples) {
+    size_t pos = maxsize;
+    unsigned int ii;
+
+    for (ii = 0; ii < nsamples && pos > 0; ++ii) {
+        size_t n = sizes[ii] < pos ? sizes[ii] : pos;
+        pos -= n;
+        memcpy(dest + pos, samples, n);
+        samples += sizes[ii];
+    }
+
+    memmove(dest, dest + pos, maxsize - pos);
+    return maxsize - pos;
+}
+
+/*
+ * Prepare the codec specific state of a dictionary (zstd digests the
+ * dictionary up front).
+ */
+static struct codec_dict *dict_prepare(const struct codec *codec, int level,
+                                       struct codec_dict *dict) {
+#ifdef HAVE_LIBZSTD
+    if (codec->id == CODEC_ZSTD) {
+        dict->zstd_cdict = ZSTD_createCDict(dict->data, dict->size,
+                                            level == 0 ? ZSTD_CLEVEL_DEFAULT : level);
+        dict->zstd_ddict = ZSTD_createDDict(dict->data, dict->size);
+        if (dict->zstd_cdict == NULL || dict->zstd_ddict == NULL) {
+            codec_dict_destroy(dict);
+            return NULL;
+        }
+    }
+#else
+    (void)codec;
+    (void)level;
+#endif
+
+    return dict;
+}
+
+struct codec_dict *codec_dict_create(const struct codec *codec, int level,
+                                     const void *samples, const size_t *sizes,
+                                     unsigned int nsamples, size_t maxsize) {
+    struct codec_dict *dict;
+
+    /* zlib only use a 32k window and LZ4 a 64k window */
+    if (codec->id == CODEC_ZLIB && maxsize > 32 * 1024) {
+        maxsize = 32 * 1024;
+    } else if (codec->id == CODEC_LZ4 && maxsize > 64 * 1024) {
+        maxsize = 64 * 1024;
+    }
+
+    if ((dict = calloc(1, sizeof(*dict))) == NULL) {
+        return NULL;
+    }
+    if ((dict->data = malloc(maxsize)) == NULL) {
+        free(dict);
+        return NULL;
+    }
+
+#ifdef HAVE_LIBZSTD
+    if (codec->id == CODEC_ZSTD) {
+        size_t r = ZDICT_trainFromBuffer(dict->data, maxsize, samples,
+                                         sizes, nsamples);
+        if (!ZDICT_isError(r)) {
+            dict->size = r;
+        }
+    }
+#endif
+
+    if (dict->size == 0) {
+        dict->size = dict_from_samples(dict->data, maxsize, samples,
+                                       sizes, nsamples);
+    }
+
+    return dict_prepare(codec, level, dict);
+}
+
+struct codec_dict *codec_dict_load(const struct codec *codec, int level,
+                                   const void *data, size_t size) {
+    struct codec_dict *dict;
+
+    if (size == 0 || (dict = calloc(1, sizeof(*dict))) == NULL) {
+        return NULL;
+    }
+    if ((dict->data = malloc(size)) == NULL) {
+        free(dict);
+        return NULL;
+    }
+    memcpy(dict->data, data, size);
+    dict->size = size;
+
+    return dict_prepare(codec, level, dict);
+}
+
+const void *codec_dict_data(const struct codec_dict *dict, size_t *size) {
+    *size = dict->size;
+    return dict->data;
+}
+
+void codec_dict_destroy(struct codec_dict *dict) {
+#ifdef HAVE_LIBZSTD
+    ZSTD_freeCDict(dict->zstd_cdict);
+    ZSTD_freeDDict(dict->zstd_ddict);
+#endif
+    free(dict->data);
+    free(dict);
+}
@@ -0,0 +1,139 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The compression codecs available in the compress engine. The id of the
+ * codec used for an item is stored in its iflag (see ITEM_CODEC_MASK), so
+ * there is room for three codecs (0 means that the item isn't compressed).
+ */
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+#define CODEC_LZ4  2
+#define CODEC_ZSTD 3
+
+/*
+ * The per thread state used by the codecs (zlib streams etc). A context
+ * may only be used by one thread at a time.
+ */
+struct codec_context;
+
+/*
+ * A dictionary prepared for use by a codec (see codec_dict_create).
+ */
+struct codec_dict;
+
+struct codec {
+    /** The name used to select the codec in the configuration */
+    const char *name;
+    /** The id stored in the items (CODEC_xxx) */
+    uint8_t id;
+    /**
+     * Get the maximum number of bytes a compressed object may use
+     * @param nbytes the size of the uncompressed object
+     */
+    size_t (*bound)(size_t nbytes);
+    /**
+     * Compress an object
+     * @param ctx the context to use
+     * @param dict the dictionary to use (may be NULL)
+     * @param src the data to compress
+     * @param nsrc the number of bytes to compress
+     * @param dest where to store the result
+     * @param ndest the size of dest (at least bound(nsrc))
+     * @return the size of the compressed data, or 0 on failure
+     */
+    size_t (*compress)(struct codec_context *ctx,
+                       const struct codec_dict *dict,
+                       const void *src, size_t nsrc,
+                       void *dest, size_t ndest);
+    /**
+     * Decompress an object
+     * @param ctx the context to use
+     * @param dict the dictionary the data was compressed with (may be NULL)
+     * @param src the compressed data
+     * @param nsrc the number of bytes of compressed data
+     * @param dest where to store the result
+     * @param ndest the size of the uncompressed object
+     * @return true if we got exactly ndest bytes of data
+     */
+    bool (*decompress)(struct codec_context *ctx,
+                       const struct codec_dict *dict,
+                       const void *src, size_t nsrc,
+                       void *dest, size_t ndest);
+};
+
+/**
+ * Look up a codec by name
+ * @param name the name of the codec ("zlib", "lz4" or "zstd")
+ * @return the codec or NULL if it's unknown (or not compiled in)
+ */
+const struct codec *codec_find(const char *name);
+
+/**
+ * Look up a codec by id
+ * @param id the id stored in the item
+ * @return the codec or NULL if it's unknown (or not compiled in)
+ */
+const struct codec *codec_get(uint8_t id);
+
+/**
+ * Create a new codec context
+ * @param level the compression level to use (0 == the codec's default)
+ * @return the new context or NULL if we're out of memory
+ */
+struct codec_context *codec_context_create(int level);
+
+/**
+ * Release all resources used by a codec context
+ * @param ctx the context to destroy
+ */
+void codec_context_destroy(struct codec_context *ctx);
+
+/**
+ * Build a dictionary from a set of sample values. Zstd trains the
+ * dictionary from the samples, the other codecs use the samples as a
+ * preset dictionary (with the first samples last, where they are the
+ * cheapest to reference).
+ * @param codec the codec the dictionary is for
+ * @param level the compression level to use (0 == the codec's default)
+ * @param samples the sample values stored back to back
+ * @param sizes the size of each sample
+ * @param nsamples the number of samples
+ * @param maxsize the maximum size of the dictionary
+ * @return the new dictionary or NULL on failure
+ */
+struct codec_dict *codec_dict_create(const struct codec *codec, int level,
+                                     const void *samples, const size_t *sizes,
+                                     unsigned int nsamples, size_t maxsize);
+
+/**
+ * Build a dictionary from the content of a dictionary created earlier
+ * (see codec_dict_data)
+ * @param codec the codec the dictionary is for
+ * @param level the compression level to use (0 == the codec's default)
+ * @param data the content of the dictionary
+ * @param size the size of the content
+ * @return the new dictionary or NULL on failure
+ */
+struct codec_dict *codec_dict_load(const struct codec *codec, int level,
+                                   const void *data, size_t size);
+
+/**
+ * Get the content of a dictionary
+ * @param dict the dictionary
+ * @param size where to store the size of the content
+ * @return the content (owned by the dictionary)
+ */
+const void *codec_dict_data(const struct codec_dict *dict, size_t *size);
+
+/**
+ * Release all resources used by a dictionary
+ * @param dict the dictionary to destroy
+ */
+void codec_dict_destroy(struct codec_dict *dict);
+
+#endif
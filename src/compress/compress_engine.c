@@ -9,6 +9,8 @@
 #include <inttypes.h>
 
 #include "compress_engine.h"
+#include "codec.h"
+#include "snapshot.h"
 #include <memcached/util.h>
 #include <memcached/config_parser.h>
 
@@ -108,12 +110,11 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
       .get_server_api = get_server_api,
       .initialized = true,
       .assoc = {
-         .hashpower = 16,
+         .hashpower = 15,
       },
       .slabs = {
          .lock = PTHREAD_MUTEX_INITIALIZER
       },
-      .cache_lock = PTHREAD_MUTEX_INITIALIZER,
       .stats = {
          .lock = PTHREAD_MUTEX_INITIALIZER,
       },
@@ -124,9 +125,28 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
          .evict_to_free = true,
          .maxbytes = 64 * 1024 * 1024,
          .preallocate = false,
+         .hugepages = true,
+         .numa = false,
+         .slab_automove = false,
+         .slab_automove_interval = 10,
+         .hash_bulk_move = 1024,
+         .hash_move_sleep = 1000,
          .factor = 1.25,
          .chunk_size = 48,
          .item_size_max= 1024 * 1024,
+         .slab_chunk_max = 0,
+         .compression_codec = "zlib",
+         .compression_level = 0,
+         .min_compress_size = 64,
+         .compression_dict_size = 0,
+         .compression_dict_interval = 300,
+         .compress_async = false,
+         .compress_min_age = 60,
+         .compress_interval = 1,
+         .snapshot_file = NULL,
+         .admission_filter = false,
+         .admission_filter_keys = 0,
+         .latency_stats = true,
        },
       .info.engine_info = {
            .description = "Default engine v0.1",
@@ -165,11 +185,28 @@ static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
       return ret;
    }
 
+   se->codec = codec_find(se->config.compression_codec);
+   if (se->codec == NULL) {
+      fprintf(stderr, "Unknown compression codec: %s\n",
+              se->config.compression_codec);
+      return ENGINE_FAILED;
+   }
+
    /* fixup feature_info */
    if (se->config.use_cas) {
        se->info.engine_info.features[se->info.engine_info.num_features++].feature = ENGINE_FEATURE_CAS;
    }
 
+   ret = latency_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = item_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
    ret = assoc_init(se);
    if (ret != ENGINE_SUCCESS) {
       return ret;
@@ -181,6 +218,31 @@ static ENGINE_ERROR_CODE default_initialize(ENGINE_HANDLE* handle,
       return ret;
    }
 
+   ret = dictionary_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = admission_init(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   /* The rebalancer mustn't move the pages while they're restored */
+   if (se->config.snapshot_file != NULL) {
+      snapshot_restore(se, se->config.snapshot_file, NULL);
+   }
+
+   ret = slabs_start_rebalancer(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
+   ret = item_start_compactor(se);
+   if (ret != ENGINE_SUCCESS) {
+      return ret;
+   }
+
    return ENGINE_SUCCESS;
 }
 
@@ -188,7 +250,16 @@ static void default_destroy(ENGINE_HANDLE* handle) {
    struct compress_engine* se = get_handle(handle);
 
    if (se->initialized) {
-      pthread_mutex_destroy(&se->cache_lock);
+      slabs_stop_rebalancer(se);
+      item_stop_compactor(se);
+      if (se->config.snapshot_file != NULL) {
+         snapshot_save(se, se->config.snapshot_file, NULL);
+      }
+      dictionary_destroy(se);
+      assoc_destroy(se);
+      item_destroy(se);
+      admission_destroy(se);
+      latency_destroy(se);
       pthread_mutex_destroy(&se->stats.lock);
       se->initialized = false;
       free(se);
@@ -214,6 +285,9 @@ static ENGINE_ERROR_CODE default_item_allocate(ENGINE_HANDLE* handle,
    }
 
    hash_item *it;
+   if (admission_enabled(engine)) {
+      admission_record(engine, engine->server.hash(key, nkey, 0));
+   }
    it = item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
 
    if (it != NULL) {
@@ -231,19 +305,21 @@ static ENGINE_ERROR_CODE default_item_delete(ENGINE_HANDLE* handle,
                                              uint64_t cas)
 {
    struct compress_engine* engine = get_handle(handle);
+   uint64_t start = latency_start(engine);
+   ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
    hash_item *it = item_get(engine, key, nkey);
    if (it == NULL) {
-      return ENGINE_KEY_ENOENT;
-   }
-
-   if (cas == 0 || cas == item_get_cas(it)) {
+      ret = ENGINE_KEY_ENOENT;
+   } else if (cas == 0 || cas == item_get_cas(it)) {
       item_unlink(engine, it);
       item_release(engine, it);
    } else {
-      return ENGINE_KEY_EEXISTS;
+      item_release(engine, it);
+      ret = ENGINE_KEY_EEXISTS;
    }
 
-   return ENGINE_SUCCESS;
+   latency_record(engine, LATENCY_DELETE, start);
+   return ret;
 }
 
 static void default_item_release(ENGINE_HANDLE* handle,
@@ -257,7 +333,14 @@ static ENGINE_ERROR_CODE default_get(ENGINE_HANDLE* handle,
                                      item** item,
                                      const void* key,
                                      const int nkey) {
-   *item = item_get(get_handle(handle), key, nkey);
+   struct compress_engine* engine = get_handle(handle);
+   uint64_t start = latency_start(engine);
+   *item = item_get(engine, key, nkey);
+   if (admission_enabled(engine)) {
+      admission_record(engine, engine->server.hash(key, nkey, 0));
+   }
+   latency_count(engine, *item != NULL ? LATENCY_GET_HITS : LATENCY_GET_MISSES, 1);
+   latency_record(engine, LATENCY_GET, start);
    if (*item != NULL) {
       return ENGINE_SUCCESS;
    } else {
@@ -292,12 +375,15 @@ static ENGINE_ERROR_CODE default_get_stats(ENGINE_HANDLE* handle,
       len = sprintf(val, "%"PRIu64, (uint64_t)engine->config.maxbytes);
       add_stat("engine_maxbytes", 15, val, len, cookie);
       pthread_mutex_unlock(&engine->stats.lock);
+      admission_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "slabs", 5) == 0) {
       slabs_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "items", 5) == 0) {
       item_stats(engine, add_stat, cookie);
    } else if (strncmp(stat_key, "sizes", 5) == 0) {
       item_stats_sizes(engine, add_stat, cookie);
+   } else if (strncmp(stat_key, "latency", 7) == 0) {
+      latency_stats(engine, add_stat, cookie);
    } else {
       ret = ENGINE_KEY_ENOENT;
    }
@@ -313,8 +399,12 @@ static ENGINE_ERROR_CODE default_store(ENGINE_HANDLE* handle,
     if (operation == OPERATION_APPEND || operation == OPERATION_PREPEND) {
         return ENGINE_ENOTSUP;
     }
-    return store_item(get_handle(handle), get_real_item(item), cas, operation,
-                      cookie);
+    struct compress_engine *engine = get_handle(handle);
+    uint64_t start = latency_start(engine);
+    ENGINE_ERROR_CODE ret = store_item(engine, get_real_item(item), cas,
+                                       operation, cookie);
+    latency_record(engine, LATENCY_STORE, start);
+    return ret;
 }
 
 static ENGINE_ERROR_CODE default_arithmetic(ENGINE_HANDLE* handle,
@@ -347,6 +437,8 @@ static void default_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
    engine->stats.reclaimed = 0;
    engine->stats.total_items = 0;
    pthread_mutex_unlock(&engine->stats.lock);
+   admission_reset_stats(engine);
+   latency_reset(engine);
 }
 
 static ENGINE_ERROR_CODE initalize_configuration(struct compress_engine *se,
@@ -370,6 +462,24 @@ static ENGINE_ERROR_CODE initalize_configuration(struct compress_engine *se,
          { .key = "preallocate",
            .datatype = DT_BOOL,
            .value.dt_bool = &se->config.preallocate },
+         { .key = "hugepages",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.hugepages },
+         { .key = "numa",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.numa },
+         { .key = "slab_automove",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.slab_automove },
+         { .key = "slab_automove_interval",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.slab_automove_interval },
+         { .key = "hash_bulk_move",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.hash_bulk_move },
+         { .key = "hash_move_sleep",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.hash_move_sleep },
          { .key = "factor",
            .datatype = DT_FLOAT,
            .value.dt_float = &se->config.factor },
@@ -379,6 +489,45 @@ static ENGINE_ERROR_CODE initalize_configuration(struct compress_engine *se,
          { .key = "item_size_max",
            .datatype = DT_SIZE,
            .value.dt_size = &se->config.item_size_max },
+         { .key = "slab_chunk_max",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.slab_chunk_max },
+         { .key = "compression_codec",
+           .datatype = DT_STRING,
+           .value.dt_string = &se->config.compression_codec },
+         { .key = "compression_level",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.compression_level },
+         { .key = "min_compress_size",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.min_compress_size },
+         { .key = "compression_dict_size",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.compression_dict_size },
+         { .key = "compression_dict_interval",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.compression_dict_interval },
+         { .key = "compress_async",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.compress_async },
+         { .key = "compress_min_age",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.compress_min_age },
+         { .key = "compress_interval",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.compress_interval },
+         { .key = "snapshot_file",
+           .datatype = DT_STRING,
+           .value.dt_string = &se->config.snapshot_file },
+         { .key = "admission_filter",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.admission_filter },
+         { .key = "admission_filter_keys",
+           .datatype = DT_SIZE,
+           .value.dt_size = &se->config.admission_filter_keys },
+         { .key = "latency_stats",
+           .datatype = DT_BOOL,
+           .value.dt_bool = &se->config.latency_stats },
          { .key = "config_file",
            .datatype = DT_CONFIGFILE },
          { .key = NULL}
@@ -444,18 +593,22 @@ uint8_t item_get_clsid(const hash_item* item)
 static bool get_item_info(ENGINE_HANDLE *handle, const item* item, item_info *item_info)
 {
     hash_item* it = (hash_item*)item;
+    int nvalue;
     if (item_info->nvalue < 1) {
         return false;
     }
+    /* A chained value needs an iovec for each of its chunks */
+    nvalue = item_get_iov(it, item_info->value, item_info->nvalue);
+    if (nvalue > item_info->nvalue) {
+        return false;
+    }
     item_info->cas = item_get_cas(it);
     item_info->exptime = it->exptime;
     item_info->nbytes = it->nbytes;
     item_info->flags = it->flags;
     item_info->clsid = it->slabs_clsid;
     item_info->nkey = it->nkey;
-    item_info->nvalue = 1;
+    item_info->nvalue = nvalue;
     item_info->key = item_get_key(it);
-    item_info->value[0].iov_base = item_get_data(it);
-    item_info->value[0].iov_len = it->nbytes;
     return true;
 }
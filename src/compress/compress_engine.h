@@ -48,11 +48,26 @@ struct compress_engine;
 #include "items.h"
 #include "assoc.h"
 #include "slabs.h"
+#include "dictionary.h"
+#include "latency.h"
+#include "admission.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/*
+ * The upper 8 bits of iflag (the lower ones are the core server's):
+ *
+ *   8      ITEM_LINKED
+ *   9      ITEM_SLABBED
+ *   10-11  ITEM_CODEC_MASK
+ *   12-14  ITEM_DICT_MASK
+ *   15     ITEM_COMPRESS_TRIED
+ *
+ * That's all of them, so the flags of chained values go in eflag.
+ */
+
    /* Flags */
 #define ITEM_WITH_CAS 1
 
@@ -61,6 +76,23 @@ extern "C" {
 /* temp */
 #define ITEM_SLABBED (2<<8)
 
+/* The codec used to compress the item data (see compress_item) */
+#define ITEM_CODEC_SHIFT 10
+#define ITEM_CODEC_MASK (3<<ITEM_CODEC_SHIFT)
+
+/* The version of the dictionary used to compress the item (see dictionary.h) */
+#define ITEM_DICT_SHIFT 12
+#define ITEM_DICT_MASK (7<<ITEM_DICT_SHIFT)
+
+/* The compactor failed to shrink the item, so don't try again */
+#define ITEM_COMPRESS_TRIED (1<<15)
+
+/* The value is split over a chain of chunks (see slab_chunk_max, in eflag) */
+#define ITEM_CHAINED 1
+
+/* Not an item, but a chunk holding a part of the value of one (in eflag) */
+#define ITEM_CHUNK 2
+
 struct config {
    bool use_cas;
    size_t verbose;
@@ -68,9 +100,28 @@ struct config {
    bool evict_to_free;
    size_t maxbytes;
    bool preallocate;
+   bool hugepages;
+   bool numa;
+   bool slab_automove;
+   size_t slab_automove_interval;
+   size_t hash_bulk_move;
+   size_t hash_move_sleep;
    float factor;
    size_t chunk_size;
    size_t item_size_max;
+   size_t slab_chunk_max;
+   char *compression_codec;
+   size_t compression_level;
+   size_t min_compress_size;
+   size_t compression_dict_size;
+   size_t compression_dict_interval;
+   bool compress_async;
+   size_t compress_min_age;
+   size_t compress_interval;
+   char *snapshot_file;
+   bool admission_filter;
+   size_t admission_filter_keys;
+   bool latency_stats;
 };
 
 PUBLIC
@@ -109,14 +160,13 @@ struct compress_engine {
    struct assoc assoc;
    struct slabs slabs;
    struct items items;
-
-   /**
-    * The cache layer (item_* and assoc_*) is currently protected by
-    * this single mutex
-    */
-   pthread_mutex_t cache_lock;
+   struct latency latency;
+   struct admission admission;
 
    struct config config;
+   /* The codec used for new items (from config.compression_codec) */
+   const struct codec *codec;
+   struct dictionaries dictionaries;
    struct engine_stats stats;
    union {
        engine_info engine_info;
@@ -0,0 +1,268 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compression dictionaries trained from the items in the cache
+ *
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "compress_engine.h"
+#include "codec.h"
+
+/* The maximum number of items to sample when training a dictionary */
+#define DICTIONARY_MAX_SAMPLES 4096
+
+/* Don't bother to train a dictionary from fewer items than this */
+#define DICTIONARY_MIN_SAMPLES 64
+
+static void *dictionary_trainer(void *arg);
+
+ENGINE_ERROR_CODE dictionary_init(struct compress_engine *engine) {
+    struct dictionaries *d = &engine->dictionaries;
+    int ret;
+
+    memset(d->dicts, 0, sizeof(d->dicts));
+    memset(d->refs, 0, sizeof(d->refs));
+    d->current = 0;
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->cond, NULL);
+
+    if (engine->config.compression_dict_size == 0) {
+        return ENGINE_SUCCESS;
+    }
+
+    if ((ret = pthread_create(&d->tid, NULL, dictionary_trainer, engine)) != 0) {
+        fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
+        return ENGINE_FAILED;
+    }
+    d->running = true;
+
+    return ENGINE_SUCCESS;
+}
+
+void dictionary_destroy(struct compress_engine *engine) {
+    struct dictionaries *d = &engine->dictionaries;
+    int ii;
+
+    if (d->running) {
+        pthread_mutex_lock(&d->lock);
+        d->shutdown = true;
+        pthread_cond_signal(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+        pthread_join(d->tid, NULL);
+        d->running = false;
+    }
+
+    /*
+     * The items may still reference the dictionaries. Clear the table so
+     * that the references released after this point are ignored.
+     */
+    d->current = 0;
+    for (ii = 0; ii < DICTIONARY_VERSIONS; ++ii) {
+        if (d->dicts[ii] != NULL) {
+            codec_dict_destroy(d->dicts[ii]);
+            d->dicts[ii] = NULL;
+        }
+    }
+
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->lock);
+}
+
+uint8_t dictionary_acquire(struct compress_engine *engine) {
+    struct dictionaries *d = &engine->dictionaries;
+    uint8_t version;
+
+    pthread_mutex_lock(&d->lock);
+    version = d->current;
+    dictionary_retain(engine, version);
+    pthread_mutex_unlock(&d->lock);
+
+    return version;
+}
+
+void dictionary_retain(struct compress_engine *engine, uint8_t version) {
+    if (version != 0) {
+        __sync_add_and_fetch(&engine->dictionaries.refs[version], 1);
+    }
+}
+
+void dictionary_release(struct compress_engine *engine, uint8_t version) {
+    struct dictionaries *d = &engine->dictionaries;
+    if (version == 0 || d->dicts[version] == NULL) {
+        return;
+    }
+
+    if (__sync_sub_and_fetch(&d->refs[version], 1) == 0) {
+        /* Nobody may use this version anymore, so the slot may be reused */
+        codec_dict_destroy(d->dicts[version]);
+        __sync_synchronize();
+        d->dicts[version] = NULL;
+    }
+}
+
+struct codec_dict *dictionary_get(struct compress_engine *engine,
+                                  uint8_t version) {
+    return engine->dictionaries.dicts[version];
+}
+
+bool dictionary_try_retain(struct compress_engine *engine, uint8_t version) {
+    uint32_t *refs = &engine->dictionaries.refs[version];
+    uint32_t old;
+
+    do {
+        if ((old = *refs) == 0) {
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(refs, old, old + 1));
+
+    if (engine->dictionaries.dicts[version] == NULL) {
+        /* The trainer is still installing it */
+        __sync_sub_and_fetch(refs, 1);
+        return false;
+    }
+    return true;
+}
+
+bool dictionary_restore(struct compress_engine *engine, uint8_t version,
+                        const struct codec *codec,
+                        const void *data, size_t size) {
+    struct dictionaries *d = &engine->dictionaries;
+    struct codec_dict *dict;
+
+    if (version == 0 || version >= DICTIONARY_VERSIONS ||
+        (dict = codec_dict_load(codec, engine->config.compression_level,
+                                data, size)) == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    if (d->dicts[version] != NULL) {
+        /* The trainer got there first */
+        pthread_mutex_unlock(&d->lock);
+        codec_dict_destroy(dict);
+        return false;
+    }
+    d->refs[version] = 1;
+    d->dicts[version] = dict;
+    pthread_mutex_unlock(&d->lock);
+
+    return true;
+}
+
+void dictionary_restore_done(struct compress_engine *engine, uint8_t current,
+                             uint8_t restored) {
+    struct dictionaries *d = &engine->dictionaries;
+    uint8_t version;
+
+    pthread_mutex_lock(&d->lock);
+    if (current != 0 && (restored & (1 << current)) != 0 && d->current == 0) {
+        /* The restore reference becomes the one held by the current version */
+        d->current = current;
+        restored &= ~(1 << current);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    for (version = 1; version < DICTIONARY_VERSIONS; ++version) {
+        if ((restored & (1 << version)) != 0) {
+            dictionary_release(engine, version);
+        }
+    }
+}
+
+/*
+ * Train a new dictionary from the most recently used items and make it
+ * the current one.
+ */
+static void dictionary_train(struct compress_engine *engine) {
+    struct dictionaries *d = &engine->dictionaries;
+    size_t dictsize = engine->config.compression_dict_size;
+    /* Use samples of about 100 times the dictionary size */
+    size_t bufsize = dictsize * 100;
+    char *buffer = malloc(bufsize);
+    size_t *sizes = calloc(DICTIONARY_MAX_SAMPLES, sizeof(size_t));
+    struct codec_dict *dict = NULL;
+    unsigned int nsamples = 0;
+    uint8_t version, old;
+
+    if (buffer != NULL && sizes != NULL) {
+        nsamples = item_sample(engine, buffer, bufsize, sizes,
+                               DICTIONARY_MAX_SAMPLES);
+        if (nsamples >= DICTIONARY_MIN_SAMPLES) {
+            dict = codec_dict_create(engine->codec,
+                                     engine->config.compression_level,
+                                     buffer, sizes, nsamples, dictsize);
+        }
+    }
+    free(buffer);
+    free(sizes);
+
+    if (dict == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    for (version = 1; version < DICTIONARY_VERSIONS; ++version) {
+        if (d->dicts[version] == NULL) {
+            break;
+        }
+    }
+
+    if (version == DICTIONARY_VERSIONS) {
+        /* The items still use all of the old versions */
+        pthread_mutex_unlock(&d->lock);
+        codec_dict_destroy(dict);
+        if (engine->config.verbose) {
+            fprintf(stderr, "No free dictionary slots, keeping version %u\n",
+                    d->current);
+        }
+        return;
+    }
+
+    d->refs[version] = 1;
+    d->dicts[version] = dict;
+    __sync_synchronize();
+    old = d->current;
+    d->current = version;
+    pthread_mutex_unlock(&d->lock);
+
+    dictionary_release(engine, old);
+
+    if (engine->config.verbose) {
+        fprintf(stderr, "Using compression dictionary version %u "
+                "(trained from %u items)\n", version, nsamples);
+    }
+}
+
+static void *dictionary_trainer(void *arg) {
+    struct compress_engine *engine = arg;
+    struct dictionaries *d = &engine->dictionaries;
+
+    pthread_mutex_lock(&d->lock);
+    while (!d->shutdown) {
+        struct timeval tv;
+        struct timespec ts;
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + engine->config.compression_dict_interval;
+        ts.tv_nsec = tv.tv_usec * 1000;
+
+        while (!d->shutdown &&
+               pthread_cond_timedwait(&d->cond, &d->lock, &ts) != ETIMEDOUT) {
+            /* spurious wakeup */
+        }
+        if (d->shutdown) {
+            break;
+        }
+
+        pthread_mutex_unlock(&d->lock);
+        dictionary_train(engine);
+        pthread_mutex_lock(&d->lock);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return NULL;
+}
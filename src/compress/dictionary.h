@@ -0,0 +1,112 @@
+#ifndef DICTIONARY_H
+#define DICTIONARY_H
+
+/*
+ * The compress engine may compress items with a shared dictionary trained
+ * from the items in the cache. The version of the dictionary used for an
+ * item is stored in its iflag (see ITEM_DICT_MASK), and version 0 means
+ * that no dictionary was used.
+ */
+#define DICTIONARY_VERSIONS 8
+
+struct codec;
+struct codec_dict;
+
+struct dictionaries {
+   /* The dictionaries in use, indexed by version */
+   struct codec_dict *dicts[DICTIONARY_VERSIONS];
+   /*
+    * The number of references to each dictionary (updated with atomic
+    * operations). The items compressed with a dictionary, the threads
+    * caching it and the current version all hold a reference, and the
+    * dictionary is destroyed when the last one is released.
+    */
+   uint32_t refs[DICTIONARY_VERSIONS];
+   /* The version used for new items (protected by lock) */
+   volatile uint8_t current;
+   pthread_mutex_t lock;
+
+   /* The trainer thread builds a new dictionary every interval seconds */
+   pthread_t tid;
+   pthread_cond_t cond;
+   bool running;
+   bool shutdown;
+};
+
+/**
+ * Initialize the dictionaries, and start the trainer thread if
+ * dictionary compression is enabled
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE dictionary_init(struct compress_engine *engine);
+
+/**
+ * Stop the trainer thread and release all of the dictionaries
+ * @param engine handle to the storage engine
+ */
+void dictionary_destroy(struct compress_engine *engine);
+
+/**
+ * Get a reference to the current dictionary
+ * @param engine handle to the storage engine
+ * @return the version of the dictionary (0 == no dictionary)
+ */
+uint8_t dictionary_acquire(struct compress_engine *engine);
+
+/**
+ * Add a reference to a dictionary the caller already holds a reference to
+ * @param engine handle to the storage engine
+ * @param version the dictionary to retain (0 is ignored)
+ */
+void dictionary_retain(struct compress_engine *engine, uint8_t version);
+
+/**
+ * Release a reference to a dictionary
+ * @param engine handle to the storage engine
+ * @param version the dictionary to release (0 is ignored)
+ */
+void dictionary_release(struct compress_engine *engine, uint8_t version);
+
+/**
+ * Get a dictionary the caller holds a reference to
+ * @param engine handle to the storage engine
+ * @param version the version of the dictionary
+ * @return the dictionary (NULL for version 0)
+ */
+struct codec_dict *dictionary_get(struct compress_engine *engine,
+                                  uint8_t version);
+
+/**
+ * Get a reference to a dictionary unless it is already being destroyed
+ * @param engine handle to the storage engine
+ * @param version the version of the dictionary
+ * @return true if the caller now holds a reference to it
+ */
+bool dictionary_try_retain(struct compress_engine *engine, uint8_t version);
+
+/**
+ * Add a dictionary restored from a snapshot. The caller holds a reference
+ * to it until dictionary_restore_done is called.
+ * @param engine handle to the storage engine
+ * @param version the version of the dictionary
+ * @param codec the codec the dictionary was built for
+ * @param data the content of the dictionary (see codec_dict_data)
+ * @param size the size of the content
+ * @return true on success
+ */
+bool dictionary_restore(struct compress_engine *engine, uint8_t version,
+                        const struct codec *codec,
+                        const void *data, size_t size);
+
+/**
+ * Drop the references held by the restore once the items using the
+ * restored dictionaries are linked
+ * @param engine handle to the storage engine
+ * @param current the version to use for new items (0 == none)
+ * @param restored a bitmask of the versions restored
+ */
+void dictionary_restore_done(struct compress_engine *engine, uint8_t current,
+                             uint8_t restored);
+
+#endif
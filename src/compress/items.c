@@ -16,11 +16,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <sys/time.h>
 #include <assert.h>
 #include <inttypes.h>
-#include <zlib.h>
-
 #include "compress_engine.h"
+#include "codec.h"
 
 /* Forward Declarations */
 static void item_link_q(struct compress_engine *engine, hash_item *it);
@@ -31,14 +31,18 @@ static hash_item *do_item_alloc(struct compress_engine *engine,
                                 const int nbytes,
                                 const void *cookie);
 static hash_item *do_item_get(struct compress_engine *engine,
-                              const char *key, const size_t nkey);
-static int do_item_link(struct compress_engine *engine, hash_item *it);
-static void do_item_unlink(struct compress_engine *engine, hash_item *it);
+                              const char *key, const size_t nkey,
+                              uint32_t hv);
+static int do_item_link(struct compress_engine *engine, hash_item *it, uint32_t hv);
+static void do_item_unlink(struct compress_engine *engine, hash_item *it, uint32_t hv);
+static void do_item_unlink_nolock(struct compress_engine *engine, hash_item *it,
+                                  uint32_t hv);
 static void do_item_release(struct compress_engine *engine, hash_item *it);
 static void do_item_update(struct compress_engine *engine, hash_item *it);
 static int do_item_replace(struct compress_engine *engine,
-                            hash_item *it, hash_item *new_it);
+                            hash_item *it, hash_item *new_it, uint32_t hv);
 static void item_free(struct compress_engine *engine, hash_item *it);
+static void item_drop_dict(struct compress_engine *engine, hash_item *it);
 
 /*
  * We only reposition items in the LRU queue if they haven't been repositioned
@@ -47,10 +51,123 @@ static void item_free(struct compress_engine *engine, hash_item *it);
  */
 #define ITEM_UPDATE_INTERVAL 60
 
+/*
+ * Compressed items (marked with the codec in ITEM_CODEC_MASK, and the
+ * dictionary version in ITEM_DICT_MASK) start with the length of the
+ * uncompressed data (in network byte order), followed by the compressed
+ * data.
+ */
+#define COMPRESS_HEADER_SIZE sizeof(uint32_t)
+
+/*
+ * Setting up the codecs (zlib streams etc) costs more than compressing
+ * most of our values, so each thread keeps its own codec context (and
+ * the scratch buffer used while compressing) and reuses it.
+ */
+struct compressor {
+    struct compressor *next;
+    struct compress_engine *engine;
+    struct codec_context *ctx;
+    /* The dictionary version used for new items (we hold a reference) */
+    uint8_t dict;
+    char *buffer;
+    size_t buffersize;
+    /* Where we copy a chained value we need in one piece */
+    char *raw;
+    size_t rawsize;
+    /* The block of CAS ids reserved by this thread (see get_cas_id) */
+    uint64_t cas_next;
+    uint64_t cas_end;
+};
+
+/* The number of CAS ids a thread reserves at a time */
+#define CAS_BLOCK_SIZE 1024
+
+static void compressor_free(struct compressor *c) {
+    dictionary_release(c->engine, c->dict);
+    codec_context_destroy(c->ctx);
+    free(c->buffer);
+    free(c->raw);
+    free(c);
+}
+
+/*
+ * Called by pthreads when a thread that used the engine terminates.
+ */
+static void compressor_release(void *arg) {
+    struct compressor *c = arg;
+    struct items *items = &c->engine->items;
+    struct compressor **pp;
+
+    pthread_mutex_lock(&items->compressors_lock);
+    for (pp = &items->compressors; *pp != c; pp = &(*pp)->next) {
+        /* empty */
+    }
+    *pp = c->next;
+    pthread_mutex_unlock(&items->compressors_lock);
+    compressor_free(c);
+}
+
+static struct compressor *get_compressor(struct compress_engine *engine) {
+    struct compressor *c = pthread_getspecific(engine->items.compressors_key);
+    if (c == NULL) {
+        if ((c = calloc(1, sizeof(*c))) == NULL) {
+            return NULL;
+        }
+        c->engine = engine;
+        c->ctx = codec_context_create(engine->config.compression_level);
+        if (c->ctx == NULL) {
+            free(c);
+            return NULL;
+        }
+        if (pthread_setspecific(engine->items.compressors_key, c) != 0) {
+            compressor_free(c);
+            return NULL;
+        }
+
+        pthread_mutex_lock(&engine->items.compressors_lock);
+        c->next = engine->items.compressors;
+        engine->items.compressors = c;
+        pthread_mutex_unlock(&engine->items.compressors_lock);
+    }
+    return c;
+}
+
+ENGINE_ERROR_CODE item_init(struct compress_engine *engine) {
+    int ii;
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        pthread_mutex_init(&engine->items.lru_locks[ii], NULL);
+    }
+
+    if (pthread_key_create(&engine->items.compressors_key,
+                           compressor_release) != 0) {
+        return ENGINE_FAILED;
+    }
+    pthread_mutex_init(&engine->items.compressors_lock, NULL);
+    engine->items.compressors = NULL;
+
+    return ENGINE_SUCCESS;
+}
+
+void item_destroy(struct compress_engine *engine) {
+    /* The destructor isn't called for deleted keys, so free them all here */
+    pthread_key_delete(engine->items.compressors_key);
+    while (engine->items.compressors != NULL) {
+        struct compressor *next = engine->items.compressors->next;
+        compressor_free(engine->items.compressors);
+        engine->items.compressors = next;
+    }
+    pthread_mutex_destroy(&engine->items.compressors_lock);
+}
+
 void item_stats_reset(struct compress_engine *engine) {
-    pthread_mutex_lock(&engine->cache_lock);
-    memset(engine->items.itemstats, 0, sizeof(engine->items.itemstats));
-    pthread_mutex_unlock(&engine->cache_lock);
+    int ii;
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        pthread_mutex_lock(&engine->items.lru_locks[ii]);
+        memset(&engine->items.itemstats[ii], 0,
+               sizeof(engine->items.itemstats[ii]));
+        pthread_mutex_unlock(&engine->items.lru_locks[ii]);
+    }
 }
 
 
@@ -65,10 +182,50 @@ static inline size_t ITEM_ntotal(struct compress_engine *engine,
     return ret;
 }
 
-/* Get the next CAS id for a new item. */
-static uint64_t get_cas_id(void) {
-    static uint64_t cas_id = 0;
-    return ++cas_id;
+/*
+ * Get the next CAS id for a new item. Each thread reserves a block of ids
+ * from the shared counter at a time, so the threads don't fight over the
+ * cache line holding it.
+ */
+static uint64_t get_cas_id(struct compress_engine *engine) {
+    struct compressor *c = get_compressor(engine);
+    if (c == NULL) {
+        return __sync_add_and_fetch(&engine->items.cas_id, 1);
+    }
+
+    if (c->cas_next == c->cas_end) {
+        c->cas_next = __sync_add_and_fetch(&engine->items.cas_id,
+                                           CAS_BLOCK_SIZE) - CAS_BLOCK_SIZE + 1;
+        c->cas_end = c->cas_next + CAS_BLOCK_SIZE;
+    }
+    return c->cas_next++;
+}
+
+/*
+ * Try to get exclusive access to an item in the LRU so that we may unlink
+ * it and reuse its memory. Called with the lru lock held, so we can't
+ * block on the item lock (the caller may already hold another item lock).
+ * On success the item lock is held and we've got a reference to the item.
+ */
+static bool item_claim(struct compress_engine *engine, hash_item *it, uint32_t *hv) {
+    if (it->refcount != 1) {
+        /* Someone else is using it */
+        return false;
+    }
+
+    *hv = engine->server.hash(item_get_key(it), it->nkey, 0);
+    if (!item_trylock(engine, *hv)) {
+        return false;
+    }
+
+    /* The only other reference should be the one held by the cache */
+    if (__sync_add_and_fetch(&it->refcount, 1) != 2) {
+        __sync_sub_and_fetch(&it->refcount, 1);
+        item_unlock(engine, *hv);
+        return false;
+    }
+
+    return true;
 }
 
 /* Enable this for reference-count debugging. */
@@ -83,36 +240,217 @@ static uint64_t get_cas_id(void) {
 #endif
 
 
-/*@null@*/
-hash_item *do_item_alloc(struct compress_engine *engine,
-                         const void *key,
-                         const size_t nkey,
-                         const int flags,
-                         const rel_time_t exptime,
-                         const int nbytes,
-                         const void *cookie) {
-    hash_item *it = NULL;
-    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-    if (engine->config.use_cas) {
-        ntotal += sizeof(uint64_t);
+/*
+ * Large values may be split over a chain of chunks (see slab_chunk_max),
+ * so they don't need a chunk from the big (and mostly wasted) slab
+ * classes. The item itself is a chunk of slabs.chunk_clsid, and its data
+ * starts with a struct item_chain followed by the first part of the
+ * value. The rest of the value is in chunks linked through their next
+ * pointer. A chunk is a hash_item with ITEM_CHUNK set, no key and nbytes
+ * set to the size of its part of the value, and its prev pointer points
+ * back at the item (so the rebalancer can find it).
+ *
+ * The data of an item isn't aligned, so the header is always memcpy'd.
+ */
+struct item_chain {
+    hash_item *chunks;
+    uint32_t nhead;  /* The number of bytes of the value in the item */
+};
+
+static void item_get_chain(const hash_item *it, struct item_chain *chain) {
+    memcpy(chain, item_get_data(it), sizeof(*chain));
+}
+
+static void item_set_chain(hash_item *it, const struct item_chain *chain) {
+    memcpy(item_get_data(it), chain, sizeof(*chain));
+}
+
+/* The number of bytes the item (but not its chunks) uses in the slabs */
+static size_t item_slab_size(struct compress_engine *engine,
+                             const hash_item *it) {
+    struct item_chain chain;
+    if ((it->eflag & ITEM_CHAINED) == 0) {
+        return ITEM_ntotal(engine, it);
+    }
+    item_get_chain(it, &chain);
+    return ITEM_ntotal(engine, it) - it->nbytes + sizeof(chain) + chain.nhead;
+}
+
+/* Give the chunks of a chained item back to the slab allocator */
+static void item_free_chunks(struct compress_engine *engine, hash_item *it) {
+    struct item_chain chain;
+    hash_item *chunk;
+    unsigned int clsid;
+
+    if ((it->eflag & ITEM_CHAINED) == 0) {
+        return;
+    }
+    item_get_chain(it, &chain);
+    while ((chunk = chain.chunks) != NULL) {
+        chain.chunks = chunk->next;
+        clsid = chunk->slabs_clsid;
+        chunk->slabs_clsid = 0;
+        slabs_free(engine, chunk, sizeof(*chunk) + chunk->nbytes, clsid);
     }
+    it->eflag &= ~ITEM_CHAINED;
+}
 
-    unsigned int id = slabs_clsid(engine, ntotal);
-    if (id == 0)
-        return 0;
+/* A part of a value (see item_first_segment) */
+struct item_segment {
+    char *data;
+    size_t len;
+    /* The chunk holding the next part */
+    hash_item *next;
+};
+
+/*
+ * Get the first part of the value of an item. The rest of the value (if
+ * it's chained) is walked with item_next_segment.
+ */
+static void item_first_segment(const hash_item *it, struct item_segment *seg) {
+    struct item_chain chain;
+    if ((it->eflag & ITEM_CHAINED) == 0) {
+        seg->data = item_get_data(it);
+        seg->len = it->nbytes;
+        seg->next = NULL;
+    } else {
+        item_get_chain(it, &chain);
+        seg->data = item_get_data(it) + sizeof(chain);
+        seg->len = chain.nhead;
+        seg->next = chain.chunks;
+    }
+}
+
+static bool item_next_segment(struct item_segment *seg) {
+    hash_item *chunk = seg->next;
+    if (chunk == NULL) {
+        return false;
+    }
+    seg->data = item_get_data(chunk);
+    seg->len = chunk->nbytes;
+    seg->next = chunk->next;
+    return true;
+}
+
+int item_get_iov(const hash_item *it, struct iovec *iov, int niov) {
+    struct item_segment seg;
+    int n = 0;
+
+    item_first_segment(it, &seg);
+    do {
+        if (n < niov) {
+            iov[n].iov_base = seg.data;
+            iov[n].iov_len = seg.len;
+        }
+        ++n;
+    } while (item_next_segment(&seg));
+
+    return n;
+}
+
+/* Copy len bytes between buf and the value of an item, starting at offset */
+static void item_copy_range(const hash_item *it, size_t offset,
+                            char *buf, size_t len, bool to_item) {
+    struct item_segment seg;
+    size_t n;
+
+    item_first_segment(it, &seg);
+    while (len > 0) {
+        if (offset < seg.len) {
+            n = seg.len - offset < len ? seg.len - offset : len;
+            if (to_item) {
+                memcpy(seg.data + offset, buf, n);
+            } else {
+                memcpy(buf, seg.data + offset, n);
+            }
+            buf += n;
+            len -= n;
+            offset = 0;
+        } else {
+            offset -= seg.len;
+        }
+        if (len > 0 && !item_next_segment(&seg)) {
+            assert(false);
+            return;
+        }
+    }
+}
+
+static void item_read_value(const hash_item *it, size_t offset,
+                            void *dest, size_t len) {
+    item_copy_range(it, offset, dest, len, false);
+}
+
+static void item_write_value(hash_item *it, size_t offset,
+                             const void *src, size_t len) {
+    item_copy_range(it, offset, (char*)src, len, true);
+}
+
+/* Copy the (raw) value of an item into the value of dest at offset */
+static void item_copy_data(const hash_item *it, hash_item *dest,
+                           size_t offset) {
+    struct item_segment seg;
+
+    item_first_segment(it, &seg);
+    do {
+        item_write_value(dest, offset, seg.data, seg.len);
+        offset += seg.len;
+    } while (item_next_segment(&seg));
+}
+
+/*
+ * Get the value of an item in one piece. A chained value is copied into
+ * the raw buffer of the compressor.
+ */
+static const char *item_linear_data(struct compressor *c, const hash_item *it) {
+    if ((it->eflag & ITEM_CHAINED) == 0) {
+        return item_get_data(it);
+    }
+    if (c->rawsize < it->nbytes) {
+        char *raw = realloc(c->raw, it->nbytes);
+        if (raw == NULL) {
+            return NULL;
+        }
+        c->raw = raw;
+        c->rawsize = it->nbytes;
+    }
+    item_read_value(it, 0, c->raw, it->nbytes);
+    return c->raw;
+}
+
+/*
+ * Get ntotal bytes of memory from slab class id, reclaiming an expired
+ * item or evicting one from the tail of the LRU if we have to. The memory
+ * of an item we take over is reused directly (but its chunks are freed).
+ *
+ * With the admission filter on, freq is the estimate for the key we
+ * allocate for. An item asked for more often than that is moved back to
+ * the head of the LRU instead of being evicted (at most ADMISSION_MAX_KEPT
+ * times, after that we have to evict something).
+ */
+static hash_item *do_item_alloc_memory(struct compress_engine *engine,
+                                       const size_t ntotal,
+                                       const unsigned int id,
+                                       const void *cookie,
+                                       const uint32_t freq) {
+    hash_item *it = NULL;
+    bool filter = admission_enabled(engine);
+    int kept = 0;
+
+    pthread_mutex_lock(&engine->items.lru_locks[id]);
 
     /* do a quick check if we have any expired items in the tail.. */
     int tries = 50;
-    hash_item *search;
+    hash_item *search, *next;
+    uint32_t hv;
 
     rel_time_t current_time = engine->server.get_current_time();
 
     for (search = engine->items.tails[id];
          tries > 0 && search != NULL;
          tries--, search=search->prev) {
-        if (search->refcount == 0 &&
-            (search->exptime != 0 && search->exptime < current_time)) {
-            it = search;
+        if ((search->exptime != 0 && search->exptime < current_time) &&
+            item_claim(engine, search, &hv)) {
             /* I don't want to actually free the object, just steal
              * the item to avoid to grab the slab mutex twice ;-)
              */
@@ -120,11 +458,13 @@ hash_item *do_item_alloc(struct compress_engine *engine,
             engine->stats.reclaimed++;
             pthread_mutex_unlock(&engine->stats.lock);
             engine->items.itemstats[id].reclaimed++;
-            it->refcount = 1;
-            do_item_unlink(engine, it);
+            do_item_unlink_nolock(engine, search, hv);
+            item_unlock(engine, hv);
+            item_drop_dict(engine, search);
             /* Initialize the item block: */
+            it = search;
+            item_free_chunks(engine, it);
             it->slabs_clsid = 0;
-            it->refcount = 0;
             break;
         }
     }
@@ -142,23 +482,38 @@ hash_item *do_item_alloc(struct compress_engine *engine,
 
         if (engine->config.evict_to_free == 0) {
             engine->items.itemstats[id].outofmemory++;
+            pthread_mutex_unlock(&engine->items.lru_locks[id]);
             return NULL;
         }
 
         /*
          * try to get one off the right LRU
-         * don't necessariuly unlink the tail because it may be locked: refcount>0
-         * search up from tail an item with refcount==0 and unlink it; give up after 50
+         * don't necessariuly unlink the tail because it may be locked: refcount>1
+         * search up from tail an item we may claim and reuse it; give up after 50
          * tries
          */
 
         if (engine->items.tails[id] == 0) {
             engine->items.itemstats[id].outofmemory++;
+            pthread_mutex_unlock(&engine->items.lru_locks[id]);
             return NULL;
         }
 
-        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-            if (search->refcount == 0) {
+        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=next) {
+            next = search->prev;
+            if (item_claim(engine, search, &hv)) {
+                if ((search->exptime == 0 || search->exptime > current_time) &&
+                    filter && kept < ADMISSION_MAX_KEPT &&
+                    admission_estimate(engine, hv) > freq) {
+                    /* Give it another trip through the LRU */
+                    item_unlink_q(engine, search);
+                    item_link_q(engine, search);
+                    __sync_sub_and_fetch(&search->refcount, 1);
+                    item_unlock(engine, hv);
+                    __sync_add_and_fetch(&engine->admission.kept, 1);
+                    ++kept;
+                    continue;
+                }
                 if (search->exptime == 0 || search->exptime > current_time) {
                     engine->items.itemstats[id].evicted++;
                     engine->items.itemstats[id].evicted_time = current_time - search->time;
@@ -177,12 +532,17 @@ hash_item *do_item_alloc(struct compress_engine *engine,
                     engine->stats.reclaimed++;
                     pthread_mutex_unlock(&engine->stats.lock);
                 }
-                do_item_unlink(engine, search);
+                do_item_unlink_nolock(engine, search, hv);
+                item_unlock(engine, hv);
+                item_drop_dict(engine, search);
+                it = search;
+                item_free_chunks(engine, it);
+                it->slabs_clsid = 0;
                 break;
             }
         }
-        it = slabs_alloc(engine, ntotal, id);
-        if (it == 0) {
+
+        if (it == NULL) {
             engine->items.itemstats[id].outofmemory++;
             /* Last ditch effort. There is a very rare bug which causes
              * refcount leaks. We've fixed most of them, but it still happens,
@@ -193,50 +553,184 @@ hash_item *do_item_alloc(struct compress_engine *engine,
              */
             tries = 50;
             for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-                if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
+                if (search->refcount > 1 && search->time + TAIL_REPAIR_TIME < current_time) {
+                    hv = engine->server.hash(item_get_key(search), search->nkey, 0);
+                    if (!item_trylock(engine, hv)) {
+                        continue;
+                    }
                     engine->items.itemstats[id].tailrepairs++;
-                    search->refcount = 0;
-                    do_item_unlink(engine, search);
+                    search->refcount = 1;
+                    do_item_unlink_nolock(engine, search, hv);
+                    item_unlock(engine, hv);
                     break;
                 }
             }
             it = slabs_alloc(engine, ntotal, id);
             if (it == 0) {
+                pthread_mutex_unlock(&engine->items.lru_locks[id]);
                 return NULL;
             }
         }
     }
 
+    assert(it != engine->items.heads[id]);
+    pthread_mutex_unlock(&engine->items.lru_locks[id]);
+
     assert(it->slabs_clsid == 0);
 
     it->slabs_clsid = id;
+    return it;
+}
 
-    assert(it != engine->items.heads[it->slabs_clsid]);
-
+static void do_item_init(struct compress_engine *engine, hash_item *it,
+                         const void *key, const size_t nkey,
+                         const int flags, const rel_time_t exptime,
+                         const int nbytes) {
     it->next = it->prev = it->h_next = 0;
     it->refcount = 1;     /* the caller will have a reference */
     DEBUG_REFCNT(it, '*');
     it->iflag = engine->config.use_cas ? ITEM_WITH_CAS : 0;
+    it->eflag = 0;
     it->nkey = nkey;
     it->nbytes = nbytes;
     it->flags = flags;
     memcpy((void*)item_get_key(it), key, nkey);
     it->exptime = exptime;
+}
+
+/*
+ * Allocate an item with its value split over chunks of slabs.chunk_clsid
+ * (see struct item_chain). The end of the value goes in the smallest
+ * chunk it fits in.
+ */
+static hash_item *do_item_alloc_chained(struct compress_engine *engine,
+                                        const void *key, const size_t nkey,
+                                        const int flags,
+                                        const rel_time_t exptime,
+                                        const int nbytes,
+                                        const void *cookie,
+                                        const uint32_t freq) {
+    unsigned int chunk_id = engine->slabs.chunk_clsid;
+    size_t chunk_size = engine->slabs.slabclass[chunk_id].size;
+    size_t header = sizeof(hash_item) + nkey + sizeof(struct item_chain);
+    struct item_chain chain;
+    hash_item *it, *last = NULL;
+    size_t left;
+
+    if (engine->config.use_cas) {
+        header += sizeof(uint64_t);
+    }
+    /* slabs_init makes sure of this (SLAB_CHUNK_MIN) */
+    assert(header < chunk_size);
+
+    it = do_item_alloc_memory(engine, chunk_size, chunk_id, cookie, freq);
+    if (it == NULL) {
+        return NULL;
+    }
+    do_item_init(engine, it, key, nkey, flags, exptime, nbytes);
+    it->eflag |= ITEM_CHAINED;
+    chain.chunks = NULL;
+    chain.nhead = chunk_size - header;
+    item_set_chain(it, &chain);
+
+    for (left = nbytes - chain.nhead; left > 0; ) {
+        size_t n = chunk_size - sizeof(hash_item);
+        unsigned int id = chunk_id;
+        hash_item *chunk;
+
+        if (left < n) {
+            n = left;
+            id = slabs_clsid(engine, sizeof(hash_item) + n);
+        }
+        chunk = do_item_alloc_memory(engine, sizeof(hash_item) + n, id, cookie,
+                                     freq);
+        if (chunk == NULL) {
+            it->refcount = 0;
+            item_free(engine, it);
+            return NULL;
+        }
+
+        chunk->next = chunk->h_next = 0;
+        chunk->prev = it;
+        chunk->time = chunk->exptime = 0;
+        chunk->refcount = 0;
+        chunk->iflag = 0;
+        chunk->eflag = ITEM_CHUNK;
+        chunk->nkey = 0;
+        chunk->nbytes = n;
+        chunk->flags = 0;
+        if (last == NULL) {
+            chain.chunks = chunk;
+            item_set_chain(it, &chain);
+        } else {
+            last->next = chunk;
+        }
+        last = chunk;
+        left -= n;
+    }
+
+    return it;
+}
+
+/*@null@*/
+hash_item *do_item_alloc(struct compress_engine *engine,
+                         const void *key,
+                         const size_t nkey,
+                         const int flags,
+                         const rel_time_t exptime,
+                         const int nbytes,
+                         const void *cookie) {
+    hash_item *it = NULL;
+    uint32_t freq = 0;
+    unsigned int chunk_id = engine->slabs.chunk_clsid;
+    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
+    if (engine->config.use_cas) {
+        ntotal += sizeof(uint64_t);
+    }
+
+    unsigned int id = slabs_clsid(engine, ntotal);
+    if (id == 0)
+        return 0;
+
+    if (admission_enabled(engine)) {
+        freq = admission_estimate(engine, engine->server.hash(key, nkey, 0));
+    }
+
+    if (chunk_id != 0 && ntotal > engine->slabs.slabclass[chunk_id].size) {
+        return do_item_alloc_chained(engine, key, nkey, flags, exptime,
+                                     nbytes, cookie, freq);
+    }
+
+    if ((it = do_item_alloc_memory(engine, ntotal, id, cookie,
+                                   freq)) == NULL) {
+        return NULL;
+    }
+    do_item_init(engine, it, key, nkey, flags, exptime, nbytes);
     return it;
 }
 
+/*
+ * Release the reference the item holds to the dictionary it was
+ * compressed with.
+ */
+static void item_drop_dict(struct compress_engine *engine, hash_item *it) {
+    dictionary_release(engine, (it->iflag & ITEM_DICT_MASK) >> ITEM_DICT_SHIFT);
+    it->iflag &= ~(ITEM_CODEC_MASK | ITEM_DICT_MASK);
+}
+
 static void item_free(struct compress_engine *engine, hash_item *it) {
-    size_t ntotal = ITEM_ntotal(engine, it);
+    size_t ntotal = item_slab_size(engine, it);
     unsigned int clsid;
     assert((it->iflag & ITEM_LINKED) == 0);
     assert(it != engine->items.heads[it->slabs_clsid]);
     assert(it != engine->items.tails[it->slabs_clsid]);
     assert(it->refcount == 0);
 
-    /* so slab size changer can tell later if item is already free or not */
+    item_drop_dict(engine, it);
+    item_free_chunks(engine, it);
+
     clsid = it->slabs_clsid;
     it->slabs_clsid = 0;
-    it->iflag |= ITEM_SLABBED;
     DEBUG_REFCNT(it, 'F');
     slabs_free(engine, it, ntotal, clsid);
 }
@@ -259,6 +753,27 @@ static void item_link_q(struct compress_engine *engine, hash_item *it) { /* item
     return;
 }
 
+/* Put an item in the LRU right behind (towards the tail of) another one */
+static void item_link_q_after(struct compress_engine *engine, hash_item *it,
+                              hash_item *after) {
+    hash_item **tail;
+    if (after == NULL) {
+        item_link_q(engine, it);
+        return;
+    }
+    assert(it->slabs_clsid < POWER_LARGEST);
+    assert(after->slabs_clsid == it->slabs_clsid);
+    assert((it->iflag & ITEM_SLABBED) == 0);
+
+    tail = &engine->items.tails[it->slabs_clsid];
+    it->prev = after;
+    it->next = after->next;
+    if (it->next) it->next->prev = it;
+    after->next = it;
+    if (*tail == after) *tail = it;
+    engine->items.sizes[it->slabs_clsid]++;
+}
+
 static void item_unlink_q(struct compress_engine *engine, hash_item *it) {
     hash_item **head, **tail;
     assert(it->slabs_clsid < POWER_LARGEST);
@@ -282,50 +797,65 @@ static void item_unlink_q(struct compress_engine *engine, hash_item *it) {
     return;
 }
 
-int do_item_link(struct compress_engine *engine, hash_item *it) {
+/* Link an item in the hash table (but not the LRU). Called with the item lock */
+static void do_item_link_hash(struct compress_engine *engine, hash_item *it,
+                              uint32_t hv) {
     assert((it->iflag & (ITEM_LINKED|ITEM_SLABBED)) == 0);
     assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
     it->iflag |= ITEM_LINKED;
-    it->time = engine->server.get_current_time();
-    assoc_insert(engine, engine->server.hash(item_get_key(it), it->nkey, 0),
-                 it);
+    /* The cache holds a reference to the item while it is linked */
+    __sync_add_and_fetch(&it->refcount, 1);
+    assoc_insert(engine, hv, it);
 
     pthread_mutex_lock(&engine->stats.lock);
     engine->stats.curr_bytes += ITEM_ntotal(engine, it);
     engine->stats.curr_items += 1;
     engine->stats.total_items += 1;
     pthread_mutex_unlock(&engine->stats.lock);
+}
+
+int do_item_link(struct compress_engine *engine, hash_item *it, uint32_t hv) {
+    it->time = engine->server.get_current_time();
+    do_item_link_hash(engine, it, hv);
 
     /* Allocate a new CAS ID on link. */
-    item_set_cas(NULL, it, get_cas_id());
+    item_set_cas(NULL, it, get_cas_id(engine));
 
+    pthread_mutex_lock(&engine->items.lru_locks[it->slabs_clsid]);
     item_link_q(engine, it);
+    pthread_mutex_unlock(&engine->items.lru_locks[it->slabs_clsid]);
 
     return 1;
 }
 
-void do_item_unlink(struct compress_engine *engine, hash_item *it) {
+/* Unlink an item. The caller must hold both the item and lru lock */
+static void do_item_unlink_nolock(struct compress_engine *engine, hash_item *it,
+                                  uint32_t hv) {
     if ((it->iflag & ITEM_LINKED) != 0) {
         it->iflag &= ~ITEM_LINKED;
         pthread_mutex_lock(&engine->stats.lock);
         engine->stats.curr_bytes -= ITEM_ntotal(engine, it);
         engine->stats.curr_items -= 1;
         pthread_mutex_unlock(&engine->stats.lock);
-        assoc_delete(engine, engine->server.hash(item_get_key(it), it->nkey, 0),
-                     item_get_key(it), it->nkey);
+        assoc_delete(engine, hv, item_get_key(it), it->nkey);
         item_unlink_q(engine, it);
-        if (it->refcount == 0) {
-            item_free(engine, it);
-        }
+        /* drop the reference held by the cache */
+        do_item_release(engine, it);
     }
 }
 
-void do_item_release(struct compress_engine *engine, hash_item *it) {
-    if (it->refcount != 0) {
-        it->refcount--;
-        DEBUG_REFCNT(it, '-');
+void do_item_unlink(struct compress_engine *engine, hash_item *it, uint32_t hv) {
+    if ((it->iflag & ITEM_LINKED) != 0) {
+        unsigned int clsid = it->slabs_clsid;
+        pthread_mutex_lock(&engine->items.lru_locks[clsid]);
+        do_item_unlink_nolock(engine, it, hv);
+        pthread_mutex_unlock(&engine->items.lru_locks[clsid]);
     }
-    if (it->refcount == 0 && (it->iflag & ITEM_LINKED) == 0) {
+}
+
+void do_item_release(struct compress_engine *engine, hash_item *it) {
+    DEBUG_REFCNT(it, '-');
+    if (__sync_sub_and_fetch(&it->refcount, 1) == 0) {
         item_free(engine, it);
     }
 }
@@ -336,19 +866,61 @@ void do_item_update(struct compress_engine *engine, hash_item *it) {
         assert((it->iflag & ITEM_SLABBED) == 0);
 
         if ((it->iflag & ITEM_LINKED) != 0) {
+            pthread_mutex_lock(&engine->items.lru_locks[it->slabs_clsid]);
             item_unlink_q(engine, it);
             it->time = current_time;
             item_link_q(engine, it);
+            pthread_mutex_unlock(&engine->items.lru_locks[it->slabs_clsid]);
         }
     }
 }
 
 int do_item_replace(struct compress_engine *engine,
-                    hash_item *it, hash_item *new_it) {
+                    hash_item *it, hash_item *new_it, uint32_t hv) {
     assert((it->iflag & ITEM_SLABBED) == 0);
 
-    do_item_unlink(engine, it);
-    return do_item_link(engine, new_it);
+    do_item_unlink(engine, it, hv);
+    return do_item_link(engine, new_it, hv);
+}
+
+/*
+ * Replace an item with a copy holding the same value (the compactor's
+ * compressed one). The copy keeps the access time and the CAS of the
+ * original, and takes its place in the LRU so it's evicted when the
+ * original would have been. If the copy is in another slab class it goes
+ * behind the items of that class accessed after the original (looking at
+ * no more than COPY_SEARCH_DEPTH items from the tail). Called with the
+ * item lock held.
+ */
+#define COPY_SEARCH_DEPTH 50
+static void do_item_replace_copy(struct compress_engine *engine,
+                                 hash_item *it, hash_item *new_it, uint32_t hv) {
+    unsigned int id = new_it->slabs_clsid;
+    bool same_class = it->slabs_clsid == id;
+    hash_item *after;
+    int tries = COPY_SEARCH_DEPTH;
+
+    assert((it->iflag & ITEM_LINKED) != 0);
+    new_it->time = it->time;
+    item_set_cas(NULL, new_it, item_get_cas(it));
+
+    if (!same_class) {
+        do_item_unlink(engine, it, hv);
+    }
+
+    pthread_mutex_lock(&engine->items.lru_locks[id]);
+    if (same_class) {
+        after = it->prev;
+        do_item_unlink_nolock(engine, it, hv);
+    } else {
+        after = engine->items.tails[id];
+        while (after != NULL && after->time < new_it->time && tries-- > 0) {
+            after = after->prev;
+        }
+    }
+    do_item_link_hash(engine, new_it, hv);
+    item_link_q_after(engine, new_it, after);
+    pthread_mutex_unlock(&engine->items.lru_locks[id]);
 }
 
 /*@null@*/
@@ -405,6 +977,7 @@ static void do_item_stats(struct compress_engine *engine,
                           ADD_STAT add_stats, void *c) {
     int i;
     for (i = 0; i < POWER_LARGEST; i++) {
+        pthread_mutex_lock(&engine->items.lru_locks[i]);
         if (engine->items.tails[i] != NULL) {
             const char *prefix = "items";
             add_statistics(c, add_stats, prefix, i, "number", "%u",
@@ -424,6 +997,7 @@ static void do_item_stats(struct compress_engine *engine,
             add_statistics(c, add_stats, prefix, i, "reclaimed",
                            "%u", engine->items.itemstats[i].reclaimed);;
         }
+        pthread_mutex_unlock(&engine->items.lru_locks[i]);
     }
 
     /* getting here means both ascii and binary terminators fit */
@@ -444,6 +1018,7 @@ static void do_item_stats_sizes(struct compress_engine *engine,
 
         /* build the histogram */
         for (i = 0; i < POWER_LARGEST; i++) {
+            pthread_mutex_lock(&engine->items.lru_locks[i]);
             hash_item *iter = engine->items.heads[i];
             while (iter) {
                 int ntotal = ITEM_ntotal(engine, iter);
@@ -452,6 +1027,7 @@ static void do_item_stats_sizes(struct compress_engine *engine,
                 if (bucket < num_buckets) histogram[bucket]++;
                 iter = iter->next;
             }
+            pthread_mutex_unlock(&engine->items.lru_locks[i]);
         }
 
         /* write the buffer */
@@ -473,9 +1049,9 @@ static void do_item_stats_sizes(struct compress_engine *engine,
 
 /** wrapper around assoc_find which does the lazy expiration logic */
 hash_item *do_item_get(struct compress_engine *engine,
-                       const char *key, const size_t nkey) {
+                       const char *key, const size_t nkey, uint32_t hv) {
     rel_time_t current_time = engine->server.get_current_time();
-    hash_item *it = assoc_find(engine, engine->server.hash(key, nkey, 0), key, nkey);
+    hash_item *it = assoc_find(engine, hv, key, nkey);
     int was_found = 0;
 
     if (engine->config.verbose > 2) {
@@ -490,7 +1066,7 @@ hash_item *do_item_get(struct compress_engine *engine,
     if (it != NULL && engine->config.oldest_live != 0 &&
         engine->config.oldest_live <= current_time &&
         it->time <= engine->config.oldest_live) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
+        do_item_unlink(engine, it, hv);       /* MTSAFE - item lock held */
         it = NULL;
     }
 
@@ -500,7 +1076,7 @@ hash_item *do_item_get(struct compress_engine *engine,
     }
 
     if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
+        do_item_unlink(engine, it, hv);       /* MTSAFE - item lock held */
         it = NULL;
     }
 
@@ -510,7 +1086,7 @@ hash_item *do_item_get(struct compress_engine *engine,
     }
 
     if (it != NULL) {
-        it->refcount++;
+        __sync_add_and_fetch(&it->refcount, 1);
         DEBUG_REFCNT(it, '+');
     }
 
@@ -522,16 +1098,17 @@ hash_item *do_item_get(struct compress_engine *engine,
 
 /*
  * Stores an item in the cache according to the semantics of one of the set
- * commands. In threaded mode, this is protected by the cache lock.
+ * commands. In threaded mode, this is protected by the item lock.
  *
  * Returns the state of storage.
  */
 static ENGINE_ERROR_CODE do_store_item(struct compress_engine *engine,
                                        hash_item *it, uint64_t *cas,
                                        ENGINE_STORE_OPERATION operation,
-                                       const void *cookie) {
+                                       const void *cookie,
+                                       uint32_t hv) {
     const char *key = item_get_key(it);
-    hash_item *old_it = do_item_get(engine, key, it->nkey);
+    hash_item *old_it = do_item_get(engine, key, it->nkey, hv);
     ENGINE_ERROR_CODE stored = ENGINE_NOT_STORED;
 
     hash_item *new_it = NULL;
@@ -564,7 +1141,7 @@ static ENGINE_ERROR_CODE do_store_item(struct compress_engine *engine,
             pthread_mutex_unlock(&c->thread->stats.mutex);
 #endif
 
-            do_item_replace(engine, old_it, it);
+            do_item_replace(engine, old_it, it, hv);
             stored = ENGINE_SUCCESS;
         } else {
 #if 0
@@ -616,12 +1193,12 @@ static ENGINE_ERROR_CODE do_store_item(struct compress_engine *engine,
                 /* copy data from it and old_it to new_it */
 
                 if (operation == OPERATION_APPEND) {
-                    memcpy(item_get_data(new_it), item_get_data(old_it), old_it->nbytes);
-                    memcpy(item_get_data(new_it) + old_it->nbytes - 2 /* CRLF */, item_get_data(it), it->nbytes);
+                    item_copy_data(old_it, new_it, 0);
+                    item_copy_data(it, new_it, old_it->nbytes - 2 /* CRLF */);
                 } else {
                     /* OPERATION_PREPEND */
-                    memcpy(item_get_data(new_it), item_get_data(it), it->nbytes);
-                    memcpy(item_get_data(new_it) + it->nbytes - 2 /* CRLF */, item_get_data(old_it), old_it->nbytes);
+                    item_copy_data(it, new_it, 0);
+                    item_copy_data(old_it, new_it, it->nbytes - 2 /* CRLF */);
                 }
 
                 it = new_it;
@@ -630,9 +1207,9 @@ static ENGINE_ERROR_CODE do_store_item(struct compress_engine *engine,
 
         if (stored == ENGINE_NOT_STORED) {
             if (old_it != NULL) {
-                do_item_replace(engine, old_it, it);
+                do_item_replace(engine, old_it, it, hv);
             } else {
-                do_item_link(engine, it);
+                do_item_link(engine, it, hv);
             }
 
             *cas = item_get_cas(it);
@@ -665,53 +1242,107 @@ hash_item *item_alloc(struct compress_engine *engine,
                       const void *key, size_t nkey, int flags,
                       rel_time_t exptime, int nbytes, const void *cookie) {
     hash_item *it;
-    pthread_mutex_lock(&engine->cache_lock);
     it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
     return it;
 }
 
-static hash_item *inflate_item(struct compress_engine *engine, hash_item *it)
-{
-    char buffer[1024*1024];
-    z_stream z = { .zalloc = Z_NULL,.zfree = Z_NULL, .opaque = Z_NULL };
-    if (inflateInit(&z) != Z_OK) {
-        item_release(engine, it);
-        return NULL;
+/*
+ * Get the size of the item's value when it's uncompressed
+ */
+static uint32_t item_raw_length(const hash_item *it) {
+    uint32_t len;
+    if ((it->iflag & ITEM_CODEC_MASK) == 0) {
+        return it->nbytes;
     }
+    item_read_value(it, 0, &len, sizeof(len));
+    return ntohl(len);
+}
 
-    z.next_in = (Bytef*)item_get_data(it);
-    z.avail_in = it->nbytes;
-    z.next_out = (Bytef*)buffer;
-    z.avail_out = sizeof(buffer);
+/*
+ * Decompress the value of a compressed item into dest (which must be
+ * item_raw_length() bytes). The caller must hold a reference to the item
+ * (so that its dictionary can't go away).
+ */
+static bool item_decompress(struct compress_engine *engine,
+                            struct compressor *c,
+                            const hash_item *it, char *dest, uint32_t len) {
+    uint8_t id = (it->iflag & ITEM_CODEC_MASK) >> ITEM_CODEC_SHIFT;
+    uint8_t version = (it->iflag & ITEM_DICT_MASK) >> ITEM_DICT_SHIFT;
+    const struct codec *codec = codec_get(id);
+    const char *data;
+
+    if (codec == NULL) {
+        fprintf(stderr, "Unknown codec %u\r\n", id);
+        return false;
+    }
+    if ((data = item_linear_data(c, it)) == NULL) {
+        return false;
+    }
 
-    int r = inflate(&z, Z_FINISH);
-    if (r != Z_OK && r != Z_BUF_ERROR) {
-        if (memcmp("\r\n", item_get_data(it) + it->nbytes - 2, 2) == 0) {
-            /* This object wasn't compressed */
-            return it;
-        }
+    uint64_t start = latency_start(engine);
+    if (!codec->decompress(c->ctx, dictionary_get(engine, version),
+                           data + COMPRESS_HEADER_SIZE,
+                           it->nbytes - COMPRESS_HEADER_SIZE, dest, len)) {
+        fprintf(stderr, "Failed to inflate data (%s)\r\n", codec->name);
+        return false;
+    }
+    latency_record(engine, LATENCY_INFLATE, start);
+    return true;
+}
 
-        fprintf(stderr, "Failed to inflate data: %d\r\n", r);
+static hash_item *inflate_item(struct compress_engine *engine, hash_item *it)
+{
+    if ((it->iflag & ITEM_CODEC_MASK) == 0) {
+        return it;
+    }
+
+    struct compressor *c = get_compressor(engine);
+    if (c == NULL) {
         item_release(engine, it);
         return NULL;
     }
 
+    /* We know the size, so inflate directly into the new item */
+    uint32_t len = item_raw_length(it);
     hash_item *ret = item_alloc(engine, item_get_key(it), it->nkey,
-                              it->flags, it->exptime,
-                              sizeof(buffer) - z.avail_out, NULL);
+                                it->flags, it->exptime, len, NULL);
     if (ret == NULL) {
         fprintf(stderr, "Failed to allocate buffer for inflated object\r\n");
         item_release(engine, it);
         return NULL;
     }
 
+    /* A chained value is inflated in the scratch buffer and copied in */
+    char *dest = item_get_data(ret);
+    if ((ret->eflag & ITEM_CHAINED) != 0) {
+        if (c->buffersize < len) {
+            char *buffer = realloc(c->buffer, len);
+            if (buffer == NULL) {
+                item_release(engine, ret);
+                item_release(engine, it);
+                return NULL;
+            }
+            c->buffer = buffer;
+            c->buffersize = len;
+        }
+        dest = c->buffer;
+    }
+
+    if (!item_decompress(engine, c, it, dest, len)) {
+        item_release(engine, ret);
+        item_release(engine, it);
+        return NULL;
+    }
+    if (dest == c->buffer) {
+        item_write_value(ret, 0, dest, len);
+    }
+
     if (engine->config.verbose) {
         fprintf(stderr, "Found item.. compressed %u, inflated  %u\n",
                 it->nbytes, ret->nbytes);
     }
 
-    memcpy(item_get_data(ret), buffer, sizeof(buffer) - z.avail_out);
+    item_set_cas((ENGINE_HANDLE*)engine, ret, item_get_cas(it));
     item_release(engine, it);
 
     return ret;
@@ -724,10 +1355,10 @@ static hash_item *inflate_item(struct compress_engine *engine, hash_item *it)
 hash_item *item_get(struct compress_engine *engine,
                     const void *key, const size_t nkey) {
     hash_item *it;
-
-    pthread_mutex_lock(&engine->cache_lock);
-    it = do_item_get(engine, key, nkey);
-    pthread_mutex_unlock(&engine->cache_lock);
+    uint32_t hv = engine->server.hash(key, nkey, 0);
+    item_lock(engine, hv);
+    it = do_item_get(engine, key, nkey, hv);
+    item_unlock(engine, hv);
 
     if (it == NULL) {
         return NULL;
@@ -738,54 +1369,236 @@ hash_item *item_get(struct compress_engine *engine,
 
 /*
  * Decrements the reference count on an item and adds it to the freelist if
- * needed.
+ * needed. This doesn't need any locks, because nobody else may find the
+ * item once its refcount drops to zero.
  */
 void item_release(struct compress_engine *engine, hash_item *item) {
-    pthread_mutex_lock(&engine->cache_lock);
     do_item_release(engine, item);
-    pthread_mutex_unlock(&engine->cache_lock);
 }
 
 /*
  * Unlinks an item from the LRU and hashtable.
  */
 void item_unlink(struct compress_engine *engine, hash_item *item) {
-    pthread_mutex_lock(&engine->cache_lock);
-    do_item_unlink(engine, item);
-    pthread_mutex_unlock(&engine->cache_lock);
+    uint32_t hv = engine->server.hash(item_get_key(item), item->nkey, 0);
+    item_lock(engine, hv);
+    do_item_unlink(engine, item, hv);
+    item_unlock(engine, hv);
+}
+
+/*
+ * Unlink the item a chunk of a chained value belongs to (see
+ * item_evacuate). The chunk points back at its item, but that may be
+ * stale until we hold the item lock and find the chunk in its chain.
+ */
+static bool item_evacuate_chunk(struct compress_engine *engine,
+                                hash_item *chunk) {
+    hash_item *it = chunk->prev;
+    unsigned int id = engine->slabs.chunk_clsid;
+    struct item_chain chain;
+    hash_item *iter;
+    uint16_t nkey;
+    uint32_t hv;
+    bool ret = false;
+
+    if (it == NULL || it->slabs_clsid != id ||
+        (it->iflag & ITEM_LINKED) == 0 || (it->eflag & ITEM_CHAINED) == 0) {
+        return false;
+    }
+    nkey = it->nkey;
+    if (sizeof(*it) + sizeof(uint64_t) + nkey > engine->slabs.slabclass[id].size) {
+        return false;
+    }
+
+    hv = engine->server.hash(item_get_key(it), nkey, 0);
+    item_lock(engine, hv);
+    if ((chunk->iflag & ITEM_SLABBED) == 0 && (chunk->eflag & ITEM_CHUNK) != 0 &&
+        chunk->prev == it &&
+        (it->iflag & ITEM_LINKED) != 0 && (it->eflag & ITEM_CHAINED) != 0 &&
+        it->nkey == nkey &&
+        engine->server.hash(item_get_key(it), nkey, 0) == hv) {
+        item_get_chain(it, &chain);
+        for (iter = chain.chunks; iter != NULL && iter != chunk; iter = iter->next) {
+            /* empty */
+        }
+        if (iter != NULL) {
+            do_item_unlink(engine, it, hv);
+            ret = true;
+        }
+    }
+    item_unlock(engine, hv);
+
+    return ret;
+}
+
+/*
+ * Unlink an item in a slab page the rebalancer wants to move. We're called
+ * without any locks, so the item may be unlinked (and its memory reused)
+ * until we hold its item lock. Verify that it's still linked under the key
+ * we hashed before we touch it.
+ */
+bool item_evacuate(struct compress_engine *engine, hash_item *it,
+                   size_t chunk_size) {
+    uint16_t nkey = it->nkey;
+    uint32_t hv;
+    bool ret = false;
+
+    if ((it->iflag & ITEM_SLABBED) == 0 && (it->eflag & ITEM_CHUNK) != 0) {
+        return item_evacuate_chunk(engine, it);
+    }
+    if ((it->iflag & ITEM_LINKED) == 0 ||
+        sizeof(*it) + sizeof(uint64_t) + nkey > chunk_size) {
+        return false;
+    }
+
+    hv = engine->server.hash(item_get_key(it), nkey, 0);
+    item_lock(engine, hv);
+    if ((it->iflag & ITEM_LINKED) != 0 && it->nkey == nkey &&
+        engine->server.hash(item_get_key(it), nkey, 0) == hv) {
+        do_item_unlink(engine, it, hv);
+        ret = true;
+    }
+    item_unlock(engine, hv);
+
+    return ret;
+}
+
+/*
+ * Link an item restored from a snapshot. The item keeps its CAS id and
+ * access time, and becomes the new head of its LRU.
+ */
+bool item_restore(struct compress_engine *engine, hash_item *it) {
+    unsigned int id = it->slabs_clsid;
+    size_t ntotal = ITEM_ntotal(engine, it);
+    uint8_t codec = (it->iflag & ITEM_CODEC_MASK) >> ITEM_CODEC_SHIFT;
+    uint8_t version = (it->iflag & ITEM_DICT_MASK) >> ITEM_DICT_SHIFT;
+    uint64_t cas = item_get_cas(it);
+    uint64_t last;
+    uint32_t hv;
+    bool ret = false;
+
+    if (it->nkey == 0 || ntotal > engine->slabs.slabclass[id].size) {
+        return false;
+    }
+    /* The chunks of a chained value aren't where they used to be */
+    if ((it->eflag & (ITEM_CHAINED | ITEM_CHUNK)) != 0) {
+        return false;
+    }
+    /* We can't decompress it without its codec and dictionary */
+    if ((codec != CODEC_NONE && codec_get(codec) == NULL) ||
+        (version != 0 && dictionary_get(engine, version) == NULL)) {
+        return false;
+    }
+
+    hv = engine->server.hash(item_get_key(it), it->nkey, 0);
+    item_lock(engine, hv);
+    if (assoc_find(engine, hv, item_get_key(it), it->nkey) == NULL) {
+        it->iflag = (it->iflag & ~ITEM_SLABBED) | ITEM_LINKED;
+        it->next = it->prev = it->h_next = 0;
+        /* The cache holds the only reference */
+        it->refcount = 1;
+        dictionary_retain(engine, version);
+        assoc_insert(engine, hv, it);
+
+        pthread_mutex_lock(&engine->stats.lock);
+        engine->stats.curr_bytes += ntotal;
+        engine->stats.curr_items += 1;
+        engine->stats.total_items += 1;
+        pthread_mutex_unlock(&engine->stats.lock);
+        slabs_adjust_mem_requested(engine, id, 0, ntotal);
+
+        /* New CAS ids must be higher than the restored ones */
+        while ((last = engine->items.cas_id) < cas &&
+               !__sync_bool_compare_and_swap(&engine->items.cas_id, last, cas)) {
+            ;
+        }
+
+        pthread_mutex_lock(&engine->items.lru_locks[id]);
+        item_link_q(engine, it);
+        pthread_mutex_unlock(&engine->items.lru_locks[id]);
+        ret = true;
+    }
+    item_unlock(engine, hv);
+
+    return ret;
+}
+
+void item_lru_info(struct compress_engine *engine, unsigned int id,
+                   unsigned int *evicted, rel_time_t *age) {
+    rel_time_t current_time = engine->server.get_current_time();
+
+    pthread_mutex_lock(&engine->items.lru_locks[id]);
+    *evicted = engine->items.itemstats[id].evicted +
+        engine->items.itemstats[id].outofmemory;
+    if (engine->items.tails[id] != NULL) {
+        *age = current_time - engine->items.tails[id]->time;
+    } else {
+        *age = 0;
+    }
+    pthread_mutex_unlock(&engine->items.lru_locks[id]);
 }
 
 static hash_item *compress_item(struct compress_engine *engine,
                                 hash_item *item,
                                 const void *cookie) {
-    z_stream z = { .zalloc = Z_NULL, .zfree = Z_NULL, .opaque = Z_NULL };
-    if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    const struct codec *codec = engine->codec;
+    if (item->nbytes < engine->config.min_compress_size) {
+        return NULL;
+    }
+
+    struct compressor *c = get_compressor(engine);
+    if (c == NULL) {
         return NULL;
     }
 
-    char buffer[1024*1024];
-    z.next_in = (Bytef*)item_get_data(item);
-    z.avail_in = item->nbytes;
-    z.next_out = (Bytef*)buffer;
-    z.avail_out = sizeof(buffer);
+    if (c->dict != engine->dictionaries.current) {
+        /* A new dictionary has been trained */
+        dictionary_release(engine, c->dict);
+        c->dict = dictionary_acquire(engine);
+    }
+
+    size_t needed = COMPRESS_HEADER_SIZE + codec->bound(item->nbytes);
+    if (c->buffersize < needed) {
+        char *buffer = realloc(c->buffer, needed);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        c->buffer = buffer;
+        c->buffersize = needed;
+    }
+
+    const char *data = item_linear_data(c, item);
+    if (data == NULL) {
+        return NULL;
+    }
 
-    int r = deflate(&z, Z_FULL_FLUSH);
-    if (r != Z_OK) {
+    uint64_t start = latency_start(engine);
+    size_t size = codec->compress(c->ctx, dictionary_get(engine, c->dict),
+                                  data, item->nbytes,
+                                  c->buffer + COMPRESS_HEADER_SIZE,
+                                  c->buffersize - COMPRESS_HEADER_SIZE);
+    latency_record(engine, LATENCY_COMPRESS, start);
+    if (size == 0) {
         return NULL;
     }
 
-    if (sizeof(buffer) - z.avail_out < item->nbytes) {
+    size += COMPRESS_HEADER_SIZE;
+    if (size < item->nbytes) {
         hash_item *n = item_alloc(engine, item_get_key(item), item->nkey,
                                   item->flags, item->exptime,
-                                  sizeof(buffer) - z.avail_out, cookie);
+                                  size, cookie);
         if (n == NULL) {
             fprintf(stderr, "Failed to allocate memory, storing uncompressed\n");
             return NULL;
         }
-        memcpy(item_get_data(n), buffer, sizeof(buffer) - z.avail_out);
+        uint32_t len = htonl(item->nbytes);
+        memcpy(c->buffer, &len, sizeof(len));
+        item_write_value(n, 0, c->buffer, size);
+        n->iflag |= (codec->id << ITEM_CODEC_SHIFT) | (c->dict << ITEM_DICT_SHIFT);
+        dictionary_retain(engine, c->dict);
         if (engine->config.verbose) {
-            fprintf(stderr, "Storing item. Raw: %u, compressed %u\n",
-                    item->nbytes, n->nbytes);
+            fprintf(stderr, "Storing item. Raw: %u, compressed %u (%s)\n",
+                    item->nbytes, n->nbytes, codec->name);
         }
         return n;
     } else if (engine->config.verbose) {
@@ -803,13 +1616,19 @@ ENGINE_ERROR_CODE store_item(struct compress_engine *engine,
                              ENGINE_STORE_OPERATION operation,
                              const void *cookie) {
     ENGINE_ERROR_CODE ret;
+    hash_item *compressed = NULL;
 
-    hash_item *compressed = compress_item(engine, item, cookie);
+    /* In async mode the compactor compresses the item once it gets cold */
+    if (!engine->config.compress_async) {
+        compressed = compress_item(engine, item, cookie);
+    }
+
+    uint32_t hv = engine->server.hash(item_get_key(item), item->nkey, 0);
 
-    pthread_mutex_lock(&engine->cache_lock);
+    item_lock(engine, hv);
     ret = do_store_item(engine, compressed ? compressed : item,
-                        cas, operation, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
+                        cas, operation, cookie, hv);
+    item_unlock(engine, hv);
 
     if (compressed != NULL) {
         item_release(engine, compressed);
@@ -818,6 +1637,144 @@ ENGINE_ERROR_CODE store_item(struct compress_engine *engine,
     return ret;
 }
 
+/*
+ * The maximum number of items the compactor tries to compress in each
+ * slab class per pass
+ */
+#define COMPACTOR_BATCH_SIZE 256
+
+/*
+ * Replace the cold (not accessed for compress_min_age seconds) raw items
+ * at the tail of an LRU with compressed copies.
+ * @return the number of items compressed
+ */
+static int item_compact_class(struct compress_engine *engine, int id) {
+    hash_item *items[COMPACTOR_BATCH_SIZE];
+    rel_time_t current_time = engine->server.get_current_time();
+    /* Don't hold the lru lock too long if the tail is already compressed */
+    int tries = COMPACTOR_BATCH_SIZE * 4;
+    int nitems = 0;
+    int compacted = 0;
+    int ii;
+    hash_item *it;
+
+    pthread_mutex_lock(&engine->items.lru_locks[id]);
+    for (it = engine->items.tails[id];
+         it != NULL && nitems < COMPACTOR_BATCH_SIZE && tries > 0;
+         it = it->prev, tries--) {
+        if (it->time + engine->config.compress_min_age > current_time) {
+            /* The rest of the items are newer */
+            break;
+        }
+        if ((it->iflag & (ITEM_CODEC_MASK | ITEM_COMPRESS_TRIED)) == 0 &&
+            it->nbytes >= engine->config.min_compress_size &&
+            (it->exptime == 0 || it->exptime > current_time)) {
+            /* The item can't be unlinked while we hold the lru lock */
+            __sync_add_and_fetch(&it->refcount, 1);
+            items[nitems++] = it;
+        }
+    }
+    pthread_mutex_unlock(&engine->items.lru_locks[id]);
+
+    for (ii = 0; ii < nitems; ++ii) {
+        hash_item *compressed;
+        uint32_t hv;
+
+        it = items[ii];
+        compressed = compress_item(engine, it, NULL);
+        hv = engine->server.hash(item_get_key(it), it->nkey, 0);
+
+        item_lock(engine, hv);
+        if ((it->iflag & ITEM_LINKED) == 0) {
+            /* The item was deleted or replaced while we compressed it */
+        } else if (compressed == NULL) {
+            it->iflag |= ITEM_COMPRESS_TRIED;
+        } else {
+            /* The value didn't change, so the client's CAS is still valid */
+            do_item_replace_copy(engine, it, compressed, hv);
+            ++compacted;
+        }
+        item_unlock(engine, hv);
+
+        if (compressed != NULL) {
+            item_release(engine, compressed);
+        }
+        item_release(engine, it);
+    }
+
+    return compacted;
+}
+
+static void *item_compactor_thread(void *arg) {
+    struct compress_engine *engine = arg;
+    struct items *items = &engine->items;
+
+    pthread_mutex_lock(&items->compactor_lock);
+    while (!items->compactor_shutdown) {
+        struct timeval tv;
+        struct timespec ts;
+        int id;
+        int compacted = 0;
+
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + engine->config.compress_interval;
+        ts.tv_nsec = tv.tv_usec * 1000;
+        while (!items->compactor_shutdown &&
+               pthread_cond_timedwait(&items->compactor_cond,
+                                      &items->compactor_lock, &ts) != ETIMEDOUT) {
+            /* spurious wakeup */
+        }
+        if (items->compactor_shutdown) {
+            break;
+        }
+        pthread_mutex_unlock(&items->compactor_lock);
+
+        for (id = POWER_SMALLEST; id < POWER_LARGEST; id++) {
+            compacted += item_compact_class(engine, id);
+        }
+        if (engine->config.verbose && compacted > 0) {
+            fprintf(stderr, "Compressed %d cold items\n", compacted);
+        }
+
+        pthread_mutex_lock(&items->compactor_lock);
+    }
+    pthread_mutex_unlock(&items->compactor_lock);
+
+    return NULL;
+}
+
+ENGINE_ERROR_CODE item_start_compactor(struct compress_engine *engine) {
+    int ret;
+
+    if (!engine->config.compress_async) {
+        return ENGINE_SUCCESS;
+    }
+
+    pthread_mutex_init(&engine->items.compactor_lock, NULL);
+    pthread_cond_init(&engine->items.compactor_cond, NULL);
+    if ((ret = pthread_create(&engine->items.compactor_tid, NULL,
+                              item_compactor_thread, engine)) != 0) {
+        fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
+        return ENGINE_FAILED;
+    }
+    engine->items.compactor_running = true;
+
+    return ENGINE_SUCCESS;
+}
+
+void item_stop_compactor(struct compress_engine *engine) {
+    if (engine->items.compactor_running) {
+        pthread_mutex_lock(&engine->items.compactor_lock);
+        engine->items.compactor_shutdown = true;
+        pthread_cond_signal(&engine->items.compactor_cond);
+        pthread_mutex_unlock(&engine->items.compactor_lock);
+        pthread_join(engine->items.compactor_tid, NULL);
+        engine->items.compactor_running = false;
+        pthread_cond_destroy(&engine->items.compactor_cond);
+        pthread_mutex_destroy(&engine->items.compactor_lock);
+    }
+}
+
 /*
  * Flushes expired items after a flush_all call
  */
@@ -825,8 +1782,6 @@ void item_flush_expired(struct compress_engine *engine, time_t when) {
     int i;
     hash_item *iter, *next;
 
-    pthread_mutex_lock(&engine->cache_lock);
-
     if (when == 0) {
         engine->config.oldest_live = engine->server.get_current_time() - 1;
     } else {
@@ -835,27 +1790,35 @@ void item_flush_expired(struct compress_engine *engine, time_t when) {
 
     if (engine->config.oldest_live != 0) {
         for (i = 0; i < POWER_LARGEST; i++) {
+            pthread_mutex_lock(&engine->items.lru_locks[i]);
             /*
              * The LRU is sorted in decreasing time order, and an item's
              * timestamp is never newer than its last access time, so we
              * only need to walk back until we hit an item older than the
              * oldest_live time.
-             * The oldest_live checking will auto-expire the remaining items.
+             * The oldest_live checking will auto-expire the remaining items
+             * (and the ones we fail to lock, as we can't block for the item
+             * lock while holding the lru lock).
              */
             for (iter = engine->items.heads[i]; iter != NULL; iter = next) {
                 if (iter->time >= engine->config.oldest_live) {
                     next = iter->next;
                     if ((iter->iflag & ITEM_SLABBED) == 0) {
-                        do_item_unlink(engine, iter);
+                        uint32_t hv = engine->server.hash(item_get_key(iter),
+                                                          iter->nkey, 0);
+                        if (item_trylock(engine, hv)) {
+                            do_item_unlink_nolock(engine, iter, hv);
+                            item_unlock(engine, hv);
+                        }
                     }
                 } else {
                     /* We've hit the first old item. Continue to the next queue. */
                     break;
                 }
             }
+            pthread_mutex_unlock(&engine->items.lru_locks[i]);
         }
     }
-    pthread_mutex_unlock(&engine->cache_lock);
 }
 
 /*
@@ -867,25 +1830,83 @@ char *item_cachedump(struct compress_engine *engine,
                      unsigned int *bytes) {
     char *ret;
 
-    pthread_mutex_lock(&engine->cache_lock);
+    if (slabs_clsid >= POWER_LARGEST) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&engine->items.lru_locks[slabs_clsid]);
     ret = do_item_cachedump(slabs_clsid, limit, bytes);
-    pthread_mutex_unlock(&engine->cache_lock);
+    pthread_mutex_unlock(&engine->items.lru_locks[slabs_clsid]);
     return ret;
 }
 
+unsigned int item_sample(struct compress_engine *engine,
+                         char *buffer, size_t size,
+                         size_t *sizes, unsigned int max) {
+    hash_item **items = calloc(max, sizeof(hash_item*));
+    unsigned int per_class = max / 16 + 1;
+    unsigned int nitems = 0;
+    unsigned int nsamples = 0;
+    size_t offset = 0;
+    unsigned int ii;
+    int id;
+
+    if (items == NULL) {
+        return 0;
+    }
+
+    /* Grab the most recently used items from each slab class */
+    for (id = POWER_SMALLEST; id < POWER_LARGEST && nitems < max; id++) {
+        unsigned int n = 0;
+        hash_item *it;
+
+        pthread_mutex_lock(&engine->items.lru_locks[id]);
+        for (it = engine->items.heads[id];
+             it != NULL && n < per_class && nitems < max;
+             it = it->next) {
+            if (item_raw_length(it) >= engine->config.min_compress_size) {
+                /* The item can't be unlinked while we hold the lru lock */
+                __sync_add_and_fetch(&it->refcount, 1);
+                items[nitems++] = it;
+                ++n;
+            }
+        }
+        pthread_mutex_unlock(&engine->items.lru_locks[id]);
+    }
+
+    struct compressor *c = get_compressor(engine);
+    for (ii = 0; ii < nitems; ++ii) {
+        hash_item *it = items[ii];
+        uint32_t len = item_raw_length(it);
+
+        if (c != NULL && offset + len <= size) {
+            bool ok = true;
+            if ((it->iflag & ITEM_CODEC_MASK) == 0) {
+                item_read_value(it, 0, buffer + offset, len);
+            } else {
+                ok = item_decompress(engine, c, it, buffer + offset, len);
+            }
+            if (ok) {
+                sizes[nsamples++] = len;
+                offset += len;
+            }
+        }
+        item_release(engine, it);
+    }
+    free(items);
+
+    return nsamples;
+}
+
 void item_stats(struct compress_engine *engine,
                    ADD_STAT add_stat, const void *cookie)
 {
-    pthread_mutex_lock(&engine->cache_lock);
     do_item_stats(engine, add_stat, (void*)cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
 }
 
 
 void item_stats_sizes(struct compress_engine *engine,
                       ADD_STAT add_stat, const void *cookie)
 {
-    pthread_mutex_lock(&engine->cache_lock);
     do_item_stats_sizes(engine, add_stat, (void*)cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
 }
@@ -4,6 +4,10 @@
 /*
  * You should not try to aquire any of the item locks before calling these
  * functions.
+ *
+ * Locking order: item lock (see assoc.h) -> lru lock -> slabs lock ->
+ * stats lock. A linked item holds a reference to itself, and the
+ * refcount is only modified with atomic operations.
  */
 typedef struct _hash_item {
     struct _hash_item *next;
@@ -20,6 +24,7 @@ typedef struct _hash_item {
                      * implementation. */
     unsigned short refcount;
     uint8_t slabs_clsid;/* which slab class we're in */
+    uint8_t eflag; /**< More engine flags (iflag is full) */
 } hash_item;
 
 typedef struct {
@@ -31,13 +36,43 @@ typedef struct {
     unsigned int reclaimed;
 } itemstats_t;
 
+struct compressor;
+
 struct items {
    hash_item *heads[POWER_LARGEST];
    hash_item *tails[POWER_LARGEST];
    itemstats_t itemstats[POWER_LARGEST];
    unsigned int sizes[POWER_LARGEST];
+   /* Each LRU (and its itemstats) is protected by its own lock */
+   pthread_mutex_t lru_locks[POWER_LARGEST];
+   /* Each thread gets its own codec context, scratch buffer and CAS ids */
+   pthread_key_t compressors_key;
+   /* All of the compressors (protected by compressors_lock) */
+   struct compressor *compressors;
+   pthread_mutex_t compressors_lock;
+   /* The last CAS id handed out to a thread (updated with atomic operations) */
+   uint64_t cas_id;
+   /* The compactor compresses cold items in the background (compress_async) */
+   pthread_t compactor_tid;
+   pthread_mutex_t compactor_lock;
+   pthread_cond_t compactor_cond;
+   bool compactor_running;
+   bool compactor_shutdown;
 };
 
+/**
+ * Initialize the item subsystem
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_init(struct compress_engine *engine);
+
+/**
+ * Release the resources used by the item subsystem
+ * @param engine handle to the storage engine
+ */
+void item_destroy(struct compress_engine *engine);
+
 
 /**
  * Allocate and initialize a new item structure
@@ -53,6 +88,16 @@ hash_item *item_alloc(struct compress_engine *engine,
                       const void *key, size_t nkey, int flags,
                       rel_time_t exptime, int nbytes, const void *cookie);
 
+/**
+ * Get the parts of the value of an item. A chained item (see
+ * slab_chunk_max) has its value split over a number of chunks.
+ * @param it the item
+ * @param iov where to store the parts
+ * @param niov the number of entries in iov
+ * @return the number of parts (only the first niov are stored)
+ */
+int item_get_iov(const hash_item *it, struct iovec *iov, int niov);
+
 /**
  * Get an item from the cache
  *
@@ -127,6 +172,66 @@ void item_release(struct compress_engine *engine, hash_item *it);
  */
 void item_unlink(struct compress_engine *engine, hash_item *it);
 
+/**
+ * Start the thread compressing cold items (if compress_async is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_start_compactor(struct compress_engine *engine);
+
+/**
+ * Stop the thread compressing cold items
+ * @param engine handle to the storage engine
+ */
+void item_stop_compactor(struct compress_engine *engine);
+
+/**
+ * Unlink an item so that the slab rebalancer may reuse its memory
+ * @param engine handle to the storage engine
+ * @param it the chunk to evacuate (may not hold a linked item)
+ * @param chunk_size the size of the chunk
+ * @return true if the item was unlinked
+ */
+bool item_evacuate(struct compress_engine *engine, hash_item *it,
+                   size_t chunk_size);
+
+/**
+ * Link an item restored from a snapshot (in a page added by
+ * slabs_restore_page). Restore the items of an LRU from the tail to the
+ * head to keep their order.
+ * @param engine handle to the storage engine
+ * @param it the item to link
+ * @return false if the item is invalid, its codec or dictionary is
+ *         missing, or the key is already in the cache (the chunk is
+ *         still free)
+ */
+bool item_restore(struct compress_engine *engine, hash_item *it);
+
+/**
+ * Get the information the slab rebalancer uses to pick the classes
+ * @param engine handle to the storage engine
+ * @param id the slab class
+ * @param evicted where to store the number of items evicted (or that we
+ *                failed to allocate)
+ * @param age where to store the age of the oldest item in the LRU
+ */
+void item_lru_info(struct compress_engine *engine, unsigned int id,
+                   unsigned int *evicted, rel_time_t *age);
+
+/**
+ * Copy the uncompressed values of some of the most recently used items
+ * (used to train compression dictionaries)
+ * @param engine handle to the storage engine
+ * @param buffer where to store the values (back to back)
+ * @param size the size of the buffer
+ * @param sizes where to store the size of each value
+ * @param max the maximum number of values to copy
+ * @return the number of values copied
+ */
+unsigned int item_sample(struct compress_engine *engine,
+                         char *buffer, size_t size,
+                         size_t *sizes, unsigned int max);
+
 /**
  * Store an item in the cache
  * @param engine handle to the storage engine
@@ -4,7 +4,8 @@
 
 #include "compress_engine.h"
 
-
+/* The smallest chunks we split the chained values into (see slab_chunk_max) */
+#define SLAB_CHUNK_MIN 1024
 
 /* powers-of-N allocation structures */
 
@@ -28,20 +29,50 @@ typedef struct {
     size_t requested; /* The number of requested bytes */
 } slabclass_t;
 
+/* A part of the preallocated memory (there is one per NUMA node) */
+struct slab_arena {
+    char *base;
+    char *current;
+    size_t avail;
+};
+
 struct slabs {
    slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
    size_t mem_limit;
    size_t mem_malloced;
    int power_largest;
+   /* The class the values of chained items are split into (0 if none) */
+   unsigned int chunk_clsid;
 
+   /* The preallocated memory (NULL if we malloc each slab page) */
    void *mem_base;
-   void *mem_current;
-   size_t mem_avail;
+   struct slab_arena *arenas;
+   int narenas;
 
    /**
     * Access to the slab allocator is protected by this lock
     */
    pthread_mutex_t lock;
+
+   /*
+    * The page being moved by the rebalancer (protected by lock). Chunks
+    * in [rebal_start, rebal_end) are not put back on the freelist when
+    * they're released, they're just counted in rebal_free.
+    */
+   char *rebal_start;
+   char *rebal_end;
+   unsigned int rebal_free;
+   uint64_t slabs_moved;
+   uint64_t slab_reassign_evictions;
+
+   /* The rebalancer moves pages between the classes (slab_automove) */
+   pthread_t rebal_tid;
+   pthread_mutex_t rebal_lock;
+   pthread_cond_t rebal_cond;
+   bool rebal_running;
+   bool rebal_shutdown;
+   /* The eviction counters at the end of the last window */
+   unsigned int rebal_evicted[MAX_NUMBER_OF_SLAB_CLASSES];
 };
 
 
@@ -72,6 +103,66 @@ void *slabs_alloc(struct compress_engine *engine, const size_t size, unsigned in
 /** Free previously allocated object */
 void slabs_free(struct compress_engine *engine, void *ptr, size_t size, unsigned int id);
 
+/**
+ * Start the thread moving slab pages from the classes with free memory to
+ * the classes evicting items (if slab_automove is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE slabs_start_rebalancer(struct compress_engine *engine);
+
+/**
+ * Stop the rebalancer thread (if running)
+ * @param engine handle to the storage engine
+ */
+void slabs_stop_rebalancer(struct compress_engine *engine);
+
+/**
+ * Move a slab page from one class to another. The items in the page are
+ * evicted.
+ * @param engine handle to the storage engine
+ * @param src the class to take the page from
+ * @param dst the class to give the page to
+ * @return true if the page was moved
+ */
+bool slabs_reassign(struct compress_engine *engine, unsigned int src,
+                    unsigned int dst);
+
+/**
+ * Get the size of the slab pages of a class
+ * @param engine handle to the storage engine
+ * @param id the slab class
+ * @return the number of bytes in a page
+ */
+size_t slabs_page_size(struct compress_engine *engine, unsigned int id);
+
+/** Adjust the number of requested bytes in a class (an item changed size) */
+void slabs_adjust_mem_requested(struct compress_engine *engine, unsigned int id,
+                                size_t old, size_t ntotal);
+
+/**
+ * Add a slab page restored from a snapshot to a class. All of its chunks
+ * are marked ITEM_SLABBED, and none of them may be allocated until
+ * slabs_restore_done is called.
+ * @param engine handle to the storage engine
+ * @param id the slab class
+ * @param data the content of the page
+ * @param len the size of the page (must match the class)
+ * @return the new page, or NULL if it doesn't match or we're out of memory
+ */
+void *slabs_restore_page(struct compress_engine *engine, unsigned int id,
+                         const void *data, size_t len);
+
+/**
+ * Put the chunks of a restored page that are still marked ITEM_SLABBED on
+ * the freelist
+ * @param engine handle to the storage engine
+ * @param id the slab class
+ * @param page the page returned by slabs_restore_page
+ */
+void slabs_restore_done(struct compress_engine *engine, unsigned int id,
+                        void *page);
+
 /** Fill buffer with stats */ /*@null@*/
 void slabs_stats(struct compress_engine *engine, ADD_STAT add_stats, const void *c);
 
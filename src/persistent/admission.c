@@ -0,0 +1,214 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The frequency sketch of the admission filter
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "persistent_engine.h"
+
+/* The smallest sketch we use (a row must be a multiple of 8 counters) */
+#define ADMISSION_MIN_KEYS 4096
+
+/* The size of an average item we guess when admission_filter_keys is 0 */
+#define ADMISSION_ITEM_SIZE 256
+
+/*
+ * The doorkeeper bits per key. It sees every key used in a sample (ten
+ * times the number of keys), so it needs a few more than a row.
+ */
+#define ADMISSION_DOORKEEPER_BITS 16
+
+static inline size_t doorkeeper_words(const struct admission *a) {
+    return (a->mask + 1) * ADMISSION_DOORKEEPER_BITS / 64;
+}
+
+ENGINE_ERROR_CODE admission_init(struct persistent_engine *engine) {
+    struct admission *a = &engine->admission;
+    size_t keys = engine->config.admission_filter_keys;
+    size_t width = ADMISSION_MIN_KEYS;
+
+    a->counters = NULL;
+    a->mask = 0;
+    a->additions = 0;
+    if (!engine->config.admission_filter) {
+        return ENGINE_SUCCESS;
+    }
+
+    if (keys == 0) {
+        keys = engine->config.maxbytes / ADMISSION_ITEM_SIZE;
+    }
+    while (width < keys) {
+        width <<= 1;
+    }
+    a->counters = calloc(ADMISSION_DEPTH, width);
+    a->doorkeeper = calloc(width * ADMISSION_DOORKEEPER_BITS / 64,
+                           sizeof(uint64_t));
+    if (a->counters == NULL || a->doorkeeper == NULL) {
+        free(a->counters);
+        free(a->doorkeeper);
+        a->counters = NULL;
+        a->doorkeeper = NULL;
+        fprintf(stderr, "Failed to allocate the admission filter\n");
+        return ENGINE_ENOMEM;
+    }
+    a->mask = width - 1;
+    a->sample = width * 10;
+    pthread_mutex_init(&a->lock, NULL);
+
+    return ENGINE_SUCCESS;
+}
+
+void admission_destroy(struct persistent_engine *engine) {
+    struct admission *a = &engine->admission;
+
+    if (a->counters != NULL) {
+        pthread_mutex_destroy(&a->lock);
+        free(a->counters);
+        free(a->doorkeeper);
+        a->counters = NULL;
+        a->doorkeeper = NULL;
+    }
+}
+
+bool admission_enabled(struct persistent_engine *engine) {
+    return engine->admission.counters != NULL;
+}
+
+/* Every row uses its own hash of the key */
+static inline uint8_t *counter(struct admission *a, uint32_t hv, int row) {
+    static const uint64_t seeds[ADMISSION_DEPTH] = {
+        0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+        0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL
+    };
+    uint64_t h = ((uint64_t)hv + seeds[row]) * seeds[row];
+    h ^= h >> 32;
+    return &a->counters[row * (a->mask + 1) + (h & a->mask)];
+}
+
+/* A key sets two of the bits in the doorkeeper */
+static inline void doorkeeper_bits(struct admission *a, uint32_t hv,
+                                   size_t *bits) {
+    uint64_t h = (uint64_t)hv * 0xff51afd7ed558ccdULL;
+    size_t nbits = doorkeeper_words(a) * 64;
+    bits[0] = h & (nbits - 1);
+    bits[1] = (h >> 32) & (nbits - 1);
+}
+
+static bool doorkeeper_contains(struct admission *a, uint32_t hv) {
+    size_t bits[2];
+    doorkeeper_bits(a, hv, bits);
+    return (a->doorkeeper[bits[0] / 64] & (1ULL << (bits[0] % 64))) != 0 &&
+        (a->doorkeeper[bits[1] / 64] & (1ULL << (bits[1] % 64))) != 0;
+}
+
+/*
+ * Halve all of the counters and clear the doorkeeper. Every eight counters
+ * are updated with a single compare and swap, so we don't lose the
+ * increments made while we're at it.
+ */
+static void admission_age(struct admission *a) {
+    uint64_t *words = (uint64_t*)a->counters;
+    size_t nwords = ADMISSION_DEPTH * (a->mask + 1) / sizeof(uint64_t);
+    size_t ii;
+
+    pthread_mutex_lock(&a->lock);
+    for (ii = 0; ii < nwords; ++ii) {
+        uint64_t old, new;
+        do {
+            old = words[ii];
+            new = (old >> 1) & 0x7f7f7f7f7f7f7f7fULL;
+        } while (!__sync_bool_compare_and_swap(&words[ii], old, new));
+    }
+    for (ii = 0; ii < doorkeeper_words(a); ++ii) {
+        __sync_and_and_fetch(&a->doorkeeper[ii], 0);
+    }
+    __sync_sub_and_fetch(&a->additions, a->sample / 2);
+    __sync_add_and_fetch(&a->resets, 1);
+    pthread_mutex_unlock(&a->lock);
+}
+
+void admission_record(struct persistent_engine *engine, uint32_t hv) {
+    struct admission *a = &engine->admission;
+    uint8_t *c[ADMISSION_DEPTH];
+    uint8_t min = ADMISSION_MAX_COUNT;
+    size_t bits[2];
+    int row;
+
+    if (a->counters == NULL) {
+        return;
+    }
+
+    if (__sync_add_and_fetch(&a->additions, 1) == a->sample) {
+        admission_age(a);
+    }
+
+    /* The first access only goes into the doorkeeper */
+    if (!doorkeeper_contains(a, hv)) {
+        doorkeeper_bits(a, hv, bits);
+        __sync_fetch_and_or(&a->doorkeeper[bits[0] / 64], 1ULL << (bits[0] % 64));
+        __sync_fetch_and_or(&a->doorkeeper[bits[1] / 64], 1ULL << (bits[1] % 64));
+        return;
+    }
+
+    /*
+     * Only bump the counters holding the estimate (the others are too
+     * high already because of the other keys in them)
+     */
+    for (row = 0; row < ADMISSION_DEPTH; ++row) {
+        c[row] = counter(a, hv, row);
+        if (*c[row] < min) {
+            min = *c[row];
+        }
+    }
+    if (min < ADMISSION_MAX_COUNT) {
+        for (row = 0; row < ADMISSION_DEPTH; ++row) {
+            /* Losing an increment to a race doesn't matter much */
+            if (*c[row] == min) {
+                __sync_bool_compare_and_swap(c[row], min, min + 1);
+            }
+        }
+    }
+}
+
+uint32_t admission_estimate(struct persistent_engine *engine, uint32_t hv) {
+    struct admission *a = &engine->admission;
+    uint32_t ret = ADMISSION_MAX_COUNT;
+    int row;
+
+    if (a->counters == NULL) {
+        return 0;
+    }
+
+    for (row = 0; row < ADMISSION_DEPTH; ++row) {
+        uint8_t c = *counter(a, hv, row);
+        if (c < ret) {
+            ret = c;
+        }
+    }
+    return doorkeeper_contains(a, hv) ? ret + 1 : ret;
+}
+
+void admission_stats(struct persistent_engine *engine, ADD_STAT add_stat,
+                     const void *cookie) {
+    struct admission *a = &engine->admission;
+
+    if (a->counters == NULL) {
+        return;
+    }
+
+    add_statistics(cookie, add_stat, NULL, -1, "admission_kept", "%llu",
+                   (unsigned long long)a->kept);
+    add_statistics(cookie, add_stat, NULL, -1, "admission_rejected", "%llu",
+                   (unsigned long long)a->rejected);
+    add_statistics(cookie, add_stat, NULL, -1, "admission_resets", "%llu",
+                   (unsigned long long)a->resets);
+}
+
+void admission_reset_stats(struct persistent_engine *engine) {
+    engine->admission.kept = 0;
+    engine->admission.rejected = 0;
+    engine->admission.resets = 0;
+}
@@ -1,35 +1,88 @@
 #ifndef ASSOC_H
 #define ASSOC_H
 
+/*
+ * The number of items stored directly in a bucket. The rest of the items
+ * in the bucket are chained through h_next.
+ */
+#define ASSOC_BUCKET_SLOTS 4
+
+/*
+ * A hash bucket fills a cache line. We store the hash value next to each
+ * item pointer, so a lookup only touches the items with the right hash
+ * value.
+ */
+struct assoc_bucket {
+   uint32_t hashes[ASSOC_BUCKET_SLOTS];
+   hash_item *items[ASSOC_BUCKET_SLOTS];
+   hash_item *overflow;
+} __attribute__((aligned(64)));
+
 struct assoc {
    /* how many powers of 2's worth of buckets we use */
    unsigned int hashpower;
 
 
    /* Main hash table. This is where we look except during expansion. */
-   hash_item** primary_hashtable;
+   struct assoc_bucket *primary_hashtable;
 
    /*
     * Previous hash table. During expansion, we look here for keys that haven't
     * been moved over to the primary yet.
     */
-   hash_item** old_hashtable;
+   struct assoc_bucket *old_hashtable;
 
-   /* Number of items in the hash table. */
+   /* Number of items in the hash table (updated with atomic operations) */
    unsigned int hash_items;
 
    /* Flag: Are we in the middle of expanding now? */
    bool expanding;
 
    /*
-    * During expansion we migrate values with bucket granularity; this is how
-    * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+    * During expansion we migrate values with bucket granularity. The front
+    * end threads move a bucket the first time they use it, and the
+    * maintenance thread moves the rest in order; this is how far it has
+    * gotten so far. Ranges from 0 .. hashsize(hashpower - 1).
     */
    unsigned int expand_bucket;
+
+   /*
+    * The hash chains are protected by a set of striped locks (see
+    * item_lock()). A key always maps to the same lock, no matter if it
+    * lives in the old or the new table during expansion.
+    */
+   pthread_mutex_t *item_locks;
+   uint32_t item_lock_mask;
+
+   /*
+    * The maintenance thread expands the hash table when it is signalled
+    * from assoc_insert.
+    */
+   pthread_t maintenance_tid;
+   pthread_mutex_t maintenance_lock;
+   pthread_cond_t maintenance_cond;
+   bool maintenance_running;
+   bool maintenance_shutdown;
 };
 
 /* associative array */
 ENGINE_ERROR_CODE assoc_init(struct persistent_engine *engine);
+void assoc_destroy(struct persistent_engine *engine);
+
+/*
+ * Lock the hash chain the key with the given hash value lives in. The
+ * caller must hold this lock when calling assoc_find, assoc_insert and
+ * assoc_delete. Never block on an item lock while holding another item
+ * lock (use item_trylock instead).
+ */
+void item_lock(struct persistent_engine *engine, uint32_t hv);
+bool item_trylock(struct persistent_engine *engine, uint32_t hv);
+void item_unlock(struct persistent_engine *engine, uint32_t hv);
+/*
+ * Start loading the bucket for a hash value into the cache. This is only
+ * a hint, so it doesn't need the item lock.
+ */
+void assoc_prefetch(struct persistent_engine *engine, uint32_t hash);
 hash_item *assoc_find(struct persistent_engine *engine, uint32_t hash,
                       const char *key, const size_t nkey);
 int assoc_insert(struct persistent_engine *engine, uint32_t hash,
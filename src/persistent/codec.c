@@ -0,0 +1,220 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compression codecs used by the warm tier of the persistent engine
+ *
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#include "codec.h"
+
+struct codec_context {
+    int level;
+#ifdef HAVE_LIBZ
+    /* The streams are initialized the first time they are used */
+    bool deflate_ok;
+    bool inflate_ok;
+    z_stream deflate;
+    z_stream inflate;
+#endif
+#ifdef HAVE_LIBZSTD
+    ZSTD_CCtx *zstd_cctx;
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+
+/******************************** ZLIB ***************************************/
+
+#ifdef HAVE_LIBZ
+static size_t zlib_bound(size_t nbytes) {
+    return compressBound(nbytes);
+}
+
+static size_t zlib_compress(struct codec_context *ctx,
+                            const void *src, size_t nsrc,
+                            void *dest, size_t ndest) {
+    z_stream *z = &ctx->deflate;
+    if (ctx->deflate_ok) {
+        deflateReset(z);
+    } else {
+        int level = ctx->level == 0 ? Z_DEFAULT_COMPRESSION : ctx->level;
+        if (level > Z_BEST_COMPRESSION) {
+            level = Z_BEST_COMPRESSION;
+        }
+        if (deflateInit(z, level) != Z_OK) {
+            return 0;
+        }
+        ctx->deflate_ok = true;
+    }
+
+    z->next_in = (Bytef*)src;
+    z->avail_in = nsrc;
+    z->next_out = dest;
+    z->avail_out = ndest;
+
+    if (deflate(z, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+    return z->total_out;
+}
+
+static bool zlib_decompress(struct codec_context *ctx,
+                            const void *src, size_t nsrc,
+                            void *dest, size_t ndest) {
+    z_stream *z = &ctx->inflate;
+    if (ctx->inflate_ok) {
+        inflateReset(z);
+    } else {
+        if (inflateInit(z) != Z_OK) {
+            return false;
+        }
+        ctx->inflate_ok = true;
+    }
+
+    z->next_in = (Bytef*)src;
+    z->avail_in = nsrc;
+    z->next_out = dest;
+    z->avail_out = ndest;
+
+    return inflate(z, Z_FINISH) == Z_STREAM_END && z->total_out == ndest;
+}
+#endif
+
+/******************************** LZ4 ****************************************/
+
+#ifdef HAVE_LIBLZ4
+static size_t lz4_bound(size_t nbytes) {
+    return LZ4_compressBound(nbytes);
+}
+
+static size_t lz4_compress(struct codec_context *ctx,
+                           const void *src, size_t nsrc,
+                           void *dest, size_t ndest) {
+    /* The level is used as the acceleration factor (higher is faster) */
+    int acceleration = ctx->level == 0 ? 1 : ctx->level;
+    int r = LZ4_compress_fast(src, dest, nsrc, ndest, acceleration);
+    return r > 0 ? (size_t)r : 0;
+}
+
+static bool lz4_decompress(struct codec_context *ctx,
+                           const void *src, size_t nsrc,
+                           void *dest, size_t ndest) {
+    (void)ctx;
+    return LZ4_decompress_safe(src, dest, nsrc, ndest) == (int)ndest;
+}
+#endif
+
+/******************************** ZSTD ***************************************/
+
+#ifdef HAVE_LIBZSTD
+static size_t zstd_bound(size_t nbytes) {
+    return ZSTD_compressBound(nbytes);
+}
+
+static size_t zstd_compress(struct codec_context *ctx,
+                            const void *src, size_t nsrc,
+                            void *dest, size_t ndest) {
+    size_t r;
+    if (ctx->zstd_cctx == NULL && (ctx->zstd_cctx = ZSTD_createCCtx()) == NULL) {
+        return 0;
+    }
+
+    r = ZSTD_compressCCtx(ctx->zstd_cctx, dest, ndest, src, nsrc, ctx->level);
+    return ZSTD_isError(r) ? 0 : r;
+}
+
+static bool zstd_decompress(struct codec_context *ctx,
+                            const void *src, size_t nsrc,
+                            void *dest, size_t ndest) {
+    size_t r;
+    if (ctx->zstd_dctx == NULL && (ctx->zstd_dctx = ZSTD_createDCtx()) == NULL) {
+        return false;
+    }
+
+    r = ZSTD_decompressDCtx(ctx->zstd_dctx, dest, ndest, src, nsrc);
+    return !ZSTD_isError(r) && r == ndest;
+}
+#endif
+
+static const struct codec codecs[] = {
+#ifdef HAVE_LIBZ
+    { .name = "zlib",
+      .id = CODEC_ZLIB,
+      .bound = zlib_bound,
+      .compress = zlib_compress,
+      .decompress = zlib_decompress },
+#endif
+#ifdef HAVE_LIBLZ4
+    { .name = "lz4",
+      .id = CODEC_LZ4,
+      .bound = lz4_bound,
+      .compress = lz4_compress,
+      .decompress = lz4_decompress },
+#endif
+#ifdef HAVE_LIBZSTD
+    { .name = "zstd",
+      .id = CODEC_ZSTD,
+      .bound = zstd_bound,
+      .compress = zstd_compress,
+      .decompress = zstd_decompress },
+#endif
+    { .name = NULL }
+};
+
+const struct codec *codec_find(const char *name) {
+    const struct codec *codec;
+    for (codec = codecs; codec->name != NULL; ++codec) {
+        if (strcmp(codec->name, name) == 0) {
+            return codec;
+        }
+    }
+    return NULL;
+}
+
+const struct codec *codec_get(uint8_t id) {
+    const struct codec *codec;
+    for (codec = codecs; codec->name != NULL; ++codec) {
+        if (codec->id == id) {
+            return codec;
+        }
+    }
+    return NULL;
+}
+
+struct codec_context *codec_context_create(int level) {
+    struct codec_context *ctx = calloc(1, sizeof(*ctx));
+    if (ctx != NULL) {
+        ctx->level = level;
+    }
+    return ctx;
+}
+
+void codec_context_destroy(struct codec_context *ctx) {
+#ifdef HAVE_LIBZ
+    if (ctx->deflate_ok) {
+        deflateEnd(&ctx->deflate);
+    }
+    if (ctx->inflate_ok) {
+        inflateEnd(&ctx->inflate);
+    }
+#endif
+#ifdef HAVE_LIBZSTD
+    ZSTD_freeCCtx(ctx->zstd_cctx);
+    ZSTD_freeDCtx(ctx->zstd_dctx);
+#endif
+    free(ctx);
+}
@@ -0,0 +1,88 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The compression codecs available for the warm tier (a copy of the
+ * codecs in the compress engine, without the dictionaries). The id of the
+ * codec used for an item is stored in its iflag (see ITEM_CODEC_MASK), so
+ * there is room for three codecs (0 means that the item isn't compressed).
+ */
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+#define CODEC_LZ4  2
+#define CODEC_ZSTD 3
+
+/*
+ * The per thread state used by the codecs (zlib streams etc). A context
+ * may only be used by one thread at a time.
+ */
+struct codec_context;
+
+struct codec {
+    /** The name used to select the codec in the configuration */
+    const char *name;
+    /** The id stored in the items (CODEC_xxx) */
+    uint8_t id;
+    /**
+     * Get the maximum number of bytes a compressed object may use
+     * @param nbytes the size of the uncompressed object
+     */
+    size_t (*bound)(size_t nbytes);
+    /**
+     * Compress an object
+     * @param ctx the context to use
+     * @param src the data to compress
+     * @param nsrc the number of bytes to compress
+     * @param dest where to store the result
+     * @param ndest the size of dest (at least bound(nsrc))
+     * @return the size of the compressed data, or 0 on failure
+     */
+    size_t (*compress)(struct codec_context *ctx,
+                       const void *src, size_t nsrc,
+                       void *dest, size_t ndest);
+    /**
+     * Decompress an object
+     * @param ctx the context to use
+     * @param src the compressed data
+     * @param nsrc the number of bytes of compressed data
+     * @param dest where to store the result
+     * @param ndest the size of the uncompressed object
+     * @return true if we got exactly ndest bytes of data
+     */
+    bool (*decompress)(struct codec_context *ctx,
+                       const void *src, size_t nsrc,
+                       void *dest, size_t ndest);
+};
+
+/**
+ * Look up a codec by name
+ * @param name the name of the codec ("zlib", "lz4" or "zstd")
+ * @return the codec or NULL if it's unknown (or not compiled in)
+ */
+const struct codec *codec_find(const char *name);
+
+/**
+ * Look up a codec by id
+ * @param id the id stored in the item
+ * @return the codec or NULL if it's unknown (or not compiled in)
+ */
+const struct codec *codec_get(uint8_t id);
+
+/**
+ * Create a new codec context
+ * @param level the compression level to use (0 == the codec's default)
+ * @return the new context or NULL if we're out of memory
+ */
+struct codec_context *codec_context_create(int level);
+
+/**
+ * Release all resources used by a codec context
+ * @param ctx the context to destroy
+ */
+void codec_context_destroy(struct codec_context *ctx);
+
+#endif
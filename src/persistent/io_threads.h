@@ -0,0 +1,1062 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The pieces shared by the I/O threads of the storage backends.
+ */
+#ifndef IO_THREADS_H
+#define IO_THREADS_H
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <string>
+#include <map>
+#include <deque>
+#include <vector>
+
+#include "persistent_engine.h"
+
+static inline uint64_t now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * A mutex and a condition variable used to protect (and signal changes
+ * to) a queue shared between the frontend threads and our worker threads.
+ */
+class Monitor {
+public:
+    Monitor() {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    virtual ~Monitor() {
+        pthread_mutex_destroy(&mutex);
+        pthread_cond_destroy(&cond);
+    }
+
+protected:
+    void lock() {
+        int ret;
+        while ((ret = pthread_mutex_lock(&mutex)) == -1) {
+            if (errno != EINTR) {
+                abort();
+            }
+        }
+    }
+
+    void unlock() {
+        int ret;
+        while ((ret = pthread_mutex_unlock(&mutex)) == -1) {
+            if (errno != EINTR) {
+                abort();
+            }
+        }
+    }
+
+    void notify() {
+        int ret;
+        while ((ret = pthread_cond_signal(&cond)) == -1) {
+            if (errno != EINTR) {
+                abort();
+            }
+        }
+    }
+
+    void notifyAll() {
+        int ret;
+        while ((ret = pthread_cond_broadcast(&cond)) == -1) {
+            if (errno != EINTR) {
+                abort();
+            }
+        }
+    }
+
+    void wait() {
+        int ret;
+        while ((ret = pthread_cond_wait(&cond, &mutex)) == -1) {
+            if (errno != EINTR) {
+                abort();
+            }
+        }
+    }
+
+    /**
+     * Wait for a notification, but don't wait past the given time
+     * @param abstime the absolute time to wait until
+     * @return false if we timed out
+     */
+    bool wait(const struct timespec &abstime) {
+        int ret;
+        while ((ret = pthread_cond_timedwait(&cond, &mutex, &abstime)) == -1) {
+            if (errno != EINTR) {
+                abort();
+            }
+        }
+        return ret != ETIMEDOUT;
+    }
+
+    pthread_cond_t cond;
+    pthread_mutex_t mutex;
+};
+
+/**
+ * Statistics collected by the read queue. All members are protected
+ * by the queue's mutex.
+ */
+struct reader_stats {
+    reader_stats() { reset(); queue_depth = 0; }
+
+    void reset() {
+        requests = 0;
+        multi_requests = 0;
+        coalesced = 0;
+        reads = 0;
+        batches = 0;
+        hits = 0;
+        queue_depth_max = 0;
+        read_ahead = 0;
+        read_ahead_items = 0;
+    }
+
+    /** The number of requests from the frontend */
+    uint64_t requests;
+    /** The number of those that were part of a multi-get */
+    uint64_t multi_requests;
+    /** The number of requests that piggybacked on a pending read */
+    uint64_t coalesced;
+    /** The number of keys read from disk */
+    uint64_t reads;
+    /** The number of queries used to read them */
+    uint64_t batches;
+    /** The number of reads that found the item */
+    uint64_t hits;
+    /** The number of keys waiting to be read */
+    uint64_t queue_depth;
+    /** The highest number of keys we've seen waiting to be read */
+    uint64_t queue_depth_max;
+    /** The number of times we read ahead after a key */
+    uint64_t read_ahead;
+    /** The number of items the read ahead added to the cache */
+    uint64_t read_ahead_items;
+};
+
+/**
+ * The queue of keys to read from disk, shared by all of the reader
+ * threads. The requests are keyed by the item key, so that a number of
+ * clients missing the same key results in a single read from disk that
+ * notifies all of them. The keys we don't find are added to the negative
+ * cache.
+ */
+class ReadQueue : public Monitor {
+public:
+    /**
+     * @param se the engine we read the items for
+     * @param name the prefix used for the names of the stats
+     */
+    ReadQueue(struct persistent_engine *se, const char *name)
+        : engine(se), prefix(name) {
+    }
+
+    void enqueue(const void *cookie, const std::string &key) {
+        lock();
+        add(cookie, key);
+        unlock();
+    }
+
+    /**
+     * Queue all of the keys a client is missing from a multi-get. The
+     * client is notified once, when the last of them has been read.
+     */
+    void enqueue(const void *cookie, const std::vector<std::string> &keys) {
+        lock();
+        assert(outstanding.find(cookie) == outstanding.end());
+        outstanding[cookie] = keys.size();
+        stats.multi_requests += keys.size();
+        std::vector<std::string>::const_iterator iter;
+        for (iter = keys.begin(); iter != keys.end(); ++iter) {
+            add(cookie, *iter);
+        }
+        unlock();
+    }
+
+    /**
+     * Get the next keys to read from disk (block until one is available)
+     * @param keys where to store the keys
+     * @param max the maximum number of keys to return
+     */
+    void next(std::vector<std::string> &keys, size_t max) {
+        lock();
+        while (pending.empty()) {
+            wait();
+        }
+        while (!pending.empty() && keys.size() < max) {
+            keys.push_back(pending.front());
+            pending.pop_front();
+        }
+        stats.queue_depth = pending.size();
+        stats.batches++;
+        unlock();
+    }
+
+    /**
+     * We're done reading a key from disk, so get the clients we should
+     * notify. A client waiting for a multi-get is only notified after
+     * the last of its keys.
+     * @param key the key we just read
+     * @param found if the key was found on disk or not
+     * @param wakeup where to add the clients to notify (and the status
+     *               to notify them with)
+     */
+    void complete(const std::string &key, bool found,
+                  std::vector<std::pair<const void*, ENGINE_ERROR_CODE> > &wakeup) {
+        lock();
+        std::map<std::string, read_request>::iterator iter;
+        iter = requests.find(key);
+        assert(iter != requests.end());
+        if (!found) {
+            negative_cache_add(engine, iter->second.hv, key.data(),
+                               key.length(), iter->second.ticket);
+        }
+        std::vector<const void*>::iterator w;
+        for (w = iter->second.cookies.begin(); w != iter->second.cookies.end(); ++w) {
+            std::map<const void*, size_t>::iterator o = outstanding.find(*w);
+            if (o == outstanding.end()) {
+                wakeup.push_back(std::make_pair(*w, found ? ENGINE_SUCCESS :
+                                                ENGINE_KEY_ENOENT));
+            } else if (--o->second == 0) {
+                outstanding.erase(o);
+                wakeup.push_back(std::make_pair(*w, ENGINE_SUCCESS));
+            }
+        }
+        requests.erase(iter);
+        stats.reads++;
+        if (found) {
+            stats.hits++;
+        }
+        unlock();
+    }
+
+    void addStats(ADD_STAT add_stat, const void *cookie) {
+        lock();
+        reader_stats s = stats;
+        unlock();
+
+        addStat(add_stat, cookie, "_read_requests", s.requests);
+        addStat(add_stat, cookie, "_read_multi", s.multi_requests);
+        addStat(add_stat, cookie, "_read_coalesced", s.coalesced);
+        addStat(add_stat, cookie, "_reads", s.reads);
+        addStat(add_stat, cookie, "_read_batches", s.batches);
+        addStat(add_stat, cookie, "_read_hits", s.hits);
+        addStat(add_stat, cookie, "_read_queue_depth", s.queue_depth);
+        addStat(add_stat, cookie, "_read_queue_depth_max", s.queue_depth_max);
+        if (engine->config.read_ahead > 0) {
+            addStat(add_stat, cookie, "_read_ahead", s.read_ahead);
+            addStat(add_stat, cookie, "_read_ahead_items", s.read_ahead_items);
+        }
+    }
+
+    /**
+     * Get the prefix the keys we read ahead after a key must share with
+     * it: everything up to (and including) the last delimiter.
+     * @return false if we shouldn't read ahead after this key
+     */
+    bool readAheadPrefix(const std::string &key, std::string &pfx) {
+        const char *delimiter = engine->config.read_ahead_delimiter;
+        if (engine->config.read_ahead == 0 || delimiter == NULL ||
+            *delimiter == '\0') {
+            return false;
+        }
+        size_t pos = key.rfind(delimiter);
+        if (pos == std::string::npos) {
+            return false;
+        }
+        pfx.assign(key, 0, pos + strlen(delimiter));
+        return true;
+    }
+
+    /** Count a read ahead that added nitems items to the cache */
+    void readAhead(size_t nitems) {
+        lock();
+        stats.read_ahead++;
+        stats.read_ahead_items += nitems;
+        unlock();
+    }
+
+    void resetStats() {
+        lock();
+        stats.reset();
+        unlock();
+    }
+
+private:
+    void addStat(ADD_STAT add_stat, const void *cookie, const char *name,
+                 uint64_t value) {
+        std::string key(prefix);
+        key.append(name);
+        add_statistics(cookie, add_stat, NULL, -1, key.c_str(), "%llu",
+                       (unsigned long long)value);
+    }
+
+    /** Add a request for a key (the caller must hold the lock) */
+    void add(const void *cookie, const std::string &key) {
+        stats.requests++;
+        std::map<std::string, read_request>::iterator iter;
+        iter = requests.find(key);
+        if (iter != requests.end()) {
+            /* Someone is already waiting for this key */
+            iter->second.cookies.push_back(cookie);
+            stats.coalesced++;
+        } else {
+            read_request &r = requests[key];
+            r.cookies.push_back(cookie);
+            /* Stores from now on invalidate the miss we may add */
+            r.hv = engine->server.hash(key.data(), key.length(), 0);
+            r.ticket = negative_cache_ticket(engine, r.hv);
+            pending.push_back(key);
+            stats.queue_depth = pending.size();
+            if (stats.queue_depth > stats.queue_depth_max) {
+                stats.queue_depth_max = stats.queue_depth;
+            }
+            notify();
+        }
+    }
+
+    struct read_request {
+        /** The clients waiting for the key */
+        std::vector<const void*> cookies;
+        /** The hash of the key */
+        uint32_t hv;
+        /** The version of its negative cache slot when it was requested */
+        uint32_t ticket;
+    };
+
+    struct persistent_engine *engine;
+    /** All of the clients waiting for a key (pending or being read) */
+    std::map<std::string, read_request> requests;
+    /** The number of keys each multi-get client is still waiting for */
+    std::map<const void*, size_t> outstanding;
+    /** The keys not picked up by a reader yet (in the order requested) */
+    std::deque<std::string> pending;
+    struct reader_stats stats;
+    const char *prefix;
+};
+
+/**
+ * The writes we take from the write queue in one go
+ */
+struct write_batch {
+    write_batch() : bytes(0), cas(0), generation(0), flushed(false) {}
+
+    /** The items to store, or NULL to remove the key from disk */
+    std::vector<std::pair<std::string, hash_item*> > items;
+    /** Items we don't have to write (just release them) */
+    std::vector<hash_item*> replaced;
+    /** The number of bytes the items used of the queue's budget */
+    size_t bytes;
+    /** A new CAS limit to persist (0 if none) */
+    uint64_t cas;
+    /** The flush generation to store the items with */
+    uint32_t generation;
+    /** The generation was bumped since the previous batch */
+    bool flushed;
+};
+
+/**
+ * A slot in the ring of writes. The sequence number tells who owns it:
+ * the slot is free for the write at position pos when sequence == pos,
+ * and holds that write when sequence == pos + 1.
+ */
+struct write_slot {
+    volatile uint64_t sequence;
+    /** The item to store (NULL to remove the key) */
+    hash_item *item;
+    /** The key to remove (malloc'ed, NULL for a store) */
+    char *key;
+    uint16_t nkey;
+    /** The flush generation when the write was queued */
+    uint32_t generation;
+};
+
+/* What the writer thread is waiting for (see WriteQueue::wakeWriter) */
+#define WRITER_AWAKE 0
+#define WRITER_IDLE 1
+#define WRITER_FILLING 2
+
+/* How long (in ms) the writer waits before it writes a failed batch again */
+#define WRITE_RETRY_INTERVAL_MS 1000
+
+/**
+ * The queue of writes waiting for the writer thread of a backend.
+ *
+ * The frontend threads add the writes to a bounded ring without taking
+ * a lock (there is a single consumer: the writer thread). A queued item
+ * holds a reference, so the queue is also bounded by the number of bytes
+ * of the items in it (write_queue_bytes). When the queue is full we mark
+ * the item ITEM_DIRTY instead and let the writer pick it up by scanning
+ * the LRUs. A dirty item doesn't hold a reference, so it's freed as soon
+ * as it's replaced or deleted (but it isn't evicted until it's written).
+ * Removes always go through the ring, as there is no item to mark, so a
+ * delete fails if the ring is full.
+ *
+ * Each key is only written once per batch: a store or a remove replaces
+ * the write already in the batch for the key.
+ *
+ * flush_all bumps the flush generation. The readers (and the warmup)
+ * ignore everything stored with an older generation, so the old data
+ * doesn't have to be removed before the flush completes.
+ *
+ * A batch the backend fails to write is handed back with retry(), and
+ * written again before anything queued after it.
+ */
+class WriteQueue : public Monitor {
+public:
+    WriteQueue(struct persistent_engine* se)
+        : batchSize(se->config.write_batch_size), owner(se), ring(NULL),
+          mask(0), enqueuePos(0), dequeuePos(0), queuedBytes(0),
+          byteLimit(se->config.write_queue_bytes), queueDepthMax(0),
+          queuedBytesMax(0), dirtyQueued(0), dirtyWritten(0), removesFailed(0),
+          sleeping(WRITER_AWAKE), dirty(false), scanning(false),
+          scanUntil(0), scanGeneration(0),
+          batchInterval(se->config.write_batch_interval_ms),
+          pendingCas(0), generation(0), pendingFlush(false), flushAt(0),
+          retrying(false), retryAt(0) {
+        if (batchSize == 0) {
+            batchSize = 1;
+        }
+
+        /* The ring size must be a power of two */
+        size_t size = 2;
+        while (size < se->config.write_queue_items) {
+            size <<= 1;
+        }
+        ring = new write_slot[size];
+        mask = size - 1;
+        for (size_t ii = 0; ii < size; ++ii) {
+            ring[ii].sequence = ii;
+        }
+    }
+
+    ~WriteQueue() {
+        delete []ring;
+    }
+
+    /**
+     * Queue an item to be stored (we keep a reference until it's written).
+     * Called with the item lock held.
+     */
+    void enqueue(hash_item* item) {
+        size_t size = itemSize(item);
+        size_t bytes = __sync_add_and_fetch(&queuedBytes, size);
+        /* An item larger than the budget may still use an empty queue */
+        if ((bytes > byteLimit && bytes != size) || !put(item, NULL, 0)) {
+            __sync_sub_and_fetch(&queuedBytes, size);
+            item->iflag |= ITEM_DIRTY;
+            __sync_add_and_fetch(&dirtyQueued, 1);
+            if (!dirty) {
+                dirty = true;
+                wakeWriter(batchSize);
+            }
+        } else if (bytes > queuedBytesMax) {
+            queuedBytesMax = bytes;
+        }
+    }
+
+    /**
+     * Queue a key to be removed from disk. Called with the item lock held,
+     * so we don't wait for a slot if the writer is behind: the caller
+     * fails the delete instead (ENGINE_TMPFAIL).
+     */
+    ENGINE_ERROR_CODE remove(const void *key, uint16_t nkey) {
+        char *copy = static_cast<char*>(malloc(nkey));
+        if (copy == NULL) {
+            return ENGINE_ENOMEM;
+        }
+        memcpy(copy, key, nkey);
+        if (!put(NULL, copy, nkey)) {
+            free(copy);
+            __sync_add_and_fetch(&removesFailed, 1);
+            wakeWriter(batchSize);
+            return ENGINE_TMPFAIL;
+        }
+        return ENGINE_SUCCESS;
+    }
+
+    void reserveCas(uint64_t limit) {
+        lock();
+        if (limit > pendingCas) {
+            pendingCas = limit;
+            notify();
+        }
+        unlock();
+    }
+
+    /**
+     * Invalidate everything stored on disk
+     * @param when when the flush takes effect (an absolute time, 0 == now)
+     */
+    void flush(time_t when) {
+        lock();
+        if (when <= time(NULL)) {
+            bumpGeneration();
+        } else {
+            flushAt = when;
+        }
+        notify();
+        unlock();
+    }
+
+    /** The generation the readers may use data from */
+    uint32_t currentGeneration() const {
+        return generation;
+    }
+
+protected:
+    /**
+     * Continue with the generation stored by the previous run (called
+     * before the threads are started)
+     */
+    void setGeneration(uint32_t gen) {
+        generation = gen;
+    }
+
+    /**
+     * Wait for the next batch of writes, until we've got a full batch or
+     * the writes have waited for write_batch_interval_ms
+     * @param batch where to store the batch (must be empty)
+     * @param deadline return an empty batch if there is nothing to do by
+     *                 this time (in usec, 0 == wait forever)
+     */
+    void next(write_batch &batch, uint64_t deadline) {
+        if (retrying) {
+            takeRetry(batch, deadline);
+            return;
+        }
+
+        lock();
+        if (!scanning) {
+            waitForBatch(deadline);
+        }
+        batch.cas = pendingCas;
+        batch.generation = generation;
+        batch.flushed = pendingFlush;
+        pendingCas = 0;
+        pendingFlush = false;
+        unlock();
+
+        if (!scanning && dirty) {
+            scanDirty(batch.generation);
+        }
+
+        /*
+         * The dirty items are newer than the writes queued before the
+         * scan, and older than the ones queued after it
+         */
+        if (scanning && dequeuePos == scanUntil) {
+            takeDirty(batch);
+        } else {
+            take(batch, scanning ? scanUntil : ~(uint64_t)0);
+        }
+    }
+
+    /**
+     * Release the items of a batch we're done with, and give their bytes
+     * back to the queue
+     */
+    void complete(write_batch &batch) {
+        ENGINE_HANDLE *handle = reinterpret_cast<ENGINE_HANDLE*>(&owner->engine);
+        std::vector<std::pair<std::string, hash_item*> >::iterator iter;
+        for (iter = batch.items.begin(); iter != batch.items.end(); ++iter) {
+            if (iter->second != NULL) {
+                owner->engine.release(handle, NULL, iter->second);
+            }
+        }
+        std::vector<hash_item*>::iterator r;
+        for (r = batch.replaced.begin(); r != batch.replaced.end(); ++r) {
+            owner->engine.release(handle, NULL, *r);
+        }
+        if (batch.bytes != 0) {
+            __sync_sub_and_fetch(&queuedBytes, batch.bytes);
+        }
+        batch.items.clear();
+        batch.replaced.clear();
+        batch.bytes = 0;
+    }
+
+    /**
+     * Keep a batch we failed to write, so next() returns it again (after
+     * WRITE_RETRY_INTERVAL_MS) before any of the writes queued after it.
+     * The items keep their references until then. Leaves the batch empty.
+     */
+    void retry(write_batch &batch) {
+        assert(!retrying);
+        swapBatch(failed, batch);
+        retrying = true;
+        retryAt = now_usec() + WRITE_RETRY_INTERVAL_MS * 1000;
+    }
+
+    /** The number of writes in the ring */
+    size_t queueDepth() const {
+        return enqueuePos - dequeuePos;
+    }
+
+    void addQueueStats(ADD_STAT add_stat, const void *cookie,
+                       const char *prefix) {
+        addStat(add_stat, cookie, prefix, "_write_queue_depth", queueDepth());
+        addStat(add_stat, cookie, prefix, "_write_queue_depth_max",
+                queueDepthMax);
+        addStat(add_stat, cookie, prefix, "_write_queue_bytes", queuedBytes);
+        addStat(add_stat, cookie, prefix, "_write_queue_bytes_max",
+                queuedBytesMax);
+        addStat(add_stat, cookie, prefix, "_write_queue_bytes_limit",
+                byteLimit);
+        addStat(add_stat, cookie, prefix, "_write_queue_dirty", dirtyQueued);
+        addStat(add_stat, cookie, prefix, "_write_dirty_items", dirtyWritten);
+        addStat(add_stat, cookie, prefix, "_write_queue_removes_failed",
+                removesFailed);
+    }
+
+    void resetQueueStats() {
+        queueDepthMax = queueDepth();
+        queuedBytesMax = queuedBytes;
+        dirtyQueued = 0;
+        dirtyWritten = 0;
+        removesFailed = 0;
+    }
+
+    /** The number of items per batch */
+    size_t batchSize;
+
+private:
+    static void addStat(ADD_STAT add_stat, const void *cookie,
+                        const char *prefix, const char *name, uint64_t value) {
+        std::string key(prefix);
+        key.append(name);
+        add_statistics(cookie, add_stat, NULL, -1, key.c_str(), "%llu",
+                       (unsigned long long)value);
+    }
+
+    /** The number of bytes an item uses in the slabs */
+    static size_t itemSize(const hash_item *item) {
+        size_t ret = sizeof(*item) + item->nkey + item->nbytes;
+        if (item->iflag & ITEM_WITH_CAS) {
+            ret += sizeof(uint64_t);
+        }
+        return ret;
+    }
+
+    /**
+     * Add a write to the ring
+     * @return false if the ring is full
+     */
+    bool put(hash_item *item, char *key, uint16_t nkey) {
+        write_slot *slot;
+        uint64_t pos = enqueuePos;
+        while (true) {
+            slot = &ring[pos & mask];
+            int64_t diff = (int64_t)(slot->sequence - pos);
+            if (diff == 0) {
+                if (__sync_bool_compare_and_swap(&enqueuePos, pos, pos + 1)) {
+                    break;
+                }
+                pos = enqueuePos;
+            } else if (diff < 0) {
+                /* The writer hasn't taken the write a lap ago yet */
+                return false;
+            } else {
+                /* Another thread got the slot first */
+                pos = enqueuePos;
+            }
+        }
+
+        if (item != NULL) {
+            __sync_add_and_fetch(&item->refcount, 1);
+        }
+        slot->item = item;
+        slot->key = key;
+        slot->nkey = nkey;
+        slot->generation = generation;
+        __sync_synchronize();
+        slot->sequence = pos + 1;
+
+        uint64_t depth = pos + 1 - dequeuePos;
+        if (depth > queueDepthMax) {
+            queueDepthMax = depth;
+        }
+        wakeWriter(depth);
+        return true;
+    }
+
+    /**
+     * Notify the writer if it's waiting for us. It sets sleeping before it
+     * looks at the ring for the last time, so either it sees our write or
+     * we see that it's sleeping.
+     */
+    void wakeWriter(uint64_t depth) {
+        __sync_synchronize();
+        int s = sleeping;
+        if (s == WRITER_IDLE || (s == WRITER_FILLING && depth >= batchSize)) {
+            lock();
+            notify();
+            unlock();
+        }
+    }
+
+    /** Is the write at the head of the ring ready? */
+    bool available() const {
+        return ring[dequeuePos & mask].sequence == dequeuePos + 1;
+    }
+
+    /**
+     * Take the writes from the ring (up to the position limit), and drop
+     * the ones queued before the last flush
+     */
+    void take(write_batch &batch, uint64_t limit) {
+        std::map<std::string, size_t> seen;
+        while (batch.items.size() < batchSize && dequeuePos < limit &&
+               available()) {
+            write_slot *slot = &ring[dequeuePos & mask];
+            __sync_synchronize();
+            if (slot->generation > batch.generation) {
+                /* Queued after a flush the batch doesn't include */
+                break;
+            }
+
+            hash_item *it = slot->item;
+            char *key = slot->key;
+            uint16_t nkey = slot->nkey;
+            bool old = slot->generation != batch.generation;
+            __sync_synchronize();
+            slot->sequence = dequeuePos + mask + 1;
+            ++dequeuePos;
+
+            std::string k;
+            if (it != NULL) {
+                batch.bytes += itemSize(it);
+                if (old) {
+                    batch.replaced.push_back(it);
+                    continue;
+                }
+                k.assign(item_get_key(it), it->nkey);
+            } else {
+                if (!old) {
+                    k.assign(key, nkey);
+                }
+                free(key);
+                if (old) {
+                    continue;
+                }
+            }
+
+            std::map<std::string, size_t>::iterator iter = seen.find(k);
+            if (iter != seen.end()) {
+                hash_item *prev = batch.items[iter->second].second;
+                if (prev != NULL) {
+                    batch.replaced.push_back(prev);
+                }
+                batch.items[iter->second].second = it;
+            } else {
+                seen[k] = batch.items.size();
+                batch.items.push_back(std::make_pair(k, it));
+            }
+        }
+    }
+
+    static void collectDirty(hash_item *it, void *arg) {
+        static_cast<std::deque<hash_item*>*>(arg)->push_back(it);
+    }
+
+    /**
+     * Pick up the dirty items. They're written once we've written the
+     * writes queued before the scan.
+     */
+    void scanDirty(uint32_t gen) {
+        dirty = false;
+        __sync_synchronize();
+        scanUntil = enqueuePos;
+        scanGeneration = gen;
+        if (!item_collect_dirty(owner, collectDirty, &dirtyItems)) {
+            /* We couldn't lock some of them, so try again later */
+            dirty = true;
+        }
+        scanning = true;
+    }
+
+    /** Take the next batch of dirty items */
+    void takeDirty(write_batch &batch) {
+        while (!dirtyItems.empty() && batch.items.size() < batchSize) {
+            hash_item *it = dirtyItems.front();
+            dirtyItems.pop_front();
+            if (scanGeneration != batch.generation) {
+                /* They were flushed after we picked them up */
+                batch.replaced.push_back(it);
+            } else {
+                batch.items.push_back(std::make_pair(
+                    std::string(item_get_key(it), it->nkey), it));
+            }
+        }
+        dirtyWritten += batch.items.size();
+        if (dirtyItems.empty()) {
+            scanning = false;
+        }
+    }
+
+    static void swapBatch(write_batch &a, write_batch &b) {
+        a.items.swap(b.items);
+        a.replaced.swap(b.replaced);
+        std::swap(a.bytes, b.bytes);
+        std::swap(a.cas, b.cas);
+        std::swap(a.generation, b.generation);
+        std::swap(a.flushed, b.flushed);
+    }
+
+    /**
+     * Give the failed batch back to the writer once it has waited long
+     * enough (see next()), with the CAS limit and flush that came in since
+     */
+    void takeRetry(write_batch &batch, uint64_t deadline) {
+        lock();
+        uint64_t until = retryAt;
+        if (deadline != 0 && deadline < until) {
+            until = deadline;
+        }
+        if (now_usec() < until) {
+            wait(abstime(until));
+        }
+        if (now_usec() < retryAt) {
+            unlock();
+            return;
+        }
+
+        swapBatch(batch, failed);
+        retrying = false;
+        if (pendingCas > batch.cas) {
+            batch.cas = pendingCas;
+        }
+        if (batch.generation != generation) {
+            /* The writes were flushed meanwhile, so only the flush is left */
+            std::vector<std::pair<std::string, hash_item*> >::iterator iter;
+            for (iter = batch.items.begin(); iter != batch.items.end(); ++iter) {
+                if (iter->second != NULL) {
+                    batch.replaced.push_back(iter->second);
+                }
+            }
+            batch.items.clear();
+            batch.generation = generation;
+            batch.flushed = true;
+        }
+        batch.flushed = batch.flushed || pendingFlush;
+        pendingCas = 0;
+        pendingFlush = false;
+        unlock();
+    }
+
+    /** Start a new generation (the caller holds the lock) */
+    void bumpGeneration() {
+        __sync_synchronize();
+        ++generation;
+        pendingFlush = true;
+        flushAt = 0;
+    }
+
+    static struct timespec abstime(uint64_t usec) {
+        struct timespec ts;
+        ts.tv_sec = usec / 1000000;
+        ts.tv_nsec = (usec % 1000000) * 1000;
+        return ts;
+    }
+
+    /** Is there anything for the writer to do? (called with the lock held) */
+    bool haveWork() const {
+        return available() || dirty || pendingCas != 0 || pendingFlush;
+    }
+
+    /** See next() (called with the lock held) */
+    void waitForBatch(uint64_t deadline) {
+        bool waited = false;
+        while (!haveWork()) {
+            if (flushAt != 0 && time(NULL) >= flushAt) {
+                bumpGeneration();
+                break;
+            }
+            uint64_t until = deadline;
+            if (flushAt != 0 &&
+                (until == 0 || (uint64_t)flushAt * 1000000 < until)) {
+                until = (uint64_t)flushAt * 1000000;
+            }
+
+            sleeping = WRITER_IDLE;
+            __sync_synchronize();
+            if (haveWork()) {
+                sleeping = WRITER_AWAKE;
+                break;
+            }
+            bool notified = true;
+            if (until == 0) {
+                wait();
+            } else {
+                notified = wait(abstime(until));
+            }
+            sleeping = WRITER_AWAKE;
+            waited = true;
+            if (!notified && until == deadline) {
+                return;
+            }
+        }
+
+        /*
+         * Writes that queued up while we wrote the previous batch have
+         * waited long enough. Don't keep the frontend threads waiting for
+         * a new CAS limit either.
+         */
+        if (!waited || batchInterval == 0 || pendingCas != 0 ||
+            pendingFlush) {
+            return;
+        }
+
+        struct timespec ts = abstime(now_usec() + batchInterval * 1000);
+        while (queueDepth() < batchSize && pendingCas == 0) {
+            sleeping = WRITER_FILLING;
+            __sync_synchronize();
+            if (queueDepth() >= batchSize || !wait(ts)) {
+                break;
+            }
+        }
+        sleeping = WRITER_AWAKE;
+    }
+
+    struct persistent_engine *owner;
+    write_slot *ring;
+    uint64_t mask;
+    /** The position of the next write (claimed by the frontend threads) */
+    volatile uint64_t enqueuePos;
+    /** The position of the next write to take (only moved by the writer) */
+    volatile uint64_t dequeuePos;
+    /** The bytes of the items in the queue (updated with atomic operations) */
+    volatile size_t queuedBytes;
+    size_t byteLimit;
+    /* The stats below are updated without a lock (so they may be off) */
+    uint64_t queueDepthMax;
+    size_t queuedBytesMax;
+    /** The number of items we marked dirty because the queue was full */
+    volatile uint64_t dirtyQueued;
+    /** The number of dirty items the writer picked up */
+    uint64_t dirtyWritten;
+    /** The number of deletes we failed because the queue was full */
+    volatile uint64_t removesFailed;
+    /** What the writer waits for (WRITER_AWAKE if it isn't waiting) */
+    volatile int sleeping;
+    /** There are dirty items in the cache */
+    volatile bool dirty;
+    /* The state of the dirty scan (only used by the writer) */
+    bool scanning;
+    uint64_t scanUntil;
+    uint32_t scanGeneration;
+    std::deque<hash_item*> dirtyItems;
+    /** The longest time (in ms) to wait for a batch to fill up */
+    size_t batchInterval;
+    /** A CAS limit waiting to be written (0 if none) */
+    uint64_t pendingCas;
+    volatile uint32_t generation;
+    /** The generation was bumped, but not written yet */
+    bool pendingFlush;
+    /** When a delayed flush_all takes effect (0 if none) */
+    time_t flushAt;
+    /* A batch we failed to write (only used by the writer) */
+    write_batch failed;
+    bool retrying;
+    /** When to write the failed batch again (in usec) */
+    uint64_t retryAt;
+};
+
+/**
+ * Convert the expiry time of an item to the absolute time we store on
+ * disk, so that it survives a restart
+ * @param engine the engine the item belongs to
+ * @param exptime the expiry time of the item (0 == never)
+ * @return the absolute expiry time (0 == never)
+ */
+static inline uint32_t disk_exptime(struct persistent_engine *engine,
+                                    rel_time_t exptime) {
+    if (exptime == 0) {
+        return 0;
+    }
+    return (uint32_t)(time(NULL) +
+                      ((int64_t)exptime - engine->server.get_current_time()));
+}
+
+/**
+ * Get the value of an item in one piece
+ * @param it the item
+ * @param buffer where to copy the value of a chained item to
+ * @return the value
+ */
+static inline const char *item_value(const hash_item *it,
+                                     std::vector<char> &buffer) {
+    if ((it->iflag & ITEM_CHAINED) == 0) {
+        return item_get_data(it);
+    }
+    buffer.resize(it->nbytes);
+    item_read_value(it, 0, &buffer[0], it->nbytes);
+    return &buffer[0];
+}
+
+/** Check if we already have a key in memory (so there is no need to read it) */
+static inline bool in_cache(struct persistent_engine *engine,
+                            const std::string &key) {
+    hash_item *it = item_get(engine, key.data(), key.length());
+    if (it == NULL) {
+        return false;
+    }
+    item_release(engine, it);
+    return true;
+}
+
+/**
+ * Add an item read from disk to the cache (unless someone stored the key
+ * while we read it).
+ * @param engine the engine to add the item to
+ * @param key the key of the item
+ * @param flags the flags stored with the item
+ * @param exptime the expiry time stored with the item (see disk_exptime)
+ * @param data the value of the item
+ * @param nbytes the number of bytes in the value
+ * @param prefetch nobody is waiting for the item (see item_alloc_disk)
+ * @return true if we could allocate the item (false if it has expired)
+ */
+static inline bool load_item(struct persistent_engine *engine,
+                             const std::string &key, int flags,
+                             uint32_t exptime,
+                             const void *data, size_t nbytes,
+                             bool prefetch = false) {
+    rel_time_t rel = 0;
+    if (exptime != 0) {
+        time_t now = time(NULL);
+        if ((time_t)exptime <= now) {
+            return false;
+        }
+        rel = engine->server.get_current_time() + (rel_time_t)(exptime - now);
+    }
+    hash_item *itm = item_alloc_disk(engine, key.c_str(), key.length(),
+                                     flags, rel, nbytes, prefetch);
+    if (itm == NULL) {
+        return false;
+    }
+
+    item_write_value(itm, 0, data, nbytes);
+    uint64_t cas;
+    store_item(engine, itm, &cas, OPERATION_ADD, false, NULL);
+    item_release(engine, itm);
+    return true;
+}
+
+#endif
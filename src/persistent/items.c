@@ -7,6 +7,7 @@
 #include <sys/socket.h>
 #include <sys/signal.h>
 #include <sys/resource.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #endif
 
@@ -18,6 +19,7 @@
 #include <time.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include "persistent_engine.h"
 
@@ -28,15 +30,18 @@ static hash_item *do_item_alloc(struct persistent_engine *engine,
                                 const void *key, const size_t nkey,
                                 const int flags, const rel_time_t exptime,
                                 const int nbytes,
-                                const void *cookie);
+                                const void *cookie, const bool optional);
 static hash_item *do_item_get(struct persistent_engine *engine,
-                              const char *key, const size_t nkey);
-static int do_item_link(struct persistent_engine *engine, hash_item *it);
-static void do_item_unlink(struct persistent_engine *engine, hash_item *it);
+                              const char *key, const size_t nkey,
+                              uint32_t hv);
+static int do_item_link(struct persistent_engine *engine, hash_item *it, uint32_t hv);
+static void do_item_unlink(struct persistent_engine *engine, hash_item *it, uint32_t hv);
+static void do_item_unlink_nolock(struct persistent_engine *engine, hash_item *it,
+                                  uint32_t hv);
 static void do_item_release(struct persistent_engine *engine, hash_item *it);
 static void do_item_update(struct persistent_engine *engine, hash_item *it);
 static int do_item_replace(struct persistent_engine *engine,
-                            hash_item *it, hash_item *new_it);
+                            hash_item *it, hash_item *new_it, uint32_t hv);
 static void item_free(struct persistent_engine *engine, hash_item *it);
 
 
@@ -47,10 +52,134 @@ static void item_free(struct persistent_engine *engine, hash_item *it);
  */
 #define ITEM_UPDATE_INTERVAL 60
 
+/* The number of CAS ids a thread reserves at a time */
+#define CAS_BLOCK_SIZE 1024
+
+/*
+ * How far ahead of the CAS ids in use we persist the limit (so we don't
+ * have to wait for the database every time a thread needs a new block)
+ */
+#define CAS_RESERVE (1 << 24)
+
+/* How long a store waits for the writer to persist the CAS limit */
+#define CAS_WAIT_SEC 1
+
+/* The block of CAS ids reserved by a thread */
+struct cas_block {
+    uint64_t next;
+    uint64_t end;
+};
+
+/*
+ * Warm items (marked with the codec in ITEM_CODEC_MASK) start with the
+ * length of the uncompressed data (in network byte order), followed by
+ * the compressed data.
+ */
+#define COMPRESS_HEADER_SIZE sizeof(uint32_t)
+
+/*
+ * Setting up the codecs (zlib streams etc) costs more than compressing
+ * most of our values, so each thread keeps its own codec context (and
+ * the scratch buffer used while compressing) and reuses it.
+ */
+struct compressor {
+    struct compressor *next;
+    struct persistent_engine *engine;
+    struct codec_context *ctx;
+    char *buffer;
+    size_t buffersize;
+};
+
+static void compressor_free(struct compressor *c) {
+    codec_context_destroy(c->ctx);
+    free(c->buffer);
+    free(c);
+}
+
+/*
+ * Called by pthreads when a thread that used the engine terminates.
+ */
+static void compressor_release(void *arg) {
+    struct compressor *c = arg;
+    struct items *items = &c->engine->items;
+    struct compressor **pp;
+
+    pthread_mutex_lock(&items->compressors_lock);
+    for (pp = &items->compressors; *pp != c; pp = &(*pp)->next) {
+        /* empty */
+    }
+    *pp = c->next;
+    pthread_mutex_unlock(&items->compressors_lock);
+    compressor_free(c);
+}
+
+static struct compressor *get_compressor(struct persistent_engine *engine) {
+    struct compressor *c = pthread_getspecific(engine->items.compressors_key);
+    if (c == NULL) {
+        if ((c = calloc(1, sizeof(*c))) == NULL) {
+            return NULL;
+        }
+        c->engine = engine;
+        c->ctx = codec_context_create(engine->config.compression_level);
+        if (c->ctx == NULL) {
+            free(c);
+            return NULL;
+        }
+        if (pthread_setspecific(engine->items.compressors_key, c) != 0) {
+            compressor_free(c);
+            return NULL;
+        }
+
+        pthread_mutex_lock(&engine->items.compressors_lock);
+        c->next = engine->items.compressors;
+        engine->items.compressors = c;
+        pthread_mutex_unlock(&engine->items.compressors_lock);
+    }
+    return c;
+}
+
+ENGINE_ERROR_CODE item_init(struct persistent_engine *engine) {
+    int ii;
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        pthread_mutex_init(&engine->items.lru_locks[ii], NULL);
+    }
+
+    if (pthread_key_create(&engine->items.cas_key, free) != 0) {
+        return ENGINE_FAILED;
+    }
+    if (pthread_key_create(&engine->items.compressors_key,
+                           compressor_release) != 0) {
+        return ENGINE_FAILED;
+    }
+    pthread_mutex_init(&engine->items.compressors_lock, NULL);
+    engine->items.compressors = NULL;
+    pthread_mutex_init(&engine->items.cas_lock, NULL);
+    pthread_cond_init(&engine->items.cas_cond, NULL);
+
+    return ENGINE_SUCCESS;
+}
+
+void item_destroy(struct persistent_engine *engine) {
+    /* The destructor isn't called for deleted keys, so free them all here */
+    pthread_key_delete(engine->items.compressors_key);
+    while (engine->items.compressors != NULL) {
+        struct compressor *next = engine->items.compressors->next;
+        compressor_free(engine->items.compressors);
+        engine->items.compressors = next;
+    }
+    pthread_mutex_destroy(&engine->items.compressors_lock);
+    pthread_cond_destroy(&engine->items.cas_cond);
+    pthread_mutex_destroy(&engine->items.cas_lock);
+}
+
 void item_stats_reset(struct persistent_engine *engine) {
-    pthread_mutex_lock(&engine->cache_lock);
-    memset(engine->items.itemstats, 0, sizeof(engine->items.itemstats));
-    pthread_mutex_unlock(&engine->cache_lock);
+    int ii;
+    for (ii = 0; ii < POWER_LARGEST; ++ii) {
+        pthread_mutex_lock(&engine->items.lru_locks[ii]);
+        memset(&engine->items.itemstats[ii], 0,
+               sizeof(engine->items.itemstats[ii]));
+        pthread_mutex_unlock(&engine->items.lru_locks[ii]);
+    }
 }
 
 
@@ -65,42 +194,319 @@ static inline size_t ITEM_ntotal(struct persistent_engine *engine,
     return ret;
 }
 
-/* Get the next CAS id for a new item. */
-static uint64_t get_cas_id(void) {
-    static uint64_t cas_id = 0;
-    return ++cas_id;
+void item_set_cas_limit(struct persistent_engine *engine, uint64_t limit) {
+    pthread_mutex_lock(&engine->items.cas_lock);
+    engine->items.cas_limit = limit;
+    pthread_cond_broadcast(&engine->items.cas_cond);
+    pthread_mutex_unlock(&engine->items.cas_lock);
 }
 
-/*@null@*/
-hash_item *do_item_alloc(struct persistent_engine *engine,
-                         const void *key,
-                         const size_t nkey,
-                         const int flags,
-                         const rel_time_t exptime,
-                         const int nbytes,
-                         const void *cookie) {
-    hash_item *it = NULL;
-    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
-    if (engine->config.use_cas) {
-        ntotal += sizeof(uint64_t);
+/* Wait (at most CAS_WAIT_SEC) for the writer to persist a limit of last */
+static bool cas_wait_limit(struct persistent_engine *engine, uint64_t last) {
+    struct timespec deadline;
+    bool ret = true;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CAS_WAIT_SEC;
+
+    pthread_mutex_lock(&engine->items.cas_lock);
+    while (last > engine->items.cas_limit && ret) {
+        if (pthread_cond_timedwait(&engine->items.cas_cond,
+                                   &engine->items.cas_lock,
+                                   &deadline) == ETIMEDOUT) {
+            ret = last <= engine->items.cas_limit;
+        }
     }
+    pthread_mutex_unlock(&engine->items.cas_lock);
+    return ret;
+}
 
-    unsigned int id = slabs_clsid(engine, ntotal);
-    if (id == 0)
+/*
+ * Reserve a block of CAS ids for the calling thread. The ids must stay
+ * unique across restarts, so we never hand out an id above the limit
+ * stored in the database, and ask the writer to move the limit before we
+ * get there. If the writer fell behind we wait for it (when we may block),
+ * and give up if it doesn't catch up in time (the ids we took are just
+ * skipped).
+ */
+static bool cas_reserve_block(struct persistent_engine *engine,
+                              struct cas_block *b, bool wait) {
+    uint64_t last = __sync_add_and_fetch(&engine->items.cas_id, CAS_BLOCK_SIZE);
+
+    if (last + CAS_RESERVE / 2 > engine->items.cas_limit) {
+        engine->storage->reserve_cas(engine, last + CAS_RESERVE);
+    }
+
+    if (last > engine->items.cas_limit &&
+        (!wait || !cas_wait_limit(engine, last))) {
+        return false;
+    }
+
+    b->next = last - CAS_BLOCK_SIZE + 1;
+    b->end = last + 1;
+    return true;
+}
+
+static struct cas_block *get_cas_block(struct persistent_engine *engine) {
+    struct cas_block *b = pthread_getspecific(engine->items.cas_key);
+    if (b == NULL) {
+        if ((b = calloc(1, sizeof(*b))) == NULL ||
+            pthread_setspecific(engine->items.cas_key, b) != 0) {
+            free(b);
+            return NULL;
+        }
+    }
+    return b;
+}
+
+/* Make sure the calling thread has a CAS id for the next item it links */
+static bool cas_reserve(struct persistent_engine *engine) {
+    struct cas_block *b;
+
+    if (!engine->config.use_cas) {
+        return true;
+    }
+    if ((b = get_cas_block(engine)) == NULL) {
+        return false;
+    }
+    return b->next != b->end || cas_reserve_block(engine, b, true);
+}
+
+/*
+ * Get the next CAS id for a new item. Each thread reserves a block of ids
+ * from the shared counter at a time, so the threads don't fight over the
+ * cache line holding it. We're called with the item lock held, so we never
+ * wait for the writer here: store_item reserves the id up front (see
+ * cas_reserve), and the other callers replace the id we return with
+ * the one of the item they copy.
+ */
+static uint64_t get_cas_id(struct persistent_engine *engine) {
+    struct cas_block *b = get_cas_block(engine);
+    struct cas_block tmp = { 0, 0 };
+
+    if (b == NULL) {
+        b = &tmp;
+    }
+    if (b->next == b->end && !cas_reserve_block(engine, b, false)) {
         return 0;
+    }
+    return b->next++;
+}
+
+/*
+ * Try to get exclusive access to an item in the LRU so that we may unlink
+ * it and reuse its memory. Called with the lru lock held, so we can't
+ * block on the item lock (the caller may already hold another item lock).
+ * On success the item lock is held and we've got a reference to the item.
+ */
+static bool item_claim(struct persistent_engine *engine, hash_item *it, uint32_t *hv) {
+    if (it->refcount != 1) {
+        /* Someone else is using it */
+        return false;
+    }
+
+    *hv = engine->server.hash(item_get_key(it), it->nkey, 0);
+    if (!item_trylock(engine, *hv)) {
+        return false;
+    }
+
+    /* Don't throw away a write the writer thread hasn't picked up yet */
+    if ((it->iflag & ITEM_DIRTY) != 0) {
+        item_unlock(engine, *hv);
+        return false;
+    }
+
+    /* The only other reference should be the one held by the cache */
+    if (__sync_add_and_fetch(&it->refcount, 1) != 2) {
+        __sync_sub_and_fetch(&it->refcount, 1);
+        item_unlock(engine, *hv);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Large values may be split over a chain of chunks (see slab_chunk_max),
+ * so they don't need a chunk from the big (and mostly wasted) slab
+ * classes. The item itself is a chunk of slabs.chunk_clsid, and its data
+ * starts with a struct item_chain followed by the first part of the
+ * value. The rest of the value is in chunks linked through their next
+ * pointer. A chunk is a hash_item with ITEM_CHUNK set, no key and nbytes
+ * set to the size of its part of the value, and its prev pointer points
+ * back at the item (so the rebalancer can find it).
+ *
+ * The data of an item isn't aligned, so the header is always memcpy'd.
+ */
+struct item_chain {
+    hash_item *chunks;
+    uint32_t nhead;  /* The number of bytes of the value in the item */
+};
+
+static void item_get_chain(const hash_item *it, struct item_chain *chain) {
+    memcpy(chain, item_get_data(it), sizeof(*chain));
+}
+
+static void item_set_chain(hash_item *it, const struct item_chain *chain) {
+    memcpy(item_get_data(it), chain, sizeof(*chain));
+}
+
+/* The number of bytes the item (but not its chunks) uses in the slabs */
+static size_t item_slab_size(struct persistent_engine *engine,
+                             const hash_item *it) {
+    struct item_chain chain;
+    if ((it->iflag & ITEM_CHAINED) == 0) {
+        return ITEM_ntotal(engine, it);
+    }
+    item_get_chain(it, &chain);
+    return ITEM_ntotal(engine, it) - it->nbytes + sizeof(chain) + chain.nhead;
+}
+
+/* Give the chunks of a chained item back to the slab allocator */
+static void item_free_chunks(struct persistent_engine *engine, hash_item *it) {
+    struct item_chain chain;
+    hash_item *chunk;
+    unsigned int clsid;
+
+    if ((it->iflag & ITEM_CHAINED) == 0) {
+        return;
+    }
+    item_get_chain(it, &chain);
+    while ((chunk = chain.chunks) != NULL) {
+        chain.chunks = chunk->next;
+        clsid = chunk->slabs_clsid;
+        chunk->slabs_clsid = 0;
+        slabs_free(engine, chunk, sizeof(*chunk) + chunk->nbytes, clsid);
+    }
+    it->iflag &= ~ITEM_CHAINED;
+}
+
+/* A part of a value (see item_first_segment) */
+struct item_segment {
+    char *data;
+    size_t len;
+    /* The chunk holding the next part */
+    hash_item *next;
+};
+
+/*
+ * Get the first part of the value of an item. The rest of the value (if
+ * it's chained) is walked with item_next_segment.
+ */
+static void item_first_segment(const hash_item *it, struct item_segment *seg) {
+    struct item_chain chain;
+    if ((it->iflag & ITEM_CHAINED) == 0) {
+        seg->data = item_get_data(it);
+        seg->len = it->nbytes;
+        seg->next = NULL;
+    } else {
+        item_get_chain(it, &chain);
+        seg->data = item_get_data(it) + sizeof(chain);
+        seg->len = chain.nhead;
+        seg->next = chain.chunks;
+    }
+}
+
+static bool item_next_segment(struct item_segment *seg) {
+    hash_item *chunk = seg->next;
+    if (chunk == NULL) {
+        return false;
+    }
+    seg->data = item_get_data(chunk);
+    seg->len = chunk->nbytes;
+    seg->next = chunk->next;
+    return true;
+}
+
+int item_get_iov(const hash_item *it, struct iovec *iov, int niov) {
+    struct item_segment seg;
+    int n = 0;
+
+    item_first_segment(it, &seg);
+    do {
+        if (n < niov) {
+            iov[n].iov_base = seg.data;
+            iov[n].iov_len = seg.len;
+        }
+        ++n;
+    } while (item_next_segment(&seg));
+
+    return n;
+}
+
+/* Copy len bytes between buf and the value of an item, starting at offset */
+static void item_copy_range(const hash_item *it, size_t offset,
+                            char *buf, size_t len, bool to_item) {
+    struct item_segment seg;
+    size_t n;
+
+    item_first_segment(it, &seg);
+    while (len > 0) {
+        if (offset < seg.len) {
+            n = seg.len - offset < len ? seg.len - offset : len;
+            if (to_item) {
+                memcpy(seg.data + offset, buf, n);
+            } else {
+                memcpy(buf, seg.data + offset, n);
+            }
+            buf += n;
+            len -= n;
+            offset = 0;
+        } else {
+            offset -= seg.len;
+        }
+        if (len > 0 && !item_next_segment(&seg)) {
+            assert(false);
+            return;
+        }
+    }
+}
+
+void item_read_value(const hash_item *it, size_t offset,
+                     void *dest, size_t len) {
+    item_copy_range(it, offset, dest, len, false);
+}
+
+void item_write_value(hash_item *it, size_t offset,
+                      const void *src, size_t len) {
+    item_copy_range(it, offset, (char*)src, len, true);
+}
+
+/*
+ * Get ntotal bytes of memory from slab class id, reclaiming an expired
+ * item or evicting one from the tail of the LRU if we have to. The memory
+ * of an item we take over is reused directly (but its chunks are freed).
+ *
+ * With the admission filter on, freq is the estimate for the key we
+ * allocate for. An item asked for more often than that isn't evicted:
+ * if the allocation is optional we give up, and otherwise the item is
+ * moved back to the head of the LRU (at most ADMISSION_MAX_KEPT times,
+ * after that we have to evict something).
+ */
+static hash_item *do_item_alloc_memory(struct persistent_engine *engine,
+                                       const size_t ntotal,
+                                       const unsigned int id,
+                                       const void *cookie,
+                                       const uint32_t freq,
+                                       const bool optional) {
+    hash_item *it = NULL;
+    bool filter = admission_enabled(engine);
+    int kept = 0;
+
+    pthread_mutex_lock(&engine->items.lru_locks[id]);
 
     /* do a quick check if we have any expired items in the tail.. */
     int tries = 50;
-    hash_item *search;
+    hash_item *search, *next;
+    uint32_t hv;
 
     rel_time_t current_time = engine->server.get_current_time();
 
     for (search = engine->items.tails[id];
          tries > 0 && search != NULL;
          tries--, search=search->prev) {
-        if (search->refcount == 0 &&
-            (search->exptime != 0 && search->exptime < current_time)) {
-            it = search;
+        if ((search->exptime != 0 && search->exptime < current_time) &&
+            item_claim(engine, search, &hv)) {
             /* I don't want to actually free the object, just steal
              * the item to avoid to grab the slab mutex twice ;-)
              */
@@ -108,11 +514,12 @@ hash_item *do_item_alloc(struct persistent_engine *engine,
             engine->stats.reclaimed++;
             pthread_mutex_unlock(&engine->stats.lock);
             engine->items.itemstats[id].reclaimed++;
-            it->refcount = 1;
-            do_item_unlink(engine, it);
+            do_item_unlink_nolock(engine, search, hv);
+            item_unlock(engine, hv);
             /* Initialize the item block: */
+            it = search;
+            item_free_chunks(engine, it);
             it->slabs_clsid = 0;
-            it->refcount = 0;
             break;
         }
     }
@@ -130,23 +537,46 @@ hash_item *do_item_alloc(struct persistent_engine *engine,
 
         if (engine->config.evict_to_free == 0) {
             engine->items.itemstats[id].outofmemory++;
+            pthread_mutex_unlock(&engine->items.lru_locks[id]);
             return NULL;
         }
 
         /*
          * try to get one off the right LRU
-         * don't necessariuly unlink the tail because it may be locked: refcount>0
-         * search up from tail an item with refcount==0 and unlink it; give up after 50
+         * don't necessariuly unlink the tail because it may be locked: refcount>1
+         * search up from tail an item we may claim and reuse it; give up after 50
          * tries
          */
 
         if (engine->items.tails[id] == 0) {
             engine->items.itemstats[id].outofmemory++;
+            pthread_mutex_unlock(&engine->items.lru_locks[id]);
             return NULL;
         }
 
-        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-            if (search->refcount == 0) {
+        for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=next) {
+            next = search->prev;
+            if (item_claim(engine, search, &hv)) {
+                if ((search->exptime == 0 || search->exptime > current_time) &&
+                    filter && admission_estimate(engine, hv) > freq) {
+                    if (optional) {
+                        __sync_sub_and_fetch(&search->refcount, 1);
+                        item_unlock(engine, hv);
+                        __sync_add_and_fetch(&engine->admission.rejected, 1);
+                        pthread_mutex_unlock(&engine->items.lru_locks[id]);
+                        return NULL;
+                    }
+                    if (kept < ADMISSION_MAX_KEPT) {
+                        /* Give it another trip through the LRU */
+                        item_unlink_q(engine, search);
+                        item_link_q(engine, search);
+                        __sync_sub_and_fetch(&search->refcount, 1);
+                        item_unlock(engine, hv);
+                        __sync_add_and_fetch(&engine->admission.kept, 1);
+                        ++kept;
+                        continue;
+                    }
+                }
                 if (search->exptime == 0 || search->exptime > current_time) {
                     engine->items.itemstats[id].evicted++;
                     engine->items.itemstats[id].evicted_time = current_time - search->time;
@@ -165,12 +595,16 @@ hash_item *do_item_alloc(struct persistent_engine *engine,
                     engine->stats.reclaimed++;
                     pthread_mutex_unlock(&engine->stats.lock);
                 }
-                do_item_unlink(engine, search);
+                do_item_unlink_nolock(engine, search, hv);
+                item_unlock(engine, hv);
+                it = search;
+                item_free_chunks(engine, it);
+                it->slabs_clsid = 0;
                 break;
             }
         }
-        it = slabs_alloc(engine, ntotal, id);
-        if (it == 0) {
+
+        if (it == NULL) {
             engine->items.itemstats[id].outofmemory++;
             /* Last ditch effort. There is a very rare bug which causes
              * refcount leaks. We've fixed most of them, but it still happens,
@@ -181,26 +615,39 @@ hash_item *do_item_alloc(struct persistent_engine *engine,
              */
             tries = 50;
             for (search = engine->items.tails[id]; tries > 0 && search != NULL; tries--, search=search->prev) {
-                if (search->refcount != 0 && search->time + TAIL_REPAIR_TIME < current_time) {
+                if (search->refcount > 1 && search->time + TAIL_REPAIR_TIME < current_time) {
+                    hv = engine->server.hash(item_get_key(search), search->nkey, 0);
+                    if (!item_trylock(engine, hv)) {
+                        continue;
+                    }
                     engine->items.itemstats[id].tailrepairs++;
-                    search->refcount = 0;
-                    do_item_unlink(engine, search);
+                    search->refcount = 1;
+                    do_item_unlink_nolock(engine, search, hv);
+                    item_unlock(engine, hv);
                     break;
                 }
             }
             it = slabs_alloc(engine, ntotal, id);
             if (it == 0) {
+                pthread_mutex_unlock(&engine->items.lru_locks[id]);
                 return NULL;
             }
         }
     }
 
+    assert(it != engine->items.heads[id]);
+    pthread_mutex_unlock(&engine->items.lru_locks[id]);
+
     assert(it->slabs_clsid == 0);
 
     it->slabs_clsid = id;
+    return it;
+}
 
-    assert(it != engine->items.heads[it->slabs_clsid]);
-
+static void do_item_init(struct persistent_engine *engine, hash_item *it,
+                         const void *key, const size_t nkey,
+                         const int flags, const rel_time_t exptime,
+                         const int nbytes) {
     it->next = it->prev = it->h_next = 0;
     it->refcount = 1;     /* the caller will have a reference */
     it->iflag = engine->config.use_cas ? ITEM_WITH_CAS : 0;
@@ -209,21 +656,137 @@ hash_item *do_item_alloc(struct persistent_engine *engine,
     it->flags = flags;
     memcpy((void*)item_get_key(it), key, nkey);
     it->exptime = exptime;
+}
+
+/*
+ * Allocate an item with its value split over chunks of slabs.chunk_clsid
+ * (see struct item_chain). The end of the value goes in the smallest
+ * chunk it fits in.
+ */
+static hash_item *do_item_alloc_chained(struct persistent_engine *engine,
+                                        const void *key, const size_t nkey,
+                                        const int flags,
+                                        const rel_time_t exptime,
+                                        const int nbytes,
+                                        const void *cookie,
+                                        const uint32_t freq,
+                                        const bool optional) {
+    unsigned int chunk_id = engine->slabs.chunk_clsid;
+    size_t chunk_size = engine->slabs.slabclass[chunk_id].size;
+    size_t header = sizeof(hash_item) + nkey + sizeof(struct item_chain);
+    struct item_chain chain;
+    hash_item *it, *last = NULL;
+    size_t left;
+
+    if (engine->config.use_cas) {
+        header += sizeof(uint64_t);
+    }
+    /* slabs_init makes sure of this (SLAB_CHUNK_MIN) */
+    assert(header < chunk_size);
+
+    it = do_item_alloc_memory(engine, chunk_size, chunk_id, cookie, freq,
+                              optional);
+    if (it == NULL) {
+        return NULL;
+    }
+    do_item_init(engine, it, key, nkey, flags, exptime, nbytes);
+    it->iflag |= ITEM_CHAINED;
+    chain.chunks = NULL;
+    chain.nhead = chunk_size - header;
+    item_set_chain(it, &chain);
+
+    for (left = nbytes - chain.nhead; left > 0; ) {
+        size_t n = chunk_size - sizeof(hash_item);
+        unsigned int id = chunk_id;
+        hash_item *chunk;
+
+        if (left < n) {
+            n = left;
+            id = slabs_clsid(engine, sizeof(hash_item) + n);
+        }
+        chunk = do_item_alloc_memory(engine, sizeof(hash_item) + n, id, cookie,
+                                     freq, optional);
+        if (chunk == NULL) {
+            it->refcount = 0;
+            item_free(engine, it);
+            return NULL;
+        }
+
+        chunk->next = chunk->h_next = 0;
+        chunk->prev = it;
+        chunk->time = chunk->exptime = 0;
+        chunk->refcount = 0;
+        chunk->iflag = ITEM_CHUNK;
+        chunk->nkey = 0;
+        chunk->nbytes = n;
+        chunk->flags = 0;
+        if (last == NULL) {
+            chain.chunks = chunk;
+            item_set_chain(it, &chain);
+        } else {
+            last->next = chunk;
+        }
+        last = chunk;
+        left -= n;
+    }
+
+    return it;
+}
+
+/*
+ * Allocate an item. An optional item is one we can do without (an item
+ * we read from disk that nobody asked for yet, or a compressed copy), so
+ * the admission filter may refuse it (see do_item_alloc_memory).
+ */
+/*@null@*/
+hash_item *do_item_alloc(struct persistent_engine *engine,
+                         const void *key,
+                         const size_t nkey,
+                         const int flags,
+                         const rel_time_t exptime,
+                         const int nbytes,
+                         const void *cookie,
+                         const bool optional) {
+    hash_item *it = NULL;
+    uint32_t freq = 0;
+    unsigned int chunk_id = engine->slabs.chunk_clsid;
+    size_t ntotal = sizeof(hash_item) + nkey + nbytes;
+    if (engine->config.use_cas) {
+        ntotal += sizeof(uint64_t);
+    }
+
+    unsigned int id = slabs_clsid(engine, ntotal);
+    if (id == 0)
+        return 0;
+
+    if (admission_enabled(engine)) {
+        freq = admission_estimate(engine, engine->server.hash(key, nkey, 0));
+    }
+
+    if (chunk_id != 0 && ntotal > engine->slabs.slabclass[chunk_id].size) {
+        return do_item_alloc_chained(engine, key, nkey, flags, exptime,
+                                     nbytes, cookie, freq, optional);
+    }
+
+    if ((it = do_item_alloc_memory(engine, ntotal, id, cookie, freq,
+                                   optional)) == NULL) {
+        return NULL;
+    }
+    do_item_init(engine, it, key, nkey, flags, exptime, nbytes);
     return it;
 }
 
 static void item_free(struct persistent_engine *engine, hash_item *it) {
-    size_t ntotal = ITEM_ntotal(engine, it);
+    size_t ntotal = item_slab_size(engine, it);
     unsigned int clsid;
     assert((it->iflag & ITEM_LINKED) == 0);
     assert(it != engine->items.heads[it->slabs_clsid]);
     assert(it != engine->items.tails[it->slabs_clsid]);
     assert(it->refcount == 0);
 
-    /* so slab size changer can tell later if item is already free or not */
+    item_free_chunks(engine, it);
     clsid = it->slabs_clsid;
     it->slabs_clsid = 0;
-    it->iflag |= ITEM_SLABBED;
     slabs_free(engine, it, ntotal, clsid);
 }
 
@@ -245,6 +808,27 @@ static void item_link_q(struct persistent_engine *engine, hash_item *it) { /* it
     return;
 }
 
+/* Put an item in the LRU right behind (towards the tail of) another one */
+static void item_link_q_after(struct persistent_engine *engine, hash_item *it,
+                              hash_item *after) {
+    hash_item **tail;
+    if (after == NULL) {
+        item_link_q(engine, it);
+        return;
+    }
+    assert(it->slabs_clsid < POWER_LARGEST);
+    assert(after->slabs_clsid == it->slabs_clsid);
+    assert((it->iflag & ITEM_SLABBED) == 0);
+
+    tail = &engine->items.tails[it->slabs_clsid];
+    it->prev = after;
+    it->next = after->next;
+    if (it->next) it->next->prev = it;
+    after->next = it;
+    if (*tail == after) *tail = it;
+    engine->items.sizes[it->slabs_clsid]++;
+}
+
 static void item_unlink_q(struct persistent_engine *engine, hash_item *it) {
     hash_item **head, **tail;
     assert(it->slabs_clsid < POWER_LARGEST);
@@ -268,49 +852,74 @@ static void item_unlink_q(struct persistent_engine *engine, hash_item *it) {
     return;
 }
 
-int do_item_link(struct persistent_engine *engine, hash_item *it) {
+/* Link an item in the hash table (but not the LRU). Called with the item lock */
+static void do_item_link_hash(struct persistent_engine *engine, hash_item *it,
+                              uint32_t hv) {
     assert((it->iflag & (ITEM_LINKED|ITEM_SLABBED)) == 0);
     assert(it->nbytes < (1024 * 1024));  /* 1MB max size */
     it->iflag |= ITEM_LINKED;
-    it->time = engine->server.get_current_time();
-    assoc_insert(engine, engine->server.hash(item_get_key(it), it->nkey, 0),
-                 it);
+    /* The cache holds a reference to the item while it is linked */
+    __sync_add_and_fetch(&it->refcount, 1);
+    assoc_insert(engine, hv, it);
 
     pthread_mutex_lock(&engine->stats.lock);
     engine->stats.curr_bytes += ITEM_ntotal(engine, it);
     engine->stats.curr_items += 1;
     engine->stats.total_items += 1;
+    if ((it->iflag & ITEM_CODEC_MASK) != 0) {
+        engine->stats.warm_bytes += ITEM_ntotal(engine, it);
+        engine->stats.warm_items += 1;
+    }
     pthread_mutex_unlock(&engine->stats.lock);
+}
 
-    /* Allocate a new CAS ID on link. */
-    item_set_cas(NULL, (item*)it, get_cas_id());
+int do_item_link(struct persistent_engine *engine, hash_item *it, uint32_t hv) {
+    it->time = engine->server.get_current_time();
+    do_item_link_hash(engine, it, hv);
 
+    /* Allocate a new CAS ID on link (no need to reserve ids without CAS) */
+    if (engine->config.use_cas) {
+        item_set_cas(NULL, (item*)it, get_cas_id(engine));
+    }
+
+    pthread_mutex_lock(&engine->items.lru_locks[it->slabs_clsid]);
     item_link_q(engine, it);
+    pthread_mutex_unlock(&engine->items.lru_locks[it->slabs_clsid]);
 
     return 1;
 }
 
-void do_item_unlink(struct persistent_engine *engine, hash_item *it) {
+/* Unlink an item. The caller must hold both the item and lru lock */
+static void do_item_unlink_nolock(struct persistent_engine *engine, hash_item *it,
+                                  uint32_t hv) {
     if ((it->iflag & ITEM_LINKED) != 0) {
         it->iflag &= ~ITEM_LINKED;
         pthread_mutex_lock(&engine->stats.lock);
         engine->stats.curr_bytes -= ITEM_ntotal(engine, it);
         engine->stats.curr_items -= 1;
+        if ((it->iflag & ITEM_CODEC_MASK) != 0) {
+            engine->stats.warm_bytes -= ITEM_ntotal(engine, it);
+            engine->stats.warm_items -= 1;
+        }
         pthread_mutex_unlock(&engine->stats.lock);
-        assoc_delete(engine, engine->server.hash(item_get_key(it), it->nkey, 0),
-                     item_get_key(it), it->nkey);
+        assoc_delete(engine, hv, item_get_key(it), it->nkey);
         item_unlink_q(engine, it);
-        if (it->refcount == 0) {
-            item_free(engine, it);
-        }
+        /* drop the reference held by the cache */
+        do_item_release(engine, it);
     }
 }
 
-void do_item_release(struct persistent_engine *engine, hash_item *it) {
-    if (it->refcount != 0) {
-        it->refcount--;
+void do_item_unlink(struct persistent_engine *engine, hash_item *it, uint32_t hv) {
+    if ((it->iflag & ITEM_LINKED) != 0) {
+        unsigned int clsid = it->slabs_clsid;
+        pthread_mutex_lock(&engine->items.lru_locks[clsid]);
+        do_item_unlink_nolock(engine, it, hv);
+        pthread_mutex_unlock(&engine->items.lru_locks[clsid]);
     }
-    if (it->refcount == 0 && (it->iflag & ITEM_LINKED) == 0) {
+}
+
+void do_item_release(struct persistent_engine *engine, hash_item *it) {
+    if (__sync_sub_and_fetch(&it->refcount, 1) == 0) {
         item_free(engine, it);
     }
 }
@@ -321,19 +930,61 @@ void do_item_update(struct persistent_engine *engine, hash_item *it) {
         assert((it->iflag & ITEM_SLABBED) == 0);
 
         if ((it->iflag & ITEM_LINKED) != 0) {
+            pthread_mutex_lock(&engine->items.lru_locks[it->slabs_clsid]);
             item_unlink_q(engine, it);
             it->time = current_time;
             item_link_q(engine, it);
+            pthread_mutex_unlock(&engine->items.lru_locks[it->slabs_clsid]);
         }
     }
 }
 
 int do_item_replace(struct persistent_engine *engine,
-                    hash_item *it, hash_item *new_it) {
+                    hash_item *it, hash_item *new_it, uint32_t hv) {
     assert((it->iflag & ITEM_SLABBED) == 0);
 
-    do_item_unlink(engine, it);
-    return do_item_link(engine, new_it);
+    do_item_unlink(engine, it, hv);
+    return do_item_link(engine, new_it, hv);
+}
+
+/*
+ * Replace an item with a copy holding the same value (the compactor's
+ * compressed one). The copy keeps the access time and the CAS of the
+ * original, and takes its place in the LRU so it's evicted when the
+ * original would have been. If the copy is in another slab class it goes
+ * behind the items of that class accessed after the original (looking at
+ * no more than COPY_SEARCH_DEPTH items from the tail). Called with the
+ * item lock held.
+ */
+#define COPY_SEARCH_DEPTH 50
+static void do_item_replace_copy(struct persistent_engine *engine,
+                                 hash_item *it, hash_item *new_it, uint32_t hv) {
+    unsigned int id = new_it->slabs_clsid;
+    bool same_class = it->slabs_clsid == id;
+    hash_item *after;
+    int tries = COPY_SEARCH_DEPTH;
+
+    assert((it->iflag & ITEM_LINKED) != 0);
+    new_it->time = it->time;
+    item_set_cas(NULL, (item*)new_it, item_get_cas(it));
+
+    if (!same_class) {
+        do_item_unlink(engine, it, hv);
+    }
+
+    pthread_mutex_lock(&engine->items.lru_locks[id]);
+    if (same_class) {
+        after = it->prev;
+        do_item_unlink_nolock(engine, it, hv);
+    } else {
+        after = engine->items.tails[id];
+        while (after != NULL && after->time < new_it->time && tries-- > 0) {
+            after = after->prev;
+        }
+    }
+    do_item_link_hash(engine, new_it, hv);
+    item_link_q_after(engine, new_it, after);
+    pthread_mutex_unlock(&engine->items.lru_locks[id]);
 }
 
 /*@null@*/
@@ -390,6 +1041,7 @@ static void do_item_stats(struct persistent_engine *engine,
                           ADD_STAT add_stats, void *c) {
     int i;
     for (i = 0; i < POWER_LARGEST; i++) {
+        pthread_mutex_lock(&engine->items.lru_locks[i]);
         if (engine->items.tails[i] != NULL) {
             const char *prefix = "items";
             add_statistics(c, add_stats, prefix, i, "number", "%u",
@@ -409,6 +1061,7 @@ static void do_item_stats(struct persistent_engine *engine,
             add_statistics(c, add_stats, prefix, i, "reclaimed",
                            "%u", engine->items.itemstats[i].reclaimed);;
         }
+        pthread_mutex_unlock(&engine->items.lru_locks[i]);
     }
 
     /* getting here means both ascii and binary terminators fit */
@@ -429,6 +1082,7 @@ static void do_item_stats_sizes(struct persistent_engine *engine,
 
         /* build the histogram */
         for (i = 0; i < POWER_LARGEST; i++) {
+            pthread_mutex_lock(&engine->items.lru_locks[i]);
             hash_item *iter = engine->items.heads[i];
             while (iter) {
                 int ntotal = ITEM_ntotal(engine, iter);
@@ -437,6 +1091,7 @@ static void do_item_stats_sizes(struct persistent_engine *engine,
                 if (bucket < num_buckets) histogram[bucket]++;
                 iter = iter->next;
             }
+            pthread_mutex_unlock(&engine->items.lru_locks[i]);
         }
 
         /* write the buffer */
@@ -458,9 +1113,9 @@ static void do_item_stats_sizes(struct persistent_engine *engine,
 
 /** wrapper around assoc_find which does the lazy expiration logic */
 hash_item *do_item_get(struct persistent_engine *engine,
-                       const char *key, const size_t nkey) {
+                       const char *key, const size_t nkey, uint32_t hv) {
     rel_time_t current_time = engine->server.get_current_time();
-    hash_item *it = assoc_find(engine, engine->server.hash(key, nkey, 0), key, nkey);
+    hash_item *it = assoc_find(engine, hv, key, nkey);
     int was_found = 0;
 
     if (engine->config.verbose > 2) {
@@ -475,7 +1130,7 @@ hash_item *do_item_get(struct persistent_engine *engine,
     if (it != NULL && engine->config.oldest_live != 0 &&
         engine->config.oldest_live <= current_time &&
         it->time <= engine->config.oldest_live) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
+        do_item_unlink(engine, it, hv);       /* MTSAFE - item lock held */
         it = NULL;
     }
 
@@ -485,7 +1140,7 @@ hash_item *do_item_get(struct persistent_engine *engine,
     }
 
     if (it != NULL && it->exptime != 0 && it->exptime <= current_time) {
-        do_item_unlink(engine, it);           /* MTSAFE - cache_lock held */
+        do_item_unlink(engine, it, hv);       /* MTSAFE - item lock held */
         it = NULL;
     }
 
@@ -495,7 +1150,7 @@ hash_item *do_item_get(struct persistent_engine *engine,
     }
 
     if (it != NULL) {
-        it->refcount++;
+        __sync_add_and_fetch(&it->refcount, 1);
     }
 
     if (engine->config.verbose > 2)
@@ -504,18 +1159,94 @@ hash_item *do_item_get(struct persistent_engine *engine,
     return it;
 }
 
+/*
+ * Get the size of the item's value when it's uncompressed
+ */
+static uint32_t item_raw_length(const hash_item *it) {
+    uint32_t len;
+    if ((it->iflag & ITEM_CODEC_MASK) == 0) {
+        return it->nbytes;
+    }
+    memcpy(&len, item_get_data(it), sizeof(len));
+    return ntohl(len);
+}
+
+/*
+ * Copy the uncompressed value of an item into the value of dest (which
+ * must have room for item_raw_length() bytes from offset), inflating it
+ * if it's a warm item.
+ */
+static bool item_copy_value(struct persistent_engine *engine,
+                            const hash_item *it, hash_item *dest,
+                            size_t offset) {
+    uint8_t id = (it->iflag & ITEM_CODEC_MASK) >> ITEM_CODEC_SHIFT;
+    uint32_t len = item_raw_length(it);
+    const struct codec *codec;
+    struct compressor *c;
+    struct item_segment seg;
+    char *out;
+    uint64_t start;
+
+    if (id == CODEC_NONE) {
+        item_first_segment(it, &seg);
+        do {
+            item_write_value(dest, offset, seg.data, seg.len);
+            offset += seg.len;
+        } while (item_next_segment(&seg));
+        return true;
+    }
+
+    /* The compactor leaves the chained items alone */
+    assert((it->iflag & ITEM_CHAINED) == 0);
+    if ((codec = codec_get(id)) == NULL) {
+        fprintf(stderr, "Unknown codec %u\r\n", id);
+        return false;
+    }
+    if ((c = get_compressor(engine)) == NULL) {
+        return false;
+    }
+
+    /* A chained value is inflated in the scratch buffer and copied in */
+    if ((dest->iflag & ITEM_CHAINED) == 0) {
+        out = item_get_data(dest) + offset;
+    } else {
+        if (c->buffersize < len) {
+            char *buffer = realloc(c->buffer, len);
+            if (buffer == NULL) {
+                return false;
+            }
+            c->buffer = buffer;
+            c->buffersize = len;
+        }
+        out = c->buffer;
+    }
+
+    start = latency_start(engine);
+    if (!codec->decompress(c->ctx, item_get_data(it) + COMPRESS_HEADER_SIZE,
+                           it->nbytes - COMPRESS_HEADER_SIZE, out, len)) {
+        fprintf(stderr, "Failed to inflate data (%s)\r\n", codec->name);
+        return false;
+    }
+    latency_record(engine, LATENCY_INFLATE, start);
+    if (out == c->buffer) {
+        item_write_value(dest, offset, out, len);
+    }
+    return true;
+}
+
 /*
  * Stores an item in the cache according to the semantics of one of the set
- * commands. In threaded mode, this is protected by the cache lock.
+ * commands. In threaded mode, this is protected by the item lock.
  *
  * Returns the state of storage.
  */
 static ENGINE_ERROR_CODE do_store_item(struct persistent_engine *engine,
                                        hash_item *it, uint64_t *cas,
                                        ENGINE_STORE_OPERATION operation,
-                                       bool notify, const void *cookie) {
+                                       bool notify, const void *cookie,
+                                       uint32_t hv) {
     const char *key = item_get_key(it);
-    hash_item *old_it = do_item_get(engine, key, it->nkey);
+    hash_item *old_it = do_item_get(engine, key, it->nkey, hv);
     ENGINE_ERROR_CODE stored = ENGINE_NOT_STORED;
 
     hash_item *new_it = NULL;
@@ -548,7 +1279,7 @@ static ENGINE_ERROR_CODE do_store_item(struct persistent_engine *engine,
             pthread_mutex_unlock(&c->thread->stats.mutex);
 #endif
 
-            do_item_replace(engine, old_it, it);
+            do_item_replace(engine, old_it, it, hv);
             stored = ENGINE_SUCCESS;
         } else {
 #if 0
@@ -581,12 +1312,15 @@ static ENGINE_ERROR_CODE do_store_item(struct persistent_engine *engine,
             }
 
             if (stored == ENGINE_NOT_STORED) {
+                /* The old value may be a warm (compressed) item */
+                uint32_t old_nbytes = item_raw_length(old_it);
+
                 /* we have it and old_it here - alloc memory to hold both */
                 new_it = do_item_alloc(engine, key, it->nkey,
                                        old_it->flags,
                                        old_it->exptime,
-                                       it->nbytes + old_it->nbytes - 2 /* CRLF */,
-                                       cookie);
+                                       it->nbytes + old_nbytes - 2 /* CRLF */,
+                                       cookie, false);
 
                 if (new_it == NULL) {
                     /* SERVER_ERROR out of memory */
@@ -600,12 +1334,20 @@ static ENGINE_ERROR_CODE do_store_item(struct persistent_engine *engine,
                 /* copy data from it and old_it to new_it */
 
                 if (operation == OPERATION_APPEND) {
-                    memcpy(item_get_data(new_it), item_get_data(old_it), old_it->nbytes);
-                    memcpy(item_get_data(new_it) + old_it->nbytes - 2 /* CRLF */, item_get_data(it), it->nbytes);
+                    if (!item_copy_value(engine, old_it, new_it, 0)) {
+                        do_item_release(engine, new_it);
+                        do_item_release(engine, old_it);
+                        return ENGINE_NOT_STORED;
+                    }
+                    item_copy_value(engine, it, new_it, old_nbytes - 2 /* CRLF */);
                 } else {
                     /* OPERATION_PREPEND */
-                    memcpy(item_get_data(new_it), item_get_data(it), it->nbytes);
-                    memcpy(item_get_data(new_it) + it->nbytes - 2 /* CRLF */, item_get_data(old_it), old_it->nbytes);
+                    item_copy_value(engine, it, new_it, 0);
+                    if (!item_copy_value(engine, old_it, new_it, it->nbytes - 2 /* CRLF */)) {
+                        do_item_release(engine, new_it);
+                        do_item_release(engine, old_it);
+                        return ENGINE_NOT_STORED;
+                    }
                 }
 
                 it = new_it;
@@ -614,9 +1356,9 @@ static ENGINE_ERROR_CODE do_store_item(struct persistent_engine *engine,
 
         if (stored == ENGINE_NOT_STORED) {
             if (old_it != NULL) {
-                do_item_replace(engine, old_it, it);
+                do_item_replace(engine, old_it, it, hv);
             } else {
-                do_item_link(engine, it);
+                do_item_link(engine, it, hv);
             }
 
             *cas = item_get_cas(it);
@@ -634,8 +1376,10 @@ static ENGINE_ERROR_CODE do_store_item(struct persistent_engine *engine,
 
     if (stored == ENGINE_SUCCESS) {
         *cas = item_get_cas(it);
+        /* A read racing with us must not remember the key as missing */
+        negative_cache_clear(engine, hv);
         if (notify) {
-            sqlite_io_store_item(engine, it);
+            engine->storage->store_item(engine, it);
         }
     }
 
@@ -662,6 +1406,7 @@ static ENGINE_ERROR_CODE do_add_delta(struct persistent_engine *engine,
     const char *ptr;
     uint64_t value;
     int res;
+    uint32_t hv = engine->server.hash(item_get_key(it), it->nkey, 0);
 
     ptr = item_get_data(it);
 
@@ -687,13 +1432,13 @@ static ENGINE_ERROR_CODE do_add_delta(struct persistent_engine *engine,
     hash_item *new_it = do_item_alloc(engine, item_get_key(it),
                                       it->nkey, it->flags,
                                       it->exptime, res,
-                                      cookie );
+                                      cookie, false);
     if (new_it == 0) {
-        do_item_unlink(engine, it);
+        do_item_unlink(engine, it, hv);
         return ENGINE_ENOMEM;
     }
     memcpy(item_get_data(new_it), buf, res);
-    do_item_replace(engine, it, new_it);
+    do_item_replace(engine, it, new_it, hv);
     *rcas = item_get_cas(new_it);
     do_item_release(engine, new_it);       /* release our reference */
 
@@ -711,12 +1456,68 @@ hash_item *item_alloc(struct persistent_engine *engine,
                       const void *key, size_t nkey, int flags,
                       rel_time_t exptime, int nbytes, const void *cookie) {
     hash_item *it;
-    pthread_mutex_lock(&engine->cache_lock);
-    it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
+    if (admission_enabled(engine)) {
+        admission_record(engine, engine->server.hash(key, nkey, 0));
+    }
+    it = do_item_alloc(engine, key, nkey, flags, exptime, nbytes, cookie,
+                       false);
     return it;
 }
 
+hash_item *item_alloc_disk(struct persistent_engine *engine,
+                           const void *key, size_t nkey, int flags,
+                           rel_time_t exptime, int nbytes, bool prefetch) {
+    return do_item_alloc(engine, key, nkey, flags, exptime, nbytes, NULL,
+                         prefetch);
+}
+
+/*
+ * Move a warm item back to the hot tier: inflate it into a new raw item,
+ * and let that replace the warm copy if nobody changed the key meanwhile.
+ * Consumes the caller's reference to it.
+ */
+static hash_item *item_promote(struct persistent_engine *engine, hash_item *it) {
+    hash_item *ret;
+    uint32_t hv;
+
+    if ((it->iflag & ITEM_CODEC_MASK) == 0) {
+        return it;
+    }
+
+    /* We know the size, so inflate directly into the new item */
+    ret = do_item_alloc(engine, item_get_key(it), it->nkey, it->flags,
+                        it->exptime, item_raw_length(it), NULL, false);
+    if (ret == NULL) {
+        if (engine->config.verbose) {
+            fprintf(stderr, "Failed to allocate buffer for inflated object\r\n");
+        }
+        do_item_release(engine, it);
+        return NULL;
+    }
+
+    if (!item_copy_value(engine, it, ret, 0)) {
+        do_item_release(engine, ret);
+        do_item_release(engine, it);
+        return NULL;
+    }
+
+    hv = engine->server.hash(item_get_key(it), it->nkey, 0);
+    item_lock(engine, hv);
+    if ((it->iflag & ITEM_LINKED) != 0) {
+        /* The value is already on disk, so there is nothing to write */
+        do_item_replace(engine, it, ret, hv);
+        pthread_mutex_lock(&engine->stats.lock);
+        engine->stats.warm_promotions++;
+        pthread_mutex_unlock(&engine->stats.lock);
+    }
+    /* The value didn't change, so the client's CAS is still valid */
+    item_set_cas(NULL, ret, item_get_cas(it));
+    item_unlock(engine, hv);
+    do_item_release(engine, it);
+
+    return ret;
+}
+
 /*
  * Returns an item if it hasn't been marked as expired,
  * lazy-expiring as needed.
@@ -724,29 +1525,319 @@ hash_item *item_alloc(struct persistent_engine *engine,
 hash_item *item_get(struct persistent_engine *engine,
                     const void *key, const size_t nkey) {
     hash_item *it;
-    pthread_mutex_lock(&engine->cache_lock);
-    it = do_item_get(engine, key, nkey);
-    pthread_mutex_unlock(&engine->cache_lock);
-    return it;
+    uint32_t hv = engine->server.hash(key, nkey, 0);
+    item_lock(engine, hv);
+    it = do_item_get(engine, key, nkey, hv);
+    item_unlock(engine, hv);
+
+    if (it == NULL) {
+        return NULL;
+    }
+
+    return item_promote(engine, it);
+}
+
+/* The number of keys item_get_multi hashes (and prefetches) up front */
+#define ITEM_GET_MULTI_BATCH 64
+
+int item_get_multi(struct persistent_engine *engine, int nkeys,
+                   const void * const *keys, const size_t *lengths,
+                   hash_item **items) {
+    uint32_t hv[ITEM_GET_MULTI_BATCH];
+    bool done[ITEM_GET_MULTI_BATCH];
+    uint32_t mask = engine->assoc.item_lock_mask;
+    int found = 0;
+    int base, n, ii, jj;
+
+    for (base = 0; base < nkeys; base += n) {
+        n = nkeys - base;
+        if (n > ITEM_GET_MULTI_BATCH) {
+            n = ITEM_GET_MULTI_BATCH;
+        }
+
+        /* Start loading the buckets while we hash the rest of the keys */
+        for (ii = 0; ii < n; ++ii) {
+            hv[ii] = engine->server.hash(keys[base + ii],
+                                         lengths[base + ii], 0);
+            assoc_prefetch(engine, hv[ii]);
+            done[ii] = false;
+        }
+
+        /*
+         * Look up all of the keys sharing an item lock in one go. We
+         * release each lock before taking the next one, since we may not
+         * block on an item lock while holding another.
+         */
+        for (ii = 0; ii < n; ++ii) {
+            if (done[ii]) {
+                continue;
+            }
+            item_lock(engine, hv[ii]);
+            for (jj = ii; jj < n; ++jj) {
+                if (!done[jj] && (hv[jj] & mask) == (hv[ii] & mask)) {
+                    items[base + jj] = do_item_get(engine, keys[base + jj],
+                                                   lengths[base + jj], hv[jj]);
+                    if (items[base + jj] != NULL) {
+                        ++found;
+                    }
+                    done[jj] = true;
+                }
+            }
+            item_unlock(engine, hv[ii]);
+        }
+    }
+
+    /* Inflate the warm items once we don't hold any item locks */
+    for (ii = 0; ii < nkeys; ++ii) {
+        if (items[ii] != NULL &&
+            (items[ii] = item_promote(engine, items[ii])) == NULL) {
+            --found;
+        }
+    }
+
+    return found;
 }
 
 /*
  * Decrements the reference count on an item and adds it to the freelist if
- * needed.
+ * needed. This doesn't need any locks, because nobody else may find the
+ * item once its refcount drops to zero.
  */
 void item_release(struct persistent_engine *engine, hash_item *item) {
-    pthread_mutex_lock(&engine->cache_lock);
     do_item_release(engine, item);
-    pthread_mutex_unlock(&engine->cache_lock);
 }
 
 /*
  * Unlinks an item from the LRU and hashtable.
  */
 void item_unlink(struct persistent_engine *engine, hash_item *item) {
-    pthread_mutex_lock(&engine->cache_lock);
-    do_item_unlink(engine, item);
-    pthread_mutex_unlock(&engine->cache_lock);
+    uint32_t hv = engine->server.hash(item_get_key(item), item->nkey, 0);
+    item_lock(engine, hv);
+    do_item_unlink(engine, item, hv);
+    item_unlock(engine, hv);
+}
+
+/*
+ * Remove a key from the cache and from disk. The removal is queued while
+ * we hold the item lock, so it's ordered with the stores of the key. If
+ * we can't queue it we leave the cached item alone too, so the delete
+ * fails as a whole.
+ */
+ENGINE_ERROR_CODE item_delete(struct persistent_engine *engine,
+                              const void *key, const size_t nkey) {
+    ENGINE_ERROR_CODE ret;
+    hash_item *it;
+    uint32_t hv = engine->server.hash(key, nkey, 0);
+    item_lock(engine, hv);
+    ret = engine->storage->remove_item(engine, key, nkey);
+    if (ret == ENGINE_SUCCESS &&
+        (it = do_item_get(engine, key, nkey, hv)) != NULL) {
+        do_item_unlink(engine, it, hv);
+        do_item_release(engine, it);
+    }
+    item_unlock(engine, hv);
+    return ret;
+}
+
+/*
+ * Unlink the item a chunk of a chained value belongs to (see
+ * item_evacuate). The chunk points back at its item, but that may be
+ * stale until we hold the item lock and find the chunk in its chain.
+ */
+static bool item_evacuate_chunk(struct persistent_engine *engine,
+                                hash_item *chunk) {
+    hash_item *it = chunk->prev;
+    unsigned int id = engine->slabs.chunk_clsid;
+    struct item_chain chain;
+    hash_item *iter;
+    uint16_t nkey;
+    uint32_t hv;
+    bool ret = false;
+
+    if (it == NULL || it->slabs_clsid != id ||
+        (it->iflag & (ITEM_LINKED|ITEM_CHAINED)) != (ITEM_LINKED|ITEM_CHAINED)) {
+        return false;
+    }
+    nkey = it->nkey;
+    if (sizeof(*it) + sizeof(uint64_t) + nkey > engine->slabs.slabclass[id].size) {
+        return false;
+    }
+
+    hv = engine->server.hash(item_get_key(it), nkey, 0);
+    item_lock(engine, hv);
+    if ((chunk->iflag & (ITEM_CHUNK|ITEM_SLABBED)) == ITEM_CHUNK &&
+        chunk->prev == it &&
+        (it->iflag & (ITEM_LINKED|ITEM_CHAINED|ITEM_DIRTY)) == (ITEM_LINKED|ITEM_CHAINED) &&
+        it->nkey == nkey &&
+        engine->server.hash(item_get_key(it), nkey, 0) == hv) {
+        item_get_chain(it, &chain);
+        for (iter = chain.chunks; iter != NULL && iter != chunk; iter = iter->next) {
+            /* empty */
+        }
+        if (iter != NULL) {
+            do_item_unlink(engine, it, hv);
+            ret = true;
+        }
+    }
+    item_unlock(engine, hv);
+
+    return ret;
+}
+
+/*
+ * Unlink an item in a slab page the rebalancer wants to move. We're called
+ * without any locks, so the item may be unlinked (and its memory reused)
+ * until we hold its item lock. Verify that it's still linked under the key
+ * we hashed before we touch it.
+ */
+bool item_evacuate(struct persistent_engine *engine, hash_item *it,
+                   size_t chunk_size) {
+    uint16_t nkey = it->nkey;
+    uint32_t hv;
+    bool ret = false;
+
+    if ((it->iflag & (ITEM_CHUNK|ITEM_SLABBED)) == ITEM_CHUNK) {
+        return item_evacuate_chunk(engine, it);
+    }
+    if ((it->iflag & ITEM_LINKED) == 0 ||
+        sizeof(*it) + sizeof(uint64_t) + nkey > chunk_size) {
+        return false;
+    }
+
+    hv = engine->server.hash(item_get_key(it), nkey, 0);
+    item_lock(engine, hv);
+    if ((it->iflag & (ITEM_LINKED|ITEM_DIRTY)) == ITEM_LINKED &&
+        it->nkey == nkey &&
+        engine->server.hash(item_get_key(it), nkey, 0) == hv) {
+        do_item_unlink(engine, it, hv);
+        ret = true;
+    }
+    item_unlock(engine, hv);
+
+    return ret;
+}
+
+/*
+ * Walk the LRUs looking for the items the write queue had no room for.
+ * As in item_flush_expired we can't block for an item lock while holding
+ * an lru lock, so the items we fail to lock are left for the next scan.
+ */
+bool item_collect_dirty(struct persistent_engine *engine,
+                        void (*collect)(hash_item *it, void *arg),
+                        void *arg) {
+    rel_time_t current_time = engine->server.get_current_time();
+    rel_time_t oldest_live = engine->config.oldest_live;
+    bool complete = true;
+    hash_item *iter;
+    int i;
+
+    for (i = 0; i < POWER_LARGEST; i++) {
+        pthread_mutex_lock(&engine->items.lru_locks[i]);
+        for (iter = engine->items.heads[i]; iter != NULL; iter = iter->next) {
+            if ((iter->iflag & ITEM_DIRTY) == 0) {
+                continue;
+            }
+            uint32_t hv = engine->server.hash(item_get_key(iter),
+                                              iter->nkey, 0);
+            if (!item_trylock(engine, hv)) {
+                complete = false;
+                continue;
+            }
+            iter->iflag &= ~ITEM_DIRTY;
+            /* An expired item is still written, to replace the old value */
+            if (oldest_live == 0 || oldest_live > current_time ||
+                iter->time > oldest_live) {
+                __sync_add_and_fetch(&iter->refcount, 1);
+                collect(iter, arg);
+            }
+            item_unlock(engine, hv);
+        }
+        pthread_mutex_unlock(&engine->items.lru_locks[i]);
+    }
+
+    return complete;
+}
+
+/*
+ * Link an item restored from a snapshot. The item keeps its CAS id and
+ * access time, and becomes the new head of its LRU.
+ */
+bool item_restore(struct persistent_engine *engine, hash_item *it) {
+    unsigned int id = it->slabs_clsid;
+    size_t ntotal = ITEM_ntotal(engine, it);
+    uint8_t codec = (it->iflag & ITEM_CODEC_MASK) >> ITEM_CODEC_SHIFT;
+    uint64_t cas = item_get_cas(it);
+    uint64_t last;
+    uint32_t hv;
+    bool ret = false;
+
+    if (it->nkey == 0 || ntotal > engine->slabs.slabclass[id].size) {
+        return false;
+    }
+    /* The chunks of a chained value aren't where they used to be */
+    if ((it->iflag & (ITEM_CHAINED | ITEM_CHUNK)) != 0) {
+        return false;
+    }
+    /* We can't inflate a warm item without its codec */
+    if (codec != CODEC_NONE && codec_get(codec) == NULL) {
+        return false;
+    }
+
+    hv = engine->server.hash(item_get_key(it), it->nkey, 0);
+    item_lock(engine, hv);
+    if (assoc_find(engine, hv, item_get_key(it), it->nkey) == NULL) {
+        it->iflag = (it->iflag & ~ITEM_SLABBED) | ITEM_LINKED;
+        it->next = it->prev = it->h_next = 0;
+        /* The cache holds the only reference */
+        it->refcount = 1;
+        assoc_insert(engine, hv, it);
+
+        pthread_mutex_lock(&engine->stats.lock);
+        engine->stats.curr_bytes += ntotal;
+        engine->stats.curr_items += 1;
+        engine->stats.total_items += 1;
+        if (codec != CODEC_NONE) {
+            engine->stats.warm_bytes += ntotal;
+            engine->stats.warm_items += 1;
+        }
+        pthread_mutex_unlock(&engine->stats.lock);
+        slabs_adjust_mem_requested(engine, id, 0, ntotal);
+
+        /* New CAS ids must be higher than the restored ones */
+        while ((last = engine->items.cas_id) < cas &&
+               !__sync_bool_compare_and_swap(&engine->items.cas_id, last, cas)) {
+            ;
+        }
+
+        pthread_mutex_lock(&engine->items.lru_locks[id]);
+        item_link_q(engine, it);
+        pthread_mutex_unlock(&engine->items.lru_locks[id]);
+
+        /* It wasn't written to disk before the snapshot was taken */
+        if ((it->iflag & ITEM_DIRTY) != 0) {
+            it->iflag &= ~ITEM_DIRTY;
+            engine->storage->store_item(engine, it);
+        }
+        ret = true;
+    }
+    item_unlock(engine, hv);
+
+    return ret;
+}
+
+void item_lru_info(struct persistent_engine *engine, unsigned int id,
+                   unsigned int *evicted, rel_time_t *age) {
+    rel_time_t current_time = engine->server.get_current_time();
+
+    pthread_mutex_lock(&engine->items.lru_locks[id]);
+    *evicted = engine->items.itemstats[id].evicted +
+        engine->items.itemstats[id].outofmemory;
+    if (engine->items.tails[id] != NULL) {
+        *age = current_time - engine->items.tails[id]->time;
+    } else {
+        *age = 0;
+    }
+    pthread_mutex_unlock(&engine->items.lru_locks[id]);
 }
 
 /*
@@ -758,9 +1849,10 @@ ENGINE_ERROR_CODE add_delta(struct persistent_engine *engine,
                             uint64_t *result, const void *cookie) {
     ENGINE_ERROR_CODE ret;
 
-    pthread_mutex_lock(&engine->cache_lock);
+    uint32_t hv = engine->server.hash(item_get_key(item), item->nkey, 0);
+    item_lock(engine, hv);
     ret = do_add_delta(engine, item, incr, delta, rcas, result, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
+    item_unlock(engine, hv);
     return ret;
 }
 
@@ -773,12 +1865,228 @@ ENGINE_ERROR_CODE store_item(struct persistent_engine *engine,
                              bool notify, const void *cookie) {
     ENGINE_ERROR_CODE ret;
 
-    pthread_mutex_lock(&engine->cache_lock);
-    ret = do_store_item(engine, item, cas, operation, notify, cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
+    /* Don't wait for the writer while we hold the item lock */
+    if (!cas_reserve(engine)) {
+        return ENGINE_TMPFAIL;
+    }
+
+    uint32_t hv = engine->server.hash(item_get_key(item), item->nkey, 0);
+
+    item_lock(engine, hv);
+    ret = do_store_item(engine, item, cas, operation, notify, cookie, hv);
+    item_unlock(engine, hv);
     return ret;
 }
 
+static hash_item *compress_item(struct persistent_engine *engine,
+                                hash_item *item) {
+    const struct codec *codec = engine->codec;
+    struct compressor *c = get_compressor(engine);
+    if (c == NULL) {
+        return NULL;
+    }
+
+    size_t needed = COMPRESS_HEADER_SIZE + codec->bound(item->nbytes);
+    if (c->buffersize < needed) {
+        char *buffer = realloc(c->buffer, needed);
+        if (buffer == NULL) {
+            return NULL;
+        }
+        c->buffer = buffer;
+        c->buffersize = needed;
+    }
+
+    uint64_t start = latency_start(engine);
+    size_t size = codec->compress(c->ctx, item_get_data(item), item->nbytes,
+                                  c->buffer + COMPRESS_HEADER_SIZE,
+                                  c->buffersize - COMPRESS_HEADER_SIZE);
+    latency_record(engine, LATENCY_COMPRESS, start);
+    if (size == 0) {
+        return NULL;
+    }
+
+    size += COMPRESS_HEADER_SIZE;
+    if (size < item->nbytes) {
+        hash_item *n = do_item_alloc(engine, item_get_key(item), item->nkey,
+                                     item->flags, item->exptime, size, NULL,
+                                     true);
+        if (n == NULL) {
+            return NULL;
+        }
+        uint32_t len = htonl(item->nbytes);
+        memcpy(c->buffer, &len, sizeof(len));
+        memcpy(item_get_data(n), c->buffer, size);
+        n->iflag |= codec->id << ITEM_CODEC_SHIFT;
+        if (engine->config.verbose > 1) {
+            fprintf(stderr, "Moving item to the warm tier. Raw: %u, compressed %u (%s)\n",
+                    item->nbytes, n->nbytes, codec->name);
+        }
+        return n;
+    }
+
+    return NULL;
+}
+
+/*
+ * Has the item been invalidated by a flush_all (and not expired lazily
+ * yet)? There's no point in compressing those.
+ */
+static bool item_is_flushed(struct persistent_engine *engine,
+                            const hash_item *it, rel_time_t current_time) {
+    rel_time_t oldest_live = engine->config.oldest_live;
+    return oldest_live != 0 && oldest_live <= current_time &&
+        it->time <= oldest_live;
+}
+
+/*
+ * The maximum number of items the compactor tries to compress in each
+ * slab class per pass
+ */
+#define COMPACTOR_BATCH_SIZE 256
+
+/*
+ * Move the cold (not accessed for compress_min_age seconds) raw items at
+ * the tail of an LRU to the warm tier, by replacing them with compressed
+ * copies. The items are already on disk (we skip the dirty ones), so the
+ * copies don't need to be written, and evicting them later just drops
+ * them from memory.
+ * @return the number of items compressed
+ */
+static int item_compact_class(struct persistent_engine *engine, int id) {
+    hash_item *items[COMPACTOR_BATCH_SIZE];
+    rel_time_t current_time = engine->server.get_current_time();
+    /* Don't hold the lru lock too long if the tail is already compressed */
+    int tries = COMPACTOR_BATCH_SIZE * 4;
+    int nitems = 0;
+    int compacted = 0;
+    int ii;
+    hash_item *it;
+
+    pthread_mutex_lock(&engine->items.lru_locks[id]);
+    for (it = engine->items.tails[id];
+         it != NULL && nitems < COMPACTOR_BATCH_SIZE && tries > 0;
+         it = it->prev, tries--) {
+        if (it->time + engine->config.compress_min_age > current_time) {
+            /* The rest of the items are newer */
+            break;
+        }
+        if ((it->iflag & (ITEM_CODEC_MASK | ITEM_COMPRESS_TRIED |
+                          ITEM_DIRTY | ITEM_CHAINED)) == 0 &&
+            it->nbytes >= engine->config.min_compress_size &&
+            (it->exptime == 0 || it->exptime > current_time) &&
+            !item_is_flushed(engine, it, current_time)) {
+            /* The item can't be unlinked while we hold the lru lock */
+            __sync_add_and_fetch(&it->refcount, 1);
+            items[nitems++] = it;
+        }
+    }
+    pthread_mutex_unlock(&engine->items.lru_locks[id]);
+
+    for (ii = 0; ii < nitems; ++ii) {
+        hash_item *compressed;
+        uint32_t hv;
+
+        it = items[ii];
+        compressed = compress_item(engine, it);
+        hv = engine->server.hash(item_get_key(it), it->nkey, 0);
+
+        item_lock(engine, hv);
+        if ((it->iflag & (ITEM_LINKED | ITEM_DIRTY)) != ITEM_LINKED ||
+            item_is_flushed(engine, it, current_time)) {
+            /* The item was changed or flushed while we compressed it */
+        } else if (compressed == NULL) {
+            it->iflag |= ITEM_COMPRESS_TRIED;
+        } else {
+            /* The value didn't change, so the client's CAS is still valid */
+            do_item_replace_copy(engine, it, compressed, hv);
+            ++compacted;
+        }
+        item_unlock(engine, hv);
+
+        if (compressed != NULL) {
+            do_item_release(engine, compressed);
+        }
+        do_item_release(engine, it);
+    }
+
+    return compacted;
+}
+
+static void *item_compactor_thread(void *arg) {
+    struct persistent_engine *engine = arg;
+    struct items *items = &engine->items;
+
+    pthread_mutex_lock(&items->compactor_lock);
+    while (!items->compactor_shutdown) {
+        struct timeval tv;
+        struct timespec ts;
+        int id;
+        int compacted = 0;
+
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + engine->config.compress_interval;
+        ts.tv_nsec = tv.tv_usec * 1000;
+        while (!items->compactor_shutdown &&
+               pthread_cond_timedwait(&items->compactor_cond,
+                                      &items->compactor_lock, &ts) != ETIMEDOUT) {
+            /* spurious wakeup */
+        }
+        if (items->compactor_shutdown) {
+            break;
+        }
+        pthread_mutex_unlock(&items->compactor_lock);
+
+        for (id = POWER_SMALLEST; id < POWER_LARGEST; id++) {
+            int n;
+            /* Keep going while the tail is full of cold raw items */
+            do {
+                n = item_compact_class(engine, id);
+                compacted += n;
+            } while (n == COMPACTOR_BATCH_SIZE && !items->compactor_shutdown);
+        }
+        if (engine->config.verbose && compacted > 0) {
+            fprintf(stderr, "Moved %d cold items to the warm tier\n", compacted);
+        }
+
+        pthread_mutex_lock(&items->compactor_lock);
+    }
+    pthread_mutex_unlock(&items->compactor_lock);
+
+    return NULL;
+}
+
+ENGINE_ERROR_CODE item_start_compactor(struct persistent_engine *engine) {
+    int ret;
+
+    if (engine->codec == NULL) {
+        return ENGINE_SUCCESS;
+    }
+
+    pthread_mutex_init(&engine->items.compactor_lock, NULL);
+    pthread_cond_init(&engine->items.compactor_cond, NULL);
+    if ((ret = pthread_create(&engine->items.compactor_tid, NULL,
+                              item_compactor_thread, engine)) != 0) {
+        fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
+        return ENGINE_FAILED;
+    }
+    engine->items.compactor_running = true;
+
+    return ENGINE_SUCCESS;
+}
+
+void item_stop_compactor(struct persistent_engine *engine) {
+    if (engine->items.compactor_running) {
+        pthread_mutex_lock(&engine->items.compactor_lock);
+        engine->items.compactor_shutdown = true;
+        pthread_cond_signal(&engine->items.compactor_cond);
+        pthread_mutex_unlock(&engine->items.compactor_lock);
+        pthread_join(engine->items.compactor_tid, NULL);
+        engine->items.compactor_running = false;
+        pthread_cond_destroy(&engine->items.compactor_cond);
+        pthread_mutex_destroy(&engine->items.compactor_lock);
+    }
+}
+
 /*
  * Flushes expired items after a flush_all call
  */
@@ -786,37 +2094,48 @@ void item_flush_expired(struct persistent_engine *engine, time_t when) {
     int i;
     hash_item *iter, *next;
 
-    pthread_mutex_lock(&engine->cache_lock);
+    rel_time_t current_time = engine->server.get_current_time();
 
     if (when == 0) {
-        engine->config.oldest_live = engine->server.get_current_time() - 1;
+        engine->config.oldest_live = current_time - 1;
+        engine->storage->flush(engine, 0);
     } else {
         engine->config.oldest_live = engine->server.realtime(when) - 1;
+        engine->storage->flush(engine, time(NULL) +
+                               (engine->config.oldest_live + 1 - current_time));
     }
 
     if (engine->config.oldest_live != 0) {
         for (i = 0; i < POWER_LARGEST; i++) {
+            pthread_mutex_lock(&engine->items.lru_locks[i]);
             /*
              * The LRU is sorted in decreasing time order, and an item's
              * timestamp is never newer than its last access time, so we
              * only need to walk back until we hit an item older than the
              * oldest_live time.
-             * The oldest_live checking will auto-expire the remaining items.
+             * The oldest_live checking will auto-expire the remaining items
+             * (and the ones we fail to lock, as we can't block for the item
+             * lock while holding the lru lock).
              */
             for (iter = engine->items.heads[i]; iter != NULL; iter = next) {
                 if (iter->time >= engine->config.oldest_live) {
                     next = iter->next;
                     if ((iter->iflag & ITEM_SLABBED) == 0) {
-                        do_item_unlink(engine, iter);
+                        uint32_t hv = engine->server.hash(item_get_key(iter),
+                                                          iter->nkey, 0);
+                        if (item_trylock(engine, hv)) {
+                            do_item_unlink_nolock(engine, iter, hv);
+                            item_unlock(engine, hv);
+                        }
                     }
                 } else {
                     /* We've hit the first old item. Continue to the next queue. */
                     break;
                 }
             }
+            pthread_mutex_unlock(&engine->items.lru_locks[i]);
         }
     }
-    pthread_mutex_unlock(&engine->cache_lock);
 }
 
 /*
@@ -828,25 +2147,25 @@ char *item_cachedump(struct persistent_engine *engine,
                      unsigned int *bytes) {
     char *ret;
 
-    pthread_mutex_lock(&engine->cache_lock);
+    if (slabs_clsid >= POWER_LARGEST) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&engine->items.lru_locks[slabs_clsid]);
     ret = do_item_cachedump(slabs_clsid, limit, bytes);
-    pthread_mutex_unlock(&engine->cache_lock);
+    pthread_mutex_unlock(&engine->items.lru_locks[slabs_clsid]);
     return ret;
 }
 
 void item_stats(struct persistent_engine *engine,
                    ADD_STAT add_stat, const void *cookie)
 {
-    pthread_mutex_lock(&engine->cache_lock);
     do_item_stats(engine, add_stat, (void*)cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
 }
 
 
 void item_stats_sizes(struct persistent_engine *engine,
                       ADD_STAT add_stat, const void *cookie)
 {
-    pthread_mutex_lock(&engine->cache_lock);
     do_item_stats_sizes(engine, add_stat, (void*)cookie);
-    pthread_mutex_unlock(&engine->cache_lock);
 }
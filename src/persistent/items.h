@@ -4,6 +4,10 @@
 /*
  * You should not try to aquire any of the item locks before calling these
  * functions.
+ *
+ * Locking order: item lock (see assoc.h) -> lru lock -> slabs lock ->
+ * stats lock. A linked item holds a reference to itself, and the
+ * refcount is only modified with atomic operations.
  */
 typedef struct _hash_item {
     struct _hash_item *next;
@@ -36,8 +40,42 @@ struct items {
    hash_item *tails[POWER_LARGEST];
    itemstats_t itemstats[POWER_LARGEST];
    unsigned int sizes[POWER_LARGEST];
+   /* Each LRU (and its itemstats) is protected by its own lock */
+   pthread_mutex_t lru_locks[POWER_LARGEST];
+   /* The last CAS id handed out to a thread (updated with atomic operations) */
+   uint64_t cas_id;
+   /* We may hand out CAS ids up to this one (persisted by the writer) */
+   volatile uint64_t cas_limit;
+   /* Signalled (under cas_lock) when the writer moves cas_limit */
+   pthread_mutex_t cas_lock;
+   pthread_cond_t cas_cond;
+   /* The block of CAS ids reserved by each thread */
+   pthread_key_t cas_key;
+   /* Each thread gets its own codec context and scratch buffer */
+   pthread_key_t compressors_key;
+   /* All of the compressors (protected by compressors_lock) */
+   struct compressor *compressors;
+   pthread_mutex_t compressors_lock;
+   /* The compactor moves cold items to the warm tier (compression_codec) */
+   pthread_t compactor_tid;
+   pthread_mutex_t compactor_lock;
+   pthread_cond_t compactor_cond;
+   bool compactor_running;
+   bool compactor_shutdown;
 };
 
+/**
+ * Initialize the item subsystem
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_init(struct persistent_engine *engine);
+
+/**
+ * Release the resources used by the item subsystem
+ * @param engine handle to the storage engine
+ */
+void item_destroy(struct persistent_engine *engine);
 
 /**
  * Allocate and initialize a new item structure
@@ -54,7 +92,54 @@ hash_item *item_alloc(struct persistent_engine *engine,
                       rel_time_t exptime, int nbytes, const void *cookie);
 
 /**
- * Get an item from the cache
+ * Allocate an item for a value we read from disk
+ * @param engine handle to the storage engine
+ * @param key the key for the new item
+ * @param nkey the number of bytes in the key
+ * @param flags the flags in the new item
+ * @param exptime when the object should expire
+ * @param nbytes the number of bytes in the body for the item
+ * @param prefetch nobody is waiting for the item (warmup and read ahead),
+ *                 so the admission filter may refuse it
+ * @return a pointer to an item on success NULL otherwise
+ */
+hash_item *item_alloc_disk(struct persistent_engine *engine,
+                           const void *key, size_t nkey, int flags,
+                           rel_time_t exptime, int nbytes, bool prefetch);
+
+/**
+ * Get the parts of the value of an item. A chained item (see
+ * slab_chunk_max) has its value split over a number of chunks.
+ * @param it the item
+ * @param iov where to store the parts
+ * @param niov the number of entries in iov
+ * @return the number of parts (only the first niov are stored)
+ */
+int item_get_iov(const hash_item *it, struct iovec *iov, int niov);
+
+/**
+ * Copy a part of the value of an item out
+ * @param it the item
+ * @param offset where in the value to start
+ * @param dest where to store the data
+ * @param len the number of bytes to copy
+ */
+void item_read_value(const hash_item *it, size_t offset,
+                     void *dest, size_t len);
+
+/**
+ * Copy data into the value of an item
+ * @param it the item
+ * @param offset where in the value to store it
+ * @param src the data to store
+ * @param len the number of bytes to copy
+ */
+void item_write_value(hash_item *it, size_t offset,
+                      const void *src, size_t len);
+
+/**
+ * Get an item from the cache. A warm (compressed) item is inflated and
+ * replaces the warm copy in the cache.
  *
  * @param engine handle to the storage engine
  * @param key the key for the item to get
@@ -64,6 +149,21 @@ hash_item *item_alloc(struct persistent_engine *engine,
 hash_item *item_get(struct persistent_engine *engine,
                     const void *key, const size_t nkey);
 
+/**
+ * Get a number of items from the cache. The keys are looked up in groups
+ * sorted by item lock, so each lock is only taken once per group.
+ *
+ * @param engine handle to the storage engine
+ * @param nkeys the number of keys to look up
+ * @param keys the keys for the items to get
+ * @param lengths the number of bytes in each key
+ * @param items where to store the items (NULL for the keys we don't have)
+ * @return the number of items found
+ */
+int item_get_multi(struct persistent_engine *engine, int nkeys,
+                   const void * const *keys, const size_t *lengths,
+                   hash_item **items);
+
 /**
  * Reset the item statistics
  * @param engine handle to the storage engine
@@ -127,6 +227,84 @@ void item_release(struct persistent_engine *engine, hash_item *it);
  */
 void item_unlink(struct persistent_engine *engine, hash_item *it);
 
+/**
+ * Remove a key from the cache and queue its removal from disk
+ * @param engine handle to the storage engine
+ * @param key the key to remove
+ * @param nkey the number of bytes in the key
+ * @return ENGINE_SUCCESS on success, ENGINE_ENOMEM or ENGINE_TMPFAIL if
+ *         the removal couldn't be queued (nothing is removed then)
+ */
+ENGINE_ERROR_CODE item_delete(struct persistent_engine *engine,
+                              const void *key, const size_t nkey);
+
+/**
+ * Start the thread moving cold items to the warm tier (if
+ * compression_codec is set)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE item_start_compactor(struct persistent_engine *engine);
+
+/**
+ * Stop the thread moving cold items to the warm tier
+ * @param engine handle to the storage engine
+ */
+void item_stop_compactor(struct persistent_engine *engine);
+
+/**
+ * Pick up the items the write queue didn't have room for (the ones
+ * marked ITEM_DIRTY). We take a reference to each of them and clear the
+ * dirty bit, except for the flushed ones which are just cleared.
+ * @param engine handle to the storage engine
+ * @param collect called for each item (with the lru and item locks held)
+ * @param arg passed on to collect
+ * @return false if we couldn't lock some of the dirty items
+ */
+bool item_collect_dirty(struct persistent_engine *engine,
+                        void (*collect)(hash_item *it, void *arg),
+                        void *arg);
+
+/**
+ * Link an item restored from a snapshot (in a page added by
+ * slabs_restore_page). Restore the items of an LRU from the tail to the
+ * head to keep their order.
+ * @param engine handle to the storage engine
+ * @param it the item to link
+ * @return false if the item is invalid, its codec is missing, or the key
+ *         is already in the cache (the chunk is still free)
+ */
+bool item_restore(struct persistent_engine *engine, hash_item *it);
+
+/**
+ * Unlink an item so that the slab rebalancer may reuse its memory
+ * @param engine handle to the storage engine
+ * @param it the chunk to evacuate (may not hold a linked item)
+ * @param chunk_size the size of the chunk
+ * @return true if the item was unlinked
+ */
+bool item_evacuate(struct persistent_engine *engine, hash_item *it,
+                   size_t chunk_size);
+
+/**
+ * Get the information the slab rebalancer uses to pick the classes
+ * @param engine handle to the storage engine
+ * @param id the slab class
+ * @param evicted where to store the number of items evicted (or that we
+ *                failed to allocate)
+ * @param age where to store the age of the oldest item in the LRU
+ */
+void item_lru_info(struct persistent_engine *engine, unsigned int id,
+                   unsigned int *evicted, rel_time_t *age);
+
+/**
+ * Called by the backend once it persisted that we may use CAS ids up to
+ * limit (wakes up the stores waiting for it)
+ * @param engine handle to the storage engine
+ * @param limit the new limit
+ */
+void item_set_cas_limit(struct persistent_engine *engine, uint64_t limit);
+
 /**
  * Store an item in the cache
  * @param engine handle to the storage engine
@@ -0,0 +1,277 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Per thread latency histograms
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "persistent_engine.h"
+
+static const char *op_names[LATENCY_OPS] = {
+    [LATENCY_GET] = "get",
+    [LATENCY_STORE] = "store",
+    [LATENCY_DELETE] = "delete",
+    [LATENCY_ARITHMETIC] = "arithmetic",
+    [LATENCY_DISK_READ] = "disk_read",
+    [LATENCY_DISK_WRITE] = "disk_write",
+    [LATENCY_COMPRESS] = "compress",
+    [LATENCY_INFLATE] = "inflate"
+};
+
+static const char *counter_names[LATENCY_COUNTERS] = {
+    [LATENCY_GET_HITS] = "get_hits",
+    [LATENCY_GET_MISSES] = "get_misses",
+    [LATENCY_GET_EWOULDBLOCK] = "get_ewouldblock",
+    [LATENCY_LOCK_WAITS] = "lock_waits",
+    [LATENCY_LOCK_WAIT_NS] = "lock_wait_ns"
+};
+
+static void add_thread(struct latency_thread *total,
+                       const struct latency_thread *t) {
+    int op, ii;
+    for (op = 0; op < LATENCY_OPS; ++op) {
+        for (ii = 0; ii < LATENCY_BUCKETS; ++ii) {
+            total->ops[op].counts[ii] += t->ops[op].counts[ii];
+        }
+        total->ops[op].total_ns += t->ops[op].total_ns;
+    }
+    for (ii = 0; ii < LATENCY_COUNTERS; ++ii) {
+        total->counters[ii] += t->counters[ii];
+    }
+}
+
+/* Keep what an exiting thread recorded */
+static void thread_exit(void *arg) {
+    struct latency_thread *t = arg;
+    struct latency *l = t->owner;
+    struct latency_thread **p;
+
+    pthread_mutex_lock(&l->lock);
+    for (p = &l->threads; *p != NULL; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    add_thread(&l->retired, t);
+    pthread_mutex_unlock(&l->lock);
+    free(t);
+}
+
+ENGINE_ERROR_CODE latency_init(struct persistent_engine *engine) {
+    struct latency *l = &engine->latency;
+
+    l->enabled = engine->config.latency_stats;
+    l->threads = NULL;
+    memset(&l->retired, 0, sizeof(l->retired));
+    memset(&l->baseline, 0, sizeof(l->baseline));
+    pthread_mutex_init(&l->lock, NULL);
+    if (pthread_key_create(&l->key, thread_exit) != 0) {
+        fprintf(stderr, "Failed to create the latency key\n");
+        return ENGINE_FAILED;
+    }
+
+    return ENGINE_SUCCESS;
+}
+
+void latency_destroy(struct persistent_engine *engine) {
+    struct latency *l = &engine->latency;
+    struct latency_thread *t;
+
+    pthread_key_delete(l->key);
+    while ((t = l->threads) != NULL) {
+        l->threads = t->next;
+        free(t);
+    }
+    pthread_mutex_destroy(&l->lock);
+}
+
+/* Get the histograms of the calling thread */
+static struct latency_thread *get_thread(struct latency *l) {
+    struct latency_thread *t = pthread_getspecific(l->key);
+    if (t == NULL) {
+        if ((t = calloc(1, sizeof(*t))) == NULL) {
+            return NULL;
+        }
+        t->owner = l;
+        pthread_mutex_lock(&l->lock);
+        t->next = l->threads;
+        l->threads = t;
+        pthread_mutex_unlock(&l->lock);
+        pthread_setspecific(l->key, t);
+    }
+    return t;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t latency_start(struct persistent_engine *engine) {
+    return engine->latency.enabled ? now_ns() : 0;
+}
+
+static int bucket(uint64_t ns) {
+    int msb, shift;
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return (int)ns;
+    }
+    msb = 63 - __builtin_clzll(ns);
+    if (msb >= LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    shift = msb - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS +
+        (int)((ns >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+/* The highest value recorded in a bucket */
+static uint64_t bucket_max(int idx) {
+    int shift;
+    if (idx < LATENCY_SUB_BUCKETS) {
+        return idx;
+    }
+    shift = idx / LATENCY_SUB_BUCKETS - 1;
+    return (((uint64_t)LATENCY_SUB_BUCKETS + idx % LATENCY_SUB_BUCKETS) << shift) +
+        ((uint64_t)1 << shift) - 1;
+}
+
+void latency_record(struct persistent_engine *engine, enum latency_op op,
+                    uint64_t start) {
+    struct latency_thread *t;
+    uint64_t ns;
+
+    if (start == 0 || (t = get_thread(&engine->latency)) == NULL) {
+        return;
+    }
+    ns = now_ns() - start;
+    t->ops[op].counts[bucket(ns)]++;
+    t->ops[op].total_ns += ns;
+}
+
+void latency_count(struct persistent_engine *engine,
+                   enum latency_counter counter, uint64_t n) {
+    struct latency_thread *t;
+    if (engine->latency.enabled &&
+        (t = get_thread(&engine->latency)) != NULL) {
+        t->counters[counter] += n;
+    }
+}
+
+void latency_lock_wait(struct persistent_engine *engine, uint64_t start) {
+    struct latency_thread *t;
+    if (start != 0 && (t = get_thread(&engine->latency)) != NULL) {
+        t->counters[LATENCY_LOCK_WAITS]++;
+        t->counters[LATENCY_LOCK_WAIT_NS] += now_ns() - start;
+    }
+}
+
+/* Add up all of the threads (the caller holds the lock) */
+static void do_latency_totals(struct latency *l, struct latency_thread *total) {
+    struct latency_thread *t;
+    memcpy(total, &l->retired, sizeof(*total));
+    for (t = l->threads; t != NULL; t = t->next) {
+        add_thread(total, t);
+    }
+}
+
+static void add_histogram(const char *name, const struct latency_histogram *h,
+                          const struct latency_histogram *base,
+                          ADD_STAT add_stat, const void *cookie) {
+    static const struct {
+        const char *name;
+        double fraction;
+    } percentiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+    const size_t npercentiles = sizeof(percentiles) / sizeof(percentiles[0]);
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t count = 0, seen = 0;
+    size_t next = 0;
+    int ii, max = 0;
+    char key[64];
+
+    for (ii = 0; ii < LATENCY_BUCKETS; ++ii) {
+        counts[ii] = h->counts[ii] - base->counts[ii];
+        if (counts[ii] != 0) {
+            count += counts[ii];
+            max = ii;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    snprintf(key, sizeof(key), "%s_count", name);
+    add_statistics(cookie, add_stat, NULL, -1, key, "%llu",
+                   (unsigned long long)count);
+    snprintf(key, sizeof(key), "%s_mean_ns", name);
+    add_statistics(cookie, add_stat, NULL, -1, key, "%llu",
+                   (unsigned long long)((h->total_ns - base->total_ns) / count));
+    for (ii = 0; ii < LATENCY_BUCKETS && next < npercentiles; ++ii) {
+        seen += counts[ii];
+        while (next < npercentiles &&
+               seen >= percentiles[next].fraction * count) {
+            snprintf(key, sizeof(key), "%s_%s_ns", name, percentiles[next].name);
+            add_statistics(cookie, add_stat, NULL, -1, key, "%llu",
+                           (unsigned long long)bucket_max(ii));
+            ++next;
+        }
+    }
+    snprintf(key, sizeof(key), "%s_max_ns", name);
+    add_statistics(cookie, add_stat, NULL, -1, key, "%llu",
+                   (unsigned long long)bucket_max(max));
+}
+
+void latency_stats(struct persistent_engine *engine, ADD_STAT add_stat,
+                   const void *cookie) {
+    struct latency *l = &engine->latency;
+    struct latency_thread *total;
+    uint64_t counters[LATENCY_COUNTERS];
+    uint64_t gets;
+    int ii;
+
+    if (!l->enabled || (total = malloc(sizeof(*total))) == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&l->lock);
+    do_latency_totals(l, total);
+    for (ii = 0; ii < LATENCY_OPS; ++ii) {
+        add_histogram(op_names[ii], &total->ops[ii], &l->baseline.ops[ii],
+                      add_stat, cookie);
+    }
+    for (ii = 0; ii < LATENCY_COUNTERS; ++ii) {
+        counters[ii] = total->counters[ii] - l->baseline.counters[ii];
+    }
+    pthread_mutex_unlock(&l->lock);
+    free(total);
+
+    for (ii = 0; ii < LATENCY_COUNTERS; ++ii) {
+        add_statistics(cookie, add_stat, NULL, -1, counter_names[ii], "%llu",
+                       (unsigned long long)counters[ii]);
+    }
+
+    gets = counters[LATENCY_GET_HITS] + counters[LATENCY_GET_MISSES] +
+        counters[LATENCY_GET_EWOULDBLOCK];
+    if (gets > 0) {
+        add_statistics(cookie, add_stat, NULL, -1, "get_hit_ratio", "%.4f",
+                       (double)counters[LATENCY_GET_HITS] / gets);
+        add_statistics(cookie, add_stat, NULL, -1, "get_miss_ratio", "%.4f",
+                       (double)counters[LATENCY_GET_MISSES] / gets);
+        add_statistics(cookie, add_stat, NULL, -1, "get_ewouldblock_ratio",
+                       "%.4f", (double)counters[LATENCY_GET_EWOULDBLOCK] / gets);
+    }
+}
+
+void latency_reset(struct persistent_engine *engine) {
+    struct latency *l = &engine->latency;
+    pthread_mutex_lock(&l->lock);
+    do_latency_totals(l, &l->baseline);
+    pthread_mutex_unlock(&l->lock);
+}
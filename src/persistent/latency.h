@@ -0,0 +1,118 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Latency histograms and hot path counters, reported by "stats latency".
+ * Every thread records into its own histograms, so the hot path doesn't
+ * take any locks or share any cache lines with the other threads. The
+ * stats add up the threads, and reset_stats just remembers the totals so
+ * that it doesn't need to touch the histograms of the other threads.
+ *
+ * The histograms are log-linear (like a HDR histogram): each power of two
+ * nanoseconds is split into LATENCY_SUB_BUCKETS buckets, so we record a
+ * value with an error of less than 1/LATENCY_SUB_BUCKETS.
+ */
+enum latency_op {
+   LATENCY_GET,
+   LATENCY_STORE,
+   LATENCY_DELETE,
+   LATENCY_ARITHMETIC,
+   LATENCY_DISK_READ,
+   LATENCY_DISK_WRITE,
+   /* Moving an item to the warm tier and back */
+   LATENCY_COMPRESS,
+   LATENCY_INFLATE,
+   LATENCY_OPS
+};
+
+enum latency_counter {
+   LATENCY_GET_HITS,
+   LATENCY_GET_MISSES,
+   LATENCY_GET_EWOULDBLOCK,
+   /* The number of times we had to wait for an item lock, and for how long */
+   LATENCY_LOCK_WAITS,
+   LATENCY_LOCK_WAIT_NS,
+   LATENCY_COUNTERS
+};
+
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+/* Everything from 2^LATENCY_MAX_BITS ns (about a minute) ends up in the last bucket */
+#define LATENCY_MAX_BITS 36
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+struct latency_histogram {
+   uint64_t counts[LATENCY_BUCKETS];
+   uint64_t total_ns;
+};
+
+/* The numbers recorded by one thread (only updated by that thread) */
+struct latency_thread {
+   struct latency_histogram ops[LATENCY_OPS];
+   uint64_t counters[LATENCY_COUNTERS];
+   struct latency *owner;
+   struct latency_thread *next;
+};
+
+struct latency {
+   bool enabled;
+   pthread_key_t key;
+   /* Protects the list of threads, retired and baseline */
+   pthread_mutex_t lock;
+   struct latency_thread *threads;
+   /* The numbers recorded by the threads that have exited */
+   struct latency_thread retired;
+   /* The totals when the stats were reset */
+   struct latency_thread baseline;
+};
+
+ENGINE_ERROR_CODE latency_init(struct persistent_engine *engine);
+
+void latency_destroy(struct persistent_engine *engine);
+
+/**
+ * Get the time to pass to latency_record
+ * @param engine handle to the storage engine
+ * @return the current time in ns (0 if we don't collect latencies)
+ */
+uint64_t latency_start(struct persistent_engine *engine);
+
+/**
+ * Record the time an operation took
+ * @param engine handle to the storage engine
+ * @param op the operation
+ * @param start when the operation started (see latency_start)
+ */
+void latency_record(struct persistent_engine *engine, enum latency_op op,
+                    uint64_t start);
+
+/**
+ * Add to one of the counters
+ * @param engine handle to the storage engine
+ * @param counter the counter
+ * @param n the number to add
+ */
+void latency_count(struct persistent_engine *engine,
+                   enum latency_counter counter, uint64_t n);
+
+/**
+ * Count a wait for a lock
+ * @param engine handle to the storage engine
+ * @param start when we started waiting (see latency_start)
+ */
+void latency_lock_wait(struct persistent_engine *engine, uint64_t start);
+
+void latency_stats(struct persistent_engine *engine, ADD_STAT add_stat,
+                   const void *cookie);
+
+void latency_reset(struct persistent_engine *engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,1189 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * An append-only storage backend. The items are appended to a log of
+ * segment files, and an in-memory index maps each key to the location of
+ * its latest record. The writer appends a batch of items with a single
+ * write and syncs the segment once for the whole batch (group commit).
+ * A compactor rewrites the live records of the segments that are mostly
+ * garbage, and removes them.
+ *
+ * A removed key gets a tombstone record, which we keep until there are
+ * no older segments left that may hold a record for the key. flush_all
+ * starts a new generation: every record carries the generation it was
+ * written in, and the records from older generations are ignored.
+ */
+#include "persistent_engine.h"
+#include "io_threads.h"
+#include "logstore.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <map>
+#include <vector>
+
+/* The record types in the log */
+#define LOG_RECORD_ITEM 1
+#define LOG_RECORD_CAS 2
+#define LOG_RECORD_DELETE 3
+#define LOG_RECORD_FLUSH 4
+
+/*
+ * The header of each record in the log. It is followed by the key and
+ * the value (for a CAS record the value is the 64 bit CAS limit, and
+ * tombstones and flush records don't have a value).
+ */
+struct log_record {
+    /** Checksum of the rest of the record (including key and value) */
+    uint32_t checksum;
+    uint32_t nbytes;
+    uint32_t flags;
+    /** The absolute expiry time (see disk_exptime) */
+    uint32_t exptime;
+    /** The flush generation the record belongs to */
+    uint32_t generation;
+    uint16_t nkey;
+    uint8_t type;
+    uint8_t reserved;
+};
+
+/* The maximum number of bytes the compactor copies while blocking the writer */
+#define LOG_COMPACT_CHUNK (1024 * 1024)
+
+/* How often (in seconds) the compactor looks for segments to compact */
+#define LOG_COMPACT_INTERVAL 1
+
+/* The number of keys the purge checks while blocking the writer */
+#define LOG_PURGE_CHUNK 10000
+
+static uint32_t log_checksum(uint32_t h, const void *data, size_t n) {
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    for (size_t ii = 0; ii < n; ++ii) {
+        h ^= p[ii];
+        h *= 16777619;
+    }
+    return h;
+}
+
+static size_t record_size(const log_record &rec) {
+    return sizeof(rec) + rec.nkey + rec.nbytes;
+}
+
+/**
+ * Get the header of a record. The records are packed back to back in the
+ * segments, so the header may not be aligned.
+ */
+static log_record record_header(const char *data) {
+    log_record rec;
+    memcpy(&rec, data, sizeof(rec));
+    return rec;
+}
+
+/**
+ * Calculate the checksum of a record
+ * @param data the start of the record
+ * @param rec the header of the record
+ * @return the checksum to store in the header
+ */
+static uint32_t record_checksum(const char *data, const log_record &rec) {
+    return log_checksum(2166136261U, data + sizeof(uint32_t),
+                        record_size(rec) - sizeof(uint32_t));
+}
+
+/** Where the latest record for a key lives */
+struct log_location {
+    uint32_t segment;
+    uint32_t size;
+    uint64_t offset;
+    /** The expiry time of the item */
+    uint32_t exptime;
+    /** The record is a tombstone */
+    bool deleted;
+};
+
+/** Check if the latest record for a key holds an item we may use */
+static bool location_present(const log_location &loc, time_t now) {
+    return !loc.deleted && (loc.exptime == 0 || (time_t)loc.exptime > now);
+}
+
+/**
+ * A segment file. Protected by the index lock, except that only the
+ * thread holding the append lock may write to the active segment.
+ */
+struct log_segment {
+    uint32_t id;
+    int fd;
+    /** The number of bytes written to the segment */
+    uint64_t size;
+    /** The number of those bytes the index points to */
+    uint64_t live;
+    /** The number of readers using the file */
+    int refcount;
+    /** The segment was compacted, remove it once the readers are done */
+    bool dead;
+};
+
+/**
+ * Statistics collected by the log. All members are protected by the
+ * index lock.
+ */
+struct log_stats {
+    log_stats() { reset(); }
+
+    void reset() {
+        batches = 0;
+        items = 0;
+        deletes = 0;
+        failed = 0;
+        sync_usec = 0;
+        sync_usec_max = 0;
+        compactions = 0;
+        compacted_bytes = 0;
+        purged = 0;
+    }
+
+    /** The number of batches written */
+    uint64_t batches;
+    /** The number of items written */
+    uint64_t items;
+    /** The number of those that removed a key */
+    uint64_t deletes;
+    /** The number of items we failed to write */
+    uint64_t failed;
+    /** The total time spent syncing the batches to disk */
+    uint64_t sync_usec;
+    /** The slowest sync we've seen */
+    uint64_t sync_usec_max;
+    /** The number of segments compacted */
+    uint64_t compactions;
+    /** The number of bytes the compactor copied */
+    uint64_t compacted_bytes;
+    /** The number of expired items the purge replaced with tombstones */
+    uint64_t purged;
+};
+
+/**
+ * The log itself: the segments, the index and the writer thread. The
+ * WriteQueue holds the items waiting to be written.
+ *
+ * Locking order: append lock -> index lock. The append lock serializes
+ * the writer and the compactor, so the order of the records in the log
+ * always matches the order of the updates to the index.
+ */
+class LogStore : public WriteQueue {
+public:
+    LogStore(struct persistent_engine* se)
+        : WriteQueue(se), engine(se), prefix(se->config.dbname),
+          segmentSize(se->config.log_segment_size),
+          compactThreshold(se->config.log_compact_threshold),
+          purgeInterval((uint64_t)se->config.purge_interval * 1000000),
+          active(NULL), nextId(1) {
+        pthread_mutex_init(&appendLock, NULL);
+        pthread_mutex_init(&indexLock, NULL);
+        pthread_mutex_init(&compactLock, NULL);
+        pthread_cond_init(&compactCond, NULL);
+    }
+
+    /**
+     * Rebuild the index from the segments on disk, and open the segment
+     * we'll append to.
+     * @return true on success
+     */
+    bool initialize() {
+        std::vector<uint32_t> ids;
+        if (!listSegments(ids)) {
+            return false;
+        }
+
+        uint64_t cas = 0;
+        uint32_t gen = 0;
+        std::vector<uint32_t>::iterator iter;
+        for (iter = ids.begin(); iter != ids.end(); ++iter) {
+            log_segment *seg = openSegment(*iter, false);
+            if (seg == NULL) {
+                return false;
+            }
+            segments[seg->id] = seg;
+            if (!recover(seg, cas, gen)) {
+                return false;
+            }
+            nextId = seg->id + 1;
+        }
+
+        engine->items.cas_id = cas;
+        engine->items.cas_limit = cas;
+        setGeneration(gen);
+
+        /* Continue appending to the last segment if it has room */
+        if (!ids.empty() && segments[ids.back()]->size < segmentSize) {
+            active = segments[ids.back()];
+            return true;
+        }
+        return roll();
+    }
+
+    bool mayExist(const std::string &key) {
+        time_t now = time(NULL);
+        pthread_mutex_lock(&indexLock);
+        std::map<std::string, log_location>::iterator iter = index.find(key);
+        bool ret = iter != index.end() && location_present(iter->second, now);
+        pthread_mutex_unlock(&indexLock);
+        return ret;
+    }
+
+    /**
+     * Get the keys following a key that start with a prefix
+     * @param key the key to start after
+     * @param pfx the prefix
+     * @param max the maximum number of keys to return
+     * @param keys where to store the keys
+     */
+    void nextKeys(const std::string &key, const std::string &pfx, size_t max,
+                  std::vector<std::string> &keys) {
+        time_t now = time(NULL);
+        pthread_mutex_lock(&indexLock);
+        std::map<std::string, log_location>::iterator iter;
+        for (iter = index.upper_bound(key);
+             iter != index.end() && keys.size() < max &&
+                 iter->first.compare(0, pfx.length(), pfx) == 0;
+             ++iter) {
+            if (location_present(iter->second, now)) {
+                keys.push_back(iter->first);
+            }
+        }
+        pthread_mutex_unlock(&indexLock);
+    }
+
+    /**
+     * Read the latest record for a key, and add it to the cache
+     * @param key the key to read
+     * @param buffer a buffer for the record
+     * @param prefetch nobody is waiting for the key (see load_item)
+     * @return true if we found the key
+     */
+    bool readItem(const std::string &key, std::vector<char> &buffer,
+                  bool prefetch = false) {
+        pthread_mutex_lock(&indexLock);
+        std::map<std::string, log_location>::iterator iter = index.find(key);
+        if (iter == index.end() || iter->second.deleted) {
+            pthread_mutex_unlock(&indexLock);
+            return false;
+        }
+        log_location loc = iter->second;
+        log_segment *seg = segments[loc.segment];
+        ++seg->refcount;
+        pthread_mutex_unlock(&indexLock);
+
+        bool ret = false;
+        log_record rec;
+        buffer.resize(loc.size);
+        if (readAll(seg->fd, &buffer[0], loc.size, loc.offset) &&
+            (rec = record_header(&buffer[0])).checksum ==
+            record_checksum(&buffer[0], rec)) {
+            /* The index isn't cleared until the flush is written */
+            const char *data = &buffer[0] + sizeof(rec);
+            ret = rec.generation == currentGeneration() &&
+                load_item(engine, key, rec.flags, rec.exptime,
+                          data + rec.nkey, rec.nbytes, prefetch);
+        } else {
+            fprintf(stderr, "Failed to read %s from segment %u\n",
+                    key.c_str(), seg->id);
+        }
+
+        pthread_mutex_lock(&indexLock);
+        releaseSegment(seg);
+        pthread_mutex_unlock(&indexLock);
+        return ret;
+    }
+
+    void addStats(ADD_STAT add_stat, const void *cookie) {
+        uint64_t bytes = 0;
+        uint64_t live = 0;
+        pthread_mutex_lock(&indexLock);
+        log_stats s = stats;
+        size_t nsegments = segments.size();
+        size_t nkeys = index.size();
+        std::map<uint32_t, log_segment*>::iterator iter;
+        for (iter = segments.begin(); iter != segments.end(); ++iter) {
+            bytes += iter->second->size;
+            live += iter->second->live;
+        }
+        pthread_mutex_unlock(&indexLock);
+
+        add_statistics(cookie, add_stat, NULL, -1, "log_segments",
+                       "%llu", (unsigned long long)nsegments);
+        add_statistics(cookie, add_stat, NULL, -1, "log_keys",
+                       "%llu", (unsigned long long)nkeys);
+        add_statistics(cookie, add_stat, NULL, -1, "log_bytes",
+                       "%llu", (unsigned long long)bytes);
+        add_statistics(cookie, add_stat, NULL, -1, "log_live_bytes",
+                       "%llu", (unsigned long long)live);
+        add_statistics(cookie, add_stat, NULL, -1, "log_write_batches",
+                       "%llu", (unsigned long long)s.batches);
+        add_statistics(cookie, add_stat, NULL, -1, "log_write_items",
+                       "%llu", (unsigned long long)s.items);
+        add_statistics(cookie, add_stat, NULL, -1, "log_write_deletes",
+                       "%llu", (unsigned long long)s.deletes);
+        add_statistics(cookie, add_stat, NULL, -1, "log_write_failed",
+                       "%llu", (unsigned long long)s.failed);
+        add_statistics(cookie, add_stat, NULL, -1, "log_sync_latency_avg_us",
+                       "%llu", (unsigned long long)(s.batches ? s.sync_usec / s.batches : 0));
+        add_statistics(cookie, add_stat, NULL, -1, "log_sync_latency_max_us",
+                       "%llu", (unsigned long long)s.sync_usec_max);
+        add_statistics(cookie, add_stat, NULL, -1, "log_compactions",
+                       "%llu", (unsigned long long)s.compactions);
+        add_statistics(cookie, add_stat, NULL, -1, "log_compacted_bytes",
+                       "%llu", (unsigned long long)s.compacted_bytes);
+        add_statistics(cookie, add_stat, NULL, -1, "log_purged",
+                       "%llu", (unsigned long long)s.purged);
+        add_statistics(cookie, add_stat, NULL, -1, "log_flush_generation",
+                       "%u", currentGeneration());
+        addQueueStats(add_stat, cookie, "log");
+    }
+
+    void resetStats() {
+        pthread_mutex_lock(&indexLock);
+        stats.reset();
+        pthread_mutex_unlock(&indexLock);
+        resetQueueStats();
+    }
+
+    static void *writerMain(void *arg) {
+        static_cast<LogStore*>(arg)->runWriter();
+        return NULL;
+    }
+
+    static void *compactorMain(void *arg) {
+        static_cast<LogStore*>(arg)->runCompactor();
+        return NULL;
+    }
+
+private:
+    std::string segmentName(uint32_t id) {
+        char name[32];
+        snprintf(name, sizeof(name), ".%08u.log", id);
+        return prefix + name;
+    }
+
+    /** Find the ids of the segments on disk (in log order) */
+    bool listSegments(std::vector<uint32_t> &ids) {
+        std::string dir = ".";
+        std::string base = prefix;
+        std::string::size_type slash = prefix.rfind('/');
+        if (slash != std::string::npos) {
+            dir = slash == 0 ? "/" : prefix.substr(0, slash);
+            base = prefix.substr(slash + 1);
+        }
+        base.append(".");
+
+        DIR *dp = opendir(dir.c_str());
+        if (dp == NULL) {
+            fprintf(stderr, "Failed to open %s: %s\n", dir.c_str(),
+                    strerror(errno));
+            return false;
+        }
+
+        struct dirent *de;
+        while ((de = readdir(dp)) != NULL) {
+            std::string name(de->d_name);
+            if (name.length() == base.length() + 12 &&
+                name.compare(0, base.length(), base) == 0 &&
+                name.compare(name.length() - 4, 4, ".log") == 0) {
+                ids.push_back(strtoul(name.c_str() + base.length(), NULL, 10));
+            }
+        }
+        closedir(dp);
+
+        std::sort(ids.begin(), ids.end());
+        return true;
+    }
+
+    log_segment *openSegment(uint32_t id, bool create) {
+        std::string name = segmentName(id);
+        int fd = open(name.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0),
+                      S_IRUSR | S_IWUSR);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            fprintf(stderr, "Failed to open %s: %s\n", name.c_str(),
+                    strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            return NULL;
+        }
+
+        log_segment *seg = new log_segment;
+        seg->id = id;
+        seg->fd = fd;
+        seg->size = st.st_size;
+        seg->live = 0;
+        seg->refcount = 0;
+        seg->dead = false;
+        return seg;
+    }
+
+    /**
+     * Add the records in a segment to the index. A torn write at the end
+     * of the segment (we crashed while appending) is cut off.
+     * @param seg the segment to read
+     * @param cas where to store the highest CAS limit we've seen
+     * @param gen the newest flush generation we've seen
+     */
+    bool recover(log_segment *seg, uint64_t &cas, uint32_t &gen) {
+        std::vector<char> data(seg->size);
+        if (seg->size > 0 && !readAll(seg->fd, &data[0], seg->size, 0)) {
+            fprintf(stderr, "Failed to read segment %u: %s\n", seg->id,
+                    strerror(errno));
+            return false;
+        }
+
+        uint64_t offset = 0;
+        while (offset + sizeof(log_record) <= seg->size) {
+            log_record rec = record_header(&data[offset]);
+            size_t size = record_size(rec);
+            if (offset + size > seg->size ||
+                rec.checksum != record_checksum(&data[offset], rec)) {
+                break;
+            }
+
+            const char *body = &data[offset] + sizeof(rec);
+            if (rec.generation > gen) {
+                /* Everything we've read so far was flushed */
+                dropIndex();
+                gen = rec.generation;
+            }
+            if ((rec.type == LOG_RECORD_ITEM ||
+                 rec.type == LOG_RECORD_DELETE) && rec.generation == gen) {
+                log_location loc;
+                loc.segment = seg->id;
+                loc.offset = offset;
+                loc.size = size;
+                loc.exptime = rec.exptime;
+                loc.deleted = rec.type == LOG_RECORD_DELETE;
+                seg->live += size;
+                updateIndex(std::string(body, rec.nkey), loc);
+            } else if (rec.type == LOG_RECORD_CAS &&
+                       rec.nbytes == sizeof(uint64_t)) {
+                uint64_t limit;
+                memcpy(&limit, body + rec.nkey, sizeof(limit));
+                if (limit > cas) {
+                    cas = limit;
+                }
+            }
+            offset += size;
+        }
+
+        if (offset != seg->size) {
+            fprintf(stderr, "Discarding %llu bytes of garbage at the end of "
+                    "segment %u\n", (unsigned long long)(seg->size - offset),
+                    seg->id);
+            if (ftruncate(seg->fd, offset) == -1) {
+                return false;
+            }
+            seg->size = offset;
+        }
+        return true;
+    }
+
+    /**
+     * Point the index at a new record for a key, and account for the
+     * record it replaces (the caller holds the index lock, or is the only
+     * thread running)
+     */
+    void updateIndex(const std::string &key, const log_location &loc) {
+        std::map<std::string, log_location>::iterator iter = index.find(key);
+        if (iter != index.end()) {
+            segments_live(iter->second.segment, iter->second.size);
+            iter->second = loc;
+        } else {
+            index[key] = loc;
+        }
+    }
+
+    /**
+     * Remove all of the keys from the index (the caller holds the index
+     * lock, or is the only thread running)
+     */
+    void dropIndex() {
+        std::map<std::string, log_location>::iterator iter;
+        for (iter = index.begin(); iter != index.end(); ++iter) {
+            segments_live(iter->second.segment, iter->second.size);
+        }
+        index.clear();
+    }
+
+    /** Subtract a replaced record from the live bytes of its segment */
+    void segments_live(uint32_t id, uint32_t size) {
+        std::map<uint32_t, log_segment*>::iterator iter = segments.find(id);
+        if (iter != segments.end()) {
+            iter->second->live -= size;
+        }
+    }
+
+    /**
+     * Release a reference to a segment, and remove it if it's been
+     * compacted (the caller holds the index lock)
+     */
+    void releaseSegment(log_segment *seg) {
+        if (--seg->refcount == 0 && seg->dead) {
+            close(seg->fd);
+            unlink(segmentName(seg->id).c_str());
+            delete seg;
+        }
+    }
+
+    static bool readAll(int fd, char *buf, size_t n, uint64_t offset) {
+        while (n > 0) {
+            ssize_t nr = pread(fd, buf, n, offset);
+            if (nr <= 0) {
+                if (nr == -1 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            buf += nr;
+            n -= nr;
+            offset += nr;
+        }
+        return true;
+    }
+
+    static bool writeAll(int fd, const char *buf, size_t n, uint64_t offset) {
+        while (n > 0) {
+            ssize_t nw = pwrite(fd, buf, n, offset);
+            if (nw == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            buf += nw;
+            n -= nw;
+            offset += nw;
+        }
+        return true;
+    }
+
+    /**
+     * Append a record to a buffer
+     * @return the size of the record
+     */
+    static size_t appendRecord(std::vector<char> &buffer, uint8_t type,
+                               uint32_t flags, uint32_t exptime,
+                               uint32_t generation,
+                               const char *key, uint16_t nkey,
+                               const void *data, uint32_t nbytes) {
+        log_record rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.type = type;
+        rec.flags = flags;
+        rec.exptime = exptime;
+        rec.generation = generation;
+        rec.nkey = nkey;
+        rec.nbytes = nbytes;
+
+        size_t offset = buffer.size();
+        size_t size = record_size(rec);
+        buffer.resize(offset + size);
+        char *start = &buffer[offset];
+        memcpy(start, &rec, sizeof(rec));
+        memcpy(start + sizeof(rec), key, nkey);
+        memcpy(start + sizeof(rec) + nkey, data, nbytes);
+        rec.checksum = record_checksum(start, rec);
+        memcpy(start, &rec.checksum, sizeof(rec.checksum));
+        return size;
+    }
+
+    static size_t appendCas(std::vector<char> &buffer, uint64_t limit,
+                            uint32_t generation) {
+        return appendRecord(buffer, LOG_RECORD_CAS, 0, 0, generation, NULL, 0,
+                            &limit, sizeof(limit));
+    }
+
+    static size_t appendTombstone(std::vector<char> &buffer,
+                                  const std::string &key,
+                                  uint32_t generation) {
+        return appendRecord(buffer, LOG_RECORD_DELETE, 0, 0, generation,
+                            key.data(), key.length(), NULL, 0);
+    }
+
+    /**
+     * Start a new active segment. It starts with the CAS limit (and the
+     * flush generation), so they survive the compaction of the older
+     * segments. The caller holds the append lock (or is the only thread
+     * running).
+     */
+    bool roll() {
+        log_segment *seg = openSegment(nextId, true);
+        if (seg == NULL) {
+            return false;
+        }
+        ++nextId;
+
+        std::vector<char> buffer;
+        appendCas(buffer, engine->items.cas_limit, currentGeneration());
+        if (!writeAll(seg->fd, &buffer[0], buffer.size(), 0) ||
+            fsync(seg->fd) == -1) {
+            close(seg->fd);
+            delete seg;
+            return false;
+        }
+        seg->size = buffer.size();
+
+        pthread_mutex_lock(&indexLock);
+        segments[seg->id] = seg;
+        active = seg;
+        pthread_mutex_unlock(&indexLock);
+        return true;
+    }
+
+    /**
+     * Write a buffer of records to the end of the active segment (the
+     * caller holds the append lock)
+     * @param buffer the records to write
+     * @param offset where to store the offset of the buffer in the segment
+     * @param sync sync the segment to disk
+     * @return true on success
+     */
+    bool append(const std::vector<char> &buffer, uint64_t &offset, bool sync) {
+        if (active->size + buffer.size() > segmentSize &&
+            active->size > sizeof(log_record) + sizeof(uint64_t) && !roll()) {
+            return false;
+        }
+
+        offset = active->size;
+        if (!writeAll(active->fd, &buffer[0], buffer.size(), offset)) {
+            return false;
+        }
+
+        uint64_t start = now_usec();
+        if (sync && fsync(active->fd) == -1) {
+            return false;
+        }
+        uint64_t elapsed = now_usec() - start;
+
+        pthread_mutex_lock(&indexLock);
+        active->size += buffer.size();
+        if (sync) {
+            stats.sync_usec += elapsed;
+            if (elapsed > stats.sync_usec_max) {
+                stats.sync_usec_max = elapsed;
+            }
+        }
+        pthread_mutex_unlock(&indexLock);
+        return true;
+    }
+
+    /**
+     * Write a batch of items (and a new CAS limit and flush generation)
+     * with a single write and a single sync.
+     */
+    void storeBatch(write_batch &batch) {
+        std::vector<std::pair<std::string, log_location> > written;
+        std::vector<char> buffer;
+        std::vector<char> value;
+        uint64_t deletes = 0;
+        log_location loc;
+
+        if (batch.flushed) {
+            appendRecord(buffer, LOG_RECORD_FLUSH, 0, 0, batch.generation,
+                         NULL, 0, NULL, 0);
+        }
+
+        written.reserve(batch.items.size());
+        std::vector<std::pair<std::string, hash_item*> >::iterator iter;
+        for (iter = batch.items.begin(); iter != batch.items.end(); ++iter) {
+            hash_item *it = iter->second;
+            loc.offset = buffer.size();
+            if (it == NULL) {
+                loc.size = appendTombstone(buffer, iter->first,
+                                           batch.generation);
+                loc.exptime = 0;
+                loc.deleted = true;
+                ++deletes;
+            } else {
+                loc.exptime = disk_exptime(engine, it->exptime);
+                loc.size = appendRecord(buffer, LOG_RECORD_ITEM, it->flags,
+                                        loc.exptime, batch.generation,
+                                        item_get_key(it), it->nkey,
+                                        item_value(it, value), it->nbytes);
+                loc.deleted = false;
+            }
+            written.push_back(std::make_pair(iter->first, loc));
+        }
+        if (batch.cas != 0) {
+            appendCas(buffer, batch.cas, batch.generation);
+        }
+
+        pthread_mutex_lock(&appendLock);
+        uint64_t offset;
+        bool success = append(buffer, offset, true);
+        pthread_mutex_lock(&indexLock);
+        if (success) {
+            if (batch.flushed) {
+                dropIndex();
+            }
+            std::vector<std::pair<std::string, log_location> >::iterator w;
+            for (w = written.begin(); w != written.end(); ++w) {
+                w->second.segment = active->id;
+                w->second.offset += offset;
+                active->live += w->second.size;
+                updateIndex(w->first, w->second);
+            }
+        } else {
+            fprintf(stderr, "Failed to write to segment %u (will retry): %s\n",
+                    active->id, strerror(errno));
+            stats.failed += batch.items.size();
+        }
+        stats.batches++;
+        stats.items += batch.items.size();
+        stats.deletes += deletes;
+        pthread_mutex_unlock(&indexLock);
+        pthread_mutex_unlock(&appendLock);
+
+        if (!success) {
+            /* The next append starts where this one did */
+            retry(batch);
+        } else if (batch.cas != 0) {
+            item_set_cas_limit(engine, batch.cas);
+        }
+    }
+
+    void runWriter() {
+        write_batch batch;
+        batch.items.reserve(batchSize);
+
+        while (true) {
+            next(batch, 0);
+            if (!batch.items.empty() || batch.cas != 0 || batch.flushed) {
+                uint64_t start = latency_start(engine);
+                storeBatch(batch);
+                latency_record(engine, LATENCY_DISK_WRITE, start);
+            }
+            complete(batch);
+        }
+    }
+
+    /**
+     * Find the sealed segment with the smallest share of live records
+     * (below the threshold), and take a reference to it.
+     */
+    log_segment *pickSegment() {
+        log_segment *victim = NULL;
+        pthread_mutex_lock(&indexLock);
+        std::map<uint32_t, log_segment*>::iterator iter;
+        for (iter = segments.begin(); iter != segments.end(); ++iter) {
+            log_segment *seg = iter->second;
+            if (seg == active || seg->size == 0) {
+                continue;
+            }
+            if (seg->live * 100 < seg->size * compactThreshold &&
+                (victim == NULL ||
+                 seg->live * victim->size < victim->live * seg->size)) {
+                victim = seg;
+            }
+        }
+        if (victim != NULL) {
+            ++victim->refcount;
+        }
+        pthread_mutex_unlock(&indexLock);
+        return victim;
+    }
+
+    /**
+     * Copy the live records in a chunk of a segment to the end of the log.
+     * We hold the append lock while we check which records are live, so
+     * the writer can't store a newer version of a key in between (the
+     * copy would otherwise end up after it in the log).
+     *
+     * The tombstones (and the expired items, which are replaced by
+     * tombstones) are only needed while an older segment may hold a
+     * record for the key.
+     */
+    bool compactChunk(log_segment *seg, const std::vector<char> &data,
+                      uint64_t start, uint64_t end) {
+        std::vector<std::pair<std::string, log_location> > moved;
+        std::vector<char> buffer;
+        time_t now = time(NULL);
+
+        pthread_mutex_lock(&appendLock);
+        pthread_mutex_lock(&indexLock);
+        bool oldest = segments.begin()->first == seg->id;
+        for (uint64_t offset = start; offset < end; ) {
+            log_record rec = record_header(&data[offset]);
+            size_t size = record_size(rec);
+            if (rec.type == LOG_RECORD_ITEM || rec.type == LOG_RECORD_DELETE) {
+                std::string key(&data[offset] + sizeof(rec), rec.nkey);
+                std::map<std::string, log_location>::iterator iter;
+                iter = index.find(key);
+                if (iter != index.end() && iter->second.segment == seg->id &&
+                    iter->second.offset == offset) {
+                    log_location loc = iter->second;
+                    loc.offset = buffer.size();
+                    if (location_present(loc, now)) {
+                        loc.size = size;
+                        buffer.insert(buffer.end(), &data[offset],
+                                      &data[offset] + size);
+                        moved.push_back(std::make_pair(key, loc));
+                    } else if (oldest) {
+                        seg->live -= size;
+                        index.erase(iter);
+                    } else {
+                        loc.size = appendTombstone(buffer, key, rec.generation);
+                        loc.exptime = 0;
+                        loc.deleted = true;
+                        moved.push_back(std::make_pair(key, loc));
+                    }
+                }
+            }
+            offset += size;
+        }
+        pthread_mutex_unlock(&indexLock);
+
+        bool success = true;
+        if (!buffer.empty()) {
+            uint64_t offset;
+            success = append(buffer, offset, false);
+            if (success) {
+                pthread_mutex_lock(&indexLock);
+                std::vector<std::pair<std::string, log_location> >::iterator m;
+                for (m = moved.begin(); m != moved.end(); ++m) {
+                    m->second.segment = active->id;
+                    m->second.offset += offset;
+                    active->live += m->second.size;
+                    updateIndex(m->first, m->second);
+                }
+                stats.compacted_bytes += buffer.size();
+                pthread_mutex_unlock(&indexLock);
+            }
+        }
+        pthread_mutex_unlock(&appendLock);
+        return success;
+    }
+
+    /**
+     * Move the live records out of a segment, and remove it
+     * @return true on success
+     */
+    bool compact(log_segment *seg) {
+        /* Nobody appends to a sealed segment, so its size is stable */
+        std::vector<char> data(seg->size);
+        bool success = readAll(seg->fd, &data[0], seg->size, 0);
+
+        uint64_t start = 0;
+        while (success && start < seg->size) {
+            uint64_t end = start;
+            while (end < seg->size && end - start < LOG_COMPACT_CHUNK) {
+                end += record_size(record_header(&data[end]));
+            }
+            success = compactChunk(seg, data, start, end);
+            start = end;
+        }
+
+        /* The copies must be on disk before we remove the originals */
+        pthread_mutex_lock(&appendLock);
+        if (success && fsync(active->fd) == -1) {
+            success = false;
+        }
+        pthread_mutex_unlock(&appendLock);
+
+        pthread_mutex_lock(&indexLock);
+        if (success) {
+            segments.erase(seg->id);
+            seg->dead = true;
+            stats.compactions++;
+        } else {
+            fprintf(stderr, "Failed to compact segment %u: %s\n", seg->id,
+                    strerror(errno));
+        }
+        releaseSegment(seg);
+        pthread_mutex_unlock(&indexLock);
+        return success;
+    }
+
+    /**
+     * Replace the expired items in the next chunk of the index with
+     * tombstones, so the segments holding them get compacted
+     * @return true when we've been through the entire index
+     */
+    bool purgeChunk() {
+        std::vector<std::pair<std::string, log_location> > expired;
+        std::vector<char> buffer;
+        time_t now = time(NULL);
+        uint32_t gen = currentGeneration();
+        bool done;
+
+        pthread_mutex_lock(&appendLock);
+        pthread_mutex_lock(&indexLock);
+        std::map<std::string, log_location>::iterator iter;
+        iter = index.lower_bound(purgeKey);
+        for (size_t ii = 0; iter != index.end() && ii < LOG_PURGE_CHUNK;
+             ++iter, ++ii) {
+            const log_location &old = iter->second;
+            if (!old.deleted && old.exptime != 0 && (time_t)old.exptime <= now) {
+                log_location loc;
+                loc.offset = buffer.size();
+                loc.size = appendTombstone(buffer, iter->first, gen);
+                loc.exptime = 0;
+                loc.deleted = true;
+                expired.push_back(std::make_pair(iter->first, loc));
+            }
+        }
+        done = iter == index.end();
+        purgeKey = done ? std::string() : iter->first;
+        pthread_mutex_unlock(&indexLock);
+
+        uint64_t offset;
+        if (!buffer.empty() && append(buffer, offset, false)) {
+            pthread_mutex_lock(&indexLock);
+            std::vector<std::pair<std::string, log_location> >::iterator e;
+            for (e = expired.begin(); e != expired.end(); ++e) {
+                e->second.segment = active->id;
+                e->second.offset += offset;
+                active->live += e->second.size;
+                updateIndex(e->first, e->second);
+            }
+            stats.purged += expired.size();
+            pthread_mutex_unlock(&indexLock);
+        }
+        pthread_mutex_unlock(&appendLock);
+        return done;
+    }
+
+    void runCompactor() {
+        uint64_t purgeAt = now_usec() + purgeInterval;
+        pthread_mutex_lock(&compactLock);
+        while (true) {
+            struct timeval tv;
+            struct timespec ts;
+            gettimeofday(&tv, NULL);
+            ts.tv_sec = tv.tv_sec + LOG_COMPACT_INTERVAL;
+            ts.tv_nsec = tv.tv_usec * 1000;
+            pthread_cond_timedwait(&compactCond, &compactLock, &ts);
+            pthread_mutex_unlock(&compactLock);
+
+            /* Don't retry a failed segment until the next round */
+            log_segment *seg;
+            while ((seg = pickSegment()) != NULL) {
+                if (engine->config.verbose) {
+                    fprintf(stderr, "Compacting log segment %u\n", seg->id);
+                }
+                if (!compact(seg)) {
+                    break;
+                }
+            }
+
+            if (purgeInterval != 0 && now_usec() >= purgeAt) {
+                while (!purgeChunk()) {
+                    ;
+                }
+                purgeAt = now_usec() + purgeInterval;
+            }
+            pthread_mutex_lock(&compactLock);
+        }
+    }
+
+    struct persistent_engine* engine;
+    /** The segments are named prefix.<id>.log */
+    std::string prefix;
+    /** Start a new segment once the active one is this big */
+    uint64_t segmentSize;
+    /** Compact a segment once less than this percentage of it is live */
+    uint64_t compactThreshold;
+    /** How often (in usec) we look for expired items (0 == never) */
+    uint64_t purgeInterval;
+    /** Where the purge continues in the index */
+    std::string purgeKey;
+
+    /** Serializes the writes to the log */
+    pthread_mutex_t appendLock;
+    /** Protects the index, the segments and the stats */
+    pthread_mutex_t indexLock;
+    std::map<std::string, log_location> index;
+    std::map<uint32_t, log_segment*> segments;
+    /** The segment we append to */
+    log_segment *active;
+    uint32_t nextId;
+    struct log_stats stats;
+
+    pthread_mutex_t compactLock;
+    pthread_cond_t compactCond;
+};
+
+/**
+ * A thread reading the keys the frontend is missing from the log
+ */
+class LogReader {
+public:
+    LogReader(struct persistent_engine* se, LogStore *s, ReadQueue *q)
+        : engine(se), store(s), queue(q),
+          batchSize(se->config.read_batch_size) {
+        if (batchSize == 0) {
+            batchSize = 1;
+        }
+    }
+
+    static void *run(void *arg) {
+        static_cast<LogReader*>(arg)->run();
+        return NULL;
+    }
+
+private:
+    void run() {
+        std::vector<std::pair<const void*, ENGINE_ERROR_CODE> > notify;
+        std::vector<std::string> keys;
+        std::map<std::string, std::string> last;
+        std::vector<char> buffer;
+        std::string pfx;
+
+        while (true) {
+            queue->next(keys, batchSize);
+            std::vector<std::string>::iterator k;
+            for (k = keys.begin(); k != keys.end(); ++k) {
+                uint64_t start = latency_start(engine);
+                bool found = store->readItem(*k, buffer);
+                latency_record(engine, LATENCY_DISK_READ, start);
+                queue->complete(*k, found, notify);
+                if (found && queue->readAheadPrefix(*k, pfx) &&
+                    last[pfx] < *k) {
+                    last[pfx] = *k;
+                }
+            }
+
+            std::vector<std::pair<const void*, ENGINE_ERROR_CODE> >::iterator iter;
+            for (iter = notify.begin(); iter != notify.end(); ++iter) {
+                engine->server.notify_io_complete(iter->first, iter->second);
+            }
+            notify.clear();
+
+            /* Don't keep the clients waiting for the read ahead */
+            std::map<std::string, std::string>::iterator l;
+            for (l = last.begin(); l != last.end(); ++l) {
+                readAhead(l->second, l->first, buffer);
+            }
+            last.clear();
+            keys.clear();
+        }
+    }
+
+    /**
+     * Load the keys following a key we just read that share its prefix,
+     * so that a client walking through a namespace finds them in memory
+     */
+    void readAhead(const std::string &key, const std::string &pfx,
+                   std::vector<char> &buffer) {
+        std::vector<std::string> next;
+        size_t loaded = 0;
+        store->nextKeys(key, pfx, engine->config.read_ahead, next);
+        std::vector<std::string>::iterator k;
+        for (k = next.begin(); k != next.end(); ++k) {
+            if (!in_cache(engine, *k) && store->readItem(*k, buffer, true)) {
+                ++loaded;
+            }
+        }
+        queue->readAhead(loaded);
+    }
+
+    struct persistent_engine* engine;
+    LogStore *store;
+    ReadQueue *queue;
+    size_t batchSize;
+};
+
+ENGINE_ERROR_CODE log_io_start_threads(struct persistent_engine *engine)
+{
+    LogStore *store = new LogStore(engine);
+    if (!store->initialize()) {
+        return ENGINE_FAILED;
+    }
+
+    ReadQueue *queue = new ReadQueue(engine, "log");
+    engine->reader = static_cast<void*>(queue);
+    engine->writer = static_cast<void*>(store);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, LogStore::writerMain, store) != 0 ||
+        pthread_create(&tid, NULL, LogStore::compactorMain, store) != 0) {
+        return ENGINE_FAILED;
+    }
+
+    size_t num_readers = engine->config.reader_threads;
+    if (num_readers == 0) {
+        num_readers = 1;
+    }
+    for (size_t ii = 0; ii < num_readers; ++ii) {
+        LogReader *reader = new LogReader(engine, store, queue);
+        if (pthread_create(&tid, NULL, LogReader::run, reader) != 0) {
+            return ENGINE_FAILED;
+        }
+    }
+
+    return ENGINE_SUCCESS;
+}
+
+bool log_io_may_exist(struct persistent_engine* engine,
+                      const void *key, uint16_t keylen) {
+    std::string k(reinterpret_cast<const char*>(key), keylen);
+    return (reinterpret_cast<LogStore*>(engine->writer))->mayExist(k);
+}
+
+void log_io_get_item(struct persistent_engine* engine,
+                     const void* cookie,
+                     const void *key,
+                     uint16_t keylen)
+{
+    std::string k(reinterpret_cast<const char*>(key), keylen);
+    (reinterpret_cast<ReadQueue*>(engine->reader))->enqueue(cookie, k);
+}
+
+void log_io_get_items(struct persistent_engine* engine,
+                      const void* cookie, int nkeys,
+                      const void * const *keys, const size_t *lengths)
+{
+    std::vector<std::string> k;
+    k.reserve(nkeys);
+    for (int ii = 0; ii < nkeys; ++ii) {
+        k.push_back(std::string(reinterpret_cast<const char*>(keys[ii]),
+                                lengths[ii]));
+    }
+    (reinterpret_cast<ReadQueue*>(engine->reader))->enqueue(cookie, k);
+}
+
+void log_io_store_item(struct persistent_engine* engine, hash_item* item) {
+    (reinterpret_cast<LogStore*>(engine->writer))->enqueue(item);
+}
+
+ENGINE_ERROR_CODE log_io_remove_item(struct persistent_engine* engine,
+                                     const void *key, uint16_t keylen) {
+    return (reinterpret_cast<LogStore*>(engine->writer))->remove(key, keylen);
+}
+
+void log_io_flush(struct persistent_engine* engine, time_t when) {
+    (reinterpret_cast<LogStore*>(engine->writer))->flush(when);
+}
+
+void log_io_reserve_cas(struct persistent_engine* engine, uint64_t limit) {
+    (reinterpret_cast<LogStore*>(engine->writer))->reserveCas(limit);
+}
+
+void log_io_stats(struct persistent_engine* engine,
+                  ADD_STAT add_stat, const void *cookie) {
+    (reinterpret_cast<ReadQueue*>(engine->reader))->addStats(add_stat,
+                                                             cookie);
+    (reinterpret_cast<LogStore*>(engine->writer))->addStats(add_stat,
+                                                            cookie);
+}
+
+void log_io_reset_stats(struct persistent_engine* engine) {
+    (reinterpret_cast<ReadQueue*>(engine->reader))->resetStats();
+    (reinterpret_cast<LogStore*>(engine->writer))->resetStats();
+}
@@ -0,0 +1,27 @@
+#ifndef LOGSTORE_H
+#define LOGSTORE_H
+
+/*
+ * A storage backend appending the items to a log of segment files (see
+ * logstore.cc). The functions match the ones in struct storage.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   ENGINE_ERROR_CODE log_io_start_threads(struct persistent_engine *engine);
+   bool log_io_may_exist(struct persistent_engine* engine, const void *key, uint16_t keylen);
+   void log_io_get_item(struct persistent_engine* engine, const void* cookie, const void *key, uint16_t keylen);
+   void log_io_get_items(struct persistent_engine* engine, const void* cookie, int nkeys, const void * const *keys, const size_t *lengths);
+   void log_io_store_item(struct persistent_engine* engine, hash_item* item);
+   ENGINE_ERROR_CODE log_io_remove_item(struct persistent_engine* engine, const void *key, uint16_t keylen);
+   void log_io_flush(struct persistent_engine* engine, time_t when);
+   void log_io_reserve_cas(struct persistent_engine* engine, uint64_t limit);
+   void log_io_stats(struct persistent_engine* engine, ADD_STAT add_stat, const void *cookie);
+   void log_io_reset_stats(struct persistent_engine* engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,153 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The keys we recently failed to read from disk
+ *
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "persistent_engine.h"
+
+ENGINE_ERROR_CODE negative_cache_init(struct persistent_engine *engine) {
+    struct negative_cache *nc = &engine->negative;
+    size_t size = NEGATIVE_CACHE_LOCKS;
+    int ii;
+
+    nc->entries = NULL;
+    nc->mask = 0;
+    if (engine->config.negative_cache_size == 0) {
+        return ENGINE_SUCCESS;
+    }
+
+    /* Make room for at least the requested number of keys */
+    while (size < engine->config.negative_cache_size) {
+        size <<= 1;
+    }
+    if ((nc->entries = calloc(size, sizeof(*nc->entries))) == NULL) {
+        fprintf(stderr, "Failed to allocate the negative cache\n");
+        return ENGINE_ENOMEM;
+    }
+    nc->mask = size - 1;
+
+    for (ii = 0; ii < NEGATIVE_CACHE_LOCKS; ++ii) {
+        pthread_mutex_init(&nc->locks[ii], NULL);
+    }
+
+    return ENGINE_SUCCESS;
+}
+
+void negative_cache_destroy(struct persistent_engine *engine) {
+    struct negative_cache *nc = &engine->negative;
+    int ii;
+
+    if (nc->entries != NULL) {
+        for (ii = 0; ii < NEGATIVE_CACHE_LOCKS; ++ii) {
+            pthread_mutex_destroy(&nc->locks[ii]);
+        }
+        free(nc->entries);
+        nc->entries = NULL;
+    }
+}
+
+/* The slots of a lock are the ones with the same low bits */
+static inline pthread_mutex_t *slot_lock(struct negative_cache *nc,
+                                         size_t slot) {
+    return &nc->locks[slot % NEGATIVE_CACHE_LOCKS];
+}
+
+uint32_t negative_cache_ticket(struct persistent_engine *engine, uint32_t hv) {
+    struct negative_cache *nc = &engine->negative;
+    size_t slot = hv & nc->mask;
+    uint32_t ret;
+
+    if (nc->entries == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(slot_lock(nc, slot));
+    ret = nc->entries[slot].version;
+    pthread_mutex_unlock(slot_lock(nc, slot));
+
+    return ret;
+}
+
+void negative_cache_add(struct persistent_engine *engine, uint32_t hv,
+                        const void *key, uint16_t nkey, uint32_t ticket) {
+    struct negative_cache *nc = &engine->negative;
+    size_t slot = hv & nc->mask;
+    struct negative_entry *e;
+
+    if (nc->entries == NULL || nkey > NEGATIVE_CACHE_KEY_MAX) {
+        return;
+    }
+
+    e = &nc->entries[slot];
+    pthread_mutex_lock(slot_lock(nc, slot));
+    if (e->version == ticket) {
+        e->hv = hv;
+        e->expires = engine->server.get_current_time() +
+            engine->config.negative_cache_ttl;
+        e->nkey = nkey;
+        memcpy(e->key, key, nkey);
+        __sync_add_and_fetch(&nc->inserts, 1);
+    }
+    pthread_mutex_unlock(slot_lock(nc, slot));
+}
+
+bool negative_cache_contains(struct persistent_engine *engine, uint32_t hv,
+                             const void *key, uint16_t nkey) {
+    struct negative_cache *nc = &engine->negative;
+    size_t slot = hv & nc->mask;
+    struct negative_entry *e;
+    bool ret;
+
+    if (nc->entries == NULL) {
+        return false;
+    }
+
+    e = &nc->entries[slot];
+    pthread_mutex_lock(slot_lock(nc, slot));
+    ret = e->expires > engine->server.get_current_time() &&
+        e->hv == hv && e->nkey == nkey && memcmp(e->key, key, nkey) == 0;
+    pthread_mutex_unlock(slot_lock(nc, slot));
+
+    if (ret) {
+        __sync_add_and_fetch(&nc->hits, 1);
+    }
+    return ret;
+}
+
+void negative_cache_clear(struct persistent_engine *engine, uint32_t hv) {
+    struct negative_cache *nc = &engine->negative;
+    size_t slot = hv & nc->mask;
+
+    if (nc->entries == NULL) {
+        return;
+    }
+
+    /* Whatever key is in the slot, it's cheaper to drop it than to check */
+    pthread_mutex_lock(slot_lock(nc, slot));
+    nc->entries[slot].version++;
+    nc->entries[slot].expires = 0;
+    pthread_mutex_unlock(slot_lock(nc, slot));
+}
+
+void negative_cache_stats(struct persistent_engine *engine, ADD_STAT add_stat,
+                          const void *cookie) {
+    struct negative_cache *nc = &engine->negative;
+
+    if (nc->entries == NULL) {
+        return;
+    }
+
+    add_statistics(cookie, add_stat, NULL, -1, "negative_cache_hits", "%llu",
+                   (unsigned long long)nc->hits);
+    add_statistics(cookie, add_stat, NULL, -1, "negative_cache_inserts",
+                   "%llu", (unsigned long long)nc->inserts);
+}
+
+void negative_cache_reset_stats(struct persistent_engine *engine) {
+    engine->negative.hits = 0;
+    engine->negative.inserts = 0;
+}
@@ -0,0 +1,96 @@
+#ifndef NEGATIVE_CACHE_H
+#define NEGATIVE_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The keys we recently failed to read from disk, so that a client asking
+ * for them over and over again doesn't cause a disk read every time. Each
+ * key hashes to a single slot (a new miss replaces the old one), and the
+ * entries expire after negative_cache_ttl seconds.
+ *
+ * Storing a key bumps the version of its slot. A reader takes the version
+ * before it reads the key, and only adds the miss if the version is still
+ * the same, so a miss never hides an item stored while we read it.
+ */
+#define NEGATIVE_CACHE_LOCKS 64
+
+/* The longest key we remember (the longest key memcached accepts) */
+#define NEGATIVE_CACHE_KEY_MAX 250
+
+struct negative_entry {
+   uint32_t hv;
+   /* Bumped every time a key in this slot is stored */
+   uint32_t version;
+   /* When the entry expires (0 == unused) */
+   rel_time_t expires;
+   uint16_t nkey;
+   char key[NEGATIVE_CACHE_KEY_MAX];
+};
+
+struct negative_cache {
+   struct negative_entry *entries;
+   size_t mask;
+   pthread_mutex_t locks[NEGATIVE_CACHE_LOCKS];
+   /* Updated with atomic operations */
+   uint64_t hits;
+   uint64_t inserts;
+};
+
+/**
+ * Allocate the negative cache (negative_cache_size == 0 disables it)
+ * @param engine handle to the storage engine
+ * @return ENGINE_SUCCESS on success
+ */
+ENGINE_ERROR_CODE negative_cache_init(struct persistent_engine *engine);
+
+void negative_cache_destroy(struct persistent_engine *engine);
+
+/**
+ * Get the version of the slot of a key (see negative_cache_add)
+ * @param engine handle to the storage engine
+ * @param hv the hash of the key
+ */
+uint32_t negative_cache_ticket(struct persistent_engine *engine, uint32_t hv);
+
+/**
+ * Remember that a key doesn't exist on disk
+ * @param engine handle to the storage engine
+ * @param hv the hash of the key
+ * @param key the key
+ * @param nkey the length of the key
+ * @param ticket the version of the slot before we read the key
+ */
+void negative_cache_add(struct persistent_engine *engine, uint32_t hv,
+                        const void *key, uint16_t nkey, uint32_t ticket);
+
+/**
+ * Check if we recently failed to read a key from disk
+ * @param engine handle to the storage engine
+ * @param hv the hash of the key
+ * @param key the key
+ * @param nkey the length of the key
+ * @return true if there is no point in reading the key
+ */
+bool negative_cache_contains(struct persistent_engine *engine, uint32_t hv,
+                             const void *key, uint16_t nkey);
+
+/**
+ * Forget about a key we're storing (call this before it may be evicted)
+ * @param engine handle to the storage engine
+ * @param hv the hash of the key
+ */
+void negative_cache_clear(struct persistent_engine *engine, uint32_t hv);
+
+void negative_cache_stats(struct persistent_engine *engine, ADD_STAT add_stat,
+                          const void *cookie);
+
+void negative_cache_reset_stats(struct persistent_engine *engine);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
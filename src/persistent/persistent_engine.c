@@ -15,6 +15,7 @@
 #include <stddef.h>
 
 #include "persistent_engine.h"
+#include "snapshot.h"
 #include "memcached/config_parser.h"
 
 static const engine_info* persistent_get_info(ENGINE_HANDLE* handle);
@@ -113,12 +114,11 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
         .server = *api,
         .initialized = true,
         .assoc = {
-            .hashpower = 16,
+            .hashpower = 15,
         },
         .slabs = {
             .lock = PTHREAD_MUTEX_INITIALIZER
         },
-        .cache_lock = PTHREAD_MUTEX_INITIALIZER,
         .stats = {
             .lock = PTHREAD_MUTEX_INITIALIZER,
         },
@@ -129,11 +129,45 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
             .evict_to_free = true,
             .maxbytes = 64 * 1024 * 1024,
             .preallocate = false,
+            .hugepages = true,
+            .numa = false,
+            .slab_automove = false,
+            .slab_automove_interval = 10,
+            .hash_bulk_move = 1024,
+            .hash_move_sleep = 1000,
             .factor = 1.25,
             .chunk_size = 48,
             .item_size_max= 1024 * 1024,
+            .slab_chunk_max = 0,
             .warmup = false,
-            .dbname = "/tmp/memcached"
+            .storage = "sqlite",
+            .dbname = "/tmp/memcached",
+            .write_batch_size = 1000,
+            .write_batch_interval_ms = 10,
+            .write_queue_bytes = 16 * 1024 * 1024,
+            .write_queue_items = 65536,
+            .reader_threads = 4,
+            .read_batch_size = 32,
+            .bloom_filter = true,
+            .bloom_filter_keys = 0,
+            .log_segment_size = 64 * 1024 * 1024,
+            .log_compact_threshold = 50,
+            .purge_interval = 60,
+            .warmup_threads = 4,
+            .warmup_rate = 0,
+            .snapshot_file = NULL,
+            .negative_cache_size = 4096,
+            .negative_cache_ttl = 2,
+            .read_ahead = 0,
+            .read_ahead_delimiter = ":",
+            .admission_filter = false,
+            .admission_filter_keys = 0,
+            .latency_stats = true,
+            .compression_codec = "none",
+            .compression_level = 0,
+            .min_compress_size = 64,
+            .compress_min_age = 60,
+            .compress_interval = 1
         }
     };
 
@@ -181,6 +215,31 @@ static ENGINE_ERROR_CODE persistent_initialize(ENGINE_HANDLE* handle,
         return ret;
     }
 
+    se->storage = storage_find(se->config.storage);
+    if (se->storage == NULL) {
+        fprintf(stderr, "Unknown storage backend: %s\n", se->config.storage);
+        return ENGINE_FAILED;
+    }
+
+    if (strcmp(se->config.compression_codec, "none") != 0) {
+        se->codec = codec_find(se->config.compression_codec);
+        if (se->codec == NULL) {
+            fprintf(stderr, "Unknown compression codec: %s\n",
+                    se->config.compression_codec);
+            return ENGINE_FAILED;
+        }
+    }
+
+    ret = latency_init(se);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    ret = item_init(se);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
     ret = assoc_init(se);
     if (ret != ENGINE_SUCCESS) {
         return ret;
@@ -192,7 +251,32 @@ static ENGINE_ERROR_CODE persistent_initialize(ENGINE_HANDLE* handle,
         return ret;
     }
 
-    if ((ret = sqlite_io_start_threads(se)) != ENGINE_SUCCESS) {
+    ret = negative_cache_init(se);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    ret = admission_init(se);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    if ((ret = se->storage->start(se)) != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    /* The rebalancer mustn't move the pages while they're restored */
+    if (se->config.snapshot_file != NULL) {
+        snapshot_restore(se, se->config.snapshot_file, NULL);
+    }
+
+    ret = slabs_start_rebalancer(se);
+    if (ret != ENGINE_SUCCESS) {
+        return ret;
+    }
+
+    ret = item_start_compactor(se);
+    if (ret != ENGINE_SUCCESS) {
         return ret;
     }
 
@@ -203,7 +287,16 @@ static void persistent_destroy(ENGINE_HANDLE* handle) {
     struct persistent_engine* se = get_handle(handle);
 
     if (se->initialized) {
-        pthread_mutex_destroy(&se->cache_lock);
+        item_stop_compactor(se);
+        slabs_stop_rebalancer(se);
+        if (se->config.snapshot_file != NULL) {
+            snapshot_save(se, se->config.snapshot_file, NULL);
+        }
+        assoc_destroy(se);
+        item_destroy(se);
+        negative_cache_destroy(se);
+        admission_destroy(se);
+        latency_destroy(se);
         pthread_mutex_destroy(&se->stats.lock);
         se->initialized = false;
         free(se);
@@ -244,13 +337,11 @@ static ENGINE_ERROR_CODE persistent_item_delete(ENGINE_HANDLE* handle,
                                                 const void* key,
                                                 const size_t nkey,
                                                 uint64_t cas) {
-
-    item* it;
-    if (persistent_get(handle, cookie, &it, key, nkey) == ENGINE_SUCCESS) {
-        item_unlink(get_handle(handle), get_real_item(it));
-        item_release(get_handle(handle), get_real_item(it));
-    }
-    return ENGINE_SUCCESS;
+    struct persistent_engine* engine = get_handle(handle);
+    uint64_t start = latency_start(engine);
+    ENGINE_ERROR_CODE ret = item_delete(engine, key, nkey);
+    latency_record(engine, LATENCY_DELETE, start);
+    return ret;
 }
 
 static void persistent_item_release(ENGINE_HANDLE* handle,
@@ -259,20 +350,108 @@ static void persistent_item_release(ENGINE_HANDLE* handle,
     item_release(get_handle(handle), get_real_item(item));
 }
 
+/*
+ * Count a get in the admission filter. A key we have to read from disk is
+ * counted when the frontend comes back for it, so we don't count it twice.
+ */
+static void count_access(struct persistent_engine *engine,
+                         const void *key, size_t nkey) {
+    if (admission_enabled(engine)) {
+        admission_record(engine, engine->server.hash(key, nkey, 0));
+    }
+}
+
 static ENGINE_ERROR_CODE persistent_get(ENGINE_HANDLE* handle,
                                         const void* cookie,
                                         item** item,
                                         const void* key,
                                         const int nkey) {
     struct persistent_engine* engine = get_handle(handle);
+    uint64_t start = latency_start(engine);
+    ENGINE_ERROR_CODE ret;
     hash_item *it = item_get(engine, key, nkey);
     if (it != NULL) {
         *item = (void*)it;
-        return ENGINE_SUCCESS;
+        count_access(engine, key, nkey);
+        latency_count(engine, LATENCY_GET_HITS, 1);
+        ret = ENGINE_SUCCESS;
+    } else if (!engine->storage->may_exist(engine, key, nkey) ||
+               negative_cache_contains(engine,
+                                       engine->server.hash(key, nkey, 0),
+                                       key, nkey)) {
+        count_access(engine, key, nkey);
+        latency_count(engine, LATENCY_GET_MISSES, 1);
+        ret = ENGINE_KEY_ENOENT;
     } else {
-        sqlite_io_get_item(engine, cookie, key, nkey);
-        return ENGINE_EWOULDBLOCK;
+        engine->storage->get_item(engine, cookie, key, nkey);
+        latency_count(engine, LATENCY_GET_EWOULDBLOCK, 1);
+        ret = ENGINE_EWOULDBLOCK;
     }
+    latency_record(engine, LATENCY_GET, start);
+    return ret;
+}
+
+ENGINE_ERROR_CODE persistent_get_multi(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       int nkeys,
+                                       const void * const *keys,
+                                       const size_t *lengths,
+                                       item **items,
+                                       bool fetch) {
+    struct persistent_engine* engine = get_handle(handle);
+    uint64_t start = latency_start(engine);
+    hash_item **its = (hash_item**)items;
+    int found = item_get_multi(engine, nkeys, keys, lengths, its);
+    int ii;
+
+    for (ii = 0; ii < nkeys; ++ii) {
+        if (its[ii] != NULL || !fetch) {
+            count_access(engine, keys[ii], lengths[ii]);
+        }
+    }
+    latency_count(engine, LATENCY_GET_HITS, found);
+    if (found == nkeys || !fetch) {
+        latency_count(engine, LATENCY_GET_MISSES, nkeys - found);
+        latency_record(engine, LATENCY_GET, start);
+        return ENGINE_SUCCESS;
+    }
+
+    /* Queue all of the misses at once, so they share the queries */
+    const void **mkeys = malloc((nkeys - found) * sizeof(void*));
+    size_t *mlengths = malloc((nkeys - found) * sizeof(size_t));
+    int nmiss = 0;
+
+    if (mkeys == NULL || mlengths == NULL) {
+        free(mkeys);
+        free(mlengths);
+        latency_count(engine, LATENCY_GET_MISSES, nkeys - found);
+        latency_record(engine, LATENCY_GET, start);
+        return ENGINE_SUCCESS;
+    }
+
+    for (ii = 0; ii < nkeys; ++ii) {
+        if (its[ii] == NULL &&
+            engine->storage->may_exist(engine, keys[ii], lengths[ii]) &&
+            !negative_cache_contains(engine,
+                                     engine->server.hash(keys[ii], lengths[ii], 0),
+                                     keys[ii], lengths[ii])) {
+            mkeys[nmiss] = keys[ii];
+            mlengths[nmiss] = lengths[ii];
+            ++nmiss;
+        } else if (its[ii] == NULL) {
+            count_access(engine, keys[ii], lengths[ii]);
+        }
+    }
+    if (nmiss > 0) {
+        engine->storage->get_items(engine, cookie, nmiss, mkeys, mlengths);
+    }
+    free(mkeys);
+    free(mlengths);
+
+    latency_count(engine, LATENCY_GET_MISSES, nkeys - found - nmiss);
+    latency_count(engine, LATENCY_GET_EWOULDBLOCK, nmiss);
+    latency_record(engine, LATENCY_GET, start);
+    return nmiss > 0 ? ENGINE_EWOULDBLOCK : ENGINE_SUCCESS;
 }
 
 static ENGINE_ERROR_CODE persistent_get_stats(ENGINE_HANDLE* handle,
@@ -297,13 +476,24 @@ static ENGINE_ERROR_CODE persistent_get_stats(ENGINE_HANDLE* handle,
         add_stat("total_items", 11, val, len, cookie);
         len = sprintf(val, "%llu", (unsigned long long)engine->stats.curr_bytes);
         add_stat("bytes", 5, val, len, cookie);
+        len = sprintf(val, "%llu", (unsigned long long)engine->stats.warm_items);
+        add_stat("warm_items", 10, val, len, cookie);
+        len = sprintf(val, "%llu", (unsigned long long)engine->stats.warm_bytes);
+        add_stat("warm_bytes", 10, val, len, cookie);
+        len = sprintf(val, "%llu", (unsigned long long)engine->stats.warm_promotions);
+        add_stat("warm_promotions", 15, val, len, cookie);
         pthread_mutex_unlock(&engine->stats.lock);
+        negative_cache_stats(engine, add_stat, cookie);
+        admission_stats(engine, add_stat, cookie);
+        engine->storage->stats(engine, add_stat, cookie);
     } else if (strncmp(stat_key, "slabs", 5) == 0) {
         slabs_stats(engine, add_stat, cookie);
     } else if (strncmp(stat_key, "items", 5) == 0) {
         item_stats(engine, add_stat, cookie);
     } else if (strncmp(stat_key, "sizes", 5) == 0) {
         item_stats_sizes(engine, add_stat, cookie);
+    } else if (strncmp(stat_key, "latency", 7) == 0) {
+        latency_stats(engine, add_stat, cookie);
     } else {
         ret = ENGINE_KEY_ENOENT;
     }
@@ -316,21 +506,25 @@ static ENGINE_ERROR_CODE persistent_store(ENGINE_HANDLE* handle,
                                           item* item,
                                           uint64_t *cas,
                                           ENGINE_STORE_OPERATION operation) {
-    return store_item(get_handle(handle), get_real_item(item), cas, operation,
-                      true, cookie);
+    struct persistent_engine *engine = get_handle(handle);
+    uint64_t start = latency_start(engine);
+    ENGINE_ERROR_CODE ret = store_item(engine, get_real_item(item), cas,
+                                       operation, true, cookie);
+    latency_record(engine, LATENCY_STORE, start);
+    return ret;
 }
 
-static ENGINE_ERROR_CODE persistent_arithmetic(ENGINE_HANDLE* handle,
-                                               const void* cookie,
-                                               const void* key,
-                                               const int nkey,
-                                               const bool increment,
-                                               const bool create,
-                                               const uint64_t delta,
-                                               const uint64_t initial,
-                                               const rel_time_t exptime,
-                                               uint64_t *cas,
-                                               uint64_t *result) {
+static ENGINE_ERROR_CODE do_arithmetic(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       const void* key,
+                                       const int nkey,
+                                       const bool increment,
+                                       const bool create,
+                                       const uint64_t delta,
+                                       const uint64_t initial,
+                                       const rel_time_t exptime,
+                                       uint64_t *cas,
+                                       uint64_t *result) {
     ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
     struct persistent_engine *engine = get_handle(handle);
     hash_item *item = item_get(engine, key, nkey);
@@ -351,9 +545,9 @@ static ENGINE_ERROR_CODE persistent_arithmetic(ENGINE_HANDLE* handle,
             if ((ret = store_item(engine, item, cas, OPERATION_ADD, true,
                                   cookie)) == ENGINE_KEY_EEXISTS) {
                 item_release(engine, item);
-                return persistent_arithmetic(handle, cookie, key, nkey, increment,
-                                             create, delta, initial, exptime, cas,
-                                             result);
+                return do_arithmetic(handle, cookie, key, nkey, increment,
+                                     create, delta, initial, exptime, cas,
+                                     result);
             }
 
             *result = initial;
@@ -368,6 +562,26 @@ static ENGINE_ERROR_CODE persistent_arithmetic(ENGINE_HANDLE* handle,
     return ret;
 }
 
+static ENGINE_ERROR_CODE persistent_arithmetic(ENGINE_HANDLE* handle,
+                                               const void* cookie,
+                                               const void* key,
+                                               const int nkey,
+                                               const bool increment,
+                                               const bool create,
+                                               const uint64_t delta,
+                                               const uint64_t initial,
+                                               const rel_time_t exptime,
+                                               uint64_t *cas,
+                                               uint64_t *result) {
+    struct persistent_engine *engine = get_handle(handle);
+    uint64_t start = latency_start(engine);
+    ENGINE_ERROR_CODE ret = do_arithmetic(handle, cookie, key, nkey, increment,
+                                          create, delta, initial, exptime, cas,
+                                          result);
+    latency_record(engine, LATENCY_ARITHMETIC, start);
+    return ret;
+}
+
 static ENGINE_ERROR_CODE persistent_flush(ENGINE_HANDLE* handle,
                                           const void* cookie, time_t when) {
     item_flush_expired(get_handle(handle), when);
@@ -382,7 +596,12 @@ static void persistent_reset_stats(ENGINE_HANDLE* handle, const void *cookie) {
     pthread_mutex_lock(&engine->stats.lock);
     engine->stats.evictions = 0;
     engine->stats.total_items = 0;
+    engine->stats.warm_promotions = 0;
     pthread_mutex_unlock(&engine->stats.lock);
+    negative_cache_reset_stats(engine);
+    admission_reset_stats(engine);
+    latency_reset(engine);
+    engine->storage->reset_stats(engine);
 }
 
 static ENGINE_ERROR_CODE initalize_configuration(struct persistent_engine *se,
@@ -407,6 +626,24 @@ static ENGINE_ERROR_CODE initalize_configuration(struct persistent_engine *se,
             { .key = "preallocate",
               .datatype = DT_BOOL,
               .value.dt_bool = &config->preallocate },
+            { .key = "hugepages",
+              .datatype = DT_BOOL,
+              .value.dt_bool = &config->hugepages },
+            { .key = "numa",
+              .datatype = DT_BOOL,
+              .value.dt_bool = &config->numa },
+            { .key = "slab_automove",
+              .datatype = DT_BOOL,
+              .value.dt_bool = &config->slab_automove },
+            { .key = "slab_automove_interval",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->slab_automove_interval },
+            { .key = "hash_bulk_move",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->hash_bulk_move },
+            { .key = "hash_move_sleep",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->hash_move_sleep },
             { .key = "factor",
               .datatype = DT_FLOAT,
               .value.dt_float = &config->factor },
@@ -416,12 +653,96 @@ static ENGINE_ERROR_CODE initalize_configuration(struct persistent_engine *se,
             { .key = "item_size_max",
               .datatype = DT_SIZE,
               .value.dt_size = &config->item_size_max },
+            { .key = "slab_chunk_max",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->slab_chunk_max },
             { .key = "warmup",
               .datatype = DT_BOOL,
               .value.dt_bool = &config->warmup },
+            { .key = "storage",
+              .datatype = DT_STRING,
+              .value.dt_string = &config->storage },
             { .key = "dbname",
               .datatype = DT_STRING,
               .value.dt_string = &config->dbname },
+            { .key = "write_batch_size",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->write_batch_size },
+            { .key = "write_batch_interval_ms",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->write_batch_interval_ms },
+            { .key = "write_queue_bytes",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->write_queue_bytes },
+            { .key = "write_queue_items",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->write_queue_items },
+            { .key = "reader_threads",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->reader_threads },
+            { .key = "read_batch_size",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->read_batch_size },
+            { .key = "bloom_filter",
+              .datatype = DT_BOOL,
+              .value.dt_bool = &config->bloom_filter },
+            { .key = "bloom_filter_keys",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->bloom_filter_keys },
+            { .key = "log_segment_size",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->log_segment_size },
+            { .key = "log_compact_threshold",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->log_compact_threshold },
+            { .key = "purge_interval",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->purge_interval },
+            { .key = "warmup_threads",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->warmup_threads },
+            { .key = "warmup_rate",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->warmup_rate },
+            { .key = "snapshot_file",
+              .datatype = DT_STRING,
+              .value.dt_string = &config->snapshot_file },
+            { .key = "negative_cache_size",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->negative_cache_size },
+            { .key = "negative_cache_ttl",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->negative_cache_ttl },
+            { .key = "read_ahead",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->read_ahead },
+            { .key = "read_ahead_delimiter",
+              .datatype = DT_STRING,
+              .value.dt_string = &config->read_ahead_delimiter },
+            { .key = "admission_filter",
+              .datatype = DT_BOOL,
+              .value.dt_bool = &config->admission_filter },
+            { .key = "admission_filter_keys",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->admission_filter_keys },
+            { .key = "latency_stats",
+              .datatype = DT_BOOL,
+              .value.dt_bool = &config->latency_stats },
+            { .key = "compression_codec",
+              .datatype = DT_STRING,
+              .value.dt_string = &config->compression_codec },
+            { .key = "compression_level",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->compression_level },
+            { .key = "min_compress_size",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->min_compress_size },
+            { .key = "compress_min_age",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->compress_min_age },
+            { .key = "compress_interval",
+              .datatype = DT_SIZE,
+              .value.dt_size = &config->compress_interval },
             { .key = "config_file",
               .datatype = DT_CONFIGFILE },
             { .key = NULL}
@@ -487,18 +808,22 @@ uint8_t item_get_clsid(const hash_item* item)
 static bool get_item_info(ENGINE_HANDLE *handle, const item* item, item_info *item_info)
 {
     hash_item* it = (hash_item*)item;
+    int nvalue;
     if (item_info->nvalue < 1) {
         return false;
     }
+    /* A chained value needs an iovec for each of its chunks */
+    nvalue = item_get_iov(it, item_info->value, item_info->nvalue);
+    if (nvalue > item_info->nvalue) {
+        return false;
+    }
     item_info->cas = item_get_cas(it);
     item_info->exptime = it->exptime;
     item_info->nbytes = it->nbytes;
     item_info->flags = it->flags;
     item_info->clsid = it->slabs_clsid;
     item_info->nkey = it->nkey;
-    item_info->nvalue = 1;
+    item_info->nvalue = nvalue;
     item_info->key = item_get_key(it);
-    item_info->value[0].iov_base = item_get_data(it);
-    item_info->value[0].iov_len = it->nbytes;
     return true;
 }
@@ -38,6 +38,11 @@ struct persistent_engine;
 #include "assoc.h"
 #include "slabs.h"
 #include "sqlite.h"
+#include "storage.h"
+#include "negative_cache.h"
+#include "admission.h"
+#include "latency.h"
+#include "codec.h"
 
    /* Flags */
 #define ITEM_WITH_CAS 1
@@ -47,6 +52,22 @@ struct persistent_engine;
 /* temp */
 #define ITEM_SLABBED (2<<8)
 
+/* Not written to disk yet (the write queue was full) */
+#define ITEM_DIRTY (4<<8)
+
+/* The codec used to compress a warm item (see item_compact_class) */
+#define ITEM_CODEC_SHIFT 11
+#define ITEM_CODEC_MASK (3<<ITEM_CODEC_SHIFT)
+
+/* The compactor failed to shrink the item, so don't try again */
+#define ITEM_COMPRESS_TRIED (1<<13)
+
+/* The value is split over a chain of chunks (see slab_chunk_max) */
+#define ITEM_CHAINED (1<<14)
+
+/* Not an item, but a chunk holding a part of the value of one */
+#define ITEM_CHUNK (1<<15)
+
 struct config {
     bool use_cas;
     size_t verbose;
@@ -54,11 +75,45 @@ struct config {
     bool evict_to_free;
     size_t maxbytes;
     bool preallocate;
+    bool hugepages;
+    bool numa;
+    bool slab_automove;
+    size_t slab_automove_interval;
+    size_t hash_bulk_move;
+    size_t hash_move_sleep;
     float factor;
     size_t chunk_size;
     size_t item_size_max;
+    size_t slab_chunk_max;
     bool warmup;
+    char *storage;
     char *dbname;
+    size_t write_batch_size;
+    size_t write_batch_interval_ms;
+    size_t write_queue_bytes;
+    size_t write_queue_items;
+    size_t reader_threads;
+    size_t read_batch_size;
+    bool bloom_filter;
+    size_t bloom_filter_keys;
+    size_t log_segment_size;
+    size_t log_compact_threshold;
+    size_t purge_interval;
+    size_t warmup_threads;
+    size_t warmup_rate;
+    char *snapshot_file;
+    size_t negative_cache_size;
+    size_t negative_cache_ttl;
+    size_t read_ahead;
+    char *read_ahead_delimiter;
+    bool admission_filter;
+    size_t admission_filter_keys;
+    bool latency_stats;
+    char *compression_codec;
+    size_t compression_level;
+    size_t min_compress_size;
+    size_t compress_min_age;
+    size_t compress_interval;
 };
 
 EXPORT_FUNCTION
@@ -66,6 +121,36 @@ ENGINE_ERROR_CODE create_instance(uint64_t interface,
                                   GET_SERVER_API get_server_api,
                                   ENGINE_HANDLE **handle);
 
+/**
+ * Get a number of items in one go. The engine interface only has a get
+ * for a single key, so a frontend serving multi-gets may look this up
+ * with dlsym to avoid a lock round trip and a disk read per key.
+ *
+ * The items we have in memory are returned right away. The rest are
+ * read from disk in batches, and the cookie is notified once when all
+ * of them are in the cache. The frontend should then call us again for
+ * the keys that were missing, with fetch set to false.
+ *
+ * @param handle the engine handle
+ * @param cookie the cookie to notify when the reads complete
+ * @param nkeys the number of keys
+ * @param keys the keys to get
+ * @param lengths the number of bytes in each key
+ * @param items where to store the items (NULL for the keys we don't have).
+ *              The caller must release the items it gets.
+ * @param fetch read the keys we don't have from disk
+ * @return ENGINE_SUCCESS if items contains all we've got, or
+ *         ENGINE_EWOULDBLOCK if some of the keys are being read from disk
+ */
+EXPORT_FUNCTION
+ENGINE_ERROR_CODE persistent_get_multi(ENGINE_HANDLE* handle,
+                                       const void* cookie,
+                                       int nkeys,
+                                       const void * const *keys,
+                                       const size_t *lengths,
+                                       item **items,
+                                       bool fetch);
+
 /**
  * Statistic information collected by the persistent engine
  */
@@ -76,6 +161,11 @@ struct engine_stats {
     uint64_t curr_items;
     uint64_t total_items;
     uint64_t reclaimed;
+    /* The compressed items in the cache (and the memory they use) */
+    uint64_t warm_items;
+    uint64_t warm_bytes;
+    /* The warm items inflated back to raw items by a get */
+    uint64_t warm_promotions;
 };
 
 /**
@@ -92,6 +182,15 @@ struct persistent_engine {
      */
     void *reader;
     void *writer;
+    void *warmup;
+    /* The keys that may exist on disk (NULL if we don't know) */
+    void *filter;
+
+    /* The backend we store the items in */
+    const struct storage *storage;
+
+    /* The codec used for the warm tier (NULL if it's disabled) */
+    const struct codec *codec;
 
     /**
      * Is the engine initalized or not
@@ -101,12 +200,9 @@ struct persistent_engine {
     struct assoc assoc;
     struct slabs slabs;
     struct items items;
-
-    /**
-     * The cache layer (item_* and assoc_*) is currently protected by
-     * this single mutex
-     */
-    pthread_mutex_t cache_lock;
+    struct negative_cache negative;
+    struct admission admission;
+    struct latency latency;
 
     struct config config;
     struct engine_stats stats;
@@ -21,6 +21,14 @@
 #include <pthread.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <unistd.h>
+#include <sys/time.h>
+#ifndef __WIN32__
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "persistent_engine.h"
 
@@ -29,6 +37,7 @@
  */
 static int do_slabs_newslab(struct persistent_engine *engine, const unsigned int id);
 static void *memory_allocate(struct persistent_engine *engine, size_t size);
+static ENGINE_ERROR_CODE arena_init(struct persistent_engine *engine, size_t size);
 
 #ifndef DONT_PREALLOC_SLABS
 /* Preallocate as many slab pages as possible (called from slabs_init)
@@ -73,13 +82,10 @@ ENGINE_ERROR_CODE slabs_init(struct persistent_engine *engine,
     engine->slabs.mem_limit = limit;
 
     if (prealloc) {
-        /* Allocate everything in a big chunk with malloc */
-        engine->slabs.mem_base = malloc(engine->slabs.mem_limit);
-        if (engine->slabs.mem_base != NULL) {
-            engine->slabs.mem_current = engine->slabs.mem_base;
-            engine->slabs.mem_avail = engine->slabs.mem_limit;
-        } else {
-            return ENGINE_ENOMEM;
+        /* Map everything in one big arena */
+        ENGINE_ERROR_CODE ret = arena_init(engine, engine->slabs.mem_limit);
+        if (ret != ENGINE_SUCCESS) {
+            return ret;
         }
     }
 
@@ -107,6 +113,30 @@ ENGINE_ERROR_CODE slabs_init(struct persistent_engine *engine,
                 i, engine->slabs.slabclass[i].size, engine->slabs.slabclass[i].perslab);
     }
 
+    /*
+     * Values that don't fit in a slab_chunk_max chunk are split over
+     * chunks of the largest class below it. The chunks must have room
+     * for the header of an item with the longest key.
+     */
+    engine->slabs.chunk_clsid = 0;
+    if (engine->config.slab_chunk_max != 0) {
+        for (i = POWER_SMALLEST; i < engine->slabs.power_largest &&
+                 engine->slabs.slabclass[i].size <= engine->config.slab_chunk_max; ++i) {
+            if (engine->slabs.slabclass[i].size >= SLAB_CHUNK_MIN) {
+                engine->slabs.chunk_clsid = i;
+            }
+        }
+        if (engine->slabs.chunk_clsid == 0) {
+            fprintf(stderr, "slab_chunk_max must be at least %d bytes\n",
+                    SLAB_CHUNK_MIN);
+            return ENGINE_EINVAL;
+        }
+        if (engine->config.verbose > 1) {
+            fprintf(stderr, "large values are chained in slab class %u\n",
+                    engine->slabs.chunk_clsid);
+        }
+    }
+
     /* for the test suite:  faking of how much we've already malloc'd */
     {
         char *t_initial_malloc = getenv("T_MEMD_INITIAL_MALLOC");
@@ -166,6 +196,11 @@ static int do_slabs_newslab(struct persistent_engine *engine, const unsigned int
     int len = p->size * p->perslab;
     char *ptr;
 
+    if (engine->config.slab_automove) {
+        /* All pages must be the same size so they can be moved */
+        len = engine->config.item_size_max;
+    }
+
     if ((engine->slabs.mem_limit && engine->slabs.mem_malloced + len > engine->slabs.mem_limit && p->slabs > 0) ||
         (grow_slab_list(engine, id) == 0) ||
         ((ptr = memory_allocate(engine, (size_t)len)) == 0)) {
@@ -223,6 +258,8 @@ static void *do_slabs_alloc(struct persistent_engine *engine, const size_t size,
     }
 
     if (ret) {
+        /* The rebalancer uses the flag to find the free chunks */
+        ((hash_item*)ret)->iflag &= ~ITEM_SLABBED;
         p->requested += size;
     }
 
@@ -243,6 +280,16 @@ static void do_slabs_free(struct persistent_engine *engine, void *ptr, const siz
     return;
 #endif
 
+    /* so the rebalancer can tell later if the chunk is free or not */
+    ((hash_item*)ptr)->iflag |= ITEM_SLABBED;
+    p->requested -= size;
+    if ((char*)ptr >= engine->slabs.rebal_start &&
+        (char*)ptr < engine->slabs.rebal_end) {
+        /* The page is being moved to another class */
+        ++engine->slabs.rebal_free;
+        return;
+    }
+
     if (p->sl_curr == p->sl_total) { /* need more space on the free list */
         int new_size = (p->sl_total != 0) ? p->sl_total * 2 : 16;  /* 16 is arbitrary */
         void **new_slots = realloc(p->slots, new_size * sizeof(void *));
@@ -252,7 +299,6 @@ static void do_slabs_free(struct persistent_engine *engine, void *ptr, const siz
         p->sl_total = new_size;
     }
     p->slots[p->sl_curr++] = ptr;
-    p->requested -= size;
     return;
 }
 
@@ -338,35 +384,197 @@ static void do_slabs_stats(struct persistent_engine *engine, ADD_STAT add_stats,
     add_statistics(cookie, add_stats, NULL, -1, "active_slabs", "%d", total);
     add_statistics(cookie, add_stats, NULL, -1, "total_malloced", "%zu",
                    engine->slabs.mem_malloced);
+    add_statistics(cookie, add_stats, NULL, -1, "slabs_moved", "%"PRIu64,
+                   engine->slabs.slabs_moved);
+    add_statistics(cookie, add_stats, NULL, -1, "slab_reassign_evictions",
+                   "%"PRIu64, engine->slabs.slab_reassign_evictions);
     add_stats(NULL, 0, NULL, 0, cookie);
 }
 
-static void *memory_allocate(struct persistent_engine *engine, size_t size) {
-    void *ret;
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
 
-    if (engine->slabs.mem_base == NULL) {
-        /* We are not using a preallocated large memory chunk */
-        ret = malloc(size);
-    } else {
-        ret = engine->slabs.mem_current;
+#if defined(__linux__) && defined(SYS_mbind)
+#define HAVE_MBIND 1
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+/*
+ * Get the number of NUMA nodes (from /sys so we don't need libnuma)
+ */
+static int numa_nodes(void) {
+    char buffer[128];
+    int first, last;
+    FILE *fp = fopen("/sys/devices/system/node/online", "r");
+    if (fp == NULL) {
+        return 1;
+    }
+    if (fgets(buffer, sizeof(buffer), fp) == NULL) {
+        buffer[0] = '\0';
+    }
+    fclose(fp);
+
+    /* Format: "0" or "0-3" (we don't support holes in the node list) */
+    switch (sscanf(buffer, "%d-%d", &first, &last)) {
+    case 1:
+        return 1;
+    case 2:
+        return (first == 0 && last > 0) ? last + 1 : 1;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Get the NUMA node the calling thread is running on
+ */
+static int current_numa_node(void) {
+#ifdef SYS_getcpu
+    unsigned int cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return (int)node;
+    }
+#endif
+    return 0;
+}
+#endif
+
+/*
+ * Map the memory for the slab pages in one go. We try to use explicit
+ * hugepages first, then transparent hugepages, so that we don't waste
+ * TLB entries on the item headers. With numa set the mapping is split
+ * into one arena per node, and memory_allocate picks the arena local to
+ * the thread that needs a new slab page. All of the memory is touched
+ * up front so we don't take page faults while warming up.
+ */
+static ENGINE_ERROR_CODE arena_init(struct persistent_engine *engine, size_t size) {
+    struct slabs *slabs = &engine->slabs;
+    int narenas = 1;
+    int ii;
+
+#ifdef HAVE_MBIND
+    if (engine->config.numa) {
+        narenas = numa_nodes();
+    }
+#endif
+
+    /* Each arena must be a multiple of the hugepage size */
+    size = (size + HUGEPAGE_SIZE * narenas - 1) / (HUGEPAGE_SIZE * narenas);
+    size *= HUGEPAGE_SIZE * narenas;
+
+    slabs->arenas = calloc(narenas, sizeof(struct slab_arena));
+    if (slabs->arenas == NULL) {
+        return ENGINE_ENOMEM;
+    }
 
-        if (size > engine->slabs.mem_avail) {
-            return NULL;
+#ifdef __WIN32__
+    slabs->mem_base = malloc(size);
+#else
+    slabs->mem_base = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (engine->config.hugepages) {
+        slabs->mem_base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                               -1, 0);
+    }
+#endif
+    if (slabs->mem_base == MAP_FAILED) {
+        slabs->mem_base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+        if (slabs->mem_base != MAP_FAILED && engine->config.hugepages) {
+            madvise(slabs->mem_base, size, MADV_HUGEPAGE);
         }
+#endif
+    }
+    if (slabs->mem_base == MAP_FAILED) {
+        slabs->mem_base = NULL;
+    }
+#endif
 
-        /* mem_current pointer _must_ be aligned!!! */
-        if (size % CHUNK_ALIGN_BYTES) {
-            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+    if (slabs->mem_base == NULL) {
+        free(slabs->arenas);
+        slabs->arenas = NULL;
+        return ENGINE_ENOMEM;
+    }
+
+    slabs->narenas = narenas;
+    for (ii = 0; ii < narenas; ++ii) {
+        struct slab_arena *arena = &slabs->arenas[ii];
+        size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+        size_t offset;
+
+        arena->base = (char*)slabs->mem_base + (size / narenas) * ii;
+        arena->current = arena->base;
+        arena->avail = size / narenas;
+
+#ifdef HAVE_MBIND
+        if (narenas > 1) {
+            unsigned long nodemask = 1UL << ii;
+            if (syscall(SYS_mbind, arena->base, arena->avail, MPOL_BIND,
+                        &nodemask, sizeof(nodemask) * 8, 0) != 0 &&
+                engine->config.verbose) {
+                fprintf(stderr, "Failed to bind arena to node %d: %s\n",
+                        ii, strerror(errno));
+            }
         }
+#endif
 
-        engine->slabs.mem_current = ((char*)engine->slabs.mem_current) + size;
-        if (size < engine->slabs.mem_avail) {
-            engine->slabs.mem_avail -= size;
-        } else {
-            engine->slabs.mem_avail = 0;
+        /* Fault in the memory now (after it's bound to the right node) */
+        for (offset = 0; offset < arena->avail; offset += pagesize) {
+            arena->base[offset] = 0;
         }
     }
 
+    if (engine->config.verbose) {
+        fprintf(stderr, "Preallocated %zu bytes in %d arena(s)\n",
+                size, narenas);
+    }
+
+    return ENGINE_SUCCESS;
+}
+
+static void *arena_allocate(struct slab_arena *arena, size_t size) {
+    void *ret = arena->current;
+
+    /* current pointer _must_ be aligned!!! */
+    if (size % CHUNK_ALIGN_BYTES) {
+        size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+    }
+
+    if (size > arena->avail) {
+        return NULL;
+    }
+
+    arena->current += size;
+    arena->avail -= size;
+
+    return ret;
+}
+
+static void *memory_allocate(struct persistent_engine *engine, size_t size) {
+    void *ret = NULL;
+    int node = 0;
+    int ii;
+
+    if (engine->slabs.arenas == NULL) {
+        /* We are not using a preallocated large memory chunk */
+        return malloc(size);
+    }
+
+#ifdef HAVE_MBIND
+    if (engine->slabs.narenas > 1) {
+        node = current_numa_node() % engine->slabs.narenas;
+    }
+#endif
+
+    /* Prefer the local arena, but use the others before giving up */
+    for (ii = 0; ii < engine->slabs.narenas && ret == NULL; ++ii) {
+        struct slab_arena *arena;
+        arena = &engine->slabs.arenas[(node + ii) % engine->slabs.narenas];
+        ret = arena_allocate(arena, size);
+    }
+
     return ret;
 }
 
@@ -390,3 +598,357 @@ void slabs_stats(struct persistent_engine *engine, ADD_STAT add_stats, const voi
     do_slabs_stats(engine, add_stats, c);
     pthread_mutex_unlock(&engine->slabs.lock);
 }
+
+/* The number of bytes in a slab page of a class */
+static size_t do_slabs_page_size(struct persistent_engine *engine, unsigned int id) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    if (engine->config.slab_automove) {
+        return engine->config.item_size_max;
+    }
+    return (size_t)p->size * p->perslab;
+}
+
+size_t slabs_page_size(struct persistent_engine *engine, unsigned int id) {
+    return do_slabs_page_size(engine, id);
+}
+
+void slabs_adjust_mem_requested(struct persistent_engine *engine, unsigned int id,
+                                size_t old, size_t ntotal) {
+    pthread_mutex_lock(&engine->slabs.lock);
+    engine->slabs.slabclass[id].requested += ntotal - old;
+    pthread_mutex_unlock(&engine->slabs.lock);
+}
+
+/*
+ * Snapshot restore. The pages are added to their class as they are, and
+ * their chunks are handed out by linking the items restored into them.
+ * Until slabs_restore_done is called the chunks are neither on the
+ * freelist nor at the end of a page, so nobody else may allocate them.
+ */
+void *slabs_restore_page(struct persistent_engine *engine, unsigned int id,
+                         const void *data, size_t len) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    char *ptr = NULL;
+    unsigned int ii;
+
+    if (id < POWER_SMALLEST || id > (unsigned int)engine->slabs.power_largest ||
+        len != do_slabs_page_size(engine, id)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    if ((engine->slabs.mem_limit == 0 ||
+         engine->slabs.mem_malloced + len <= engine->slabs.mem_limit) &&
+        grow_slab_list(engine, id) != 0 &&
+        (ptr = memory_allocate(engine, len)) != NULL) {
+        memcpy(ptr, data, len);
+        /* item_restore clears the flag for the chunks it links */
+        for (ii = 0; ii < p->perslab; ++ii) {
+            ((hash_item*)(ptr + ii * p->size))->iflag |= ITEM_SLABBED;
+        }
+        p->slab_list[p->slabs++] = ptr;
+        engine->slabs.mem_malloced += len;
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+
+    return ptr;
+}
+
+void slabs_restore_done(struct persistent_engine *engine, unsigned int id,
+                        void *page) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    unsigned int ii;
+
+    pthread_mutex_lock(&engine->slabs.lock);
+    for (ii = 0; ii < p->perslab; ++ii) {
+        hash_item *it = (hash_item*)((char*)page + ii * p->size);
+        if ((it->iflag & ITEM_SLABBED) != 0) {
+            it->slabs_clsid = 0;
+            do_slabs_free(engine, it, 0, id);
+        }
+    }
+    pthread_mutex_unlock(&engine->slabs.lock);
+}
+
+/*
+ * Slab page rebalancing. With slab_automove set all of the slab pages are
+ * item_size_max bytes, so a page may be moved from a class with memory to
+ * spare to a class that is evicting items. The items in the page are
+ * evicted, and the page is handed over once all of its chunks are free.
+ */
+
+/* The number of passes over the page before we give up moving it */
+#define REBALANCE_MAX_PASSES 1000
+
+/*
+ * Start moving the first page of a class. Called with the slabs lock held.
+ */
+static bool do_slabs_rebalance_start(struct persistent_engine *engine,
+                                     unsigned int src, unsigned int dst) {
+    slabclass_t *s = &engine->slabs.slabclass[src];
+    char *page, *end;
+    unsigned int ii, jj;
+
+    if (s->slabs < 2 || grow_slab_list(engine, dst) == 0) {
+        return false;
+    }
+
+    page = s->slab_list[0];
+    end = page + s->size * s->perslab;
+    engine->slabs.rebal_start = page;
+    engine->slabs.rebal_end = end;
+    engine->slabs.rebal_free = 0;
+
+    /* Take the free chunks in the page off the freelist */
+    for (ii = jj = 0; ii < s->sl_curr; ++ii) {
+        char *chunk = s->slots[ii];
+        if (chunk >= page && chunk < end) {
+            ++engine->slabs.rebal_free;
+        } else {
+            s->slots[jj++] = chunk;
+        }
+    }
+    s->sl_curr = jj;
+
+    /* And the chunks we haven't handed out yet */
+    if ((char*)s->end_page_ptr >= page && (char*)s->end_page_ptr < end) {
+        char *chunk = s->end_page_ptr;
+        for (ii = 0; ii < s->end_page_free; ++ii, chunk += s->size) {
+            ((hash_item*)chunk)->iflag = ITEM_SLABBED;
+        }
+        engine->slabs.rebal_free += s->end_page_free;
+        s->end_page_ptr = 0;
+        s->end_page_free = 0;
+    }
+
+    return true;
+}
+
+/*
+ * Give the page to the destination class if all of its chunks are free,
+ * or put the free chunks back on the freelist if we gave up. Called with
+ * the slabs lock held.
+ */
+static void do_slabs_rebalance_finish(struct persistent_engine *engine,
+                                      unsigned int src, unsigned int dst,
+                                      bool moved) {
+    slabclass_t *s = &engine->slabs.slabclass[src];
+    slabclass_t *d = &engine->slabs.slabclass[dst];
+    char *page = engine->slabs.rebal_start;
+    char *chunk;
+    unsigned int ii;
+
+    engine->slabs.rebal_start = NULL;
+    engine->slabs.rebal_end = NULL;
+
+    if (!moved) {
+        for (ii = 0, chunk = page; ii < s->perslab; ++ii, chunk += s->size) {
+            if (((hash_item*)chunk)->iflag & ITEM_SLABBED) {
+                do_slabs_free(engine, chunk, 0, src);
+            }
+        }
+        return;
+    }
+
+    memmove(s->slab_list, s->slab_list + 1, (s->slabs - 1) * sizeof(void *));
+    s->slabs--;
+
+    memset(page, 0, engine->config.item_size_max);
+    d->slab_list[d->slabs++] = page;
+    if (d->end_page_ptr == 0) {
+        d->end_page_ptr = page;
+        d->end_page_free = d->perslab;
+    } else {
+        for (ii = 0, chunk = page; ii < d->perslab; ++ii, chunk += d->size) {
+            do_slabs_free(engine, chunk, 0, dst);
+        }
+    }
+    engine->slabs.slabs_moved++;
+}
+
+bool slabs_reassign(struct persistent_engine *engine, unsigned int src,
+                    unsigned int dst) {
+    struct slabs *slabs = &engine->slabs;
+    unsigned int size, perslab, ii;
+    uint64_t evicted = 0;
+    bool done = false;
+    char *page;
+    int pass;
+
+    if (!engine->config.slab_automove || src == dst ||
+        src < POWER_SMALLEST || src > (unsigned int)slabs->power_largest ||
+        dst < POWER_SMALLEST || dst > (unsigned int)slabs->power_largest) {
+        return false;
+    }
+
+    pthread_mutex_lock(&slabs->lock);
+    if (slabs->rebal_start != NULL ||
+        !do_slabs_rebalance_start(engine, src, dst)) {
+        pthread_mutex_unlock(&slabs->lock);
+        return false;
+    }
+    page = slabs->rebal_start;
+    size = slabs->slabclass[src].size;
+    perslab = slabs->slabclass[src].perslab;
+    pthread_mutex_unlock(&slabs->lock);
+
+    /*
+     * Evict the items in the page. The items in use are freed when their
+     * last reference is released, so we may need a few passes.
+     */
+    for (pass = 0; pass < REBALANCE_MAX_PASSES; ++pass) {
+        pthread_mutex_lock(&slabs->lock);
+        done = slabs->rebal_free == perslab;
+        pthread_mutex_unlock(&slabs->lock);
+        if (done) {
+            break;
+        }
+        if (pass > 0) {
+            usleep(1000);
+        }
+
+        for (ii = 0; ii < perslab; ++ii) {
+            if (item_evacuate(engine, (hash_item*)(page + ii * size), size)) {
+                ++evicted;
+            }
+        }
+    }
+
+    pthread_mutex_lock(&slabs->lock);
+    done = slabs->rebal_free == perslab;
+    do_slabs_rebalance_finish(engine, src, dst, done);
+    slabs->slab_reassign_evictions += evicted;
+    pthread_mutex_unlock(&slabs->lock);
+
+    if (engine->config.verbose) {
+        fprintf(stderr, "%s slab page from class %u to class %u "
+                "(%"PRIu64" items evicted)\n",
+                done ? "Moved" : "Failed to move", src, dst, evicted);
+    }
+
+    return done;
+}
+
+/*
+ * Look at the evictions in the last window, and move a page to the class
+ * that evicted (or failed to allocate) the most items. We take the page
+ * from a class that didn't evict anything, preferring one with a page
+ * worth of free chunks, and otherwise the one with the oldest items (if
+ * they're older than the items in the class that needs the memory).
+ */
+static void slabs_automove(struct persistent_engine *engine) {
+    struct slabs *slabs = &engine->slabs;
+    unsigned int delta[MAX_NUMBER_OF_SLAB_CLASSES];
+    rel_time_t age[MAX_NUMBER_OF_SLAB_CLASSES];
+    unsigned int most = 0, best_pages = 0;
+    unsigned int src = 0, dst = 0;
+    rel_time_t oldest;
+    unsigned int id;
+
+    for (id = POWER_SMALLEST; id <= (unsigned int)slabs->power_largest; ++id) {
+        unsigned int evicted;
+        item_lru_info(engine, id, &evicted, &age[id]);
+        /* reset_stats zeroes the counters, so they may go backwards */
+        if (evicted >= slabs->rebal_evicted[id]) {
+            delta[id] = evicted - slabs->rebal_evicted[id];
+        } else {
+            delta[id] = evicted;
+        }
+        slabs->rebal_evicted[id] = evicted;
+        if (delta[id] > most) {
+            most = delta[id];
+            dst = id;
+        }
+    }
+
+    if (dst == 0) {
+        return;
+    }
+
+    oldest = age[dst];
+    pthread_mutex_lock(&slabs->lock);
+    for (id = POWER_SMALLEST; id <= (unsigned int)slabs->power_largest; ++id) {
+        slabclass_t *p = &slabs->slabclass[id];
+        unsigned int pages;
+
+        if (id == dst || delta[id] != 0 || p->slabs < 2) {
+            continue;
+        }
+
+        pages = (p->sl_curr + p->end_page_free) / p->perslab;
+        if (pages > best_pages) {
+            best_pages = pages;
+            src = id;
+        } else if (best_pages == 0 && age[id] > oldest) {
+            oldest = age[id];
+            src = id;
+        }
+    }
+    pthread_mutex_unlock(&slabs->lock);
+
+    if (src != 0) {
+        slabs_reassign(engine, src, dst);
+    }
+}
+
+static void *slabs_rebalancer_thread(void *arg) {
+    struct persistent_engine *engine = arg;
+    struct slabs *slabs = &engine->slabs;
+
+    pthread_mutex_lock(&slabs->rebal_lock);
+    while (!slabs->rebal_shutdown) {
+        struct timeval tv;
+        struct timespec ts;
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec + engine->config.slab_automove_interval;
+        ts.tv_nsec = tv.tv_usec * 1000;
+
+        while (!slabs->rebal_shutdown &&
+               pthread_cond_timedwait(&slabs->rebal_cond, &slabs->rebal_lock,
+                                      &ts) != ETIMEDOUT) {
+            /* spurious wakeup */
+        }
+        if (slabs->rebal_shutdown) {
+            break;
+        }
+
+        pthread_mutex_unlock(&slabs->rebal_lock);
+        slabs_automove(engine);
+        pthread_mutex_lock(&slabs->rebal_lock);
+    }
+    pthread_mutex_unlock(&slabs->rebal_lock);
+
+    return NULL;
+}
+
+ENGINE_ERROR_CODE slabs_start_rebalancer(struct persistent_engine *engine) {
+    int ret;
+
+    if (!engine->config.slab_automove) {
+        return ENGINE_SUCCESS;
+    }
+
+    pthread_mutex_init(&engine->slabs.rebal_lock, NULL);
+    pthread_cond_init(&engine->slabs.rebal_cond, NULL);
+    if ((ret = pthread_create(&engine->slabs.rebal_tid, NULL,
+                              slabs_rebalancer_thread, engine)) != 0) {
+        fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
+        return ENGINE_FAILED;
+    }
+    engine->slabs.rebal_running = true;
+
+    return ENGINE_SUCCESS;
+}
+
+void slabs_stop_rebalancer(struct persistent_engine *engine) {
+    if (engine->slabs.rebal_running) {
+        pthread_mutex_lock(&engine->slabs.rebal_lock);
+        engine->slabs.rebal_shutdown = true;
+        pthread_cond_signal(&engine->slabs.rebal_cond);
+        pthread_mutex_unlock(&engine->slabs.rebal_lock);
+        pthread_join(engine->slabs.rebal_tid, NULL);
+        engine->slabs.rebal_running = false;
+        pthread_cond_destroy(&engine->slabs.rebal_cond);
+        pthread_mutex_destroy(&engine->slabs.rebal_lock);
+    }
+}
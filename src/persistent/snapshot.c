@@ -0,0 +1,460 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Snapshots of the slab cache
+ *
+ * A snapshot holds the slab pages of every class as they are in memory,
+ * followed by the position (page and offset) of every item in the LRUs,
+ * from the head to the tail. The pointers in the item headers are useless
+ * after a restart, so the restore copies the pages into new slab pages and
+ * links the items again from their positions. Nothing is allocated or
+ * copied one item at a time.
+ *
+ * The rel_time_t fields are relative to the start of the process, so the
+ * snapshot records when that was and the restore moves them over to the
+ * new start (dropping the items that expired in the meantime).
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "persistent_engine.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MAGIC "MCSNAPSH"
+#define SNAPSHOT_VERSION 1
+
+/* The number of item positions we buffer before writing them */
+#define SNAPSHOT_BUFFER 8192
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    /* The layout of the items and the slab classes must match ours */
+    uint32_t item_size;
+    uint32_t use_cas;
+    uint32_t power_largest;
+    uint32_t chunk_size[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint32_t page_size[MAX_NUMBER_OF_SLAB_CLASSES];
+    /* The number of pages and items in each class */
+    uint32_t npages[MAX_NUMBER_OF_SLAB_CLASSES];
+    uint64_t nitems[MAX_NUMBER_OF_SLAB_CLASSES];
+    /* The time(NULL) when the rel_time_t was 0 */
+    int64_t time_base;
+};
+
+/* Where an item is in the snapshot (the page is counted within its class) */
+struct snapshot_item {
+    uint32_t page;
+    uint32_t offset;
+};
+
+/* A slab page of the class we're writing, sorted by address */
+struct page_ref {
+    const char *base;
+    uint32_t index;
+};
+
+static uint64_t now_usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int64_t time_base(struct persistent_engine *engine) {
+    return (int64_t)time(NULL) - engine->server.get_current_time();
+}
+
+static bool write_all(int fd, const void *data, size_t nbytes) {
+    const char *ptr = data;
+    while (nbytes > 0) {
+        ssize_t nw = write(fd, ptr, nbytes);
+        if (nw == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += nw;
+        nbytes -= nw;
+    }
+    return true;
+}
+
+static int page_compare(const void *a, const void *b) {
+    const char *pa = ((const struct page_ref*)a)->base;
+    const char *pb = ((const struct page_ref*)b)->base;
+    return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+/* Find the page holding an item (the pages are sorted) */
+static const struct page_ref *page_find(const struct page_ref *pages,
+                                        uint32_t npages, size_t page_size,
+                                        const char *ptr) {
+    uint32_t low = 0, high = npages;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (ptr < pages[mid].base) {
+            high = mid;
+        } else if (ptr >= pages[mid].base + page_size) {
+            low = mid + 1;
+        } else {
+            return &pages[mid];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Write the positions of the items in an LRU, from the head to the tail.
+ * Called with the lru and slabs locks held.
+ */
+static bool write_lru(struct persistent_engine *engine, int fd,
+                      unsigned int id, const struct snapshot_header *header,
+                      struct snapshot_item *buffer) {
+    slabclass_t *p = &engine->slabs.slabclass[id];
+    struct page_ref *pages;
+    hash_item *it;
+    uint64_t count = 0;
+    size_t nbuffer = 0;
+    uint32_t ii;
+    bool ret = true;
+
+    if ((pages = calloc(p->slabs + 1, sizeof(*pages))) == NULL) {
+        return false;
+    }
+    for (ii = 0; ii < p->slabs; ++ii) {
+        pages[ii].base = p->slab_list[ii];
+        pages[ii].index = ii;
+    }
+    qsort(pages, p->slabs, sizeof(*pages), page_compare);
+
+    for (it = engine->items.heads[id]; it != NULL && ret; it = it->next) {
+        const struct page_ref *page;
+        page = page_find(pages, p->slabs, header->page_size[id],
+                         (const char*)it);
+        if (page == NULL || ++count > header->nitems[id]) {
+            ret = false;
+            break;
+        }
+        buffer[nbuffer].page = page->index;
+        buffer[nbuffer].offset = (const char*)it - page->base;
+        if (++nbuffer == SNAPSHOT_BUFFER) {
+            ret = write_all(fd, buffer, nbuffer * sizeof(*buffer));
+            nbuffer = 0;
+        }
+    }
+
+    if (ret && (count != header->nitems[id] ||
+                !write_all(fd, buffer, nbuffer * sizeof(*buffer)))) {
+        ret = false;
+    }
+    free(pages);
+    return ret;
+}
+
+/*
+ * Write the pages and the LRUs. Everything that may change them is blocked
+ * by the lru locks and the slabs lock (in that order).
+ */
+static bool write_snapshot(struct persistent_engine *engine, int fd,
+                           struct snapshot_info *info) {
+    struct snapshot_header header;
+    struct snapshot_item *buffer;
+    unsigned int id;
+    uint32_t ii;
+    bool ret = true;
+    int i;
+
+    if ((buffer = malloc(SNAPSHOT_BUFFER * sizeof(*buffer))) == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < POWER_LARGEST; i++) {
+        pthread_mutex_lock(&engine->items.lru_locks[i]);
+    }
+    pthread_mutex_lock(&engine->slabs.lock);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.item_size = sizeof(hash_item);
+    header.use_cas = engine->config.use_cas;
+    header.power_largest = engine->slabs.power_largest;
+    header.time_base = time_base(engine);
+    for (id = POWER_SMALLEST; id <= header.power_largest; ++id) {
+        header.chunk_size[id] = engine->slabs.slabclass[id].size;
+        header.page_size[id] = slabs_page_size(engine, id);
+        header.npages[id] = engine->slabs.slabclass[id].slabs;
+        header.nitems[id] = engine->items.sizes[id];
+        info->pages += header.npages[id];
+        info->items += header.nitems[id];
+    }
+
+    ret = write_all(fd, &header, sizeof(header));
+    for (id = POWER_SMALLEST; id <= header.power_largest && ret; ++id) {
+        slabclass_t *p = &engine->slabs.slabclass[id];
+        for (ii = 0; ii < p->slabs && ret; ++ii) {
+            ret = write_all(fd, p->slab_list[ii], header.page_size[id]);
+            info->bytes += header.page_size[id];
+        }
+    }
+    for (id = POWER_SMALLEST; id <= header.power_largest && ret; ++id) {
+        ret = write_lru(engine, fd, id, &header, buffer);
+    }
+
+    pthread_mutex_unlock(&engine->slabs.lock);
+    for (i = POWER_LARGEST - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&engine->items.lru_locks[i]);
+    }
+
+    free(buffer);
+    return ret;
+}
+
+bool snapshot_save(struct persistent_engine *engine, const char *fname,
+                   struct snapshot_info *info) {
+    struct snapshot_info dummy;
+    char tmp[PATH_MAX];
+    uint64_t start = now_usec();
+    int fd;
+
+    if (info == NULL) {
+        info = &dummy;
+    }
+    memset(info, 0, sizeof(*info));
+
+    /* Write to a new file, so a failed snapshot never replaces a good one */
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", fname) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "Snapshot file name too long: %s\n", fname);
+        return false;
+    }
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        fprintf(stderr, "Failed to create %s: %s\n", tmp, strerror(errno));
+        return false;
+    }
+
+    if (!write_snapshot(engine, fd, info) || fsync(fd) != 0) {
+        fprintf(stderr, "Failed to write the snapshot to %s: %s\n",
+                tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return false;
+    }
+    close(fd);
+
+    if (rename(tmp, fname) != 0) {
+        fprintf(stderr, "Failed to rename %s to %s: %s\n", tmp, fname,
+                strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+
+    info->usec = now_usec() - start;
+    if (engine->config.verbose) {
+        fprintf(stderr, "Wrote %llu items in %llu slab pages to %s\n",
+                (unsigned long long)info->items,
+                (unsigned long long)info->pages, fname);
+    }
+    return true;
+}
+
+/*
+ * Check that the snapshot was written by an engine with the same item and
+ * slab layout, and that the file holds everything the header promises.
+ * @return NULL if it's valid, otherwise what's wrong with it
+ */
+static const char *check_header(struct persistent_engine *engine,
+                                const struct snapshot_header *header,
+                                size_t size) {
+    uint64_t expected = sizeof(*header);
+    unsigned int id;
+
+    if (size < sizeof(*header) ||
+        memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        return "not a snapshot";
+    }
+    if (header->version != SNAPSHOT_VERSION) {
+        return "unsupported version";
+    }
+    if (header->item_size != sizeof(hash_item) ||
+        header->use_cas != engine->config.use_cas) {
+        return "different item layout";
+    }
+    if (header->power_largest != (uint32_t)engine->slabs.power_largest) {
+        return "different slab classes";
+    }
+
+    for (id = POWER_SMALLEST; id <= header->power_largest; ++id) {
+        if (header->chunk_size[id] != engine->slabs.slabclass[id].size ||
+            (header->npages[id] > 0 &&
+             header->page_size[id] != slabs_page_size(engine, id))) {
+            return "different slab classes";
+        }
+        expected += (uint64_t)header->npages[id] * header->page_size[id];
+        expected += header->nitems[id] * sizeof(struct snapshot_item);
+    }
+
+    if (expected != size) {
+        return "truncated";
+    }
+    return NULL;
+}
+
+/*
+ * Link the items of an LRU (from the tail, so they end up in the same
+ * order). The pages of the class have been restored.
+ * @return the number of items restored
+ */
+static uint64_t restore_lru(struct persistent_engine *engine,
+                            const struct snapshot_header *header,
+                            unsigned int id, char **pages,
+                            const struct snapshot_item *items) {
+    int64_t old_base = header->time_base;
+    int64_t new_base = time_base(engine);
+    int64_t now = time(NULL);
+    uint64_t restored = 0;
+    uint64_t ii;
+
+    for (ii = header->nitems[id]; ii > 0; --ii) {
+        const struct snapshot_item *pos = &items[ii - 1];
+        hash_item *it;
+        int64_t t;
+
+        if (pos->page >= header->npages[id] || pages[pos->page] == NULL ||
+            pos->offset % header->chunk_size[id] != 0 ||
+            (uint64_t)pos->offset + header->chunk_size[id] >
+            header->page_size[id]) {
+            continue;
+        }
+
+        it = (hash_item*)(pages[pos->page] + pos->offset);
+        /* Each chunk may only be restored once */
+        if (it->slabs_clsid != id || (it->iflag & ITEM_SLABBED) == 0) {
+            continue;
+        }
+
+        if (it->exptime != 0) {
+            t = old_base + it->exptime;
+            if (t <= now) {
+                continue;
+            }
+            it->exptime = (rel_time_t)(t - new_base);
+        }
+        t = old_base + it->time;
+        it->time = t > new_base ? (rel_time_t)(t - new_base) : 0;
+
+        if (item_restore(engine, it)) {
+            ++restored;
+        }
+    }
+
+    return restored;
+}
+
+bool snapshot_restore(struct persistent_engine *engine, const char *fname,
+                      struct snapshot_info *info) {
+    const struct snapshot_header *header;
+    struct snapshot_info dummy;
+    uint64_t start = now_usec();
+    const char *error;
+    const char *data;
+    char **pages[MAX_NUMBER_OF_SLAB_CLASSES];
+    struct stat st;
+    unsigned int id;
+    uint32_t ii;
+    void *map;
+    int fd;
+
+    if (info == NULL) {
+        info = &dummy;
+    }
+    memset(info, 0, sizeof(*info));
+
+    if ((fd = open(fname, O_RDONLY)) == -1) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+        }
+        return false;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s: %s\n", fname, strerror(errno));
+        close(fd);
+        return false;
+    }
+    close(fd);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    header = map;
+    if ((error = check_header(engine, header, st.st_size)) != NULL) {
+        fprintf(stderr, "Ignoring snapshot %s: %s\n", fname, error);
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    /* Copy the pages (the ones we don't have room for are left out) */
+    memset(pages, 0, sizeof(pages));
+    data = (const char*)(header + 1);
+    for (id = POWER_SMALLEST; id <= header->power_largest; ++id) {
+        if (header->npages[id] == 0) {
+            continue;
+        }
+        if ((pages[id] = calloc(header->npages[id], sizeof(char*))) == NULL) {
+            data += (size_t)header->npages[id] * header->page_size[id];
+            continue;
+        }
+        for (ii = 0; ii < header->npages[id]; ++ii) {
+            pages[id][ii] = slabs_restore_page(engine, id, data,
+                                               header->page_size[id]);
+            if (pages[id][ii] != NULL) {
+                info->pages++;
+                info->bytes += header->page_size[id];
+            }
+            data += header->page_size[id];
+        }
+    }
+
+    for (id = POWER_SMALLEST; id <= header->power_largest; ++id) {
+        const struct snapshot_item *items = (const void*)data;
+        if (pages[id] != NULL) {
+            info->items += restore_lru(engine, header, id, pages[id], items);
+        }
+        data += header->nitems[id] * sizeof(*items);
+    }
+
+    /* Free the chunks we didn't restore an item into */
+    for (id = POWER_SMALLEST; id <= header->power_largest; ++id) {
+        if (pages[id] == NULL) {
+            continue;
+        }
+        for (ii = 0; ii < header->npages[id]; ++ii) {
+            if (pages[id][ii] != NULL) {
+                slabs_restore_done(engine, id, pages[id][ii]);
+            }
+        }
+        free(pages[id]);
+    }
+
+    munmap(map, st.st_size);
+
+    /* The snapshot is stale as soon as the cache changes */
+    if (unlink(fname) != 0) {
+        fprintf(stderr, "Failed to remove %s: %s\n", fname, strerror(errno));
+    }
+
+    info->usec = now_usec() - start;
+    if (engine->config.verbose) {
+        fprintf(stderr, "Restored %llu items in %llu slab pages from %s\n",
+                (unsigned long long)info->items,
+                (unsigned long long)info->pages, fname);
+    }
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * A snapshot of the slab pages holding the items in the cache, so that a
+ * restart can bring back the cache without reading the items from the
+ * backend one at a time (see snapshot.c).
+ */
+
+/** The numbers reported for the last snapshot */
+struct snapshot_info {
+   uint64_t pages;
+   uint64_t items;
+   uint64_t bytes;
+   uint64_t usec;
+};
+
+/**
+ * Write a snapshot of the cache. The cache is blocked while the pages are
+ * written, so this is only done at shutdown.
+ * @param engine handle to the storage engine
+ * @param fname the file to write (replaced once the snapshot is complete)
+ * @param info where to store the size of the snapshot (may be NULL)
+ * @return true on success
+ */
+bool snapshot_save(struct persistent_engine *engine, const char *fname,
+                   struct snapshot_info *info);
+
+/**
+ * Restore the cache from a snapshot, and remove the snapshot (it's only
+ * valid until the cache changes). Call this before the slab rebalancer is
+ * started.
+ * @param engine handle to the storage engine
+ * @param fname the snapshot file
+ * @param info where to store the numbers restored (may be NULL)
+ * @return true if we restored the snapshot
+ */
+bool snapshot_restore(struct persistent_engine *engine, const char *fname,
+                      struct snapshot_info *info);
+
+#endif
@@ -7,26 +7,36 @@
  *
  */
 #include "persistent_engine.h"
+#include "io_threads.h"
 
 #include <assert.h>
 #include <sqlite3.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <ctime>
 #include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <map>
+#include <set>
+#include <deque>
+#include <vector>
+
+/*
+ * How many times we run a COMMIT that failed because the database was
+ * busy (each one waits for the busy timeout) before we give up on the batch
+ */
+#define COMMIT_RETRIES 5
 
 class SQLite {
 public:
     SQLite(struct persistent_engine* se)
         : db(NULL), engine(se)
     {
-        pthread_mutex_init(&mutex, NULL);
-        pthread_cond_init(&cond, NULL);
     }
 
     virtual ~SQLite() {
-        pthread_mutex_destroy(&mutex);
-        pthread_cond_destroy(&cond);
     }
 
     bool initialize(const std::string &dbname) {
@@ -35,13 +45,16 @@ public:
             db = NULL;
             return false;
         }
+        sqlite3_busy_timeout(db, 1000);
 
         std::string query = "CREATE TABLE IF NOT EXISTS kv"
             " (key VARCHAR(250) PRIMARY KEY,"
             "  flags INTEGER(4), "
             "  exptime INTEGER(4), "
             "  hash INTEGER(4), "
-            "  value BLOB)";
+            "  value BLOB, "
+            "  atime INTEGER(4) DEFAULT 0, "
+            "  gen INTEGER DEFAULT 0)";
 
         if (sqlite3_prepare_v2(db, query.c_str(),
                                query.length(), &st, NULL) != SQLITE_OK) {
@@ -74,51 +87,203 @@ protected:
     struct persistent_engine* engine;
 
 
-    void lock() {
-        int ret;
-        while ((ret = pthread_mutex_lock(&mutex)) == -1) {
-            if (errno != EINTR) {
-                abort();
+    /**
+     * Execute a statement that doesn't return any rows (like BEGIN and
+     * COMMIT). The busy handler (sqlite3_busy_timeout) waits for the
+     * database while it's busy, so we fail if it's still busy after that.
+     * @param st the statement to run
+     * @return true on success
+     */
+    bool execute(sqlite3_stmt *st) {
+        sqlite3_reset(st);
+        return sqlite3_step(st) == SQLITE_DONE;
+    }
+
+    /**
+     * Run a single SQL statement (with no result set). See above for
+     * what we do while the database is busy.
+     * @param sql the statement to execute
+     * @return true on success
+     */
+    bool execute(const char *sql) {
+        return sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK;
+    }
+
+    /**
+     * Check if a column exists in the kv table (databases created by
+     * older versions may lack some of the columns)
+     * @param name the name of the column
+     * @return true if the column exists
+     */
+    bool hasColumn(const std::string &name) {
+        sqlite3_stmt *st;
+        bool found = false;
+        if (sqlite3_prepare_v2(db, "PRAGMA table_info(kv)", -1,
+                               &st, NULL) != SQLITE_OK) {
+            return false;
+        }
+        while (sqlite3_step(st) == SQLITE_ROW) {
+            if (name == (const char*)sqlite3_column_text(st, 1)) {
+                found = true;
             }
         }
+        sqlite3_finalize(st);
+        return found;
     }
+};
 
-    void unlock() {
-        int ret;
-        while ((ret = pthread_mutex_unlock(&mutex)) == -1) {
-            if (errno != EINTR) {
-                abort();
-            }
+/* The size of the Bloom filter (~1% false positives at capacity) */
+#define BLOOM_BITS_PER_KEY 10
+#define BLOOM_HASHES 7
+/* Don't size the filter for fewer keys than this */
+#define BLOOM_MIN_KEYS (1024 * 1024)
+
+/**
+ * A Bloom filter covering the keys stored in the kv table, so that we
+ * may tell a client a key doesn't exist without reading from disk. The
+ * filter is blocked: all of the bits for a key live in the same cache
+ * line, so a lookup costs a single cache miss. We can't remove keys
+ * from it, so the keys removed from disk remain as false positives
+ * until the next restart. Until the filter is loaded from the database
+ * every key may exist.
+ */
+class BloomFilter {
+public:
+    BloomFilter(struct persistent_engine* se, size_t capacity)
+        : engine(se), nlines(0), lines(NULL), ready(false), keys(0),
+          negatives(0) {
+        nlines = (capacity * BLOOM_BITS_PER_KEY + 511) / 512;
+        if (nlines == 0) {
+            nlines = 1;
         }
+        lines = static_cast<uint64_t*>(calloc(nlines * 8, sizeof(uint64_t)));
     }
 
-    void notify() {
-        int ret;
-        while ((ret = pthread_cond_signal(&cond)) == -1) {
-            if (errno != EINTR) {
-                abort();
+    ~BloomFilter() {
+        free(lines);
+    }
+
+    bool initialized() const {
+        return lines != NULL;
+    }
+
+    void add(const void *key, size_t nkey) {
+        uint64_t *line;
+        uint32_t h2;
+        locate(key, nkey, line, h2);
+        for (int ii = 0; ii < BLOOM_HASHES; ++ii, h2 += (h2 >> 17) | 1) {
+            uint32_t bit = h2 & 511;
+            uint64_t mask = (uint64_t)1 << (bit & 63);
+            if ((line[bit >> 6] & mask) == 0) {
+                __sync_fetch_and_or(&line[bit >> 6], mask);
             }
         }
+        __sync_add_and_fetch(&keys, 1);
     }
 
-    void wait() {
-        int ret;
-        while ((ret = pthread_cond_wait(&cond, &mutex)) == -1) {
-            if (errno != EINTR) {
-                abort();
+    bool mayContain(const void *key, size_t nkey) {
+        if (!ready) {
+            return true;
+        }
+        const uint64_t *line;
+        uint32_t h2;
+        locate(key, nkey, line, h2);
+        for (int ii = 0; ii < BLOOM_HASHES; ++ii, h2 += (h2 >> 17) | 1) {
+            uint32_t bit = h2 & 511;
+            if ((line[bit >> 6] & ((uint64_t)1 << (bit & 63))) == 0) {
+                __sync_add_and_fetch(&negatives, 1);
+                return false;
             }
         }
+        return true;
+    }
+
+    /** All of the keys on disk are in the filter */
+    void setReady() {
+        __sync_synchronize();
+        ready = true;
+    }
+
+    void addStats(ADD_STAT add_stat, const void *cookie) {
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_bloom_ready",
+                       "%s", ready ? "true" : "false");
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_bloom_bytes",
+                       "%llu", (unsigned long long)(nlines * 64));
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_bloom_keys",
+                       "%llu", (unsigned long long)keys);
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_bloom_negatives",
+                       "%llu", (unsigned long long)negatives);
+    }
+
+    void resetStats() {
+        negatives = 0;
+    }
+
+private:
+    template <typename T>
+    void locate(const void *key, size_t nkey, T *&line, uint32_t &h2) {
+        uint32_t h1 = engine->server.hash(key, nkey, 0);
+        h2 = engine->server.hash(key, nkey, h1);
+        line = lines + (h1 % nlines) * 8;
+    }
+
+    struct persistent_engine* engine;
+    /** The number of 64 byte lines in the filter */
+    size_t nlines;
+    uint64_t *lines;
+    volatile bool ready;
+    /** The number of keys added (keys written more than once count twice) */
+    uint64_t keys;
+    /** The number of lookups we answered without going to disk */
+    uint64_t negatives;
+};
+
+/**
+ * Statistics collected by the writer thread. All members are protected
+ * by the writer's mutex.
+ */
+struct writer_stats {
+    writer_stats() { reset(); }
+
+    void reset() {
+        batches = 0;
+        items = 0;
+        deletes = 0;
+        batch_size_max = 0;
+        commit_usec = 0;
+        commit_usec_max = 0;
+        failed = 0;
+        purged = 0;
     }
 
-    pthread_cond_t cond;
-    pthread_mutex_t mutex;
+    /** The number of transactions committed */
+    uint64_t batches;
+    /** The number of items written */
+    uint64_t items;
+    /** The number of those that removed a key */
+    uint64_t deletes;
+    /** The largest batch we've written */
+    uint64_t batch_size_max;
+    /** The total time spent in COMMIT */
+    uint64_t commit_usec;
+    /** The slowest COMMIT we've seen */
+    uint64_t commit_usec_max;
+    /** The number of items we failed to write */
+    uint64_t failed;
+    /** The number of expired or flushed rows the purge removed */
+    uint64_t purged;
 };
 
+/* The number of rowids the purge checks in one go */
+#define PURGE_CHUNK 10000
 
-class SQLiteWriter : public SQLite {
+class SQLiteWriter : public SQLite, public WriteQueue {
 public:
     SQLiteWriter(struct persistent_engine* se)
-        : SQLite(se) {
+        : SQLite(se), WriteQueue(se),
+          purgeInterval((uint64_t)se->config.purge_interval * 1000000),
+          purgeNext(0), purgeLast(0), purgeAt(0) {
+        purgeAt = now_usec() + purgeInterval;
     }
 
     ~SQLiteWriter() {
@@ -130,112 +295,422 @@ public:
             return false;
         }
 
+        /* atime and gen were added later, so upgrade old databases */
+        if (!hasColumn("atime") &&
+            !execute("ALTER TABLE kv ADD COLUMN atime INTEGER(4) DEFAULT 0")) {
+            return false;
+        }
+        if (!hasColumn("gen") &&
+            !execute("ALTER TABLE kv ADD COLUMN gen INTEGER DEFAULT 0")) {
+            return false;
+        }
+        if (!execute("CREATE INDEX IF NOT EXISTS kv_atime ON kv (atime)")) {
+            return false;
+        }
+
         std::string query= "INSERT OR REPLACE INTO kv "
-            "(key, flags, exptime, hash, value) "
-            "values (?, ?, ?, ?, ?)";
+            "(key, flags, exptime, hash, value, atime, gen) "
+            "values (?, ?, ?, ?, ?, ?, ?)";
         if (sqlite3_prepare_v2(db, query.c_str(),
                                query.length(),
                                &statement, NULL) != SQLITE_OK) {
             return false;
         }
 
+        if (sqlite3_prepare_v2(db, "DELETE FROM kv WHERE key = ?", -1,
+                               &deleteStatement, NULL) != SQLITE_OK) {
+            return false;
+        }
+
+        /* Remove the rows from older generations and the expired ones */
+        query = "DELETE FROM kv WHERE rowid >= ? AND rowid < ? AND "
+            "(gen != ? OR (exptime != 0 AND exptime <= ?))";
+        if (sqlite3_prepare_v2(db, query.c_str(), query.length(),
+                               &purgeStatement, NULL) != SQLITE_OK) {
+            return false;
+        }
+
+        if (sqlite3_prepare_v2(db, "BEGIN", -1, &begin, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "COMMIT", -1, &commit, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "ROLLBACK", -1, &rollback,
+                               NULL) != SQLITE_OK) {
+            return false;
+        }
+
+        /* Engine state that must survive a restart (like the CAS limit) */
+        if (!execute("CREATE TABLE IF NOT EXISTS meta"
+                     " (name VARCHAR(32) PRIMARY KEY, value INTEGER)")) {
+            return false;
+        }
+        query = "INSERT OR REPLACE INTO meta (name, value) VALUES (?, ?)";
+        if (sqlite3_prepare_v2(db, query.c_str(), query.length(),
+                               &metaStatement, NULL) != SQLITE_OK) {
+            return false;
+        }
+
         return true;
     }
 
+    /**
+     * Continue handing out CAS ids from the limit stored by the previous
+     * run, so the clients can't see the same CAS id for different values,
+     * and continue with its flush generation. Called before any items are
+     * stored.
+     */
+    bool loadMeta() {
+        sqlite3_stmt *st;
+        uint64_t limit = 0;
+        uint32_t gen = 0;
+        if (sqlite3_prepare_v2(db, "SELECT name, value FROM meta",
+                               -1, &st, NULL) != SQLITE_OK) {
+            return false;
+        }
+        while (sqlite3_step(st) == SQLITE_ROW) {
+            std::string name((const char*)sqlite3_column_text(st, 0));
+            if (name == "cas") {
+                limit = (uint64_t)sqlite3_column_int64(st, 1);
+            } else if (name == "generation") {
+                gen = (uint32_t)sqlite3_column_int64(st, 1);
+            }
+        }
+        sqlite3_finalize(st);
+
+        engine->items.cas_id = limit;
+        engine->items.cas_limit = limit;
+        setGeneration(gen);
+        return true;
+    }
+
+    /**
+     * Get the highest rowid in the kv table. The rowids are only reused
+     * after the row with the highest one is removed, so this is an upper
+     * bound for the number of keys (and cheap to find).
+     */
+    size_t maxRowid() {
+        sqlite3_stmt *st;
+        size_t ret = 0;
+        if (sqlite3_prepare_v2(db, "SELECT max(rowid) FROM kv",
+                               -1, &st, NULL) == SQLITE_OK) {
+            if (sqlite3_step(st) == SQLITE_ROW) {
+                ret = (size_t)sqlite3_column_int64(st, 0);
+            }
+            sqlite3_finalize(st);
+        }
+        return ret;
+    }
+
     void finalize() {
+        sqlite3_finalize(metaStatement);
+        sqlite3_finalize(purgeStatement);
+        sqlite3_finalize(deleteStatement);
         sqlite3_finalize(statement);
+        sqlite3_finalize(begin);
+        sqlite3_finalize(commit);
+        sqlite3_finalize(rollback);
         SQLite::finalize();
     }
 
-    void enqueue(hash_item* item) {
-        std::string key(item_get_key(item), item->nkey);
-        ++item->refcount;
+    void addStats(ADD_STAT add_stat, const void *cookie) {
+        lock();
+        writer_stats s = stats;
+        unlock();
+
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_write_batches",
+                       "%llu", (unsigned long long)s.batches);
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_write_items",
+                       "%llu", (unsigned long long)s.items);
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_write_deletes",
+                       "%llu", (unsigned long long)s.deletes);
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_write_failed",
+                       "%llu", (unsigned long long)s.failed);
+        add_statistics(cookie, add_stat, NULL, -1,
+                       "sqlite_write_batch_size_avg", "%llu",
+                       (unsigned long long)(s.batches ? s.items / s.batches : 0));
+        add_statistics(cookie, add_stat, NULL, -1,
+                       "sqlite_write_batch_size_max", "%llu",
+                       (unsigned long long)s.batch_size_max);
+        add_statistics(cookie, add_stat, NULL, -1,
+                       "sqlite_commit_latency_avg_us", "%llu",
+                       (unsigned long long)(s.batches ? s.commit_usec / s.batches : 0));
+        add_statistics(cookie, add_stat, NULL, -1,
+                       "sqlite_commit_latency_max_us", "%llu",
+                       (unsigned long long)s.commit_usec_max);
+        addQueueStats(add_stat, cookie, "sqlite");
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_purged_rows",
+                       "%llu", (unsigned long long)s.purged);
+        add_statistics(cookie, add_stat, NULL, -1, "sqlite_flush_generation",
+                       "%u", currentGeneration());
+    }
 
+    void resetStats() {
         lock();
-        std::map<std::string, hash_item*>::iterator iter = queue.find(key);
-        if (iter != queue.end()) {
-            /* don't store the previous entry! */
-            engine->engine.release(reinterpret_cast<ENGINE_HANDLE*>(&engine->engine),
-                                   NULL, iter->second);
-            queue.erase(iter);
-        }
-        queue[key] = item;
-        notify();
+        stats.reset();
         unlock();
+        resetQueueStats();
     }
 
 private:
-    void storeItem(hash_item *it)
-    {
-        if (sqlite3_clear_bindings(statement) != SQLITE_OK ||
-            sqlite3_reset(statement) != SQLITE_OK) {
-            abort();
-        }
-
-        sqlite3_bind_text(statement, 1,item_get_key(it),
-                          it->nkey, SQLITE_STATIC);
-        sqlite3_bind_int(statement, 2, it->flags);
-        sqlite3_bind_int(statement, 3, it->exptime);
-        sqlite3_bind_int(statement, 4, 0);
-        sqlite3_bind_blob(statement, 5, item_get_data(it),
-                          it->nbytes, SQLITE_STATIC);
-
+    /**
+     * Run a statement changing a single row, retrying while the database
+     * is busy
+     * @return the number of rows changed, or -1 on failure
+     */
+    int change(sqlite3_stmt *st) {
         int rc = 0;
         bool retry;
         bool success = true;
 
         do {
             retry = false;
-            switch ((rc = sqlite3_step(statement))) {
+            switch ((rc = sqlite3_step(st))) {
                 /* @todo fix the correct values here */
             case SQLITE_CONSTRAINT:
                 success = false;
                 break;
             case SQLITE_DONE:
                 break;
-            default:
+            case SQLITE_BUSY:
+                sqlite3_reset(st);
                 retry = true;
+                break;
+            default:
+                success = false;
             }
         } while (retry);
 
-        if (success) {
-            success = sqlite3_changes(db) == 1;;
+        return success ? sqlite3_changes(db) : -1;
+    }
+
+    bool storeItem(hash_item *it, uint32_t generation)
+    {
+        /* Add the key before the row may be seen by the readers */
+        if (engine->filter != NULL) {
+            static_cast<BloomFilter*>(engine->filter)->add(item_get_key(it),
+                                                           it->nkey);
+        }
+
+        /* reset returns the error from the previous step if it failed */
+        sqlite3_reset(statement);
+        if (sqlite3_clear_bindings(statement) != SQLITE_OK) {
+            abort();
+        }
+
+        sqlite3_bind_text(statement, 1,item_get_key(it),
+                          it->nkey, SQLITE_STATIC);
+        sqlite3_bind_int(statement, 2, it->flags);
+        sqlite3_bind_int64(statement, 3, disk_exptime(engine, it->exptime));
+        sqlite3_bind_int(statement, 4, 0);
+        /* The blob must stay around until the statement is executed */
+        std::vector<char> value;
+        sqlite3_bind_blob(statement, 5, item_value(it, value),
+                          it->nbytes, SQLITE_STATIC);
+        /* Store the last access as an absolute time so it survives restart */
+        sqlite3_bind_int64(statement, 6,
+                           (sqlite3_int64)(time(NULL) -
+                                           (engine->server.get_current_time() - it->time)));
+        sqlite3_bind_int64(statement, 7, generation);
+
+        return change(statement) == 1;
+    }
+
+    bool removeItem(const std::string &key) {
+        sqlite3_reset(deleteStatement);
+        sqlite3_bind_text(deleteStatement, 1, key.c_str(), key.length(),
+                          SQLITE_STATIC);
+        /* The key doesn't have to be on disk */
+        return change(deleteStatement) >= 0;
+    }
+
+    bool storeMeta(const char *name, uint64_t value) {
+        sqlite3_reset(metaStatement);
+        sqlite3_bind_text(metaStatement, 1, name, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(metaStatement, 2, (sqlite3_int64)value);
+        return execute(metaStatement);
+    }
+
+    /**
+     * Roll back the transaction if one is still open (a COMMIT that fails
+     * with anything but SQLITE_BUSY may leave it open, and then every
+     * BEGIN after it fails)
+     */
+    void rollbackTransaction() {
+        if (!sqlite3_get_autocommit(db) && !execute(rollback)) {
+            fprintf(stderr, "Failed to roll back the transaction: %s\n",
+                    sqlite3_errmsg(db));
+        }
+    }
+
+    /**
+     * Write a batch of items inside a single transaction so that we
+     * only pay for a single sync to disk for the entire batch. A new CAS
+     * limit and flush generation are written in the same transaction.
+     */
+    void storeBatch(write_batch &batch) {
+        uint64_t failed = 0;
+        uint64_t deletes = 0;
+        bool transaction;
+
+        /* Don't run the batch inside a transaction we failed to end */
+        rollbackTransaction();
+        transaction = execute(begin);
+        bool casStored = batch.cas != 0 && storeMeta("cas", batch.cas);
+        if (batch.flushed && !storeMeta("generation", batch.generation)) {
+            fprintf(stderr, "Failed to store the flush generation: %s\n",
+                    sqlite3_errmsg(db));
+        }
+
+        std::vector<std::pair<std::string, hash_item*> >::iterator iter;
+        for (iter = batch.items.begin(); iter != batch.items.end(); ++iter) {
+            if (iter->second == NULL) {
+                ++deletes;
+                if (!removeItem(iter->first)) {
+                    ++failed;
+                }
+            } else {
+                if (!storeItem(iter->second, batch.generation)) {
+                    ++failed;
+                }
+            }
+        }
+
+        uint64_t start = now_usec();
+        bool committed = true;
+        if (transaction) {
+            int tries = 0;
+            /* A COMMIT that failed with SQLITE_BUSY may be run again */
+            while (!(committed = execute(commit)) &&
+                   sqlite3_errcode(db) == SQLITE_BUSY &&
+                   ++tries < COMMIT_RETRIES) {
+                ;
+            }
+        }
+        if (!committed) {
+            fprintf(stderr, "Failed to commit a batch of %lu writes "
+                    "(will retry): %s\n",
+                    (unsigned long)batch.items.size(), sqlite3_errmsg(db));
+            failed = batch.items.size();
+            casStored = false;
+            rollbackTransaction();
+        }
+        uint64_t elapsed = now_usec() - start;
+
+        if (casStored) {
+            item_set_cas_limit(engine, batch.cas);
+        }
+
+        lock();
+        stats.batches++;
+        stats.items += batch.items.size();
+        stats.deletes += deletes;
+        stats.failed += failed;
+        if (batch.items.size() > stats.batch_size_max) {
+            stats.batch_size_max = batch.items.size();
+        }
+        stats.commit_usec += elapsed;
+        if (elapsed > stats.commit_usec_max) {
+            stats.commit_usec_max = elapsed;
+        }
+        unlock();
+
+        if (!committed) {
+            /* Nothing in the batch made it to disk (the deletes either) */
+            retry(batch);
+        }
+    }
+
+    /**
+     * Remove the expired rows (and the ones from older generations) in
+     * the next range of rowids. We go through the table a chunk at a time
+     * between the batches, so we never hold the write lock for long.
+     */
+    void purge() {
+        if (purgeLast == 0) {
+            /* Start a new pass */
+            purgeNext = 0;
+            if ((purgeLast = maxRowid()) == 0) {
+                purgeAt = now_usec() + purgeInterval;
+                return;
+            }
+        }
+
+        sqlite3_reset(purgeStatement);
+        sqlite3_bind_int64(purgeStatement, 1, purgeNext);
+        sqlite3_bind_int64(purgeStatement, 2, purgeNext + PURGE_CHUNK);
+        sqlite3_bind_int64(purgeStatement, 3, currentGeneration());
+        sqlite3_bind_int64(purgeStatement, 4, (sqlite3_int64)time(NULL));
+        int removed = change(purgeStatement);
+        purgeNext += PURGE_CHUNK;
+
+        if (removed > 0) {
+            lock();
+            stats.purged += removed;
+            unlock();
+        }
+
+        if (purgeNext > purgeLast) {
+            purgeLast = 0;
+            purgeAt = now_usec() + purgeInterval;
         }
     }
 
     virtual void run() {
         assert(engine != NULL);
-        lock();
+        write_batch batch;
+        batch.items.reserve(batchSize);
+
         while (true) {
-            while (queue.empty()) {
-                wait();
+            /* Don't wait for more writes while a purge is in progress */
+            uint64_t deadline = 0;
+            if (purgeInterval != 0) {
+                deadline = purgeLast != 0 ? now_usec() : purgeAt;
             }
-
-            while (queue.begin() != queue.end()) {
-                hash_item *item = queue.begin()->second;
-                queue.erase(queue.begin());
-                unlock();
-                storeItem(item);
-                engine->engine.release(reinterpret_cast<ENGINE_HANDLE*>(&engine->engine),
-                                       NULL, item);
-                lock();
+            next(batch, deadline);
+            if (!batch.items.empty() || batch.cas != 0 || batch.flushed) {
+                uint64_t start = latency_start(engine);
+                storeBatch(batch);
+                latency_record(engine, LATENCY_DISK_WRITE, start);
+            }
+            complete(batch);
+            if (purgeInterval != 0 && now_usec() >= purgeAt) {
+                purge();
             }
         }
     }
 
     sqlite3_stmt *statement;
-    std::map<std::string, hash_item*> queue;
+    sqlite3_stmt *deleteStatement;
+    sqlite3_stmt *purgeStatement;
+    sqlite3_stmt *begin;
+    sqlite3_stmt *commit;
+    sqlite3_stmt *rollback;
+    sqlite3_stmt *metaStatement;
+    /** How often (in usec) we look for rows to purge (0 == never) */
+    uint64_t purgeInterval;
+    /** The next rowid to purge */
+    sqlite3_int64 purgeNext;
+    /** The last rowid in this purge pass (0 if we're not purging) */
+    sqlite3_int64 purgeLast;
+    /** When to start the next purge pass */
+    uint64_t purgeAt;
+    struct writer_stats stats;
 };
 
-
-static inline hash_item* get_real_item(item* itm) {
-    return (hash_item*)itm;
-}
+/*
+ * The maximum number of keys a reader looks up with one query (SQLite
+ * doesn't allow more than 999 parameters in a statement by default)
+ */
+#define MAX_READ_BATCH 999
 
 class SQLiteReader : public SQLite {
 public:
-    SQLiteReader(struct persistent_engine* se)
-        : SQLite(se) {
+    SQLiteReader(struct persistent_engine* se, ReadQueue *q = NULL)
+        : SQLite(se), readAheadStatement(NULL), queue(q),
+          batchSize(se->config.read_batch_size) {
+        if (batchSize == 0) {
+            batchSize = 1;
+        } else if (batchSize > MAX_READ_BATCH) {
+            batchSize = MAX_READ_BATCH;
+        }
     }
 
     ~SQLiteReader() {
@@ -247,112 +722,340 @@ public:
             return false;
         }
 
-        std::string query = "SELECT flags, exptime, hash, value FROM kv "
-            "where key = ?";
+        /*
+         * Read a batch of keys with a single query. The placeholders we
+         * don't use in a batch are left NULL, which never matches a key.
+         * The last two are the current generation and time, so we don't
+         * read the rows that are flushed or expired.
+         */
+        std::string query = "SELECT key, flags, exptime, value FROM kv "
+            "WHERE key IN (?";
+        for (size_t ii = 1; ii < batchSize; ++ii) {
+            query.append(",?");
+        }
+        query.append(") AND gen = ? AND (exptime = 0 OR exptime > ?)");
         if (sqlite3_prepare_v2(db, query.c_str(),
                                query.length(),
                                &statement, NULL) != SQLITE_OK) {
             return false;
         }
 
+        /* The keys following a key with the same prefix (see readAhead) */
+        if (engine->config.read_ahead > 0) {
+            query = "SELECT key, flags, exptime, value FROM kv "
+                "WHERE key > ? AND key < ? AND gen = ? AND "
+                "(exptime = 0 OR exptime > ?) ORDER BY key LIMIT ?";
+            if (sqlite3_prepare_v2(db, query.c_str(),
+                                   query.length(),
+                                   &readAheadStatement, NULL) != SQLITE_OK) {
+                return false;
+            }
+        }
+
         return true;
     }
 
     void finalize() {
+        sqlite3_finalize(readAheadStatement);
         sqlite3_finalize(statement);
         SQLite::finalize();
     }
 
-    void enqueue(const void *cookie, const std::string &key) {
-        lock();
-        queue[cookie] = key;
-        notify();
-        unlock();
-    }
-
 protected:
 
-    bool createItem(std::string key, int flagoffset, const void *cookie) {
-        item *it = NULL;
-        ENGINE_ERROR_CODE r;
-        size_t nbytes = sqlite3_column_bytes(statement, flagoffset + 2);
-        r = engine->engine.allocate(reinterpret_cast<ENGINE_HANDLE*>(&engine->engine),
-                                    cookie, &it, key.c_str(), key.length(),
-                                    nbytes,
-                                    sqlite3_column_int(statement, flagoffset),
-                                    sqlite3_column_int(statement, flagoffset + 1));
-        if (r == ENGINE_SUCCESS) {
-            hash_item *itm = get_real_item(it);
-            memcpy(item_get_data(itm),
-                   sqlite3_column_text(statement, flagoffset + 2), nbytes);
-            uint64_t cas;
-            store_item(engine, itm, &cas, OPERATION_ADD, false, NULL);
-            return true;
+    /** The flush generation the rows we read must belong to */
+    uint32_t generation() {
+        return static_cast<SQLiteWriter*>(engine->writer)->currentGeneration();
+    }
 
-        }
-        return false;
+    /**
+     * Add the item in the current row to the cache
+     * @param key the key of the item
+     * @param flagoffset the column holding the flags (followed by the
+     *                   exptime and the value)
+     * @param prefetch nobody is waiting for the item (see load_item)
+     */
+    bool createItem(const std::string &key, int flagoffset,
+                    bool prefetch = false) {
+        return createItem(statement, key, flagoffset, prefetch);
+    }
+
+    bool createItem(sqlite3_stmt *st, const std::string &key, int flagoffset,
+                    bool prefetch = false) {
+        return load_item(engine, key,
+                         sqlite3_column_int(st, flagoffset),
+                         (uint32_t)sqlite3_column_int64(st, flagoffset + 1),
+                         sqlite3_column_blob(st, flagoffset + 2),
+                         sqlite3_column_bytes(st, flagoffset + 2), prefetch);
     }
 
-    bool readItem(const std::string &key, const void *cookie)
+    /**
+     * Read a batch of keys from disk, and add the ones we find to the cache
+     * @param keys the keys to read (at most batchSize)
+     * @param found where to store the keys we found
+     */
+    void readItems(const std::vector<std::string> &keys,
+                   std::set<std::string> &found)
     {
-        if (sqlite3_clear_bindings(statement) != SQLITE_OK ||
-            sqlite3_reset(statement) != SQLITE_OK) {
+        assert(keys.size() <= batchSize);
+        sqlite3_reset(statement);
+        if (sqlite3_clear_bindings(statement) != SQLITE_OK) {
             abort();
         }
 
-        sqlite3_bind_text(statement, 1, key.c_str(),
-                          key.length(), SQLITE_STATIC);
+        for (size_t ii = 0; ii < keys.size(); ++ii) {
+            sqlite3_bind_text(statement, ii + 1, keys[ii].c_str(),
+                              keys[ii].length(), SQLITE_STATIC);
+        }
+        sqlite3_bind_int64(statement, batchSize + 1, generation());
+        sqlite3_bind_int64(statement, batchSize + 2, (sqlite3_int64)time(NULL));
 
         int rc = 0;
-        bool retry;
-        bool found = false;
+        bool done = false;
         do {
-            retry = false;
             switch ((rc = sqlite3_step(statement))) {
             case SQLITE_ROW:
-                found = true;
+                {
+                    std::string key((char*)sqlite3_column_text(statement, 0),
+                                    sqlite3_column_bytes(statement, 0));
+                    if (createItem(key, 1)) {
+                        found.insert(key);
+                    }
+                }
                 break;
-            case SQLITE_DONE:
+            case SQLITE_BUSY:
+                /*
+                 * Start over. The items we've already created are still
+                 * in the cache, so adding them again just fails.
+                 */
+                sqlite3_reset(statement);
+                break;
+            default:
+                done = true;
                 break;
             }
-        } while (retry);
+        } while (!done);
 
-        if (found) {
-            return createItem(key, 1, cookie);
+        /* Release the read lock so that the writer may commit */
+        sqlite3_reset(statement);
+    }
+
+    /**
+     * Load the keys following a key we just read that share its prefix,
+     * so that a client walking through a namespace finds them in memory.
+     * We read ahead once per prefix in a batch, after the last key.
+     * @param found the keys we just read
+     */
+    void readAhead(const std::set<std::string> &found) {
+        std::map<std::string, std::string> last;
+        std::set<std::string>::const_iterator k;
+        std::string pfx;
+        for (k = found.begin(); k != found.end(); ++k) {
+            if (queue->readAheadPrefix(*k, pfx)) {
+                /* The set is sorted, so this ends up with the last key */
+                last[pfx] = *k;
+            }
+        }
+
+        std::map<std::string, std::string>::iterator iter;
+        for (iter = last.begin(); iter != last.end(); ++iter) {
+            readAhead(iter->second, iter->first);
         }
-        return false;
+    }
+
+    void readAhead(const std::string &key, const std::string &pfx) {
+        /* All of the keys with the prefix are less than this */
+        std::string end(pfx);
+        unsigned char c = end[end.length() - 1];
+        if (c == 0xff) {
+            return;
+        }
+        end[end.length() - 1] = c + 1;
+
+        sqlite3_reset(readAheadStatement);
+        sqlite3_bind_text(readAheadStatement, 1, key.c_str(), key.length(),
+                          SQLITE_STATIC);
+        sqlite3_bind_text(readAheadStatement, 2, end.c_str(), end.length(),
+                          SQLITE_STATIC);
+        sqlite3_bind_int64(readAheadStatement, 3, generation());
+        sqlite3_bind_int64(readAheadStatement, 4, (sqlite3_int64)time(NULL));
+        sqlite3_bind_int64(readAheadStatement, 5,
+                           (sqlite3_int64)engine->config.read_ahead);
+
+        /* This is only a hint, so we give up if the database is busy */
+        size_t loaded = 0;
+        while (sqlite3_step(readAheadStatement) == SQLITE_ROW) {
+            std::string k((char*)sqlite3_column_text(readAheadStatement, 0),
+                          sqlite3_column_bytes(readAheadStatement, 0));
+            if (!in_cache(engine, k) &&
+                createItem(readAheadStatement, k, 1, true)) {
+                ++loaded;
+            }
+        }
+        sqlite3_reset(readAheadStatement);
+        queue->readAhead(loaded);
     }
 
     virtual void run() {
         assert(engine != NULL);
-        lock();
+        assert(queue != NULL);
+        std::vector<std::pair<const void*, ENGINE_ERROR_CODE> > notify;
+        std::vector<std::string> keys;
+        std::set<std::string> found;
+
         while (true) {
-            while (queue.empty()) {
-                wait();
+            queue->next(keys, batchSize);
+            uint64_t start = latency_start(engine);
+            readItems(keys, found);
+            latency_record(engine, LATENCY_DISK_READ, start);
+
+            std::vector<std::string>::iterator k;
+            for (k = keys.begin(); k != keys.end(); ++k) {
+                queue->complete(*k, found.find(*k) != found.end(), notify);
+            }
+
+            std::vector<std::pair<const void*, ENGINE_ERROR_CODE> >::iterator iter;
+            for (iter = notify.begin(); iter != notify.end(); ++iter) {
+                engine->server.notify_io_complete(iter->first, iter->second);
             }
+            notify.clear();
 
-            while (queue.begin() != queue.end()) {
-                const void *cookie = queue.begin()->first;
-                std::string key = queue.begin()->second;
-                queue.erase(queue.begin());
-                unlock();
-                bool success = readItem(key, cookie);
-                engine->server.notify_io_complete(cookie,
-                                                  success ? ENGINE_SUCCESS : ENGINE_KEY_ENOENT);
-                lock();
+            /* Don't keep the clients waiting for the read ahead */
+            if (readAheadStatement != NULL) {
+                readAhead(found);
             }
+            keys.clear();
+            found.clear();
         }
     }
 
     sqlite3_stmt *statement;
+    sqlite3_stmt *readAheadStatement;
+    ReadQueue *queue;
+    /** The maximum number of keys we read with one query */
+    size_t batchSize;
+};
+
+/**
+ * Keeps track of the threads warming up the cache, and the progress they
+ * make.
+ */
+class SQLiteWarmup : public Monitor {
+public:
+    SQLiteWarmup(struct persistent_engine* se)
+        : engine(se), running(0), loaded(0), skipped(0), start(0), end(0),
+          evictions(0), stopped(false)
+    {
+    }
+
+    /**
+     * Split the kv table in rowid ranges and start a thread for each range
+     * @param dbname the name of the database
+     * @param nthreads the number of threads to use
+     * @return true on success
+     */
+    bool startThreads(const std::string &dbname, size_t nthreads);
+
+    /**
+     * Called by the warmup threads for each item they load into the cache,
+     * to check if they should continue.
+     * @param success true if the item was loaded into the cache
+     * @return true if the thread should continue loading items
+     */
+    bool loaded_item(bool success) {
+        bool ret;
+        uint64_t current = evictionCount();
+
+        lock();
+        if (success) {
+            ++loaded;
+        } else {
+            ++skipped;
+        }
+        if (!stopped && (!success || current != evictions)) {
+            /*
+             * We've filled up the cache. Loading more items would just
+             * push out the most recently used items we already loaded.
+             */
+            stopped = true;
+        }
+        ret = !stopped;
+        unlock();
+
+        return ret;
+    }
+
+    /**
+     * Called by the warmup threads when they are done
+     */
+    void done() {
+        lock();
+        if (--running == 0) {
+            end = now_usec();
+            if (engine->config.verbose) {
+                fprintf(stderr, "Cache warmup done: %llu items in %llu ms\n",
+                        (unsigned long long)loaded,
+                        (unsigned long long)(end - start) / 1000);
+            }
+        }
+        unlock();
+    }
 
-    std::map<const void *, std::string> queue;
+    void addStats(ADD_STAT add_stat, const void *cookie) {
+        lock();
+        const char *state = running ? "running" : "complete";
+        uint64_t elapsed = (running ? now_usec() : end) - start;
+        add_statistics(cookie, add_stat, NULL, -1, "warmup_state",
+                       "%s", state);
+        add_statistics(cookie, add_stat, NULL, -1, "warmup_threads",
+                       "%u", running);
+        add_statistics(cookie, add_stat, NULL, -1, "warmup_items",
+                       "%llu", (unsigned long long)loaded);
+        add_statistics(cookie, add_stat, NULL, -1, "warmup_skipped",
+                       "%llu", (unsigned long long)skipped);
+        add_statistics(cookie, add_stat, NULL, -1, "warmup_memory_full",
+                       "%s", stopped ? "true" : "false");
+        add_statistics(cookie, add_stat, NULL, -1, "warmup_time_ms",
+                       "%llu", (unsigned long long)elapsed / 1000);
+        unlock();
+    }
+
+private:
+    uint64_t evictionCount() {
+        pthread_mutex_lock(&engine->stats.lock);
+        uint64_t ret = engine->stats.evictions;
+        pthread_mutex_unlock(&engine->stats.lock);
+        return ret;
+    }
+
+    struct persistent_engine* engine;
+    /** The number of threads still running */
+    unsigned int running;
+    /** The number of items loaded into the cache */
+    uint64_t loaded;
+    /** The number of items we failed to load */
+    uint64_t skipped;
+    /** When we started the warmup */
+    uint64_t start;
+    /** When the last warmup thread completed */
+    uint64_t end;
+    /** The number of evictions when we started */
+    uint64_t evictions;
+    /** Set when the cache is full and all threads should stop */
+    bool stopped;
 };
 
+/**
+ * Load a range of the rows in the kv table into the cache. The most
+ * recently accessed items are loaded first, so if they don't all fit
+ * in the cache we keep the ones most likely to be used.
+ */
 class SQLiteCacheWarmup : public SQLiteReader {
 public:
-    SQLiteCacheWarmup(struct persistent_engine* se)
-        : SQLiteReader(se) {
+    SQLiteCacheWarmup(struct persistent_engine* se, SQLiteWarmup *w,
+                      sqlite3_int64 first, sqlite3_int64 last, size_t r)
+        : SQLiteReader(se), warmup(w), minRowid(first), maxRowid(last),
+          rate(r) {
     }
 
     ~SQLiteCacheWarmup() {
@@ -364,12 +1067,18 @@ public:
             return false;
         }
 
-        std::string query = "SELECT key, flags, exptime, hash, value FROM kv";
+        std::string query = "SELECT key, flags, exptime, value FROM kv "
+            "WHERE rowid >= ? AND rowid <= ? AND gen = ? AND "
+            "(exptime = 0 OR exptime > ?) ORDER BY atime DESC";
         if (sqlite3_prepare_v2(db, query.c_str(),
                                query.length(),
                                &statement, NULL) != SQLITE_OK) {
             return false;
         }
+        sqlite3_bind_int64(statement, 1, minRowid);
+        sqlite3_bind_int64(statement, 2, maxRowid);
+        sqlite3_bind_int64(statement, 3, generation());
+        sqlite3_bind_int64(statement, 4, (sqlite3_int64)time(NULL));
 
         return true;
     }
@@ -381,16 +1090,35 @@ public:
 
 private:
 
+    /**
+     * Sleep if we're loading items faster than we're allowed to
+     * @param start when we started
+     * @param count the number of items we've loaded
+     */
+    void throttle(uint64_t start, uint64_t count) {
+        if (rate == 0) {
+            return;
+        }
+        uint64_t target = start + (count * 1000000) / rate;
+        uint64_t now = now_usec();
+        if (target > now) {
+            usleep(target - now);
+        }
+    }
+
     virtual void run() {
         int rc = 0;
         bool done = false;
+        uint64_t start = now_usec();
+        uint64_t count = 0;
         do {
             switch ((rc = sqlite3_step(statement))) {
             case SQLITE_ROW:
                 {
                     std::string key((char*)sqlite3_column_text(statement, 0),
                                     sqlite3_column_bytes(statement, 0));
-                    createItem(key, 2, NULL);
+                    done = !warmup->loaded_item(createItem(key, 1, true));
+                    throttle(start, ++count);
                 }
                 break;
             case SQLITE_DONE:
@@ -403,7 +1131,73 @@ private:
             }
         } while (!done);
 
+        finalize();
+        warmup->done();
+    }
+
+    SQLiteWarmup *warmup;
+    sqlite3_int64 minRowid;
+    sqlite3_int64 maxRowid;
+    /** The number of items per sec this thread may load (0 == unlimited) */
+    size_t rate;
+};
+
+/**
+ * Load all of the keys in the database into the Bloom filter. Runs in
+ * its own thread, and the filter isn't used until it's done. The writer
+ * adds the keys it stores in the meantime itself.
+ */
+class SQLiteBloomLoader : public SQLite {
+public:
+    SQLiteBloomLoader(struct persistent_engine* se)
+        : SQLite(se), statement(NULL) {
+    }
+
+    bool initialize(const std::string &dbname) {
+        if (!SQLite::initialize(dbname)) {
+            return false;
+        }
+        return sqlite3_prepare_v2(db, "SELECT key FROM kv", -1,
+                                  &statement, NULL) == SQLITE_OK;
+    }
+
+    void finalize() {
+        sqlite3_finalize(statement);
+        SQLite::finalize();
+    }
+
+private:
+    virtual void run() {
+        BloomFilter *filter = static_cast<BloomFilter*>(engine->filter);
+        uint64_t start = now_usec();
+        uint64_t count = 0;
+        int rc;
+
+        while ((rc = sqlite3_step(statement)) == SQLITE_ROW ||
+               rc == SQLITE_BUSY) {
+            if (rc == SQLITE_ROW) {
+                filter->add(sqlite3_column_text(statement, 0),
+                            sqlite3_column_bytes(statement, 0));
+                ++count;
+            }
+        }
+
+        if (rc == SQLITE_DONE) {
+            filter->setReady();
+            if (engine->config.verbose) {
+                fprintf(stderr, "Loaded %llu keys into the bloom filter "
+                        "in %llu ms\n", (unsigned long long)count,
+                        (unsigned long long)((now_usec() - start) / 1000));
+            }
+        } else {
+            fprintf(stderr, "Failed to load the bloom filter: %s\n",
+                    sqlite3_errmsg(db));
+        }
+        finalize();
+        delete this;
     }
+
+    sqlite3_stmt *statement;
 };
 
 extern "C" {
@@ -413,30 +1207,119 @@ extern "C" {
     }
 }
 
+bool SQLiteWarmup::startThreads(const std::string &dbname, size_t nthreads)
+{
+    sqlite3 *db;
+    sqlite3_stmt *st;
+    sqlite3_int64 first = 0;
+    sqlite3_int64 last = -1;
+
+    if (sqlite3_open(dbname.c_str(), &db) != SQLITE_OK) {
+        return false;
+    }
+    if (sqlite3_prepare_v2(db, "SELECT min(rowid), max(rowid) FROM kv", -1,
+                           &st, NULL) == SQLITE_OK) {
+        if (sqlite3_step(st) == SQLITE_ROW &&
+            sqlite3_column_type(st, 0) != SQLITE_NULL) {
+            first = sqlite3_column_int64(st, 0);
+            last = sqlite3_column_int64(st, 1);
+        }
+        sqlite3_finalize(st);
+    }
+    sqlite3_close(db);
+
+    if (nthreads == 0) {
+        nthreads = 1;
+    }
+    sqlite3_int64 chunk = (last - first) / (sqlite3_int64)nthreads + 1;
+
+    start = now_usec();
+    evictions = evictionCount();
+
+    lock();
+    for (size_t ii = 0; ii < nthreads && first + chunk * (sqlite3_int64)ii <= last; ++ii) {
+        sqlite3_int64 lo = first + chunk * ii;
+        SQLiteCacheWarmup *thread;
+        thread = new SQLiteCacheWarmup(engine, this, lo, lo + chunk - 1,
+                                       engine->config.warmup_rate / nthreads);
+        pthread_t tid;
+        if (!thread->initialize(dbname) ||
+            pthread_create(&tid, NULL, thread_entry, thread) != 0) {
+            delete thread;
+            continue;
+        }
+        ++running;
+    }
+    end = start;
+    unlock();
+
+    return true;
+}
+
 ENGINE_ERROR_CODE sqlite_io_start_threads(struct persistent_engine *engine)
 {
-    SQLiteReader *reader = new SQLiteReader(engine);
+    ReadQueue *queue = new ReadQueue(engine, "sqlite");
     SQLiteWriter *writer = new SQLiteWriter(engine);
 
-    if (!reader->initialize(engine->config.dbname) ||
-        !writer->initialize(engine->config.dbname)) {
+    if (!writer->initialize(engine->config.dbname) || !writer->loadMeta()) {
         return ENGINE_FAILED;
     }
 
-    engine->reader = static_cast<void*>(reader);
+    engine->reader = static_cast<void*>(queue);
     engine->writer = static_cast<void*>(writer);
 
     pthread_t tid;
     int ret;
-    if ((ret = pthread_create(&tid, NULL, thread_entry, reader)) != 0 ||
-        (ret = pthread_create(&tid, NULL, thread_entry, writer)) != 0) {
+
+    if (engine->config.bloom_filter) {
+        size_t capacity = engine->config.bloom_filter_keys;
+        if (capacity == 0) {
+            /* Leave room for the database to double in size */
+            capacity = writer->maxRowid() * 2;
+            if (capacity < BLOOM_MIN_KEYS) {
+                capacity = BLOOM_MIN_KEYS;
+            }
+        }
+        BloomFilter *filter = new BloomFilter(engine, capacity);
+        if (!filter->initialized()) {
+            delete filter;
+            return ENGINE_ENOMEM;
+        }
+        /* The filter must be in place before the writer stores anything */
+        engine->filter = static_cast<void*>(filter);
+
+        SQLiteBloomLoader *loader = new SQLiteBloomLoader(engine);
+        if (!loader->initialize(engine->config.dbname) ||
+            (ret = pthread_create(&tid, NULL, thread_entry, loader)) != 0) {
+            return ENGINE_FAILED;
+        }
+    }
+
+    if ((ret = pthread_create(&tid, NULL, thread_entry,
+                              static_cast<SQLite*>(writer))) != 0) {
         return ENGINE_FAILED;
     }
 
+    /* Each reader use its own connection (and prepared statement) */
+    size_t num_readers = engine->config.reader_threads;
+    if (num_readers == 0) {
+        num_readers = 1;
+    }
+    for (size_t ii = 0; ii < num_readers; ++ii) {
+        SQLiteReader *reader = new SQLiteReader(engine, queue);
+        if (!reader->initialize(engine->config.dbname) ||
+            (ret = pthread_create(&tid, NULL, thread_entry, reader)) != 0) {
+            return ENGINE_FAILED;
+        }
+    }
+
     if (engine->config.warmup) {
-        SQLiteCacheWarmup *warmup = new SQLiteCacheWarmup(engine);
-        warmup->initialize(engine->config.dbname);
-        pthread_create(&tid, NULL, thread_entry, warmup);
+        SQLiteWarmup *warmup = new SQLiteWarmup(engine);
+        engine->warmup = static_cast<void*>(warmup);
+        if (!warmup->startThreads(engine->config.dbname,
+                                  engine->config.warmup_threads)) {
+            return ENGINE_FAILED;
+        }
     }
 
     return ENGINE_SUCCESS;
@@ -448,9 +1331,66 @@ void sqlite_io_get_item(struct persistent_engine* engine,
                         uint16_t keylen)
 {
     std::string k(reinterpret_cast<const char*>(key), keylen);
-    (reinterpret_cast<SQLiteReader*>(engine->reader))->enqueue(cookie, k);
+    (reinterpret_cast<ReadQueue*>(engine->reader))->enqueue(cookie, k);
+}
+
+void sqlite_io_get_items(struct persistent_engine* engine,
+                         const void* cookie, int nkeys,
+                         const void * const *keys, const size_t *lengths)
+{
+    std::vector<std::string> k;
+    k.reserve(nkeys);
+    for (int ii = 0; ii < nkeys; ++ii) {
+        k.push_back(std::string(reinterpret_cast<const char*>(keys[ii]),
+                                lengths[ii]));
+    }
+    (reinterpret_cast<ReadQueue*>(engine->reader))->enqueue(cookie, k);
+}
+
+bool sqlite_io_may_exist(struct persistent_engine* engine,
+                         const void *key, uint16_t keylen) {
+    return engine->filter == NULL ||
+        (reinterpret_cast<BloomFilter*>(engine->filter))->mayContain(key,
+                                                                     keylen);
 }
 
 void sqlite_io_store_item(struct persistent_engine* engine, hash_item* item) {
     (reinterpret_cast<SQLiteWriter*>(engine->writer))->enqueue(item);
 }
+
+ENGINE_ERROR_CODE sqlite_io_remove_item(struct persistent_engine* engine,
+                                        const void *key, uint16_t keylen) {
+    return (reinterpret_cast<SQLiteWriter*>(engine->writer))->remove(key, keylen);
+}
+
+void sqlite_io_flush(struct persistent_engine* engine, time_t when) {
+    (reinterpret_cast<SQLiteWriter*>(engine->writer))->flush(when);
+}
+
+void sqlite_io_reserve_cas(struct persistent_engine* engine, uint64_t limit) {
+    (reinterpret_cast<SQLiteWriter*>(engine->writer))->reserveCas(limit);
+}
+
+void sqlite_io_stats(struct persistent_engine* engine,
+                     ADD_STAT add_stat, const void *cookie) {
+    (reinterpret_cast<ReadQueue*>(engine->reader))->addStats(add_stat,
+                                                                   cookie);
+    (reinterpret_cast<SQLiteWriter*>(engine->writer))->addStats(add_stat,
+                                                                cookie);
+    if (engine->warmup != NULL) {
+        (reinterpret_cast<SQLiteWarmup*>(engine->warmup))->addStats(add_stat,
+                                                                    cookie);
+    }
+    if (engine->filter != NULL) {
+        (reinterpret_cast<BloomFilter*>(engine->filter))->addStats(add_stat,
+                                                                   cookie);
+    }
+}
+
+void sqlite_io_reset_stats(struct persistent_engine* engine) {
+    (reinterpret_cast<ReadQueue*>(engine->reader))->resetStats();
+    (reinterpret_cast<SQLiteWriter*>(engine->writer))->resetStats();
+    if (engine->filter != NULL) {
+        (reinterpret_cast<BloomFilter*>(engine->filter))->resetStats();
+    }
+}
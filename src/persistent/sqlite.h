@@ -4,14 +4,26 @@
 #ifndef SQLITE_IO_H
 #define SQLITE_IO_H
 
+/*
+ * The SQLite storage backend (see sqlite.cc). The functions match the
+ * ones in struct storage.
+ */
 #ifdef __cplusplus
 extern "C" {
 #endif
 
    void sqlite_io_store_item(struct persistent_engine* engine, hash_item* item);
+   ENGINE_ERROR_CODE sqlite_io_remove_item(struct persistent_engine* engine, const void *key, uint16_t keylen);
+   void sqlite_io_flush(struct persistent_engine* engine, time_t when);
    void sqlite_io_get_item(struct persistent_engine* engine, const void* cookie, const void *key, uint16_t keylen);
+   void sqlite_io_get_items(struct persistent_engine* engine, const void* cookie, int nkeys, const void * const *keys, const size_t *lengths);
+   bool sqlite_io_may_exist(struct persistent_engine* engine, const void *key, uint16_t keylen);
 
    ENGINE_ERROR_CODE sqlite_io_start_threads(struct persistent_engine *engine);
+   void sqlite_io_reserve_cas(struct persistent_engine* engine, uint64_t limit);
+
+   void sqlite_io_stats(struct persistent_engine* engine, ADD_STAT add_stat, const void *cookie);
+   void sqlite_io_reset_stats(struct persistent_engine* engine);
 
 #ifdef __cplusplus
 }
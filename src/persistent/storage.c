@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * The storage backends available to the persistent engine
+ *
+ */
+#include <string.h>
+
+#include "persistent_engine.h"
+#include "logstore.h"
+
+static const struct storage backends[] = {
+    { .name = "sqlite",
+      .start = sqlite_io_start_threads,
+      .may_exist = sqlite_io_may_exist,
+      .get_item = sqlite_io_get_item,
+      .get_items = sqlite_io_get_items,
+      .store_item = sqlite_io_store_item,
+      .remove_item = sqlite_io_remove_item,
+      .flush = sqlite_io_flush,
+      .reserve_cas = sqlite_io_reserve_cas,
+      .stats = sqlite_io_stats,
+      .reset_stats = sqlite_io_reset_stats },
+    { .name = "log",
+      .start = log_io_start_threads,
+      .may_exist = log_io_may_exist,
+      .get_item = log_io_get_item,
+      .get_items = log_io_get_items,
+      .store_item = log_io_store_item,
+      .remove_item = log_io_remove_item,
+      .flush = log_io_flush,
+      .reserve_cas = log_io_reserve_cas,
+      .stats = log_io_stats,
+      .reset_stats = log_io_reset_stats },
+    { .name = NULL }
+};
+
+const struct storage *storage_find(const char *name) {
+    const struct storage *storage;
+    for (storage = backends; storage->name != NULL; ++storage) {
+        if (strcmp(storage->name, name) == 0) {
+            return storage;
+        }
+    }
+    return NULL;
+}
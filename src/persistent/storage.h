@@ -0,0 +1,80 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The backends the persistent engine may store the items in. The backend
+ * is selected with the storage option, and all of the calls from the
+ * engine to the backend go through this table.
+ */
+struct storage {
+   /** The name used to select the backend in the configuration */
+   const char *name;
+   /**
+    * Open the database and start the I/O threads
+    * @param engine the engine to store the items for
+    * @return ENGINE_SUCCESS on success
+    */
+   ENGINE_ERROR_CODE (*start)(struct persistent_engine *engine);
+   /**
+    * Check if a key may be stored on disk. If this returns false there
+    * is no point in reading it.
+    */
+   bool (*may_exist)(struct persistent_engine *engine,
+                     const void *key, uint16_t keylen);
+   /**
+    * Read a key from disk into the cache. The cookie is notified when
+    * we're done (with ENGINE_KEY_ENOENT if the key doesn't exist).
+    */
+   void (*get_item)(struct persistent_engine *engine, const void *cookie,
+                    const void *key, uint16_t keylen);
+   /**
+    * Read a number of keys from disk. The cookie is notified once, when
+    * all of them have been read (nkeys must be at least 1).
+    */
+   void (*get_items)(struct persistent_engine *engine, const void *cookie,
+                     int nkeys, const void * const *keys,
+                     const size_t *lengths);
+   /**
+    * Queue an item to be written to disk. The backend holds a reference
+    * to the item until it's written.
+    */
+   void (*store_item)(struct persistent_engine *engine, hash_item *item);
+   /**
+    * Queue a key to be removed from disk. This is ordered with the
+    * store_item calls for the same key.
+    * @return ENGINE_SUCCESS, or ENGINE_ENOMEM/ENGINE_TMPFAIL if we
+    *         couldn't queue it (the key stays on disk)
+    */
+   ENGINE_ERROR_CODE (*remove_item)(struct persistent_engine *engine,
+                                    const void *key, uint16_t keylen);
+   /**
+    * Invalidate all of the items stored so far
+    * @param when when the flush takes effect (an absolute time, 0 == now)
+    */
+   void (*flush)(struct persistent_engine *engine, time_t when);
+   /**
+    * Persist that we may use CAS ids up to limit. The backend updates
+    * engine->items.cas_limit once it's durable.
+    */
+   void (*reserve_cas)(struct persistent_engine *engine, uint64_t limit);
+   void (*stats)(struct persistent_engine *engine, ADD_STAT add_stat,
+                 const void *cookie);
+   void (*reset_stats)(struct persistent_engine *engine);
+};
+
+/**
+ * Look up a storage backend by name
+ * @param name the name of the backend ("sqlite" or "log")
+ * @return the backend or NULL if it's unknown (or not compiled in)
+ */
+const struct storage *storage_find(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,204 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Implementation of the per thread latency histograms
+ */
+#include "latency.h"
+
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const char *opNames[LatencyStats::NUM_OPS] = {
+    "get", "store", "delete", "arithmetic"
+};
+
+LatencyStats::LatencyStats() : enabled(true), threads(NULL)
+{
+    memset(&retired, 0, sizeof(retired));
+    memset(&baseline, 0, sizeof(baseline));
+    pthread_mutex_init(&mutex, NULL);
+    if (pthread_key_create(&key, threadExit) != 0) {
+        abort();
+    }
+}
+
+LatencyStats::~LatencyStats()
+{
+    pthread_key_delete(key);
+    while (threads != NULL) {
+        Thread *t = threads;
+        threads = t->next;
+        free(t);
+    }
+    pthread_mutex_destroy(&mutex);
+}
+
+uint64_t LatencyStats::now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int LatencyStats::bucket(uint64_t ns)
+{
+    if (ns < (uint64_t)SUB_BUCKETS) {
+        return (int)ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= MAX_BITS) {
+        return BUCKETS - 1;
+    }
+    int shift = msb - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)((ns >> shift) - SUB_BUCKETS);
+}
+
+/* The highest value recorded in a bucket */
+uint64_t LatencyStats::bucketMax(int idx)
+{
+    if (idx < SUB_BUCKETS) {
+        return idx;
+    }
+    int shift = idx / SUB_BUCKETS - 1;
+    return (((uint64_t)SUB_BUCKETS + idx % SUB_BUCKETS) << shift) +
+        ((uint64_t)1 << shift) - 1;
+}
+
+void LatencyStats::add(Thread &total, const Thread &t)
+{
+    for (int op = 0; op < NUM_OPS; ++op) {
+        for (int ii = 0; ii < BUCKETS; ++ii) {
+            total.ops[op].counts[ii] += t.ops[op].counts[ii];
+        }
+        total.ops[op].totalNs += t.ops[op].totalNs;
+    }
+}
+
+/* Keep what an exiting thread recorded */
+void LatencyStats::threadExit(void *arg)
+{
+    Thread *t = reinterpret_cast<Thread*>(arg);
+    LatencyStats *l = t->owner;
+
+    pthread_mutex_lock(&l->mutex);
+    for (Thread **p = &l->threads; *p != NULL; p = &(*p)->next) {
+        if (*p == t) {
+            *p = t->next;
+            break;
+        }
+    }
+    add(l->retired, *t);
+    pthread_mutex_unlock(&l->mutex);
+    free(t);
+}
+
+LatencyStats::Thread *LatencyStats::getThread()
+{
+    Thread *t = reinterpret_cast<Thread*>(pthread_getspecific(key));
+    if (t == NULL) {
+        if ((t = reinterpret_cast<Thread*>(calloc(1, sizeof(*t)))) == NULL) {
+            return NULL;
+        }
+        t->owner = this;
+        pthread_mutex_lock(&mutex);
+        t->next = threads;
+        threads = t;
+        pthread_mutex_unlock(&mutex);
+        pthread_setspecific(key, t);
+    }
+    return t;
+}
+
+void LatencyStats::record(Op op, uint64_t start)
+{
+    Thread *t;
+    if (start == 0 || (t = getThread()) == NULL) {
+        return;
+    }
+    uint64_t ns = now() - start;
+    t->ops[op].counts[bucket(ns)]++;
+    t->ops[op].totalNs += ns;
+}
+
+void LatencyStats::totals(Thread &total) const
+{
+    memcpy(&total, &retired, sizeof(total));
+    for (Thread *t = threads; t != NULL; t = t->next) {
+        add(total, *t);
+    }
+}
+
+static void addStat(ADD_STAT add_stat, const void *cookie,
+                    const char *name, const char *suffix, uint64_t value)
+{
+    char key[64];
+    char val[32];
+    int klen = snprintf(key, sizeof(key), "%s_%s", name, suffix);
+    int len = snprintf(val, sizeof(val), "%llu", (unsigned long long)value);
+    add_stat(key, klen, val, len, cookie);
+}
+
+void LatencyStats::addStats(ADD_STAT add_stat, const void *cookie)
+{
+    static const struct {
+        const char *name;
+        double fraction;
+    } percentiles[] = {
+        { "p50_ns", 0.5 }, { "p90_ns", 0.9 }, { "p99_ns", 0.99 },
+        { "p999_ns", 0.999 }
+    };
+    const size_t npercentiles = sizeof(percentiles) / sizeof(percentiles[0]);
+
+    if (!enabled) {
+        return;
+    }
+
+    Thread *total = reinterpret_cast<Thread*>(malloc(sizeof(Thread)));
+    if (total == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    totals(*total);
+    for (int op = 0; op < NUM_OPS; ++op) {
+        Histogram &h = total->ops[op];
+        uint64_t count = 0;
+        int max = 0;
+        for (int ii = 0; ii < BUCKETS; ++ii) {
+            h.counts[ii] -= baseline.ops[op].counts[ii];
+            if (h.counts[ii] != 0) {
+                count += h.counts[ii];
+                max = ii;
+            }
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        addStat(add_stat, cookie, opNames[op], "count", count);
+        addStat(add_stat, cookie, opNames[op], "mean_ns",
+                (h.totalNs - baseline.ops[op].totalNs) / count);
+        uint64_t seen = 0;
+        size_t next = 0;
+        for (int ii = 0; ii < BUCKETS && next < npercentiles; ++ii) {
+            seen += h.counts[ii];
+            while (next < npercentiles &&
+                   seen >= percentiles[next].fraction * count) {
+                addStat(add_stat, cookie, opNames[op],
+                        percentiles[next].name, bucketMax(ii));
+                ++next;
+            }
+        }
+        addStat(add_stat, cookie, opNames[op], "max_ns", bucketMax(max));
+    }
+    pthread_mutex_unlock(&mutex);
+    free(total);
+}
+
+void LatencyStats::reset()
+{
+    pthread_mutex_lock(&mutex);
+    totals(baseline);
+    pthread_mutex_unlock(&mutex);
+}
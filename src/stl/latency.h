@@ -0,0 +1,130 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Per thread latency histograms for the stl engine (see "stats latency")
+ */
+#ifndef STL_LATENCY_H
+#define STL_LATENCY_H
+
+#include "config.h"
+
+#include <memcached/engine.h>
+#include <pthread.h>
+
+/**
+ * Log-linear latency histograms for the engine operations. Every thread
+ * records into its own histograms, so recording doesn't take any locks.
+ * Each power of two nanoseconds is split into SUB_BUCKETS buckets, so a
+ * value is recorded with an error of less than 1/SUB_BUCKETS.
+ */
+class LatencyStats {
+public:
+    enum Op {
+        GET,
+        STORE,
+        REMOVE,
+        ARITHMETIC,
+        NUM_OPS
+    };
+
+    LatencyStats();
+    ~LatencyStats();
+
+    void setEnabled(bool on) {
+        enabled = on;
+    }
+
+    /**
+     * Get the time to pass to record
+     * @return the current time in ns (0 if we don't collect latencies)
+     */
+    uint64_t start() const {
+        return enabled ? now() : 0;
+    }
+
+    /**
+     * Record the time an operation took
+     * @param op the operation
+     * @param start when the operation started (see start())
+     */
+    void record(Op op, uint64_t start);
+
+    /**
+     * Add the count, mean, percentiles and max of every operation
+     * @param add_stat callback to add a stat
+     * @param cookie the cookie to pass to add_stat
+     */
+    void addStats(ADD_STAT add_stat, const void *cookie);
+
+    /**
+     * Reset the stats. We just remember the current totals, so that we
+     * don't need to touch the histograms of the other threads.
+     */
+    void reset();
+
+    /** The current time in ns (CLOCK_MONOTONIC) */
+    static uint64_t now();
+
+private:
+    static const int SUB_BITS = 3;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    /* Everything from 2^MAX_BITS ns (about a minute) ends up in the last bucket */
+    static const int MAX_BITS = 36;
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+    struct Histogram {
+        uint64_t counts[BUCKETS];
+        uint64_t totalNs;
+    };
+
+    /** The histograms of one thread (only updated by that thread) */
+    struct Thread {
+        Histogram ops[NUM_OPS];
+        LatencyStats *owner;
+        Thread *next;
+    };
+
+    static int bucket(uint64_t ns);
+    static uint64_t bucketMax(int idx);
+    static void add(Thread &total, const Thread &t);
+    static void threadExit(void *arg);
+
+    Thread *getThread();
+    /** Add up all of the threads (the lock must be held) */
+    void totals(Thread &total) const;
+
+    bool enabled;
+    pthread_key_t key;
+    /** Protects the list of threads, retired and baseline */
+    pthread_mutex_t mutex;
+    Thread *threads;
+    /** The histograms of the threads that have exited */
+    Thread retired;
+    /** The totals when the stats were reset */
+    Thread baseline;
+
+    /* Not implemented */
+    LatencyStats(const LatencyStats&);
+    LatencyStats& operator=(const LatencyStats&);
+};
+
+/**
+ * Record the time spent in a scope
+ */
+class LatencyTimer {
+public:
+    LatencyTimer(LatencyStats &s, LatencyStats::Op o) :
+        stats(s), op(o), start(s.start())
+    {
+    }
+
+    ~LatencyTimer() {
+        stats.record(op, start);
+    }
+
+private:
+    LatencyStats &stats;
+    LatencyStats::Op op;
+    uint64_t start;
+};
+
+#endif
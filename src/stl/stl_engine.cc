@@ -1,13 +1,19 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 /*
- * Implementation of a small engine using std::string and std::map
- * for item storage.
+ * Implementation of a small engine using std::string and a sharded hash
+ * table for item storage.
  *
  * Author: Trond Norbye
  */
 #include "stl_engine.h"
+#include "memcached/config_parser.h"
 
 #include <pthread.h>
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <utility>
 
 /**
  * This is the _only_ function exported from the library. Create a new instance
@@ -160,34 +166,299 @@ extern "C" {
         (void)handle;
         reinterpret_cast<Item*>(item)->setCas(cas);
     }
+
+    static void *stl_sweeper_main(void *arg)
+    {
+        reinterpret_cast<STLEngine*>(arg)->runSweeper();
+        return NULL;
+    }
 }
 
 class CacheLock {
 public:
-    CacheLock() {
-        int ret;
-        while ((ret = pthread_mutex_lock(&mutex)) == -1) {
-            if (errno != EINTR) {
-                abort();
-            }
-        }
+    CacheLock(CacheShard &s) : shard(s) {
+        shard.lock();
     }
 
     ~CacheLock() {
-        int ret;
-        while ((ret = pthread_mutex_unlock(&mutex)) == -1) {
-            if (errno != EINTR) {
-                abort();
+        shard.unlock();
+    }
+
+private:
+    CacheShard &shard;
+};
+
+/*
+ * Implementation of the chunked values
+ */
+
+void Item::allocate(std::string &first, std::vector<std::string> &rest,
+                    size_t len, size_t chunkSize)
+{
+    if (chunkSize == 0 || len <= chunkSize) {
+        first.resize(len);
+        rest.clear();
+        return;
+    }
+
+    first.resize(chunkSize);
+    len -= chunkSize;
+    rest.resize((len + chunkSize - 1) / chunkSize);
+    for (size_t ii = 0; ii < rest.size(); ++ii) {
+        rest[ii].resize(len < chunkSize ? len : chunkSize);
+        len -= rest[ii].length();
+    }
+}
+
+void Item::join(const Item &first, const Item &second, size_t chunkSize)
+{
+    std::vector<std::pair<const char*, size_t> > src;
+    size_t skip = 2;
+
+    /* Everything but the "\r\n" terminating the first value */
+    for (size_t ii = first.chunks.size() + 1; ii > 0; --ii) {
+        const std::string &s = ii == 1 ? first.value : first.chunks[ii - 2];
+        size_t len = s.length() > skip ? s.length() - skip : 0;
+        skip -= s.length() - len;
+        src.push_back(std::make_pair(s.data(), len));
+    }
+    std::reverse(src.begin(), src.end());
+    src.push_back(std::make_pair(second.value.data(), second.value.length()));
+    for (size_t ii = 0; ii < second.chunks.size(); ++ii) {
+        src.push_back(std::make_pair(second.chunks[ii].data(),
+                                     second.chunks[ii].length()));
+    }
+
+    size_t total = 0;
+    for (size_t ii = 0; ii < src.size(); ++ii) {
+        total += src[ii].second;
+    }
+
+    std::string head;
+    std::vector<std::string> tail;
+    allocate(head, tail, total, chunkSize);
+
+    std::string *dest = &head;
+    size_t di = 0, doff = 0;
+    for (size_t ii = 0; ii < src.size(); ++ii) {
+        const char *ptr = src[ii].first;
+        size_t len = src[ii].second;
+        while (len > 0) {
+            if (doff == dest->length()) {
+                dest = &tail[di++];
+                doff = 0;
             }
+            size_t n = std::min(len, dest->length() - doff);
+            memcpy(&(*dest)[doff], ptr, n);
+            doff += n;
+            ptr += n;
+            len -= n;
         }
     }
 
-private:
-    static pthread_mutex_t mutex;
+    value.swap(head);
+    chunks.swap(tail);
+}
 
-};
+/*
+ * Implementation of the cache shards
+ */
+
+CacheShard::CacheShard() : slots(16), used(0), maxBytes(0), hand(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+CacheShard::~CacheShard()
+{
+    clear();
+    pthread_mutex_destroy(&mutex);
+}
+
+void CacheShard::lock()
+{
+    /* Only look at the clock if we have to wait */
+    if (pthread_mutex_trylock(&mutex) == 0) {
+        return;
+    }
+
+    uint64_t start = LatencyStats::now();
+    int ret;
+    while ((ret = pthread_mutex_lock(&mutex)) == -1) {
+        if (errno != EINTR) {
+            abort();
+        }
+    }
+    ++stats.lockWaits;
+    stats.lockWaitNs += LatencyStats::now() - start;
+}
+
+void CacheShard::unlock()
+{
+    int ret;
+    while ((ret = pthread_mutex_unlock(&mutex)) == -1) {
+        if (errno != EINTR) {
+            abort();
+        }
+    }
+}
+
+/*
+ * Get the index of the slot containing the key, or the empty slot
+ * terminating the probe sequence if it isn't there.
+ */
+size_t CacheShard::locate(const KeyView &key, uint32_t hv) const
+{
+    size_t mask = slots.size() - 1;
+    size_t idx = hv & mask;
+    while (slots[idx].item != NULL) {
+        if (slots[idx].hash == hv && key == slots[idx].item->key) {
+            break;
+        }
+        idx = (idx + 1) & mask;
+    }
+    return idx;
+}
+
+Item *CacheShard::find(const KeyView &key, uint32_t hv) const
+{
+    return slots[locate(key, hv)].item;
+}
+
+Item *CacheShard::insert(Item *it, uint32_t hv)
+{
+    if ((used + 1) * 4 > slots.size() * 3) {
+        grow();
+    }
+
+    size_t idx = locate(KeyView(it->key), hv);
+    Item *old = slots[idx].item;
+    slots[idx].item = it;
+    slots[idx].hash = hv;
+    stats.bytes += it->size();
+    if (old == NULL) {
+        ++used;
+    } else {
+        stats.bytes -= old->size();
+    }
+    stats.items = used;
+    return old;
+}
+
+Item *CacheShard::remove(const KeyView &key, uint32_t hv)
+{
+    size_t idx = locate(key, hv);
+    if (slots[idx].item == NULL) {
+        return NULL;
+    }
+    return removeAt(idx);
+}
+
+Item *CacheShard::removeAt(size_t hole)
+{
+    size_t mask = slots.size() - 1;
+    Item *ret = slots[hole].item;
+
+    /*
+     * Shift the following entries in the probe sequence back, so we don't
+     * need tombstones. An entry may be moved into the hole unless its
+     * home slot is located after the hole.
+     */
+    size_t next = (hole + 1) & mask;
+    while (slots[next].item != NULL) {
+        size_t home = slots[next].hash & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            slots[hole] = slots[next];
+            hole = next;
+        }
+        next = (next + 1) & mask;
+    }
+    slots[hole] = Slot();
+    --used;
+    stats.items = used;
+    stats.bytes -= ret->size();
+
+    return ret;
+}
+
+size_t CacheShard::removeExpired(rel_time_t now, rel_time_t oldestLive)
+{
+    size_t removed = 0;
+    size_t idx = 0;
+    while (idx < slots.size()) {
+        Item *it = slots[idx].item;
+        if (it != NULL && it->isExpired(now, oldestLive)) {
+            /* removeAt may move another item into this slot */
+            removeAt(idx)->release();
+            ++removed;
+        } else {
+            ++idx;
+        }
+    }
+    return removed;
+}
+
+void CacheShard::evict(const Item *keep, rel_time_t now, rel_time_t oldestLive)
+{
+    if (maxBytes == 0) {
+        return;
+    }
+
+    /* Give up after two rounds (we may only have the item to keep left) */
+    size_t tries = slots.size() * 2;
+    while (stats.bytes > maxBytes && tries-- > 0) {
+        hand &= slots.size() - 1;
+        Item *it = slots[hand].item;
+        if (it == NULL || it == keep) {
+            ++hand;
+        } else if (it->isExpired(now, oldestLive)) {
+            /* removeAt may move another item into this slot */
+            removeAt(hand)->release();
+            ++stats.reclaimed;
+        } else if (it->referenced) {
+            /* give it a second chance */
+            it->referenced = false;
+            ++hand;
+        } else {
+            removeAt(hand)->release();
+            ++stats.evictions;
+        }
+    }
+}
 
-pthread_mutex_t CacheLock::mutex = PTHREAD_MUTEX_INITIALIZER;
+void CacheShard::clear()
+{
+    std::vector<Slot>::iterator iter;
+    for (iter = slots.begin(); iter != slots.end(); ++iter) {
+        if (iter->item != NULL) {
+            iter->item->release();
+        }
+    }
+    std::vector<Slot>(16).swap(slots);
+    used = 0;
+    hand = 0;
+    stats.items = 0;
+    stats.bytes = 0;
+}
+
+void CacheShard::grow()
+{
+    std::vector<Slot> old(slots.size() * 2);
+    old.swap(slots);
+    hand = 0;
+
+    size_t mask = slots.size() - 1;
+    std::vector<Slot>::iterator iter;
+    for (iter = old.begin(); iter != old.end(); ++iter) {
+        if (iter->item != NULL) {
+            size_t idx = iter->hash & mask;
+            while (slots[idx].item != NULL) {
+                idx = (idx + 1) & mask;
+            }
+            slots[idx] = *iter;
+        }
+    }
+}
 
 
 /*
@@ -195,8 +466,13 @@ pthread_mutex_t CacheLock::mutex = PTHREAD_MUTEX_INITIALIZER;
  */
 
 STLEngine::STLEngine(SERVER_HANDLE_V1 *api) :
-    server(api), cache()
+    server(api), shards(NULL), numShards(0), casId(0),
+    cacheSize(64 * 1024 * 1024), chunkSize(0), oldestLive(0),
+    sweepInterval(60),
+    sweeperRunning(false)
 {
+    pthread_mutex_init(&sweeperMutex, NULL);
+    pthread_cond_init(&sweeperCond, NULL);
     interface.interface = 1;
     get_info = stl_get_info;
     initialize = stl_initialize;
@@ -214,6 +490,74 @@ STLEngine::STLEngine(SERVER_HANDLE_V1 *api) :
     get_item_info = stl_get_item_info;
 }
 
+STLEngine::~STLEngine()
+{
+    pthread_mutex_lock(&sweeperMutex);
+    bool running = sweeperRunning;
+    sweeperRunning = false;
+    pthread_cond_signal(&sweeperCond);
+    pthread_mutex_unlock(&sweeperMutex);
+    if (running) {
+        pthread_join(sweeper, NULL);
+    }
+
+    pthread_cond_destroy(&sweeperCond);
+    pthread_mutex_destroy(&sweeperMutex);
+    delete []shards;
+}
+
+void STLEngine::runSweeper()
+{
+    pthread_mutex_lock(&sweeperMutex);
+    while (sweeperRunning) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        struct timespec ts;
+        ts.tv_sec = tv.tv_sec + sweepInterval;
+        ts.tv_nsec = tv.tv_usec * 1000;
+        pthread_cond_timedwait(&sweeperCond, &sweeperMutex, &ts);
+        if (!sweeperRunning) {
+            break;
+        }
+        pthread_mutex_unlock(&sweeperMutex);
+
+        /* Lock one shard at a time so we don't block the frontend */
+        for (size_t ii = 0; ii < numShards; ++ii) {
+            CacheLock lock(shards[ii]);
+            shards[ii].removeExpired(server->get_current_time(), oldestLive);
+        }
+
+        pthread_mutex_lock(&sweeperMutex);
+    }
+    pthread_mutex_unlock(&sweeperMutex);
+}
+
+Item *STLEngine::findItem(CacheShard &shard, const KeyView &key, uint32_t hv)
+{
+    Item *it = shard.find(key, hv);
+    if (it != NULL) {
+        if (it->isExpired(server->get_current_time(), oldestLive)) {
+            shard.remove(key, hv)->release();
+            it = NULL;
+        } else {
+            it->referenced = true;
+        }
+    }
+    return it;
+}
+
+void STLEngine::insertItem(CacheShard &shard, Item *it, uint32_t hv)
+{
+    rel_time_t now = server->get_current_time();
+    it->time = now;
+    it->referenced = true;
+    Item *old = shard.insert(it, hv);
+    if (old != NULL) {
+        old->release();
+    }
+    shard.evict(it, now, oldestLive);
+}
+
 const std::string STLEngine::Version() const
 {
     return "Stl example engine v0.1";
@@ -221,7 +565,56 @@ const std::string STLEngine::Version() const
 
 ENGINE_ERROR_CODE STLEngine::Initialize(const char* config)
 {
-    (void)config;
+    size_t nshards = 32;
+    bool latencyStats = true;
+
+    if (config != NULL) {
+        struct config_item items[7];
+        memset(items, 0, sizeof(items));
+        items[0].key = "shards";
+        items[0].datatype = DT_SIZE;
+        items[0].value.dt_size = &nshards;
+        items[1].key = "sweep_interval";
+        items[1].datatype = DT_SIZE;
+        items[1].value.dt_size = &sweepInterval;
+        items[2].key = "cache_size";
+        items[2].datatype = DT_SIZE;
+        items[2].value.dt_size = &cacheSize;
+        items[3].key = "latency_stats";
+        items[3].datatype = DT_BOOL;
+        items[3].value.dt_bool = &latencyStats;
+        items[4].key = "value_chunk_size";
+        items[4].datatype = DT_SIZE;
+        items[4].value.dt_size = &chunkSize;
+        items[5].key = "config_file";
+        items[5].datatype = DT_CONFIGFILE;
+        items[6].key = NULL;
+
+        if (server->parse_config(config, items, stderr) != 0) {
+            return ENGINE_FAILED;
+        }
+    }
+
+    if (nshards == 0 || nshards > 65536) {
+        return ENGINE_FAILED;
+    }
+
+    latency.setEnabled(latencyStats);
+    numShards = nshards;
+    shards = new CacheShard[numShards];
+    /* Each shard gets its part of the memory, so eviction stays local */
+    for (size_t ii = 0; ii < numShards; ++ii) {
+        shards[ii].setMaxBytes(cacheSize / numShards);
+    }
+
+    if (sweepInterval != 0) {
+        sweeperRunning = true;
+        if (pthread_create(&sweeper, NULL, stl_sweeper_main, this) != 0) {
+            sweeperRunning = false;
+            return ENGINE_FAILED;
+        }
+    }
+
     return ENGINE_SUCCESS;
 }
 
@@ -234,7 +627,8 @@ ENGINE_ERROR_CODE STLEngine::Allocate(const void* cookie,
                                       const rel_time_t exptime)
 {
     (void)cookie;
-    *itm = reinterpret_cast<item*>(new Item(key, nkey, nbytes, flags, exptime));
+    *itm = reinterpret_cast<item*>(new Item(key, nkey, nbytes, flags, exptime,
+                                                 chunkSize));
     return ENGINE_SUCCESS;
 }
 
@@ -243,13 +637,16 @@ ENGINE_ERROR_CODE STLEngine::Remove(const void* cookie, const void *key,
                                     uint64_t cas)
 {
     (void)cookie;
-    CacheLock lock;
-    std::string it(static_cast<const char*>(key), nkey);
-    std::map<std::string, Item*>::iterator iter = cache.find(it);
-    if (iter != cache.end()) {
-        if (cas == iter->second->cas) {
-            delete iter->second;
-            cache.erase(iter);
+    LatencyTimer timer(latency, LatencyStats::REMOVE);
+    KeyView k(key, nkey);
+    uint32_t hv = server->hash(key, nkey, 0);
+    CacheShard &shard = getShard(hv);
+    CacheLock lock(shard);
+
+    Item *it = findItem(shard, k, hv);
+    if (it != NULL) {
+        if (cas == 0 || cas == it->cas) {
+            shard.remove(k, hv)->release();
             return ENGINE_SUCCESS;
         }
         return ENGINE_KEY_EEXISTS;
@@ -262,7 +659,7 @@ void STLEngine::Release(const void *cookie, item* item)
 {
     (void)cookie;
     Item *it = reinterpret_cast<Item*>(item);
-    delete it;
+    it->release();
 }
 
 ENGINE_ERROR_CODE STLEngine::Get(const void* cookie, item** pIt,
@@ -270,14 +667,19 @@ ENGINE_ERROR_CODE STLEngine::Get(const void* cookie, item** pIt,
                                  const int nkey)
 {
     (void)cookie;
-    std::string k(static_cast<const char*>(key), nkey);
-    CacheLock lock;
-
-    std::map<std::string, Item*>::iterator it = cache.find(k);
-    if (it != cache.end()) {
-        *pIt = it->second->clone();
+    LatencyTimer timer(latency, LatencyStats::GET);
+    uint32_t hv = server->hash(key, nkey, 0);
+    CacheShard &shard = getShard(hv);
+    CacheLock lock(shard);
+
+    Item *it = findItem(shard, KeyView(key, nkey), hv);
+    if (it != NULL) {
+        ++shard.stats.hits;
+        it->retain();
+        *pIt = reinterpret_cast<item*>(it);
         return ENGINE_SUCCESS;
     } else {
+        ++shard.stats.misses;
         *pIt = NULL;
         return ENGINE_KEY_ENOENT;
     }
@@ -289,19 +691,26 @@ ENGINE_ERROR_CODE STLEngine::Store(const void *cookie,
                                    ENGINE_STORE_OPERATION operation)
 {
     (void)cookie;
-    CacheLock lock;
+    LatencyTimer timer(latency, LatencyStats::STORE);
     Item *it = reinterpret_cast<Item*>(item);
+    uint32_t hv = server->hash(it->key.data(), it->key.length(), 0);
+    CacheShard &shard = getShard(hv);
+    CacheLock lock(shard);
 
-    std::map<std::string, Item*>::iterator iter = cache.find(it->key);
+    Item *old = findItem(shard, KeyView(it->key), hv);
 
-    if (iter == cache.end()) {
+    if (old == NULL) {
         switch (operation) {
         case OPERATION_REPLACE:
         case OPERATION_APPEND:
         case OPERATION_PREPEND:
+        case OPERATION_CAS:
             return ENGINE_KEY_ENOENT;
         default:
-            cache[it->key] = it->clone();
+            it->cas = nextCas();
+            it->retain();
+            insertItem(shard, it, hv);
+            *cas = it->cas;
             return ENGINE_SUCCESS;
         }
     }
@@ -310,23 +719,51 @@ ENGINE_ERROR_CODE STLEngine::Store(const void *cookie,
         return ENGINE_NOT_STORED;
     }
 
-    if (it->cas != 0 && (it->cas != iter->second->cas)) {
+    if (it->cas != 0 && (it->cas != old->cas)) {
         return ENGINE_KEY_EEXISTS;
     }
 
     if (operation == OPERATION_APPEND) {
-        it->append(iter->second);
+        it->append(old, chunkSize);
     } else if (operation == OPERATION_PREPEND) {
-        it->prepend(iter->second);
+        it->prepend(old, chunkSize);
     }
 
-    delete iter->second;
-    cache.erase(iter);
-    cache[it->key] = it->clone();
+    it->cas = nextCas();
+    it->retain();
+    insertItem(shard, it, hv);
     *cas = it->cas;
     return ENGINE_SUCCESS;
 }
 
+/**
+ * Parse the numeric value stored in an item ("<digits>\r\n")
+ * @param value the value to parse
+ * @param result where to store the number
+ * @return true if the value is a number
+ */
+static bool parseNumber(const std::string &value, uint64_t &result)
+{
+    size_t len = value.length();
+    if (len < 3 || len > 22 || value[len - 2] != '\r' || value[len - 1] != '\n') {
+        return false;
+    }
+
+    result = 0;
+    for (size_t ii = 0; ii < len - 2; ++ii) {
+        if (value[ii] < '0' || value[ii] > '9') {
+            return false;
+        }
+        uint64_t next = result * 10 + (value[ii] - '0');
+        if (next / 10 != result) {
+            /* overflow */
+            return false;
+        }
+        result = next;
+    }
+    return true;
+}
+
 ENGINE_ERROR_CODE STLEngine::Arithmetic(const void* cookie,
                                         const void* key,
                                         const int nkey,
@@ -338,35 +775,142 @@ ENGINE_ERROR_CODE STLEngine::Arithmetic(const void* cookie,
                                         uint64_t *cas,
                                         uint64_t *result)
 {
-    (void)cookie; (void)key; (void)nkey; (void)increment; (void)create;
-    (void)delta; (void)initial; (void)exptime; (void)cas; (void)result;
-    return ENGINE_ENOTSUP;
+    (void)cookie;
+    LatencyTimer timer(latency, LatencyStats::ARITHMETIC);
+    KeyView k(key, nkey);
+    uint32_t hv = server->hash(key, nkey, 0);
+    CacheShard &shard = getShard(hv);
+    CacheLock lock(shard);
+    char buffer[32];
+    int len;
+
+    Item *it = findItem(shard, k, hv);
+    if (it == NULL) {
+        if (!create) {
+            return ENGINE_KEY_ENOENT;
+        }
+        len = snprintf(buffer, sizeof(buffer), "%llu\r\n",
+                       (unsigned long long)initial);
+        it = new Item(key, nkey, 0, 0, exptime);
+        it->value.assign(buffer, len);
+        it->cas = nextCas();
+        insertItem(shard, it, hv);
+        *result = initial;
+        *cas = it->cas;
+        return ENGINE_SUCCESS;
+    }
+
+    uint64_t value;
+    if (!it->chunks.empty() || !parseNumber(it->value, value)) {
+        return ENGINE_EINVAL;
+    }
+
+    if (increment) {
+        value += delta;
+    } else if (delta > value) {
+        value = 0;
+    } else {
+        value -= delta;
+    }
+    len = snprintf(buffer, sizeof(buffer), "%llu\r\n",
+                   (unsigned long long)value);
+
+    /*
+     * Nobody may get a new reference to the item without holding the
+     * shard lock, so if the cache holds the only reference we may update
+     * it in place. Otherwise the frontend may be sending the old value,
+     * so we need to replace it with a new item.
+     */
+    if (it->refcount != 1) {
+        it = it->clone();
+        it->value.assign(buffer, len);
+        it->cas = nextCas();
+        insertItem(shard, it, hv);
+    } else {
+        size_t oldSize = it->size();
+        it->value.assign(buffer, len);
+        it->cas = nextCas();
+        shard.resized(oldSize, it->size());
+    }
+
+    *result = value;
+    *cas = it->cas;
+    return ENGINE_SUCCESS;
 }
 
 ENGINE_ERROR_CODE STLEngine::Flush(const void* cookie, time_t when)
 {
     (void)cookie;
     if (when != 0) {
-        return ENGINE_ENOTSUP;
+        /* The items are invalidated by findItem and the sweeper */
+        oldestLive = server->realtime(when) - 1;
+        return ENGINE_SUCCESS;
     }
 
-    CacheLock lock;
-    cache.clear();
+    oldestLive = server->get_current_time() - 1;
+    for (size_t ii = 0; ii < numShards; ++ii) {
+        CacheLock lock(shards[ii]);
+        shards[ii].clear();
+    }
 
     return ENGINE_SUCCESS;
 }
 
+static void addStat(ADD_STAT add_stat, const void *cookie,
+                    const char *key, uint64_t value)
+{
+    char val[32];
+    int len = snprintf(val, sizeof(val), "%llu", (unsigned long long)value);
+    add_stat(key, strlen(key), val, len, cookie);
+}
+
 ENGINE_ERROR_CODE STLEngine::GetStats(const void* cookie,
                                       const char* stat_key,
                                       int nkey,
                                       ADD_STAT add_stat)
 {
-    // We don't have any stats ;-)
-    (void)cookie; (void)stat_key; (void)nkey; (void)add_stat;
+    (void)nkey;
+    if (stat_key != NULL && strncmp(stat_key, "latency", 7) != 0) {
+        return ENGINE_KEY_ENOENT;
+    }
+
+    ShardStats stats;
+    for (size_t ii = 0; ii < numShards; ++ii) {
+        CacheLock lock(shards[ii]);
+        stats += shards[ii].stats;
+    }
+
+    if (stat_key != NULL) {
+        latency.addStats(add_stat, cookie);
+        addStat(add_stat, cookie, "get_hits", stats.hits);
+        addStat(add_stat, cookie, "get_misses", stats.misses);
+        addStat(add_stat, cookie, "lock_waits", stats.lockWaits);
+        addStat(add_stat, cookie, "lock_wait_ns", stats.lockWaitNs);
+        if (stats.hits + stats.misses > 0) {
+            char val[32];
+            int len = snprintf(val, sizeof(val), "%.4f",
+                               (double)stats.hits / (stats.hits + stats.misses));
+            add_stat("get_hit_ratio", 13, val, len, cookie);
+        }
+        return ENGINE_SUCCESS;
+    }
+
+    addStat(add_stat, cookie, "curr_items", stats.items);
+    addStat(add_stat, cookie, "bytes", stats.bytes);
+    addStat(add_stat, cookie, "limit_maxbytes", cacheSize);
+    addStat(add_stat, cookie, "evictions", stats.evictions);
+    addStat(add_stat, cookie, "reclaimed", stats.reclaimed);
+    addStat(add_stat, cookie, "get_hits", stats.hits);
+    addStat(add_stat, cookie, "get_misses", stats.misses);
     return ENGINE_SUCCESS;
 }
 
 void STLEngine::ResetStats(const void *cookie)
 {
     (void)cookie;
+    for (size_t ii = 0; ii < numShards; ++ii) {
+        CacheLock lock(shards[ii]);
+        shards[ii].stats.reset();
+    }
+    latency.reset();
 }
@@ -1,10 +1,9 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 /*
- * Definition of a small engine using std::string and std::map
+ * Definition of a small engine using std::string and a sharded hash table
  * for item storage.
  * Please note that the intentions behind this engine is to be an example
- * on how you can create an engine in C++. It will perfom poorly and use
- * a lot of memory!
+ * on how you can create an engine in C++.
  *
  * Copy: See COPYING for the status of this software.
  *
@@ -18,14 +17,52 @@
 #include "config.h"
 
 #include <string>
-#include <map>
+#include <vector>
+#include <cstring>
 #include <memcached/engine.h>
 #include <cerrno>
+#include <pthread.h>
+
+#include "latency.h"
 
 class STLEngine;
+class CacheShard;
 
 /**
- * Holder class for each item
+ * A non-owning reference to a key, so that we may look up items without
+ * creating a std::string for the key.
+ */
+class KeyView {
+public:
+    KeyView(const void *k, size_t n) :
+        key(static_cast<const char*>(k)), nkey(n)
+    {
+    }
+
+    KeyView(const std::string &k) : key(k.data()), nkey(k.length())
+    {
+    }
+
+    const char *data() const {
+        return key;
+    }
+
+    size_t size() const {
+        return nkey;
+    }
+
+    bool operator==(const std::string &other) const {
+        return other.length() == nkey && memcmp(other.data(), key, nkey) == 0;
+    }
+
+private:
+    const char *key;
+    size_t nkey;
+};
+
+/**
+ * Holder class for each item. The items are shared between the cache and
+ * the frontend, and deleted when the last reference is released.
  */
 class Item {
 public:
@@ -36,13 +73,16 @@ public:
      * @param numValue The number of bytes in the value
      * @param flgs The user defined flags for the object
      * @param expt The expiry time for the object
+     * @param chunkSize split values bigger than this over chunks of this
+     *                  size (0 == keep the value in one piece)
      */
     Item(const void* theKey, uint16_t numKey, uint32_t numValue,
-         uint32_t flgs, rel_time_t expt) :
+         uint32_t flgs, rel_time_t expt, size_t chunkSize = 0) :
         key(static_cast<const char*>(theKey), numKey),
-        exptime(static_cast<rel_time_t>(expt)), flags(flgs), value(), cas(0)
+        exptime(static_cast<rel_time_t>(expt)), time(0), flags(flgs), value(),
+        chunks(), cas(0), refcount(1), referenced(false)
     {
-        value.resize(numValue);
+        allocate(value, chunks, numValue, chunkSize);
     }
 
     /**
@@ -50,10 +90,81 @@ public:
      * @param other the other item to "clone"
      */
     Item(const Item &other) : key(other.key), exptime(other.exptime),
-                              flags(other.flags), value(other.value), cas(other.cas)
+                              time(other.time), flags(other.flags),
+                              value(other.value), chunks(other.chunks),
+                              cas(other.cas),
+                              refcount(1), referenced(false)
     {
     }
 
+    /**
+     * Add a reference to this object
+     */
+    void retain() {
+        __sync_add_and_fetch(&refcount, 1);
+    }
+
+    /**
+     * Release a reference to this object, and delete it when the last
+     * reference is gone.
+     */
+    void release() {
+        if (__sync_sub_and_fetch(&refcount, 1) == 0) {
+            delete this;
+        }
+    }
+
+    /**
+     * Check if this object has expired
+     * @param now the current time
+     * @param oldestLive objects stored at or before this time are
+     *                   invalid (0 == no flush_all pending)
+     */
+    bool isExpired(rel_time_t now, rel_time_t oldestLive = 0) const {
+        if (oldestLive != 0 && oldestLive <= now && time <= oldestLive) {
+            return true;
+        }
+        return exptime != 0 && exptime <= now;
+    }
+
+    /**
+     * Get the number of bytes this object use (accounted towards
+     * the cache size)
+     */
+    size_t size() const {
+        return sizeof(*this) + key.length() + valueLength();
+    }
+
+    /**
+     * Get the number of bytes in the value
+     */
+    size_t valueLength() const {
+        size_t len = value.length();
+        for (size_t ii = 0; ii < chunks.size(); ++ii) {
+            len += chunks[ii].length();
+        }
+        return len;
+    }
+
+    /**
+     * Get the pieces of the value
+     * @param iov where to store the pieces
+     * @param niov the number of entries in iov
+     * @return the number of pieces (iov is only filled in if they fit)
+     */
+    int getIov(struct iovec *iov, int niov) const {
+        int n = static_cast<int>(chunks.size()) + 1;
+        if (n <= niov) {
+            iov[0].iov_base = const_cast<char*>(value.data());
+            iov[0].iov_len = value.length();
+            for (size_t ii = 0; ii < chunks.size(); ++ii) {
+                iov[ii + 1].iov_base = const_cast<char*>(chunks[ii].data());
+                iov[ii + 1].iov_len = chunks[ii].length();
+            }
+        }
+        return n;
+    }
+
     /**
      * Get the CAS value for this object
      * @return the uniqe ID for the object
@@ -79,7 +190,7 @@ public:
     }
 
     /**
-     * Get the value in this object
+     * Get the (first piece of the) value in this object
      * @return a pointer to the value
      */
     char *getValue() {
@@ -98,38 +209,210 @@ public:
     /**
      * Append my value to the content of another item
      * @param other the other object to append my data to
+     * @param chunkSize the chunk size of the new value (see the constructor)
      */
-    void append(Item *other) {
-        std::string val = other->value;
-        val.resize(val.length() - 2);
-        val.append(value);
-        value = val;
+    void append(Item *other, size_t chunkSize = 0) {
+        join(*other, *this, chunkSize);
     }
 
     /**
      * Append the value of another item to my own value
      * @param other the other object to get the data from
+     * @param chunkSize the chunk size of the new value (see the constructor)
      */
-    void prepend(Item *other) {
-        value.resize(value.length() - 2);
-        value.append(other->value);
+    void prepend(Item *other, size_t chunkSize = 0) {
+        join(*this, *other, chunkSize);
     }
 
 private:
+    /**
+     * Size the pieces of a value
+     * @param first the first piece
+     * @param rest the remaining pieces
+     * @param len the number of bytes in the value
+     * @param chunkSize the maximum size of a piece (0 == no limit)
+     */
+    static void allocate(std::string &first, std::vector<std::string> &rest,
+                         size_t len, size_t chunkSize);
+
+    /**
+     * Replace my value with the value of first (without its trailing
+     * "\r\n") followed by the value of second
+     */
+    void join(const Item &first, const Item &second, size_t chunkSize);
+
     /**
      * We want to let the engine access our internal data without having
      * to call all of the get/set methods
      */
     friend class STLEngine;
+    friend class CacheShard;
     /** The key identifying the object */
     std::string key;
     rel_time_t exptime; /**< When the item will expire (relative to process
                          * startup) */
+    rel_time_t time; /**< When the item was stored */
     uint32_t flags; /**< Flags associated with the item (in network byte order)*/
-    /** The items value */
+    /** The items value (or the first piece of it) */
     std::string value;
+    /** The rest of the value if it's split over chunks */
+    std::vector<std::string> chunks;
     /** The uniqe id for the item */
     uint64_t cas;
+    /** The number of references to this object */
+    uint32_t refcount;
+    /** Set when the item is accessed, and cleared by the CLOCK hand */
+    bool referenced;
+};
+
+/**
+ * Statistics for a cache shard
+ */
+struct ShardStats {
+    ShardStats() : items(0), bytes(0), evictions(0), reclaimed(0),
+                   hits(0), misses(0), lockWaits(0), lockWaitNs(0)
+    {
+    }
+
+    void reset() {
+        evictions = reclaimed = hits = misses = 0;
+        lockWaits = lockWaitNs = 0;
+    }
+
+    ShardStats &operator+=(const ShardStats &other) {
+        items += other.items;
+        bytes += other.bytes;
+        evictions += other.evictions;
+        reclaimed += other.reclaimed;
+        hits += other.hits;
+        misses += other.misses;
+        lockWaits += other.lockWaits;
+        lockWaitNs += other.lockWaitNs;
+        return *this;
+    }
+
+    /** The number of items in the shard */
+    uint64_t items;
+    /** The number of bytes used by the items in the shard */
+    uint64_t bytes;
+    /** The number of items evicted to make room for new items */
+    uint64_t evictions;
+    /** The number of expired items removed to make room for new items */
+    uint64_t reclaimed;
+    /** The number of successful lookups */
+    uint64_t hits;
+    /** The number of failed lookups */
+    uint64_t misses;
+    /** The number of times we had to wait for the shard lock */
+    uint64_t lockWaits;
+    /** The time we spent waiting for the shard lock */
+    uint64_t lockWaitNs;
+};
+
+/**
+ * A part of the item cache, protected by its own lock. The items are
+ * stored in an open addressing hash table (with linear probing), and the
+ * table is doubled in size when it is 3/4 full.
+ *
+ * Each shard is limited to its part of the cache size, and items are
+ * evicted by a CLOCK hand moving over the slots. Items get a second
+ * chance if they have been referenced since the last time the hand
+ * passed them, so a hit only needs to set a flag in the item.
+ */
+class CacheShard {
+public:
+    CacheShard();
+    ~CacheShard();
+
+    void lock();
+    void unlock();
+
+    /**
+     * Look up an item (the shard must be locked)
+     * @param key the key to look up
+     * @param hv the hash value for the key
+     * @return the item or NULL if it isn't found
+     */
+    Item *find(const KeyView &key, uint32_t hv) const;
+
+    /**
+     * Insert an item, replacing any existing item with the same key (the
+     * shard must be locked)
+     * @param it the item to insert
+     * @param hv the hash value for the items key
+     * @return the item we replaced (or NULL)
+     */
+    Item *insert(Item *it, uint32_t hv);
+
+    /**
+     * Remove an item (the shard must be locked)
+     * @param key the key to remove
+     * @param hv the hash value for the key
+     * @return the removed item (or NULL if it isn't found)
+     */
+    Item *remove(const KeyView &key, uint32_t hv);
+
+    /**
+     * Delete all of the items in this shard (the shard must be locked)
+     */
+    void clear();
+
+    /**
+     * Remove all of the expired items from this shard (the shard must be
+     * locked)
+     * @param now the current time
+     * @param oldestLive items stored before this time are invalid (0 == off)
+     * @return the number of items removed
+     */
+    size_t removeExpired(rel_time_t now, rel_time_t oldestLive);
+
+    /**
+     * Evict items until the shard is within its memory limit (the shard
+     * must be locked)
+     * @param keep an item that shouldn't be evicted (the one we just stored)
+     * @param now the current time
+     * @param oldestLive items stored before this time are invalid (0 == off)
+     */
+    void evict(const Item *keep, rel_time_t now, rel_time_t oldestLive);
+
+    /**
+     * Update the memory accounting for an item changed in place
+     * @param oldSize the number of bytes the item used to use
+     * @param newSize the number of bytes the item use now
+     */
+    void resized(size_t oldSize, size_t newSize) {
+        stats.bytes = stats.bytes - oldSize + newSize;
+    }
+
+    void setMaxBytes(size_t max) {
+        maxBytes = max;
+    }
+
+    /** The shards statistics (the shard must be locked) */
+    ShardStats stats;
+
+private:
+    struct Slot {
+        Slot() : item(NULL), hash(0) { }
+        Item *item;
+        uint32_t hash;
+    };
+
+    size_t locate(const KeyView &key, uint32_t hv) const;
+    Item *removeAt(size_t idx);
+    void grow();
+
+    std::vector<Slot> slots;
+    size_t used;
+    /** The number of bytes the items in this shard may use */
+    size_t maxBytes;
+    /** The current position of the CLOCK hand */
+    size_t hand;
+    pthread_mutex_t mutex;
+
+    /* Not implemented (the mutex can't be copied) */
+    CacheShard(const CacheShard&);
+    CacheShard& operator=(const CacheShard&);
 };
 
 /**
@@ -143,6 +426,8 @@ public:
      */
     STLEngine(SERVER_HANDLE_V1 *api);
 
+    ~STLEngine();
+
     /**
      * Get the version information from the engine
      * @return a string containing the version information
@@ -219,19 +504,20 @@ public:
 
     /**
      * Perform an arithmetic operation on an item.
-     * This operation is currently not implemented
+     * The value is updated in place if nobody else holds a reference to
+     * the item, otherwise a new item replaces it.
      *
      * @param cookie not used
-     * @param key not used
-     * @param nkey not used
-     * @param increment not used
-     * @param create not used
-     * @param delta not used
-     * @param initial not used
-     * @param exptime not used
-     * @param cas not used
-     * @param result not used
-     * @return ENGINE_NOTSUP always
+     * @param key the key for the item
+     * @param nkey the number of bytes in the key
+     * @param increment true for incr, false for decr
+     * @param create should the item be created if it doesn't exist
+     * @param delta the amount to incr/decr
+     * @param initial the value for a newly created item
+     * @param exptime the expiry time for a newly created item
+     * @param cas where to store the new CAS id for the object
+     * @param result where to store the new value
+     * @return ENGINE_SUCCESS on success
      */
     ENGINE_ERROR_CODE Arithmetic(const void* cookie,
                                  const void* key,
@@ -254,12 +540,12 @@ public:
 
     /**
      * Get statistics from the engine
-     * This operation is currently not implemented
-     * @param cookie not used
-     * @param stat_key not used
-     * @param nkey not used
-     * @param add_stat not used
-     * @return ENGINE_SUCCESS always
+     * @param cookie the cookie to pass to add_stat
+     * @param stat_key the group of stats requested (NULL for the default
+     *                 stats, or "latency")
+     * @param nkey the number of bytes in the stat_key
+     * @param add_stat callback to add a stat
+     * @return ENGINE_SUCCESS on success
      */
     ENGINE_ERROR_CODE GetStats(const void* cookie, const char* stat_key,
                                int nkey, ADD_STAT add_stat);
@@ -276,23 +562,87 @@ public:
         }
         item_info->cas = it->cas;
         item_info->exptime = it->exptime;
-        item_info->nbytes = it->value.size();
+        item_info->nbytes = it->valueLength();
         item_info->flags = it->flags;
         item_info->clsid = 0;
         item_info->nkey = it->key.size();
-        item_info->nvalue = 1;
         item_info->key = it->key.c_str();
-        item_info->value[0].iov_base = const_cast<char*>(it->value.c_str());
-        item_info->value[0].iov_len = it->value.length();
+        int n = it->getIov(item_info->value, item_info->nvalue);
+        if (n > item_info->nvalue) {
+            return false;
+        }
+        item_info->nvalue = n;
         return true;
 
     }
 
+    /**
+     * Remove expired items from the cache until we're asked to stop
+     * (runs in its own thread)
+     */
+    void runSweeper();
+
 private:
+    /**
+     * Get the shard a key belongs to
+     * @param hv the hash value for the key
+     */
+    CacheShard &getShard(uint32_t hv) {
+        /* the low bits of the hash are used within the shard */
+        return shards[(hv >> 16) % numShards];
+    }
+
+    /**
+     * Look up an item in a shard (the shard must be locked). Expired
+     * items are removed from the cache.
+     * @param shard the shard the key belongs to
+     * @param key the key to look up
+     * @param hv the hash value for the key
+     * @return the item or NULL if it isn't found
+     */
+    Item *findItem(CacheShard &shard, const KeyView &key, uint32_t hv);
+
+    /**
+     * Add a new item to a shard (the shard must be locked) and evict
+     * other items if we are above the memory limit
+     * @param shard the shard the key belongs to
+     * @param it the item to add
+     * @param hv the hash value for the key
+     */
+    void insertItem(CacheShard &shard, Item *it, uint32_t hv);
+
+    /**
+     * Get the next CAS id
+     */
+    uint64_t nextCas() {
+        return __sync_add_and_fetch(&casId, 1);
+    }
+
     /** Handle to the server API */
     SERVER_HANDLE_V1 *server;
     /** The item cache */
-    std::map<std::string, Item*> cache;
+    CacheShard *shards;
+    /** The number of shards in the cache */
+    size_t numShards;
+    /** The last CAS id we handed out */
+    uint64_t casId;
+    /** The maximum number of bytes to use for items */
+    size_t cacheSize;
+    /** Values bigger than this are split over chunks (0 == off) */
+    size_t chunkSize;
+    /** Items stored before this time are invalid (set by flush_all) */
+    volatile rel_time_t oldestLive;
+
+    /** The latency histograms of the operations ("stats latency") */
+    LatencyStats latency;
+
+    /** The number of seconds between each run of the sweeper (0 == off) */
+    size_t sweepInterval;
+    /** The sweeper thread removing expired items */
+    pthread_t sweeper;
+    pthread_mutex_t sweeperMutex;
+    pthread_cond_t sweeperCond;
+    bool sweeperRunning;
 };
 
 #endif